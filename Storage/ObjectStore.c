@@ -10,6 +10,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include "../utils/stringutils.h"
 #include "../utils/utils.h"
 #include "../utils/hexdump.h"
@@ -31,6 +33,20 @@ struct la_object_store
     la_storage_env *env;
     la_storage_object_store *store;
     const la_object_store_driver_t *driver;
+    
+    /*
+     * Cached statistics. The write paths below keep these current, and
+     * la_storage_stat reconciles them with the driver's own numbers on
+     * stat_thread every LA_STORAGE_STAT_INTERVAL seconds, so reading
+     * them never waits for the driver.
+     */
+    int64_t numkeys;
+    int64_t size;
+    int64_t stat_time;  /* When numkeys/size were last reconciled; 0 if never. */
+    int stat_busy;      /* Set while a reconcile runs. */
+    pthread_mutex_t stat_lock;  /* Guards stat_thread and stat_joinable. */
+    pthread_t stat_thread;
+    int stat_joinable;  /* stat_thread was started and not yet joined. */
 };
 
 int la_storage_install_driver(const char *name, const la_object_store_driver_t *driver)
@@ -45,43 +61,224 @@ int la_storage_install_driver(const char *name, const la_object_store_driver_t *
     e = malloc(sizeof(struct driver_entry));
     e->name = name;
     e->driver = driver;
-    HASH_ADD_STR(drivers, name, e);
+    HASH_ADD_KEYPTR(hh, drivers, e->name, strlen(e->name), e);
     return 0;
 }
 
-la_storage_object *
-la_storage_create_object(const char *key, const la_storage_rev_t rev, const unsigned char *data, uint32_t length,
-                         const la_storage_rev_t *revs, size_t revcount)
+/*
+ * Objects are allocated as a single block:
+ *
+ *   | la_storage_object | key, '\0' | header, revisions, data |
+ *
+ * Blocks are rounded up to a power-of-two size class, between
+ * POOL_MIN_SIZE and POOL_MAX_SIZE, and freed blocks are kept on a
+ * per-thread free list for their class (at most POOL_MAX_FREE of them),
+ * so steady-state gets and puts don't go to malloc at all. Larger blocks
+ * are malloc'd and freed as-is.
+ */
+#define POOL_MIN_SHIFT 7
+#define POOL_MIN_SIZE (1 << POOL_MIN_SHIFT)
+#define POOL_CLASSES 10
+#define POOL_MAX_SIZE (POOL_MIN_SIZE << (POOL_CLASSES - 1))
+#define POOL_MAX_FREE 32
+
+#if LA_OBJECT_POOL
+struct pool_block
 {
-    size_t total_len = 0;
-    la_storage_object *obj = (la_storage_object *) malloc(sizeof(struct la_storage_object));
-    if (obj == NULL)
-        return NULL;
-    obj->key = strdup(key);
-    if (obj->key == NULL)
+    struct pool_block *next;
+};
+
+struct object_pool
+{
+    struct pool_block *free[POOL_CLASSES];
+    unsigned int count[POOL_CLASSES];
+};
+
+static __thread struct object_pool *thread_pool = NULL;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static void pool_destroy(void *p)
+{
+    struct object_pool *pool = (struct object_pool *) p;
+    struct pool_block *block;
+    int i;
+    
+    for (i = 0; i < POOL_CLASSES; i++)
     {
-        free(obj);
-        return NULL;
+        while ((block = pool->free[i]) != NULL)
+        {
+            pool->free[i] = block->next;
+            free(block);
+        }
     }
-    total_len = sizeof(struct la_storage_object_header) + length + (revcount * sizeof(la_storage_rev_t));
-    obj->header = malloc(total_len);
-    if (obj->header == NULL)
+    free(pool);
+    thread_pool = NULL;
+}
+
+static void pool_key_init(void)
+{
+    pthread_key_create(&pool_key, pool_destroy);
+}
+
+static struct object_pool *get_pool(void)
+{
+    if (thread_pool == NULL)
     {
-        free(obj->key);
-        free(obj);
+        pthread_once(&pool_key_once, pool_key_init);
+        thread_pool = calloc(1, sizeof(struct object_pool));
+        if (thread_pool != NULL)
+            pthread_setspecific(pool_key, thread_pool);
+    }
+    return thread_pool;
+}
+#endif
+
+/*
+ * Return the size class for size, or -1 if it is too big to pool.
+ */
+static int size_class(size_t size)
+{
+    int c = 0;
+    size_t s = POOL_MIN_SIZE;
+    
+    if (size > POOL_MAX_SIZE)
+        return -1;
+    while (s < size)
+    {
+        s <<= 1;
+        c++;
+    }
+    return c;
+}
+
+static void *block_alloc(size_t size, uint32_t *block_size)
+{
+    int c = size_class(size);
+    
+    if (c < 0)
+    {
+        *block_size = (uint32_t) size;
+        return malloc(size);
+    }
+    *block_size = POOL_MIN_SIZE << c;
+#if LA_OBJECT_POOL
+    struct object_pool *pool = get_pool();
+    if (pool != NULL && pool->free[c] != NULL)
+    {
+        struct pool_block *block = pool->free[c];
+        pool->free[c] = block->next;
+        pool->count[c]--;
+        return block;
+    }
+#endif
+    return malloc(*block_size);
+}
+
+static void block_free(void *p, uint32_t block_size)
+{
+#if LA_OBJECT_POOL
+    int c = size_class(block_size);
+    if (c >= 0)
+    {
+        struct object_pool *pool = get_pool();
+        if (pool != NULL && pool->count[c] < POOL_MAX_FREE)
+        {
+            struct pool_block *block = (struct pool_block *) p;
+            block->next = pool->free[c];
+            pool->free[c] = block;
+            pool->count[c]++;
+            return;
+        }
+    }
+#endif
+    free(p);
+}
+
+/*
+ * Offset of the header in an object's block; the header is kept 8-byte
+ * aligned so that seq and doc_seq can be read directly.
+ */
+#define object_header_offset(keylen) ((sizeof(struct la_storage_object) + (keylen) + 1 + 7) & ~((size_t) 7))
+
+#define object_header_is_inline(obj) ((const char *) (obj)->header > (const char *) (obj) \
+    && (const char *) (obj)->header < (const char *) (obj) + (obj)->block_size)
+
+la_storage_object *
+la_storage_alloc_object(const char *key, size_t key_length, size_t header_size)
+{
+    size_t offset = object_header_offset(key_length);
+    uint32_t block_size;
+    la_storage_object *obj;
+    
+    if (header_size < sizeof(struct la_storage_object_header))
+        header_size = sizeof(struct la_storage_object_header);
+    if (offset + header_size > UINT32_MAX)
+    {
+        errno = ENOMEM;
         return NULL;
     }
-    memset(obj->header, 0, total_len);
-    memcpy(&obj->header->rev, &rev, LA_OBJECT_REVISION_LEN);
-    if (revs != NULL)
+    obj = (la_storage_object *) block_alloc(offset + header_size, &block_size);
+    if (obj == NULL)
+        return NULL;
+    obj->key = (char *) (obj + 1);
+    if (key != NULL)
+        memcpy(obj->key, key, key_length);
+    obj->key[key_length] = '\0';
+    obj->header = (la_storage_object_header *) ((char *) obj + offset);
+    obj->header_capacity = block_size - (uint32_t) offset;
+    obj->block_size = block_size;
+    obj->data_length = 0;
+    return obj;
+}
+
+int
+la_storage_object_reserve(la_storage_object *object, size_t size)
+{
+    la_storage_object_header *header;
+    
+    if (size <= object->header_capacity)
+        return 0;
+    if (size > UINT32_MAX)
+        return -1;
+    if (object_header_is_inline(object))
     {
-        obj->header->rev_count = revcount;
-        memcpy(obj->header->revs_data, revs, revcount * sizeof(la_storage_rev_t));
+        // Outgrew the block; move the header out to its own allocation.
+        header = malloc(size);
+        if (header == NULL)
+            return -1;
+        memcpy(header, object->header, object->header_capacity);
     }
     else
     {
-        obj->header->rev_count = 0;
+        header = realloc(object->header, size);
+        if (header == NULL)
+            return -1;
     }
+    object->header = header;
+    object->header_capacity = (uint32_t) size;
+    return 0;
+}
+
+la_storage_object *
+la_storage_create_object(const char *key, const la_storage_rev_t rev, const unsigned char *data, uint32_t length,
+                         const la_storage_rev_t *revs, size_t revcount)
+{
+    size_t total_len = 0;
+    la_storage_object *obj;
+    
+    if (revs == NULL)
+        revcount = 0;
+    revcount = la_min(revcount, LA_OBJECT_MAX_REVISION_COUNT);
+    total_len = sizeof(struct la_storage_object_header) + length + (revcount * sizeof(la_storage_rev_t));
+    obj = la_storage_alloc_object(key, strlen(key), total_len);
+    if (obj == NULL)
+        return NULL;
+    memset(obj->header, 0, sizeof(struct la_storage_object_header));
+    memcpy(&obj->header->rev, &rev, LA_OBJECT_REVISION_LEN);
+    obj->header->rev_count = revcount;
+    if (revcount > 0)
+        memcpy(obj->header->revs_data, revs, revcount * sizeof(la_storage_rev_t));
     memcpy(la_storage_object_get_data(obj), (const char *) data, length);
     obj->data_length = length;
 #if DEBUG
@@ -96,9 +293,9 @@ la_storage_create_object(const char *key, const la_storage_rev_t rev, const unsi
 void
 la_storage_destroy_object(la_storage_object *object)
 {
-    free(object->key);
-    free(object->header);
-    free(object);
+    if (!object_header_is_inline(object))
+        free(object->header);
+    block_free(object, object->block_size);
 }
 
 int
@@ -128,13 +325,43 @@ int la_storage_revs_overlap(const la_storage_rev_t *revs1, int count1, const la_
     return 0;
 }
 
-la_storage_env *la_storage_open_env(const char *driver, const char *name)
+void la_storage_env_config_init(la_storage_env_config_t *config)
+{
+    memset(config, 0, sizeof(la_storage_env_config_t));
+    config->sqlite_wal = 1;
+    config->sqlite_synchronous = 1;
+    config->sqlite_mmap_size = 64 * 1024 * 1024;
+    config->sqlite_cache_size = 0;
+    config->sqlite_read_connections = 8;
+    config->bdb_cache_size = 64 * 1024 * 1024;
+    config->bdb_log_buffer_size = 1024 * 1024;
+    config->bdb_page_size = 0;
+    config->bdb_checkpoint_interval = 60;
+    config->bdb_checkpoint_kbytes = 1024;
+    config->bdb_archive_logs = 1;
+    config->bdb_group_commit_interval = 10;
+    config->bptree_sync = 1;
+    config->bptree_group_commit_window = 0;
+    config->bptree_mmap_size = 0;
+    config->bptree_checksum = 2;
+    config->bptree_verify_reads = 1;
+    config->memory_snapshot_interval = 0;
+}
+
+la_storage_env *la_storage_open_env(const char *driver, const char *name, const la_storage_env_config_t *config)
 {
     struct driver_entry *entry = NULL;
+    la_storage_env_config_t defaults;
+    
     HASH_FIND_STR(drivers, driver, entry);
     if (entry == NULL)
         return NULL;
-    return entry->driver->open_env(name);
+    if (config == NULL)
+    {
+        la_storage_env_config_init(&defaults);
+        config = &defaults;
+    }
+    return entry->driver->open_env(name, config);
 }
 
 void la_storage_close_env(const char *driver, la_storage_env *env)
@@ -150,7 +377,7 @@ la_storage_open_result_t la_storage_open(const char *driver, la_storage_env *env
 {
     struct driver_entry *entry = NULL;
     
-    HASH_FIND_STR(drivers, name, entry);
+    HASH_FIND_STR(drivers, driver, entry);
     if (entry == NULL)
     {
         return LA_STORAGE_OPEN_NO_DRIVER;
@@ -158,7 +385,7 @@ la_storage_open_result_t la_storage_open(const char *driver, la_storage_env *env
     
     la_storage_object_store *objstore = NULL;
     la_storage_open_result_t storeopen = entry->driver->open_store(env, name, flags, &objstore);
-    if (storeopen != LA_STORAGE_OPEN_OK)
+    if (storeopen != LA_STORAGE_OPEN_OK && storeopen != LA_STORAGE_OPEN_CREATED)
     {
         if (env != NULL)
         {
@@ -183,12 +410,33 @@ la_storage_open_result_t la_storage_open(const char *driver, la_storage_env *env
     (*store)->env = env;
     (*store)->store = objstore;
     (*store)->driver = entry->driver;
+    (*store)->numkeys = 0;
+    (*store)->size = 0;
+    (*store)->stat_time = 0;
+    (*store)->stat_busy = 0;
+    (*store)->stat_joinable = 0;
+    pthread_mutex_init(&(*store)->stat_lock, NULL);
     
-    return LA_STORAGE_OPEN_OK;
+    return storeopen;
+}
+
+/*
+ * Wait for a background reconcile, if one was started.
+ */
+static void stat_join(la_object_store_t *store)
+{
+    pthread_mutex_lock(&store->stat_lock);
+    if (store->stat_joinable)
+    {
+        pthread_join(store->stat_thread, NULL);
+        store->stat_joinable = 0;
+    }
+    pthread_mutex_unlock(&store->stat_lock);
 }
 
 void la_storage_close(la_object_store_t *store)
 {
+    stat_join(store);
     if (store->store != NULL)
     {
         store->driver->close_store(store->store);
@@ -199,11 +447,13 @@ void la_storage_close(la_object_store_t *store)
         store->driver->close_env(store->env);
         store->env = NULL;
     }
+    pthread_mutex_destroy(&store->stat_lock);
     free(store);
 }
 
 void la_storage_delete_store(la_object_store_t *store)
 {
+    stat_join(store);
     if (store->driver->delete_store(store->store) == 0)
     {
         la_storage_close(store);
@@ -216,6 +466,72 @@ la_storage_object_get_result la_storage_get(la_object_store_t *store, const char
     return store->driver->get(store->store, key, rev, obj);
 }
 
+la_storage_object_get_result la_storage_get_borrowed(la_object_store_t *store, const char *key, const la_storage_rev_t *rev,
+                                                     la_storage_borrowed_object *obj)
+{
+    la_storage_object_get_result result;
+    la_storage_object *object = NULL;
+    
+    if (store->driver->get_borrowed != NULL)
+        return store->driver->get_borrowed(store->store, key, rev, obj);
+    
+    result = store->driver->get(store->store, key, rev, &object);
+    if (result != LA_STORAGE_OBJECT_GET_OK)
+        return result;
+    memcpy(&obj->header, object->header, sizeof(la_storage_object_header));
+    obj->revs = (const la_storage_rev_t *) object->header->revs_data;
+    obj->data = la_storage_object_get_data(object);
+    obj->data_length = object->data_length;
+    obj->cookie = object;
+    return LA_STORAGE_OBJECT_GET_OK;
+}
+
+void la_storage_release(la_object_store_t *store, la_storage_borrowed_object *obj)
+{
+    if (store->driver->get_borrowed != NULL)
+    {
+        if (store->driver->release != NULL)
+            store->driver->release(store->store, obj);
+    }
+    else
+    {
+        la_storage_destroy_object((la_storage_object *) obj->cookie);
+    }
+    obj->cookie = NULL;
+}
+
+la_storage_object_get_result la_storage_get_many(la_object_store_t *store, const char * const *keys,
+                                                 size_t count, la_storage_object **objs)
+{
+    la_storage_object_get_result result;
+    size_t i;
+
+    if (store->driver->get_many != NULL)
+        return store->driver->get_many(store->store, keys, count, objs);
+
+    for (i = 0; i < count; i++)
+    {
+        objs[i] = NULL;
+        result = store->driver->get(store->store, keys[i], NULL, &objs[i]);
+        if (result == LA_STORAGE_OBJECT_GET_NOT_FOUND)
+        {
+            objs[i] = NULL;
+            continue;
+        }
+        if (result != LA_STORAGE_OBJECT_GET_OK)
+        {
+            while (i-- > 0)
+            {
+                if (objs[i] != NULL)
+                    la_storage_destroy_object(objs[i]);
+                objs[i] = NULL;
+            }
+            return LA_STORAGE_OBJECT_GET_ERROR;
+        }
+    }
+    return LA_STORAGE_OBJECT_GET_OK;
+}
+
 la_storage_object_get_result la_storage_get_rev(la_object_store_t *store, const char *key, la_storage_rev_t *rev)
 {
     return store->driver->get_rev(store->store, key, rev);
@@ -226,19 +542,77 @@ int la_storage_get_all_revs(la_object_store_t *store, const char *key, uint64_t
     return store->driver->get_all_revs(store->store, key, start, revs);
 }
 
+/*
+ * Account for a successful put of obj. New documents (doc_seq 1) add a
+ * key and their size; the size drift updates cause is corrected at the
+ * next reconcile.
+ */
+static void note_write(la_object_store_t *store, const la_storage_object *obj)
+{
+    if (obj->header->doc_seq == 1)
+    {
+        __sync_fetch_and_add(&store->numkeys, 1);
+        __sync_fetch_and_add(&store->size, (int64_t) la_storage_object_total_size(obj));
+    }
+}
+
+/*
+ * Mark the cached numkeys/size as needing a reconcile at the next stat.
+ */
+static void stat_invalidate(la_object_store_t *store)
+{
+    int64_t t = store->stat_time;
+    if (t != 0)
+        __sync_bool_compare_and_swap(&store->stat_time, t, 1);
+}
+
 la_storage_object_put_result la_storage_set_revs(la_object_store_t *store, const char *key, la_storage_rev_t *revs, size_t revcount)
 {
-    return store->driver->set_revs(store->store, key, revs, revcount);
+    la_storage_object_put_result result = store->driver->set_revs(store->store, key, revs, revcount);
+    if (result == LA_STORAGE_OBJECT_PUT_SUCCESS)
+        stat_invalidate(store);
+    return result;
 }
 
 la_storage_object_put_result la_storage_put(la_object_store_t *store, const la_storage_rev_t *rev, la_storage_object *obj)
 {
-    return store->driver->put(store->store, rev, obj);
+    la_storage_object_put_result result = store->driver->put(store->store, rev, obj);
+    if (result == LA_STORAGE_OBJECT_PUT_SUCCESS)
+        note_write(store, obj);
+    return result;
+}
+
+la_storage_object_put_result la_storage_put_bulk(la_object_store_t *store, const la_storage_rev_t * const *revs,
+                                                 la_storage_object **objs, size_t count,
+                                                 la_storage_object_put_result *results)
+{
+    la_storage_object_put_result result = LA_STORAGE_OBJECT_PUT_SUCCESS;
+    size_t i;
+    
+    if (store->driver->put_bulk != NULL)
+        result = store->driver->put_bulk(store->store, revs, objs, count, results);
+    else
+    {
+        for (i = 0; i < count; i++)
+            results[i] = store->driver->put(store->store, revs[i], objs[i]);
+    }
+    if (result != LA_STORAGE_OBJECT_PUT_SUCCESS)
+        return result;
+    for (i = 0; i < count; i++)
+    {
+        if (results[i] == LA_STORAGE_OBJECT_PUT_SUCCESS)
+            note_write(store, objs[i]);
+    }
+    return result;
 }
 
 la_storage_object_put_result la_storage_replace(la_object_store_t *store, la_storage_object *obj)
 {
-    return store->driver->replace(store->store, obj);
+    la_storage_object_put_result result = store->driver->replace(store->store, obj);
+    // Replace may or may not create the key; let the driver say.
+    if (result == LA_STORAGE_OBJECT_PUT_SUCCESS)
+        stat_invalidate(store);
+    return result;
 }
 
 uint64_t la_storage_lastseq(la_object_store_t *store)
@@ -246,9 +620,85 @@ uint64_t la_storage_lastseq(la_object_store_t *store)
     return store->driver->lastseq(store->store);
 }
 
+/*
+ * Pull numkeys/size from the driver into the cached values.
+ */
+static int stat_reconcile(la_object_store_t *store)
+{
+    la_storage_stat_t stat;
+    int64_t now = (int64_t) time(NULL);
+    
+    if (store->driver->stat != NULL)
+    {
+        if (store->driver->stat(store->store, &stat) != 0)
+            return -1;
+        __sync_lock_test_and_set(&store->numkeys, (int64_t) stat.numkeys);
+        __sync_lock_test_and_set(&store->size, (int64_t) stat.size);
+    }
+    __sync_lock_test_and_set(&store->stat_time, now);
+    return 0;
+}
+
+static void *stat_main(void *arg)
+{
+    la_object_store_t *store = (la_object_store_t *) arg;
+    
+    stat_reconcile(store);
+    __sync_lock_release(&store->stat_busy);
+    return NULL;
+}
+
+/*
+ * Start a reconcile on stat_thread, unless one is already running. The
+ * previous thread has cleared stat_busy by the time we get here, so
+ * joining it doesn't block for long.
+ */
+static void stat_start(la_object_store_t *store)
+{
+    if (!__sync_bool_compare_and_swap(&store->stat_busy, 0, 1))
+        return;
+    pthread_mutex_lock(&store->stat_lock);
+    if (store->stat_joinable)
+        pthread_join(store->stat_thread, NULL);
+    store->stat_joinable = pthread_create(&store->stat_thread, NULL, stat_main, store) == 0;
+    if (!store->stat_joinable)
+        __sync_lock_release(&store->stat_busy);
+    pthread_mutex_unlock(&store->stat_lock);
+}
+
 int la_storage_stat(la_object_store_t *store, la_storage_stat_t *stat)
 {
-    return store->driver->stat(store->store, stat);
+    int64_t now = (int64_t) time(NULL);
+    int64_t then = __sync_add_and_fetch(&store->stat_time, 0);
+    
+    if (then == 0)
+    {
+        // Nothing cached yet, so this caller has to wait for the driver.
+        if (stat_reconcile(store) != 0)
+            return -1;
+    }
+    else if (now - then >= LA_STORAGE_STAT_INTERVAL)
+        stat_start(store);
+    stat->numkeys = (int) __sync_add_and_fetch(&store->numkeys, 0);
+    stat->size = (uint64_t) __sync_add_and_fetch(&store->size, 0);
+    return 0;
+}
+
+int la_storage_compact(la_object_store_t *store, const la_storage_compact_options_t *options)
+{
+    la_storage_compact_options_t defaults;
+    
+    if (store->driver->compact == NULL)
+        return -1;
+    if (options == NULL)
+    {
+        memset(&defaults, 0, sizeof(la_storage_compact_options_t));
+        options = &defaults;
+    }
+    if (store->driver->compact(store->store, options) != 0)
+        return -1;
+    stat_invalidate(store);
+    return 0;
 }
 
 la_storage_object_iterator *la_storage_iterator_open(la_object_store_t *store, uint64_t since)
@@ -256,6 +706,35 @@ la_storage_object_iterator *la_storage_iterator_open(la_object_store_t *store, u
     return store->driver->iterator_open(store->store, since);
 }
 
+la_storage_object_iterator *la_storage_iterator_open_range(la_object_store_t *store, uint64_t from_seq, uint64_t to_seq, int flags)
+{
+    if (store->driver->iterator_open_range == NULL)
+        return NULL;
+    return store->driver->iterator_open_range(store->store, from_seq, to_seq, flags);
+}
+
+uint64_t la_storage_partition_seqs(la_object_store_t *store, unsigned int count, uint64_t *bounds)
+{
+    uint64_t lastseq = la_storage_lastseq(store);
+    unsigned int i;
+    
+    bounds[0] = 0;
+    for (i = 1; i < count; i++)
+    {
+        // lastseq * i / count, without overflowing for huge seqs.
+        bounds[i] = (lastseq / count) * i + ((lastseq % count) * i) / count;
+    }
+    bounds[count] = lastseq;
+    return lastseq;
+}
+
+la_storage_object_iterator *la_storage_iterator_open_keyrange(la_object_store_t *store, const char *startkey, const char *endkey, int descending, uint64_t limit, int flags)
+{
+    if (store->driver->iterator_open_keyrange == NULL)
+        return NULL;
+    return store->driver->iterator_open_keyrange(store->store, startkey, endkey, descending, limit, flags);
+}
+
 la_storage_object_iterator_result la_storage_iterator_next(la_object_store_t *store, la_storage_object_iterator *it, la_storage_object **obj)
 {
     return store->driver->iterator_next(it, obj);
@@ -265,3 +744,167 @@ void la_storage_iterator_close(la_object_store_t *store, la_storage_object_itera
 {
     store->driver->iterator_close(it);
 }
+
+/*
+ * A prefetching iterator reads from the driver's iterator on a thread
+ * of its own, into a ring of objects ahead of the reader. The ring has
+ * one writer (the fetch thread) and one reader, and each moves only
+ * its own index, publishing it with a release store and reading the
+ * other's with an acquire load, so objects move through the ring
+ * without a lock. The lock guards the waiting flags, and sleeping when
+ * the ring is empty (for the reader) or full (for the fetch thread).
+ */
+struct la_storage_prefetch_iterator
+{
+    la_object_store_t *store;
+    la_storage_object_iterator *it;
+    pthread_t thread;
+    
+    la_storage_object **ring;
+    size_t mask;
+    size_t head;    /* The next slot to read; moved by the reader. */
+    size_t tail;    /* The next slot to fill; moved by the fetch thread. */
+    
+    /*
+     * done is set once the fetch thread stops for good, after it sets
+     * result to how the driver's iterator ended. stop tells it to stop
+     * early.
+     */
+    int done;
+    int stop;
+    la_storage_object_iterator_result result;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int reader_waiting;
+    int fetcher_waiting;
+};
+
+static int prefetch_readable(la_storage_prefetch_iterator *it)
+{
+    return __atomic_load_n(&it->tail, __ATOMIC_ACQUIRE) != it->head || __atomic_load_n(&it->done, __ATOMIC_ACQUIRE);
+}
+
+static int prefetch_writable(la_storage_prefetch_iterator *it)
+{
+    return it->tail - __atomic_load_n(&it->head, __ATOMIC_ACQUIRE) <= it->mask || __atomic_load_n(&it->stop, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Sleep until ready says so. The waiting flag is only touched with the
+ * lock held, and the other side moves its index before taking the lock
+ * to check the flag; so either we see the change, or it sees the flag
+ * and wakes us (which can't happen until we're in pthread_cond_wait).
+ */
+static void prefetch_wait(la_storage_prefetch_iterator *it, int *waiting,
+                          int (*ready)(la_storage_prefetch_iterator *))
+{
+    pthread_mutex_lock(&it->lock);
+    *waiting = 1;
+    while (!ready(it))
+        pthread_cond_wait(&it->cond, &it->lock);
+    *waiting = 0;
+    pthread_mutex_unlock(&it->lock);
+}
+
+static void prefetch_wake(la_storage_prefetch_iterator *it, int *waiting)
+{
+    pthread_mutex_lock(&it->lock);
+    if (*waiting)
+        pthread_cond_broadcast(&it->cond);
+    pthread_mutex_unlock(&it->lock);
+}
+
+static void *prefetch_main(void *arg)
+{
+    la_storage_prefetch_iterator *it = (la_storage_prefetch_iterator *) arg;
+    la_storage_object_iterator_result result;
+    la_storage_object *obj;
+    
+    for (;;)
+    {
+        if (!prefetch_writable(it))
+            prefetch_wait(it, &it->fetcher_waiting, prefetch_writable);
+        if (__atomic_load_n(&it->stop, __ATOMIC_ACQUIRE))
+        {
+            result = LA_STORAGE_OBJECT_ITERATOR_END;
+            break;
+        }
+        result = la_storage_iterator_next(it->store, it->it, &obj);
+        if (result != LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT)
+            break;
+        it->ring[it->tail & it->mask] = obj;
+        __atomic_store_n(&it->tail, it->tail + 1, __ATOMIC_RELEASE);
+        prefetch_wake(it, &it->reader_waiting);
+    }
+    it->result = result;
+    __atomic_store_n(&it->done, 1, __ATOMIC_RELEASE);
+    prefetch_wake(it, &it->reader_waiting);
+    return NULL;
+}
+
+la_storage_prefetch_iterator *la_storage_prefetch_open(la_object_store_t *store, la_storage_object_iterator *iterator, unsigned int depth)
+{
+    la_storage_prefetch_iterator *it;
+    size_t size = 1;
+    
+    if (depth == 0)
+        depth = LA_STORAGE_PREFETCH_DEPTH;
+    while (size < depth)
+        size <<= 1;
+    if ((it = (la_storage_prefetch_iterator *) calloc(1, sizeof(struct la_storage_prefetch_iterator))) == NULL)
+        return NULL;
+    if ((it->ring = (la_storage_object **) calloc(size, sizeof(la_storage_object *))) == NULL)
+    {
+        free(it);
+        return NULL;
+    }
+    it->store = store;
+    it->it = iterator;
+    it->mask = size - 1;
+    pthread_mutex_init(&it->lock, NULL);
+    pthread_cond_init(&it->cond, NULL);
+    if (pthread_create(&it->thread, NULL, prefetch_main, it) != 0)
+    {
+        pthread_cond_destroy(&it->cond);
+        pthread_mutex_destroy(&it->lock);
+        free(it->ring);
+        free(it);
+        return NULL;
+    }
+    return it;
+}
+
+la_storage_object_iterator_result la_storage_prefetch_next(la_storage_prefetch_iterator *it, la_storage_object **obj)
+{
+    la_storage_object *next;
+    
+    if (!prefetch_readable(it))
+        prefetch_wait(it, &it->reader_waiting, prefetch_readable);
+    // Readable with nothing in the ring means done, and result is set.
+    if (__atomic_load_n(&it->tail, __ATOMIC_ACQUIRE) == it->head)
+        return it->result;
+    next = it->ring[it->head & it->mask];
+    it->ring[it->head & it->mask] = NULL;
+    __atomic_store_n(&it->head, it->head + 1, __ATOMIC_RELEASE);
+    prefetch_wake(it, &it->fetcher_waiting);
+    if (obj != NULL)
+        *obj = next;
+    else
+        la_storage_destroy_object(next);
+    return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
+}
+
+void la_storage_prefetch_close(la_storage_prefetch_iterator *it)
+{
+    __atomic_store_n(&it->stop, 1, __ATOMIC_RELEASE);
+    prefetch_wake(it, &it->fetcher_waiting);
+    pthread_join(it->thread, NULL);
+    for (; it->head != it->tail; it->head++)
+        la_storage_destroy_object(it->ring[it->head & it->mask]);
+    la_storage_iterator_close(it->store, it->it);
+    pthread_cond_destroy(&it->cond);
+    pthread_mutex_destroy(&it->lock);
+    free(it->ring);
+    free(it);
+}
@@ -19,6 +19,26 @@
 #define LA_OBJECT_MAX_REVISION_COUNT 1024
 #endif
 
+#if LA_OBJECT_MAX_REVISION_COUNT >= (1 << 13)
+#error "LA_OBJECT_MAX_REVISION_COUNT must fit in the header's rev_count"
+#endif
+
+/**
+ * Set to 0 to disable the per-thread free lists that objects are
+ * allocated from.
+ */
+#ifndef LA_OBJECT_POOL
+#define LA_OBJECT_POOL 1
+#endif
+
+/**
+ * How often, in seconds, la_storage_stat checks its cached numbers
+ * against the driver's.
+ */
+#ifndef LA_STORAGE_STAT_INTERVAL
+#define LA_STORAGE_STAT_INTERVAL 30
+#endif
+
 typedef struct la_storage_rev
 {
     unsigned char rev[LA_OBJECT_REVISION_LEN];
@@ -27,6 +47,7 @@ typedef struct la_storage_rev
 typedef struct la_storage_env la_storage_env;
 typedef struct la_storage_object_store la_storage_object_store;
 typedef struct la_storage_object_iterator la_storage_object_iterator;
+typedef struct la_storage_prefetch_iterator la_storage_prefetch_iterator;
 
 #pragma pack(push)
 #pragma pack(1)
@@ -48,9 +69,23 @@ typedef struct la_storage_object_header
     uint8_t deleted:1;
 
     /**
-     * The number of historical revisions that follow.
+     * The number of historical revisions that follow. At most
+     * LA_OBJECT_MAX_REVISION_COUNT, so thirteen bits are plenty.
      */
-    uint16_t rev_count:15;
+    uint16_t rev_count:13;
+    
+    /**
+     * Set if the data is compressed in a format that records its
+     * decompressed length (the compressor's context API). Data written
+     * before that has to be decompressed the old way.
+     */
+    uint8_t sized:1;
+    
+    /**
+     * Set if the data is stored as is, in a database whose documents
+     * are otherwise compressed, because compressing it didn't pay.
+     */
+    uint8_t uncompressed:1;
     
     /**
      * The current revision of this object.
@@ -70,14 +105,81 @@ typedef struct la_storage_object
     char *key;
     la_storage_object_header *header;
     uint32_t data_length;
+    
+    /**
+     * The number of bytes available at header, for the header, revisions
+     * and data. See la_storage_object_reserve.
+     */
+    uint32_t header_capacity;
+    
+    /**
+     * The size of the block the object was allocated in.
+     */
+    uint32_t block_size;
 } la_storage_object;
 
+/**
+ * An object read with la_storage_get_borrowed. The revisions and data
+ * point into the driver's own memory, and are only valid until the
+ * object is passed to la_storage_release.
+ */
+typedef struct la_storage_borrowed_object
+{
+    /**
+     * A copy of the object's fixed header fields.
+     */
+    la_storage_object_header header;
+    
+    /**
+     * The header->rev_count historical revisions.
+     */
+    const la_storage_rev_t *revs;
+    
+    const unsigned char *data;
+    uint32_t data_length;
+    
+    /**
+     * Driver state for releasing the object.
+     */
+    void *cookie;
+    
+    /**
+     * Driver-defined kind of cookie, for drivers with more than one.
+     */
+    int cookie_kind;
+} la_storage_borrowed_object;
+
 typedef struct la_storage_stat_s
 {
     int numkeys;
     uint64_t size;
 } la_storage_stat_t;
 
+/**
+ * Options for la_storage_compact.
+ */
+typedef struct la_storage_compact_options_s
+{
+    /**
+     * How many documents to copy per commit; 0 for the driver's default.
+     */
+    unsigned int batch_size;
+    
+    /**
+     * Limit how fast documents are copied, so compaction doesn't starve
+     * other work of I/O; 0 for no limit.
+     */
+    uint64_t max_bytes_per_second;
+    
+    /**
+     * If not NULL, called after each batch is copied with how many
+     * documents have been copied so far and an estimate of how many
+     * there are in all. Return nonzero to cancel the compaction.
+     */
+    int (*progress)(uint64_t copied, uint64_t total, void *baton);
+    void *baton;
+} la_storage_compact_options_t;
+
 typedef enum
 {
     LA_STORAGE_OBJECT_GET_OK = 0,      /**< No error, get succeeded. */
@@ -116,10 +218,166 @@ typedef enum
     LA_STORAGE_OBJECT_ITERATOR_ERROR
 } la_storage_object_iterator_result;
 
+typedef enum
+{
+    /**
+     * Return only each object's key and header: no old revisions, and
+     * no data. Drivers that keep the header apart from the document
+     * don't read the document at all.
+     */
+    LA_STORAGE_ITERATOR_HEADERS_ONLY = 1 << 0,
+    
+    /**
+     * Skip objects whose header is marked deleted.
+     */
+    LA_STORAGE_ITERATOR_SKIP_DELETED = 1 << 1
+} la_storage_iterator_flag_t;
+
+/**
+ * Tuning for a storage environment. Each driver uses the fields that
+ * apply to it and ignores the rest. Fill one in with
+ * la_storage_env_config_init before changing individual fields.
+ */
+typedef struct la_storage_env_config
+{
+    /**
+     * SQLite: use write-ahead logging (journal_mode=WAL), so that readers
+     * don't block on the writer.
+     */
+    int sqlite_wal;
+    
+    /**
+     * SQLite: the synchronous pragma; 0 is OFF, 1 NORMAL, 2 FULL.
+     */
+    int sqlite_synchronous;
+    
+    /**
+     * SQLite: bytes of each database to memory-map (mmap_size); 0 turns
+     * memory-mapped I/O off.
+     */
+    int64_t sqlite_mmap_size;
+    
+    /**
+     * SQLite: the cache_size pragma; pages if positive, KiB if negative,
+     * or 0 to keep SQLite's default.
+     */
+    int sqlite_cache_size;
+    
+    /**
+     * SQLite: how many read-only connections each store may open. Each
+     * reading thread gets its own until they run out, after which reads
+     * share the writer connection. Only used with sqlite_wal.
+     */
+    int sqlite_read_connections;
+    
+    /**
+     * BDB: the shared memory pool (cache) size in bytes, or 0 to keep
+     * BDB's default.
+     */
+    uint64_t bdb_cache_size;
+    
+    /**
+     * BDB: the in-memory log buffer size in bytes, or 0 for the default.
+     */
+    uint32_t bdb_log_buffer_size;
+    
+    /**
+     * BDB: the page size for newly created databases, or 0 to let BDB
+     * pick one.
+     */
+    uint32_t bdb_page_size;
+    
+    /**
+     * BDB: lock table limits, or 0 for the defaults.
+     */
+    uint32_t bdb_max_locks;
+    uint32_t bdb_max_lockers;
+    uint32_t bdb_max_lock_objects;
+    
+    /**
+     * BDB: seconds between checkpoints taken by the environment's
+     * maintenance thread, or 0 for no checkpoint thread.
+     */
+    unsigned int bdb_checkpoint_interval;
+    
+    /**
+     * BDB: skip a checkpoint unless at least this many kilobytes of log
+     * were written since the last one.
+     */
+    uint32_t bdb_checkpoint_kbytes;
+    
+    /**
+     * BDB: remove log files no longer needed for recovery after each
+     * checkpoint.
+     */
+    int bdb_archive_logs;
+    
+    /**
+     * BDB: group commit. Transactions commit without syncing the log,
+     * and the maintenance thread flushes it every this many
+     * milliseconds, so a crash loses at most that much. 0 turns the
+     * periodic flush off.
+     */
+    unsigned int bdb_group_commit_interval;
+    
+    /**
+     * BPTree: sync each commit to disk before the write returns. With 0,
+     * a crash may lose the most recent commits.
+     */
+    int bptree_sync;
+    
+    /**
+     * BPTree: group commit. Writers that commit while another is syncing
+     * share the next sync; the thread doing it first waits this many
+     * microseconds for more to join. 0 syncs right away.
+     */
+    unsigned int bptree_group_commit_window;
+    
+    /**
+     * BPTree: bytes of each store to memory-map for reading at first, or
+     * 0 to read with pread. The mapping grows with the file; reads that
+     * hit it copy nothing until the document itself is built.
+     */
+    int64_t bptree_mmap_size;
+    
+    /**
+     * BPTree: how new records are checksummed; 0 for none, 1 for MD5,
+     * 2 for CRC-32C. Stores with records written either way stay
+     * readable.
+     */
+    int bptree_checksum;
+    
+    /**
+     * BPTree: check the checksum of each record read. Turn this off
+     * only if the files are trusted, say on a cache that can be rebuilt.
+     */
+    int bptree_verify_reads;
+    
+    /**
+     * Memory: seconds between snapshots of each store to <name>.mem in
+     * the environment directory, which are loaded again when the store
+     * is next opened. 0 keeps stores in memory only, gone once the
+     * environment is closed.
+     */
+    unsigned int memory_snapshot_interval;
+} la_storage_env_config_t;
+
+/**
+ * Fill in the default environment configuration.
+ */
+void la_storage_env_config_init(la_storage_env_config_t *config);
+
 typedef struct la_object_store_driver
 {
     const char *name;
-    la_storage_env * (*open_env)(const char *name);
+    
+    /**
+     * Open a storage environment.
+     *
+     * @param name The environment name (usually a directory).
+     * @param config The environment configuration; never NULL.
+     */
+    la_storage_env * (*open_env)(const char *name, const la_storage_env_config_t *config);
     int (*close_env)(la_storage_env *env);
     la_storage_open_result_t (*open_store)(la_storage_env *env, const char *name, int flags, la_storage_object_store **store);
     int (*close_store)(la_storage_object_store *store);
@@ -135,7 +393,42 @@ typedef struct la_object_store_driver
      */
     la_storage_object_get_result (*get)(la_storage_object_store *store, const char *key,
                                         const la_storage_rev_t *rev, la_storage_object **obj);
-    
+
+    /**
+     * Get many objects from the store in a single pass.
+     *
+     * @param store The object store handle.
+     * @param keys The keys to get, sorted in ascending byte order and
+     *  without duplicates.
+     * @param count The number of keys.
+     * @param objs Array of count pointers. Each entry is set to the object
+     *  for the key at the same index, or NULL if that key was not found.
+     *  Each object must be released with storage_destroy_object.
+     * @return LA_STORAGE_OBJECT_GET_OK if the lookup ran (even if some
+     *  keys were not found), or LA_STORAGE_OBJECT_GET_ERROR.
+     */
+    la_storage_object_get_result (*get_many)(la_storage_object_store *store, const char * const *keys,
+                                             size_t count, la_storage_object **objs);
+
+    /**
+     * Get an object without copying it out of the driver's memory.
+     *
+     * The driver may reuse that memory for the next borrowed get on the
+     * same thread, so callers release an object before borrowing another.
+     *
+     * @param store The object store handle.
+     * @param key The key of the object to get (null-terminated).
+     * @param rev The revision to match (if null, get the latest rev).
+     * @param obj The object to fill in. Must be released with release.
+     */
+    la_storage_object_get_result (*get_borrowed)(la_storage_object_store *store, const char *key,
+                                                 const la_storage_rev_t *rev, la_storage_borrowed_object *obj);
+
+    /**
+     * Release an object filled in by get_borrowed.
+     */
+    void (*release)(la_storage_object_store *store, la_storage_borrowed_object *obj);
+
     /**
      * Get the revision of an object.
      */
@@ -167,6 +460,25 @@ typedef struct la_object_store_driver
      * @param obj The object to put.
      */
     la_storage_object_put_result (*put)(la_storage_object_store *store, const la_storage_rev_t *rev, la_storage_object *obj);
+
+    /**
+     * Put many objects into the store under a single transaction. Each
+     * object is checked for conflicts the same way as put.
+     *
+     * @param store The object store handle.
+     * @param revs Array of count previous revisions; an entry is NULL if
+     *  that object is believed to be new.
+     * @param objs Array of count objects to put.
+     * @param count The number of objects.
+     * @param results Array of count results, set to the put result of the
+     *  object at the same index.
+     * @return LA_STORAGE_OBJECT_PUT_SUCCESS if the transaction committed
+     *  (individual objects may still have conflicted), or
+     *  LA_STORAGE_OBJECT_PUT_ERROR if nothing was written.
+     */
+    la_storage_object_put_result (*put_bulk)(la_storage_object_store *store, const la_storage_rev_t * const *revs,
+                                             la_storage_object **objs, size_t count,
+                                             la_storage_object_put_result *results);
     
     /**
      * Insert the given document and revisions into the DB, replacing
@@ -175,7 +487,9 @@ typedef struct la_object_store_driver
     la_storage_object_put_result (*replace)(la_storage_object_store *store, la_storage_object *obj);
     
     /**
-     * Fetch the last sequence number of this object store.
+     * Fetch the last sequence number of this object store. This is
+     * called for every la_storage_lastseq, so it should be cheap: no
+     * transactions and no allocation.
      */
     uint64_t (*lastseq)(la_storage_object_store *store);
     
@@ -184,7 +498,38 @@ typedef struct la_object_store_driver
      */
     int (*stat)(la_storage_object_store *store, la_storage_stat_t *stat);
     
+    /**
+     * Rewrite the store to drop the space taken by old versions of
+     * documents, while other threads go on reading and writing it. May
+     * be NULL if the store doesn't need (or support) compaction.
+     */
+    int (*compact)(la_storage_object_store *store, const la_storage_compact_options_t *options);
+    
     la_storage_object_iterator * (*iterator_open)(la_storage_object_store *store, uint64_t since);
+    
+    /**
+     * Open an iterator over the objects with a seq after from_seq and no
+     * later than to_seq, in seq order. Iterators over disjoint ranges may
+     * be used on different threads at once, including threads other than
+     * the one that opened them, so the driver can't tie an iterator to
+     * the opening thread's state (SQLite gives each its own connection).
+     * flags is 0 or
+     * LA_STORAGE_ITERATOR_HEADERS_ONLY. May be NULL if the driver doesn't
+     * support ranges.
+     */
+    la_storage_object_iterator * (*iterator_open_range)(la_storage_object_store *store, uint64_t from_seq, uint64_t to_seq, int flags);
+    
+    /**
+     * Open an iterator over the objects with keys from startkey to
+     * endkey (both inclusive; NULL for no bound), in key order. Keys
+     * compare as bytes, with a key before any longer key it is a prefix
+     * of. If descending is nonzero, the keys are returned in reverse,
+     * and startkey is the high end of the range. At most limit objects
+     * are returned, or all of them if limit is 0; flags is a combination
+     * of la_storage_iterator_flag_t. May be NULL if the driver doesn't
+     * support key ranges.
+     */
+    la_storage_object_iterator * (*iterator_open_keyrange)(la_storage_object_store *store, const char *startkey, const char *endkey, int descending, uint64_t limit, int flags);
     la_storage_object_iterator_result (*iterator_next)(la_storage_object_iterator *iterator, la_storage_object **obj);
     void (*iterator_close)(la_storage_object_iterator *iterator);    
 } la_object_store_driver_t;
@@ -206,12 +551,40 @@ typedef la_storage_object *(*la_storage_view_rereduce)(la_storage_object **accum
 la_storage_object *la_storage_create_object(const char *key, const la_storage_rev_t rev,
                                             const unsigned char *data, uint32_t length,
                                             const la_storage_rev_t *revs, size_t revcount);
+
+/**
+ * Allocate an object, with room for a key of key_length bytes and for
+ * header_size bytes of header, revisions and data, in a single block.
+ *
+ * If key is not NULL, key_length bytes of it are copied into the object's
+ * key. Otherwise the caller fills in the key (up to key_length bytes,
+ * plus the terminating null). The header is left uninitialized, and
+ * data_length is zero.
+ */
+la_storage_object *la_storage_alloc_object(const char *key, size_t key_length, size_t header_size);
+
+/**
+ * Make sure the object has room for size bytes of header, revisions
+ * and data, keeping the current contents. Use this instead of
+ * reallocating the header directly.
+ *
+ * Returns 0 on success, -1 if memory could not be allocated.
+ */
+int la_storage_object_reserve(la_storage_object *object, size_t size);
+
 void la_storage_destroy_object(la_storage_object *object);
 int la_storage_scan_rev(const char *str, la_storage_rev_t *rev);
 
 int la_storage_object_get_all_revs(const la_storage_object *object, la_storage_rev_t **revs);
 
-la_storage_env *la_storage_open_env(const char *driver, const char *name);
+/**
+ * Open a storage environment.
+ *
+ * @param driver The driver name.
+ * @param name The environment name (usually a directory).
+ * @param config The environment configuration, or NULL for the defaults.
+ */
+la_storage_env *la_storage_open_env(const char *driver, const char *name, const la_storage_env_config_t *config);
 void la_storage_close_env(const char *driver, la_storage_env *env);
 
 /**
@@ -249,6 +622,44 @@ la_storage_open_result_t la_storage_open(const char *driver, la_storage_env *env
  */
 la_storage_object_get_result la_storage_get(la_object_store_t *store, const char *key, const la_storage_rev_t *rev, la_storage_object **obj);
 
+/**
+ * Get an object from the store without copying it, when the driver
+ * supports that. The object's revisions and data point into the
+ * driver's memory until it is released, and only one object per thread
+ * should be borrowed at a time.
+ *
+ * Drivers that do not support borrowing fall back to a regular get.
+ *
+ * @param store The object store handle.
+ * @param key The key of the object to get (null-terminated).
+ * @param rev The revision to match when getting the object (if null, get the latest rev).
+ * @param obj The object to fill in. If the get succeeds, it must be
+ *  released with la_storage_release.
+ */
+la_storage_object_get_result la_storage_get_borrowed(la_object_store_t *store, const char *key, const la_storage_rev_t *rev,
+                                                     la_storage_borrowed_object *obj);
+
+/**
+ * Release an object got with la_storage_get_borrowed.
+ */
+void la_storage_release(la_object_store_t *store, la_storage_borrowed_object *obj);
+
+/**
+ * Get many objects from the store, placing them in the given array.
+ *
+ * Drivers that do not implement a batched lookup fall back to one get
+ * per key.
+ *
+ * @param store The object store handle.
+ * @param keys The keys to get, sorted in ascending byte order and
+ *  without duplicates.
+ * @param count The number of keys.
+ * @param objs Array of count pointers; each is set to the object for the
+ *  corresponding key, or NULL if not found. Each object must be released
+ *  with storage_destroy_object.
+ */
+la_storage_object_get_result la_storage_get_many(la_object_store_t *store, const char * const *keys, size_t count, la_storage_object **objs);
+
 la_storage_object_get_result la_storage_get_rev(la_object_store_t *store, const char *key, la_storage_rev_t *rev);
 
 /**
@@ -275,19 +686,128 @@ la_storage_object_put_result la_storage_set_revs(la_object_store_t *store, const
  */
 la_storage_object_put_result la_storage_put(la_object_store_t *store, const la_storage_rev_t *rev, la_storage_object *obj);
 
+/**
+ * Put many objects into the store under a single transaction.
+ *
+ * Drivers that do not implement a bulk put fall back to one put per
+ * object, in which case the puts are not applied atomically.
+ *
+ * @param store The object store handle.
+ * @param revs The previous revision of each object, or NULL entries for new objects.
+ * @param objs The objects to put.
+ * @param count The number of objects.
+ * @param results Array for the put result of each object.
+ */
+la_storage_object_put_result la_storage_put_bulk(la_object_store_t *store, const la_storage_rev_t * const *revs,
+                                                 la_storage_object **objs, size_t count,
+                                                 la_storage_object_put_result *results);
+
 /**
  * Insert the given document and revisions into the DB, replacing
  * existing values without checking for conflicts.
  */
 la_storage_object_put_result la_storage_replace(la_object_store_t *store, la_storage_object *obj);
 
+/**
+ * Return the last sequence number written.
+ */
 uint64_t la_storage_lastseq(la_object_store_t *store);
+
+/**
+ * Fetch the key count and approximate size of the store. These are
+ * counted as objects are written, and refreshed from the driver on a
+ * background thread every LA_STORAGE_STAT_INTERVAL seconds, so they may
+ * lag behind slightly. Only the first call waits for the driver.
+ */
 int la_storage_stat(la_object_store_t *store, la_storage_stat_t *stat);
 
+/**
+ * Compact the store. This returns when compaction is done, but reads and
+ * writes on other threads carry on meanwhile, so it is usually run on a
+ * thread of its own.
+ *
+ * @param options The options, or NULL for the defaults.
+ * @return 0 on success, -1 if compaction failed, was canceled, or isn't
+ *  supported by the store's driver.
+ */
+int la_storage_compact(la_object_store_t *store, const la_storage_compact_options_t *options);
+
 la_storage_object_iterator *la_storage_iterator_open(la_object_store_t *store, uint64_t since);
 la_storage_object_iterator_result la_storage_iterator_next(la_object_store_t *store, la_storage_object_iterator *it, la_storage_object **obj);
+
+/**
+ * Open an iterator over the objects with from_seq < seq <= to_seq. Pass
+ * UINT64_MAX as to_seq for no upper bound. The iterator may be used on
+ * any thread, one thread at a time.
+ *
+ * @param flags 0, or LA_STORAGE_ITERATOR_HEADERS_ONLY to get just the
+ *  key and header of each object, as a changes feed needs. The deleted
+ *  ones are still returned.
+ * @return The iterator, or NULL on error or if the driver doesn't
+ *  support ranges.
+ */
+la_storage_object_iterator *la_storage_iterator_open_range(la_object_store_t *store, uint64_t from_seq, uint64_t to_seq, int flags);
+
+/**
+ * Split the seqs up to the store's current lastseq into count ranges of
+ * (nearly) equal size, so count threads can each scan one with
+ * la_storage_iterator_open_range. Range i is from bounds[i] (exclusive)
+ * to bounds[i + 1] (inclusive).
+ *
+ * Updates leave holes in the seqs, so ranges over older seqs may hold
+ * fewer documents than ranges over recent ones.
+ *
+ * @param bounds Array of count + 1 seqs to fill in.
+ * @return The lastseq the ranges cover, which is bounds[count].
+ */
+uint64_t la_storage_partition_seqs(la_object_store_t *store, unsigned int count, uint64_t *bounds);
+
+/**
+ * Open an iterator over the objects with keys from startkey to endkey,
+ * in key order (or reverse order, if descending is nonzero, in which
+ * case startkey is the high end). Either key may be NULL for no bound.
+ *
+ * @param limit The most objects to return, or 0 for no limit.
+ * @param flags Any of la_storage_iterator_flag_t. Objects returned with
+ *  LA_STORAGE_ITERATOR_HEADERS_ONLY have no revisions and no data.
+ * @return The iterator, or NULL on error or if the driver doesn't
+ *  support key ranges.
+ */
+la_storage_object_iterator *la_storage_iterator_open_keyrange(la_object_store_t *store, const char *startkey, const char *endkey, int descending, uint64_t limit, int flags);
 void la_storage_iterator_close(la_object_store_t *store, la_storage_object_iterator *it);
 
+/**
+ * The number of objects a prefetching iterator reads ahead, if not
+ * given.
+ */
+#define LA_STORAGE_PREFETCH_DEPTH 64
+
+/**
+ * Read ahead from an iterator on a thread of its own, so that the
+ * caller can work on each object (decompressing and decoding it, say)
+ * while the next ones are read from storage.
+ *
+ * The prefetching iterator takes over it, and closes it when it is
+ * closed; it must not be used otherwise meanwhile.
+ *
+ * @param depth How many objects to read ahead, or 0 for
+ *  LA_STORAGE_PREFETCH_DEPTH. Rounded up to a power of two.
+ * @return The prefetching iterator, or NULL on error, in which case it
+ *  is left open.
+ */
+la_storage_prefetch_iterator *la_storage_prefetch_open(la_object_store_t *store, la_storage_object_iterator *it, unsigned int depth);
+
+/**
+ * Get the next object, as with la_storage_iterator_next.
+ */
+la_storage_object_iterator_result la_storage_prefetch_next(la_storage_prefetch_iterator *it, la_storage_object **obj);
+
+/**
+ * Stop reading ahead, and close the prefetching iterator and the
+ * iterator it read from.
+ */
+void la_storage_prefetch_close(la_storage_prefetch_iterator *it);
+
 int la_storage_install_view(la_object_store_t *store, const char *name, la_storage_view_map mapfn, la_storage_view_reduce reducefn, void *baton);
 
 void la_storage_close(la_object_store_t *store);
@@ -11,6 +11,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <ftw.h>
 #include "../ObjectStore.h"
@@ -37,14 +40,302 @@ int cb2(const char *path, const struct stat *ptr, int flag, struct FTW *ftw)
     return 0;
 }
 
+static const char *driver = "Memory";
 static la_storage_env *env = NULL;
-static la_storage_object_store *store = NULL;
+static la_object_store_t *store = NULL;
 
 void cleanup(void)
 {
     printf("cleaning up...\n");
+    // Closing the store closes its environment, too.
     if (store) la_storage_close(store);
-    if (env) la_storage_close_env(env);
+    else if (env) la_storage_close_env(driver, env);
+}
+
+/*
+ * One thread's share of a partitioned scan.
+ */
+struct range_scan
+{
+    pthread_t thread;
+    la_storage_object_iterator *it;
+    int count;
+    la_storage_object_iterator_result result;
+};
+
+static void *scan_range(void *arg)
+{
+    struct range_scan *scan = (struct range_scan *) arg;
+    la_storage_object *object;
+    
+    while ((scan->result = la_storage_iterator_next(store, scan->it, &object)) == LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT)
+    {
+        scan->count++;
+        la_storage_destroy_object(object);
+    }
+    return NULL;
+}
+
+/*
+ * Overwrite a few keys over and over, until compaction is done. Write i
+ * sets key "compact-<i % COMPACT_TEST_KEYS>" to "<i>".
+ */
+#define COMPACT_TEST_KEYS 100
+
+struct compact_writer
+{
+    pthread_t thread;
+    int stop;
+    int writes;
+    int failed;
+};
+
+static void *compact_writes(void *arg)
+{
+    struct compact_writer *writer = (struct compact_writer *) arg;
+    la_storage_object *object;
+    la_storage_rev_t rev;
+    char key[32], data[32];
+    
+    memset(&rev, 0, sizeof(la_storage_rev_t));
+    for (writer->writes = 0; !__atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE) || writer->writes < COMPACT_TEST_KEYS; writer->writes++)
+    {
+        snprintf(key, sizeof(key), "compact-%d", writer->writes % COMPACT_TEST_KEYS);
+        snprintf(data, sizeof(data), "%d", writer->writes);
+        object = la_storage_create_object(key, rev, (const unsigned char *) data, strlen(data), NULL, 0);
+        if (object == NULL || la_storage_replace(store, object) != LA_STORAGE_OBJECT_PUT_SUCCESS)
+            writer->failed = 1;
+        if (object != NULL)
+            la_storage_destroy_object(object);
+    }
+    return NULL;
+}
+
+/*
+ * Slow compaction down, so the writes get ahead of it and it has to
+ * finish copying with them held off.
+ */
+static int compact_progress(uint64_t copied, uint64_t total, void *baton)
+{
+    usleep(10000);
+    return 0;
+}
+
+/*
+ * Count the process's open files, or return -1 if we can't tell.
+ */
+static int open_files(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    int count = 0;
+    
+    if (dir == NULL)
+        return -1;
+    while (readdir(dir) != NULL)
+        count++;
+    closedir(dir);
+    return count;
+}
+
+/*
+ * Close the store and open it again, as a restart would, with config
+ * (or the defaults, if NULL).
+ */
+static int reopen(const la_storage_env_config_t *config)
+{
+    la_storage_close(store);
+    store = NULL;
+    if ((env = la_storage_open_env(driver, "/tmp/storagetest", config)) == NULL)
+        return -1;
+    if (la_storage_open(driver, env, "test", 0, &store) != LA_STORAGE_OPEN_OK)
+    {
+        // A failed open closes the environment.
+        env = NULL;
+        store = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Find needle in the store's file, and return its offset, or -1.
+ */
+static off_t find_in_file(const char *path, const char *needle)
+{
+    FILE *f = fopen(path, "rb");
+    size_t n = strlen(needle), matched = 0;
+    off_t offset = 0;
+    int c;
+
+    if (f == NULL)
+        return -1;
+    while ((c = fgetc(f)) != EOF)
+    {
+        offset++;
+        if (c == needle[matched])
+        {
+            if (++matched == n)
+            {
+                fclose(f);
+                return offset - (off_t) n;
+            }
+        }
+        else
+            matched = (c == needle[0]) ? 1 : 0;
+    }
+    fclose(f);
+    return -1;
+}
+
+/*
+ * Tests of the BPTree driver's file: recovery on reopen, ignoring a
+ * torn commit, compaction, borrowing from the mapping, and checksums
+ * catching a damaged record.
+ */
+static int bptree_tests(void)
+{
+    const char *path = "/tmp/storagetest/test.bpt";
+    uint64_t lastseq = la_storage_lastseq(store);
+    la_storage_object *object = NULL;
+    la_storage_rev_t rev;
+    char junk[6000];
+    off_t offset;
+    int fd;
+
+    printf("reopening... ");
+    if (reopen(NULL) != 0 || la_storage_lastseq(store) != lastseq)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    if (la_storage_get(store, "stress-999", NULL, &object) != LA_STORAGE_OBJECT_GET_OK || object->data_length != 256)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    la_storage_destroy_object(object);
+    printf("OK\n");
+
+    printf("reopening after a torn commit... ");
+    // A commit cut off partway through leaves bytes past the last header.
+    memset(junk, 0xa5, sizeof(junk));
+    if ((fd = open(path, O_WRONLY | O_APPEND)) < 0 || write(fd, junk, sizeof(junk)) != sizeof(junk))
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    close(fd);
+    if (reopen(NULL) != 0 || la_storage_lastseq(store) != lastseq)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    memset(&rev, 0, sizeof(la_storage_rev_t));
+    object = la_storage_create_object("after-torn", rev, (const unsigned char *) "checksum me", 11, NULL, 0);
+    if (la_storage_put(store, NULL, object) != LA_STORAGE_OBJECT_PUT_SUCCESS)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    la_storage_destroy_object(object);
+    printf("OK\n");
+
+    printf("compacting while writing... ");
+    {
+        la_storage_compact_options_t options;
+        la_storage_object_iterator *old;
+        struct compact_writer writer;
+        char data[32];
+        int i, count = 0, failed = 0, files = open_files();
+        
+        lastseq = la_storage_lastseq(store);
+        memset(&options, 0, sizeof(options));
+        options.batch_size = 16;
+        options.progress = compact_progress;
+        // An iterator on the old file, which has to stay readable.
+        old = la_storage_iterator_open(store, 0);
+        memset(&writer, 0, sizeof(writer));
+        pthread_create(&writer.thread, NULL, compact_writes, &writer);
+        if (la_storage_compact(store, &options) != 0)
+            failed = 1;
+        __atomic_store_n(&writer.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(writer.thread, NULL);
+        while (old != NULL && la_storage_iterator_next(store, old, NULL) == LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT)
+            count++;
+        if (old != NULL)
+            la_storage_iterator_close(store, old);
+        // Closing the last iterator on it closed the old file.
+        if (files != open_files())
+            failed = 1;
+        if (failed || writer.failed || count < 1000 || la_storage_lastseq(store) != lastseq + writer.writes)
+        {
+            printf("FAIL\n");
+            return 1;
+        }
+        // Each key has its last write, whether it came before the compaction or during it.
+        for (i = 0; i < COMPACT_TEST_KEYS; i++)
+        {
+            snprintf(data, sizeof(data), "compact-%d", i);
+            if (la_storage_get(store, data, NULL, &object) != LA_STORAGE_OBJECT_GET_OK)
+            {
+                printf("FAIL\n");
+                return 1;
+            }
+            snprintf(data, sizeof(data), "%d", (writer.writes - 1 - i) / COMPACT_TEST_KEYS * COMPACT_TEST_KEYS + i);
+            failed = object->data_length != strlen(data) || memcmp(la_storage_object_get_data(object), data, strlen(data)) != 0;
+            la_storage_destroy_object(object);
+            if (failed)
+            {
+                printf("FAIL\n");
+                return 1;
+            }
+        }
+        lastseq = la_storage_lastseq(store);
+    }
+    printf("OK\n");
+
+    printf("borrowing a mapped record across compaction... ");
+    {
+        la_storage_env_config_t config;
+        la_storage_borrowed_object borrowed;
+        int files, failed;
+
+        la_storage_env_config_init(&config);
+        config.bptree_mmap_size = 1024 * 1024;
+        if (reopen(&config) != 0 || la_storage_get_borrowed(store, "after-torn", NULL, &borrowed) != LA_STORAGE_OBJECT_GET_OK)
+        {
+            printf("FAIL\n");
+            return 1;
+        }
+        files = open_files();
+        // The borrowed record keeps the old file, and its mapping, until it's released.
+        failed = la_storage_compact(store, NULL) != 0
+            || borrowed.data_length != 11 || memcmp(borrowed.data, "checksum me", 11) != 0
+            || open_files() != files + 1;
+        la_storage_release(store, &borrowed);
+        if (failed || open_files() != files)
+        {
+            printf("FAIL\n");
+            return 1;
+        }
+    }
+    printf("OK\n");
+
+    printf("reading a damaged record... ");
+    if (reopen(NULL) != 0 || (offset = find_in_file(path, "checksum me")) < 0 || (fd = open(path, O_WRONLY)) < 0
+        || pwrite(fd, "C", 1, offset) != 1)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    close(fd);
+    if (la_storage_get(store, "after-torn", NULL, &object) != LA_STORAGE_OBJECT_GET_ERROR)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
 }
 
 int main(int argc, char **argv)
@@ -54,9 +345,12 @@ int main(int argc, char **argv)
 
     atexit(cleanup);
     setvbuf(stdout, NULL, _IONBF, 0);
-    printf("storage test of driver %s\n", la_storage_driver());
+    // The driver to test may be given as the first argument.
+    if (argc > 1)
+        driver = argv[1];
+    printf("storage test of driver %s\n", driver);
     printf("opening environment... ");
-    env = la_storage_open_env("/tmp/storagetest");
+    env = la_storage_open_env(driver, "/tmp/storagetest", NULL);
     if (env == NULL)
     {
         printf("FAIL\n");
@@ -64,9 +358,12 @@ int main(int argc, char **argv)
     }
     printf("OK\n");
     printf("opening object store \"test\"... ");
-    store = la_storage_open(env, "test");
-    if (store == NULL)
+    la_storage_open_result_t opened = la_storage_open(driver, env, "test", LA_STORAGE_OPEN_FLAG_CREATE, &store);
+    if (opened != LA_STORAGE_OPEN_OK && opened != LA_STORAGE_OPEN_CREATED)
     {
+        // A failed open closes the environment.
+        env = NULL;
+        store = NULL;
         printf("FAIL\n");
         return 2;
     }
@@ -200,16 +497,35 @@ int main(int argc, char **argv)
     }
     la_storage_destroy_object(object);
     printf("OK\n");
-    
+
+    printf("getting many objects... ");
+    const char *many_keys[] = { "newobject", "not_there", "object1", "object3" };
+    la_storage_object *many[4];
+    if ((get = la_storage_get_many(store, many_keys, 4, many)) != LA_STORAGE_OBJECT_GET_OK)
+    {
+        printf("FAIL (%d)\n", get);
+        return 1;
+    }
+    if (many[0] == NULL || many[1] != NULL || many[2] == NULL || many[3] == NULL
+        || strcmp(many[2]->key, "object1") != 0 || many[2]->data_length != 4)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    la_storage_destroy_object(many[0]);
+    la_storage_destroy_object(many[2]);
+    la_storage_destroy_object(many[3]);
+    printf("OK\n");
+
     printf("iterating... ");
     la_storage_object_iterator *it = la_storage_iterator_open(store, 0);
     int ret;
     int i = 0;
     do {
-        ret = la_storage_iterator_next(it, &object);
+        ret = la_storage_iterator_next(store, it, &object);
         if (ret == LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT)
         {
-            printf("%s(%llu, %s) ", object->key, object->header->seq, la_storage_object_get_data(object));
+            printf("%s(%llu, %.*s) ", object->key, object->header->seq, (int) object->data_length, la_storage_object_get_data(object));
             la_storage_destroy_object(object);
             if (i < 4)
             {
@@ -223,14 +539,90 @@ int main(int argc, char **argv)
             }
         }
     } while (ret == LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT);
-    la_storage_iterator_close(it);
+    la_storage_iterator_close(store, it);
     if (ret != LA_STORAGE_OBJECT_ITERATOR_END)
     {
         printf("FAIL\n");
         return 1;
     }
     printf("OK\n");
-    
+
+    printf("iterating by key range... ");
+    const char *range_keys[] = { "object3", "object2" };
+    it = la_storage_iterator_open_keyrange(store, "object3", "object", 1, 2, LA_STORAGE_ITERATOR_HEADERS_ONLY);
+    if (it == NULL)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    for (i = 0; (ret = la_storage_iterator_next(store, it, &object)) == LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT; i++)
+    {
+        printf("%s(%llu) ", object->key, object->header->seq);
+        if (i >= 2 || strcmp(object->key, range_keys[i]) != 0 || object->data_length != 0)
+        {
+            printf("FAIL\n");
+            return 1;
+        }
+        la_storage_destroy_object(object);
+    }
+    la_storage_iterator_close(store, it);
+    if (ret != LA_STORAGE_OBJECT_ITERATOR_END || i != 2)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("OK\n");
+
+    printf("iterating headers only... ");
+    it = la_storage_iterator_open_range(store, 0, UINT64_MAX, LA_STORAGE_ITERATOR_HEADERS_ONLY);
+    if (it == NULL)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    for (i = 0; (ret = la_storage_iterator_next(store, it, &object)) == LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT; i++)
+    {
+        if (object->data_length != 0 || object->header->rev_count != 0 || object->header->seq == 0)
+        {
+            printf("FAIL\n");
+            return 1;
+        }
+        la_storage_destroy_object(object);
+    }
+    la_storage_iterator_close(store, it);
+    if (ret != LA_STORAGE_OBJECT_ITERATOR_END || i == 0)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("OK (%d)\n", i);
+
+    printf("prefetching... ");
+    la_storage_prefetch_iterator *prefetch = la_storage_prefetch_open(store, la_storage_iterator_open(store, 0), 2);
+    if (prefetch == NULL)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    uint64_t lastseq = 0;
+    for (i = 0; (ret = la_storage_prefetch_next(prefetch, &object)) == LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT; i++)
+    {
+        if (object->header->seq <= lastseq)
+        {
+            printf("FAIL\n");
+            return 1;
+        }
+        lastseq = object->header->seq;
+        la_storage_destroy_object(object);
+    }
+    la_storage_prefetch_close(prefetch);
+    if (ret != LA_STORAGE_OBJECT_ITERATOR_END || i == 0)
+    {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("OK (%d)\n", i);
+
     printf("stress test... ");
     for (i = 0; i < 1000; i++)
     {
@@ -249,6 +641,85 @@ int main(int argc, char **argv)
         la_storage_destroy_object(o);
     }
     printf("OK\n");
+
+    printf("counting a replaced key... ");
+    {
+        la_storage_stat_t stat;
+        la_storage_rev_t rev;
+        uint64_t lastseq = la_storage_lastseq(store);
+        int numkeys, tries;
+
+        if (la_storage_stat(store, &stat) != 0)
+        {
+            printf("FAIL (stat)\n");
+            return 1;
+        }
+        numkeys = stat.numkeys;
+        memset(&rev, 0, sizeof(la_storage_rev_t));
+        la_storage_object *o = la_storage_create_object("stat-replaced", rev, (const unsigned char *) "{}", 2, NULL, 0);
+        if (la_storage_replace(store, o) != LA_STORAGE_OBJECT_PUT_SUCCESS || la_storage_lastseq(store) != lastseq + 1)
+        {
+            printf("FAIL (lastseq)\n");
+            return 1;
+        }
+        la_storage_destroy_object(o);
+        // The count is picked up by a reconcile in the background.
+        for (tries = 0; tries < 100 && la_storage_stat(store, &stat) == 0 && stat.numkeys != numkeys + 1; tries++)
+            usleep(10000);
+        if (stat.numkeys != numkeys + 1)
+        {
+            printf("FAIL (%d keys, not %d)\n", stat.numkeys, numkeys + 1);
+            return 1;
+        }
+        printf("OK\n");
+    }
+
+    printf("scanning partitions on threads... ");
+    {
+        // Opened here, and used on the threads.
+        struct range_scan scans[4];
+        uint64_t bounds[5];
+        int total = 0, expected = 0;
+        
+        it = la_storage_iterator_open_range(store, 0, UINT64_MAX, LA_STORAGE_ITERATOR_HEADERS_ONLY);
+        while (it != NULL && la_storage_iterator_next(store, it, NULL) == LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT)
+            expected++;
+        if (it != NULL)
+            la_storage_iterator_close(store, it);
+        la_storage_partition_seqs(store, 4, bounds);
+        memset(scans, 0, sizeof(scans));
+        for (i = 0; i < 4; i++)
+        {
+            scans[i].it = la_storage_iterator_open_range(store, bounds[i], bounds[i + 1], LA_STORAGE_ITERATOR_HEADERS_ONLY);
+            if (scans[i].it == NULL)
+            {
+                printf("FAIL\n");
+                return 1;
+            }
+        }
+        for (i = 0; i < 4; i++)
+            pthread_create(&scans[i].thread, NULL, scan_range, &scans[i]);
+        for (i = 0; i < 4; i++)
+        {
+            pthread_join(scans[i].thread, NULL);
+            la_storage_iterator_close(store, scans[i].it);
+            if (scans[i].result != LA_STORAGE_OBJECT_ITERATOR_END)
+            {
+                printf("FAIL\n");
+                return 1;
+            }
+            total += scans[i].count;
+        }
+        if (expected == 0 || total != expected)
+        {
+            printf("FAIL (%d of %d)\n", total, expected);
+            return 1;
+        }
+        printf("OK (%d)\n", total);
+    }
+    
+    if (strcmp(driver, "BPTree") == 0 && (i = bptree_tests()) != 0)
+        return i;
     
     printf("lastseq is %llu\n", la_storage_lastseq(store));
     return 0;
@@ -25,6 +25,21 @@
 #define LA_API_DELETED_NAME "_deleted"
 #endif
 
+/*
+ * Documents shorter than this many bytes are stored uncompressed.
+ */
+#ifndef LA_API_COMPRESS_MIN_SIZE
+#define LA_API_COMPRESS_MIN_SIZE 64
+#endif
+
+/*
+ * Documents that compress by less than this percentage are stored
+ * uncompressed.
+ */
+#ifndef LA_API_COMPRESS_MIN_SAVINGS
+#define LA_API_COMPRESS_MIN_SAVINGS 10
+#endif
+
 #if defined (__APPLE__) /* Jerks. */
 # include <CommonCrypto/CommonDigest.h>
 # define SHA1_DIGEST_LENGTH CC_SHA1_DIGEST_LENGTH
@@ -38,6 +53,7 @@
 typedef struct la_host la_host_t;
 typedef struct la_db la_db_t;
 typedef struct la_view_iterator la_view_iterator_t;
+typedef struct la_all_docs_iterator la_all_docs_iterator_t;
 
 typedef enum
 {
@@ -54,6 +70,39 @@ typedef enum
     LA_DB_PUT_ERROR
 } la_db_put_result;
 
+/**
+ * One document in a bulk put.
+ */
+typedef struct la_db_bulk_doc
+{
+    /**
+     * The document key. If NULL, the "_id" field of the document is used,
+     * or a random key is generated.
+     */
+    const char *key;
+    
+    /**
+     * The revision being replaced, or NULL for a new document.
+     */
+    const la_rev_t *rev;
+    
+    /**
+     * The document. A document with "_deleted" set to true deletes the
+     * document instead.
+     */
+    const la_codec_value_t *doc;
+    
+    /**
+     * Set to the result of putting this document.
+     */
+    la_db_put_result result;
+    
+    /**
+     * Set to the new revision, if the put succeeded.
+     */
+    la_rev_t newrev;
+} la_db_bulk_doc_t;
+
 typedef enum
 {
     LA_DB_DELETE_OK,
@@ -61,6 +110,91 @@ typedef enum
     LA_DB_DELETE_ERROR
 } la_db_delete_result;
 
+/**
+ * Options for la_db_all_docs. All zero (or passing NULL) lists every
+ * document in key order.
+ */
+typedef struct la_db_all_docs_options
+{
+    /**
+     * The first key to list, or NULL to start at the first (or, if
+     * descending, the last) document.
+     */
+    const char *startkey;
+    
+    /**
+     * The last key to list, or NULL to go to the end.
+     */
+    const char *endkey;
+    
+    /**
+     * Nonzero to list the documents in reverse key order. startkey is
+     * then the higher key.
+     */
+    int descending;
+    
+    /**
+     * The most documents to list, or 0 for no limit.
+     */
+    uint64_t limit;
+    
+    /**
+     * Nonzero to return each document too. Otherwise only the keys and
+     * revisions are read, which for most drivers doesn't touch the
+     * documents at all.
+     */
+    int include_docs;
+} la_db_all_docs_options_t;
+
+/**
+ * Flags for la_db_get_raw.
+ */
+typedef enum
+{
+    /**
+     * Return the document as stored, without decompressing it, if the
+     * host has a compressor. For passing on to clients that can
+     * decompress it themselves.
+     */
+    LA_DB_GET_RAW_COMPRESSED = 1 << 0
+} la_db_get_raw_flag_t;
+
+/**
+ * A document as stored, from la_db_get_raw.
+ */
+typedef struct la_db_raw_doc
+{
+    /**
+     * The revision read, and the document's sequence number.
+     */
+    la_rev_t rev;
+    
+    /**
+     * Nonzero if this revision deletes the document.
+     */
+    int deleted;
+    
+    /**
+     * Nonzero if data is still compressed with the host's compressor:
+     * by its context API if object.header.sized is set, or else by its
+     * plain compressor.
+     */
+    int compressed;
+    
+    /**
+     * The document's JSON, without its "_id" and "_rev" fields. Valid
+     * until the document is passed to la_db_release_raw.
+     */
+    const unsigned char *data;
+    size_t length;
+    
+    /**
+     * State for releasing the document.
+     */
+    la_storage_borrowed_object object;
+    unsigned char *inflated;
+} la_db_raw_doc_t;
+
 typedef enum
 {
     LA_VIEW_ITERATOR_GOT_NEXT,
@@ -68,11 +202,27 @@ typedef enum
     LA_VIEW_ITERATOR_ERROR
 } la_view_iterator_result;
 
-la_host_t *la_host_open(const char *driver, const char *hosthome);
+/**
+ * Open a host, with the storage environment at hosthome.
+ *
+ * @param driver The storage driver name.
+ * @param hosthome The storage environment home.
+ * @param config Storage environment tuning, or NULL for the defaults.
+ */
+la_host_t *la_host_open(const char *driver, const char *hosthome, const la_storage_env_config_t *config);
 void la_host_close(la_host_t *host);
 
 void la_host_configure_compressor(la_host_t *host, la_compressor_t *compressor);
 
+/**
+ * Set when documents are worth compressing. Documents shorter than
+ * min_size bytes, or that the compressor shrinks by less than
+ * min_savings percent, are stored as they are, and read back without
+ * decompressing them. The defaults are LA_API_COMPRESS_MIN_SIZE and
+ * LA_API_COMPRESS_MIN_SAVINGS.
+ */
+void la_host_configure_compression(la_host_t *host, size_t min_size, unsigned int min_savings);
+
 /**
  * A view state object, passed in to the la_view_mapfn to handle
  * map results.
@@ -125,16 +275,70 @@ la_db_open_result_t la_db_open(la_host_t *host, const char *name, int flags, la_
 int la_db_delete_db(la_db_t *db);
 la_db_get_result la_db_get(la_db_t *db, const char *key, la_rev_t *rev, la_codec_value_t **value,
                            la_rev_t *current_rev, la_codec_error_t *error);
+/**
+ * Get a document's stored bytes, without decoding them, for serving
+ * the document as-is.
+ *
+ * Unlike la_db_get, deleted documents are returned, with deleted set.
+ * Unless it is decompressed, the data is read in place from the storage
+ * driver, so pass the document to la_db_release_raw promptly.
+ *
+ * @param rev The revision to get, or NULL for the current one.
+ * @param flags The la_db_get_raw_flag_t flags.
+ * @param doc Filled in with the document, if LA_DB_GET_OK is returned.
+ */
+la_db_get_result la_db_get_raw(la_db_t *db, const char *key, la_rev_t *rev, int flags, la_db_raw_doc_t *doc);
+void la_db_release_raw(la_db_t *db, la_db_raw_doc_t *doc);
 int la_db_get_allrevs(la_db_t *db, const char *key, uint64_t *start, la_storage_rev_t **revs);
 uint64_t la_db_last_seq(la_db_t *db);
 int la_db_stat(la_db_t *db, la_storage_stat_t *stat);
+
+/**
+ * Compact the database, discarding old versions of documents from its
+ * file. Blocks until done, but doesn't block readers or writers on other
+ * threads; see la_storage_compact.
+ */
+int la_db_compact(la_db_t *db, const la_storage_compact_options_t *options);
 la_db_put_result la_db_put(la_db_t *db, const char *key, const la_rev_t *rev, const la_codec_value_t *doc, la_rev_t *newrev);
+
+/**
+ * Put many documents under one storage transaction. Conflicts are
+ * checked for each document as in la_db_put, and reported in the result
+ * field of each document.
+ *
+ * @return LA_DB_PUT_OK if the batch was applied (check each document's
+ *  result), or LA_DB_PUT_ERROR if nothing was written.
+ */
+la_db_put_result la_db_put_bulk(la_db_t *db, la_db_bulk_doc_t *docs, size_t count);
 la_db_put_result la_db_replace(la_db_t *db, const char *key, const la_rev_t *rev, const la_codec_value_t *doc,
                                const la_storage_rev_t *oldrevs, size_t revcount);
 la_db_delete_result la_db_delete(la_db_t *db, const char *key, const la_rev_t *rev);
 la_view_iterator_t *la_db_view(la_db_t *db, la_view_mapfn map, la_view_reducefn reduce, la_view_rereducefn rereduce, void *baton);
 la_view_iterator_result la_view_iterator_next(la_view_iterator_t *it, la_codec_value_t **value, la_codec_error_t *error);
 void la_view_iterator_close(la_view_iterator_t *it);
+
+/**
+ * List the documents in a database by key. Deleted documents are left
+ * out.
+ *
+ * @param options The range and options, or NULL to list everything.
+ * @return The iterator, or NULL on error, or if the storage driver
+ *  can't list keys in order.
+ */
+la_all_docs_iterator_t *la_db_all_docs(la_db_t *db, const la_db_all_docs_options_t *options);
+
+/**
+ * Get the next document from an all docs iterator.
+ *
+ * @param key Set to the document's key, which is valid until the next
+ *  call. May be NULL.
+ * @param rev Set to the document's current revision. May be NULL.
+ * @param doc Set to the document, if the iterator was opened with
+ *  include_docs; otherwise set to NULL. May be NULL.
+ */
+la_view_iterator_result la_all_docs_iterator_next(la_all_docs_iterator_t *it, const char **key, la_rev_t *rev,
+                                                  la_codec_value_t **doc, la_codec_error_t *error);
+void la_all_docs_iterator_close(la_all_docs_iterator_t *it);
 void la_db_close(la_db_t *db);
 
 #endif
@@ -9,6 +9,7 @@
 #include "LoungeAct.h"
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "../Utils/buffer.h"
 #include "../Utils/stringutils.h"
 #include "../compress/compress.h"
@@ -34,6 +35,8 @@ struct la_host
     const char *driver;
     la_storage_env *env;
     la_compressor_t *compressor;
+    size_t compress_min_size;
+    unsigned int compress_min_savings;
 };
 
 struct la_db
@@ -42,10 +45,14 @@ struct la_db
     la_object_store_t *store;
 };
 
+/*
+ * Views read the store with a prefetching iterator, so documents are
+ * read from storage while earlier ones are decoded and mapped.
+ */
 struct la_view_iterator
 {
     la_db_t *db;
-    la_storage_object_iterator *it;
+    la_storage_prefetch_iterator *it;
     la_view_mapfn map;
     la_view_reducefn reduce;
     la_codec_value_t *accum;
@@ -53,12 +60,20 @@ struct la_view_iterator
     la_codec_value_t *mapped;
 };
 
-la_host_t *la_host_open(const char *driver, const char *hosthome)
+struct la_all_docs_iterator
+{
+    la_db_t *db;
+    la_storage_object_iterator *it;
+    int include_docs;
+    la_storage_object *current;
+};
+
+la_host_t *la_host_open(const char *driver, const char *hosthome, const la_storage_env_config_t *config)
 {
     la_host_t *host = (la_host_t *) malloc(sizeof(struct la_host));
     if (host == NULL)
         return NULL;
-    host->env = la_storage_open_env(driver, hosthome);
+    host->env = la_storage_open_env(driver, hosthome, config);
     if (host->env == NULL)
     {
         free(host);
@@ -66,6 +81,8 @@ la_host_t *la_host_open(const char *driver, const char *hosthome)
     }
     host->driver = driver;
     host->compressor = NULL;
+    host->compress_min_size = LA_API_COMPRESS_MIN_SIZE;
+    host->compress_min_savings = LA_API_COMPRESS_MIN_SAVINGS;
     return host;
 }
 
@@ -80,6 +97,12 @@ void la_host_configure_compressor(la_host_t *host, la_compressor_t *compressor)
     host->compressor = compressor;
 }
 
+void la_host_configure_compression(la_host_t *host, size_t min_size, unsigned int min_savings)
+{
+    host->compress_min_size = min_size;
+    host->compress_min_savings = min_savings < 100 ? min_savings : 100;
+}
+
 la_db_open_result_t la_db_open(la_host_t *host, const char *name, int flags, la_db_t **_db)
 {
     la_storage_open_result_t result;
@@ -104,6 +127,113 @@ int la_db_delete_db(la_db_t *db)
     return 0;
 }
 
+/*
+ * Each thread keeps a context for the compressor it last used, if the
+ * compressor has the context API, and a scratch buffer documents are
+ * encoded into before they are compressed.
+ */
+#define LA_API_SCRATCH_MAX (1024 * 1024)
+
+struct compress_state
+{
+    la_compressor_t *compressor;
+    void *context;
+    la_buffer_t *scratch;
+};
+
+static __thread struct compress_state *thread_compress = NULL;
+static pthread_key_t compress_key;
+static pthread_once_t compress_key_once = PTHREAD_ONCE_INIT;
+
+static void compress_state_destroy(void *p)
+{
+    struct compress_state *state = (struct compress_state *) p;
+    
+    if (state->context != NULL)
+        state->compressor->context_free(state->context);
+    if (state->scratch != NULL)
+        la_buffer_destroy(state->scratch);
+    free(state);
+    thread_compress = NULL;
+}
+
+static void compress_key_init(void)
+{
+    pthread_key_create(&compress_key, compress_state_destroy);
+}
+
+static struct compress_state *get_compress_state(la_compressor_t *compressor)
+{
+    struct compress_state *state = thread_compress;
+    
+    if (state == NULL)
+    {
+        pthread_once(&compress_key_once, compress_key_init);
+        state = calloc(1, sizeof(struct compress_state));
+        if (state == NULL)
+            return NULL;
+        pthread_setspecific(compress_key, state);
+        thread_compress = state;
+    }
+    if (state->compressor != compressor || state->context == NULL)
+    {
+        if (state->context != NULL)
+            state->compressor->context_free(state->context);
+        state->compressor = compressor;
+        state->context = compressor->context_new != NULL ? compressor->context_new() : NULL;
+    }
+    return state;
+}
+
+/*
+ * Decompress stored data into memory from malloc. Data the context API
+ * wrote records its length (the header's sized flag), so that is an
+ * allocation of the right size and one call; anything else goes to the
+ * plain decompressor.
+ */
+static unsigned char *decompress(la_compressor_t *compressor, const la_storage_object_header *header,
+                                 const unsigned char *data, size_t length, size_t *outlen)
+{
+    struct compress_state *state;
+    unsigned char *out;
+    size_t size;
+    
+    if (!header->sized)
+        return compressor->decompressor((unsigned char *) data, length, outlen);
+    if (compressor->decompressed_length == NULL || compressor->decompressed_length(data, length, &size) != 0
+        || (state = get_compress_state(compressor)) == NULL)
+        return NULL;
+    out = malloc(size > 0 ? size : 1);
+    if (out == NULL)
+        return NULL;
+    if (compressor->decompress_into(state->context, data, length, out, size, outlen) != 0)
+    {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ * Decode a stored document, decompressing it first if it's compressed.
+ */
+static la_codec_value_t *decode_doc(la_db_t *db, const la_storage_object *object, la_codec_error_t *error)
+{
+    const unsigned char *data = la_storage_object_get_data(object);
+    la_codec_value_t *v;
+    size_t inflated_size;
+    unsigned char *inflated;
+    
+    if (db->host->compressor == NULL || object->header->uncompressed)
+        return la_codec_loadb((const char *) data, object->data_length, 0, error);
+    inflated = decompress(db->host->compressor, object->header, data, object->data_length, &inflated_size);
+    if (inflated == NULL)
+        return NULL;
+    v = la_codec_loadb((const char *) inflated, inflated_size, 0, error);
+    free(inflated);
+    return v;
+}
+
 static int is_tombstone(la_codec_value_t *doc)
 {
     if (doc == NULL)
@@ -118,49 +248,72 @@ static int is_tombstone(la_codec_value_t *doc)
     return la_codec_is_true(val);
 }
 
-la_db_get_result la_db_get(la_db_t *db, const char *key, la_rev_t *rev, la_codec_value_t **value,
-                           la_rev_t *current_rev, la_codec_error_t *error)
+la_db_get_result la_db_get_raw(la_db_t *db, const char *key, la_rev_t *rev, int flags, la_db_raw_doc_t *doc)
 {
-    la_codec_value_t *v;
-    la_storage_object *object;
     la_storage_rev_t *srev = rev ? &rev->rev : NULL;
-    la_storage_object_get_result result = la_storage_get(db->store, key, srev, &object);
-    const char *object_data = NULL;
-
+    la_storage_object_get_result result = la_storage_get_borrowed(db->store, key, srev, &doc->object);
+    size_t inflated_size;
+    
     if (result != LA_STORAGE_OBJECT_GET_OK)
     {
         if (result == LA_STORAGE_OBJECT_GET_NOT_FOUND || result == LA_STORAGE_OBJECT_GET_REVISION_NOT_FOUND)
             return LA_DB_GET_NOT_FOUND;
         return LA_DB_GET_ERROR;
     }
-    if (object->header->deleted)
+    doc->rev.seq = doc->object.header.doc_seq;
+    memcpy(&doc->rev.rev, &doc->object.header.rev, sizeof(la_storage_rev_t));
+    doc->deleted = doc->object.header.deleted;
+    doc->inflated = NULL;
+    if (db->host->compressor == NULL || doc->object.header.uncompressed || (flags & LA_DB_GET_RAW_COMPRESSED) != 0)
     {
-        la_storage_destroy_object(object);
-        return LA_DB_GET_NOT_FOUND;
+        // Hand out the driver's copy; it's released in la_db_release_raw.
+        doc->compressed = db->host->compressor != NULL && !doc->object.header.uncompressed;
+        doc->data = doc->object.data;
+        doc->length = doc->object.data_length;
+        return LA_DB_GET_OK;
     }
-    object_data = (const char *) la_storage_object_get_data(object);
-    if (db->host->compressor != NULL)
+    doc->inflated = decompress(db->host->compressor, &doc->object.header, doc->object.data, doc->object.data_length,
+                               &inflated_size);
+    la_storage_release(db->store, &doc->object);
+    if (doc->inflated == NULL)
+        return LA_DB_GET_ERROR;
+    doc->compressed = 0;
+    doc->data = doc->inflated;
+    doc->length = inflated_size;
+    return LA_DB_GET_OK;
+}
+
+void la_db_release_raw(la_db_t *db, la_db_raw_doc_t *doc)
+{
+    if (doc->inflated != NULL)
     {
-        size_t inflated_size;
-        unsigned char *inflated_data = db->host->compressor->decompressor(object_data, object->data_length, &inflated_size);
-        if (inflated_data == NULL)
-        {
-            la_storage_destroy_object(object);
-            return LA_DB_GET_ERROR;
-        }
-        v = la_codec_loadb(inflated_data, inflated_size, 0, error);
-        free(inflated_data);
+        free(doc->inflated);
+        doc->inflated = NULL;
     }
     else
+        la_storage_release(db->store, &doc->object);
+}
+
+la_db_get_result la_db_get(la_db_t *db, const char *key, la_rev_t *rev, la_codec_value_t **value,
+                           la_rev_t *current_rev, la_codec_error_t *error)
+{
+    la_codec_value_t *v;
+    la_db_raw_doc_t doc;
+    la_db_get_result result = la_db_get_raw(db, key, rev, 0, &doc);
+    
+    if (result != LA_DB_GET_OK)
+        return result;
+    if (doc.deleted)
     {
-        v = la_codec_loadb(object_data, object->data_length, 0, error);
+        la_db_release_raw(db, &doc);
+        return LA_DB_GET_NOT_FOUND;
     }
+    // Decode straight from the driver's memory (or the decompressed copy);
+    // the document is released as soon as we have our own value.
+    v = la_codec_loadb((const char *) doc.data, doc.length, 0, error);
+    la_db_release_raw(db, &doc);
     if (current_rev != NULL)
-    {
-        current_rev->seq = object->header->doc_seq;
-        memcpy(&current_rev->rev, &object->header->rev, sizeof(la_storage_rev_t));
-    }            
-    la_storage_destroy_object(object);
+        memcpy(current_rev, &doc.rev, sizeof(la_rev_t));
     if (v == NULL)
         return LA_DB_GET_ERROR;
     if (is_tombstone(v))
@@ -190,6 +343,11 @@ int la_db_stat(la_db_t *db, la_storage_stat_t *stat)
     return la_storage_stat(db->store, stat);
 }
 
+int la_db_compact(la_db_t *db, const la_storage_compact_options_t *options)
+{
+    return la_storage_compact(db->store, options);
+}
+
 static int hashdoc(const char *str, size_t size, void *data)
 {
     SHA1_CTX *ctx = (SHA1_CTX *) data;
@@ -197,35 +355,256 @@ static int hashdoc(const char *str, size_t size, void *data)
     return 0;
 }
 
-static int accumulate(const char *str, size_t size, void *data)
+/*
+ * Puts encode the document straight into the storage object's data (or,
+ * if it's to be compressed, into the thread's scratch buffer), one
+ * top-level member at a time, as la_revgen_members hashes it. The
+ * reserved keys are skipped there, instead of copying the document to
+ * delete them.
+ */
+static const char * const put_skip_keys[] = { LA_API_KEY_NAME, LA_API_REV_NAME, LA_API_DELETED_NAME, NULL };
+
+struct put_encoder
 {
-    la_buffer_t *buffer = (la_buffer_t *) data;
-    if (la_buffer_append(buffer, str, size) != 0)
-        return -1;
+    la_storage_object *object;
+    la_buffer_t *scratch;
+    int members;
+};
+
+static int put_encoder_append(const char *str, size_t size, void *data)
+{
+    struct put_encoder *enc = (struct put_encoder *) data;
+    la_storage_object *object = enc->object;
+    size_t used;
+    
+    if (enc->scratch != NULL)
+        return la_buffer_append(enc->scratch, str, size);
+    used = la_storage_object_total_size(object);
+    if (used + size > object->header_capacity)
+    {
+        size_t capacity = (size_t) object->header_capacity * 2;
+        if (capacity < used + size)
+            capacity = used + size;
+        if (la_storage_object_reserve(object, capacity) != 0)
+            return -1;
+    }
+    memcpy(la_storage_object_get_data(object) + object->data_length, str, size);
+    object->data_length += (uint32_t) size;
     return 0;
 }
 
-static la_db_put_result do_la_db_put(la_db_t *db, const char *key, const la_rev_t *oldrev, const la_codec_value_t *doc,
-                                     la_rev_t *newrev, int is_delete)
+static int put_encode_key(struct put_encoder *enc, const char *key)
 {
-    char uuidkey[65];
-    la_storage_object *object;
-    la_buffer_t *buffer;
-    la_codec_value_t *putdoc;
-    la_storage_object_put_result result;
-    la_rev_t nextrev;
+    const char *run = key;
+    const char *p;
     
-    if (!la_codec_is_object(doc) || (!is_delete && la_codec_object_get(doc, LA_API_DELETED_NAME) != NULL))
+    if (put_encoder_append("\"", 1, enc) != 0)
+        return -1;
+    for (p = key; *p != '\0'; p++)
     {
-        return LA_DB_PUT_INVALID_ARG;
+        unsigned char c = (unsigned char) *p;
+        char esc[7];
+        
+        if (c != '"' && c != '\\' && c >= 0x20)
+            continue;
+        if (put_encoder_append(run, p - run, enc) != 0)
+            return -1;
+        switch (c)
+        {
+            case '"': strcpy(esc, "\\\""); break;
+            case '\\': strcpy(esc, "\\\\"); break;
+            case '\b': strcpy(esc, "\\b"); break;
+            case '\f': strcpy(esc, "\\f"); break;
+            case '\n': strcpy(esc, "\\n"); break;
+            case '\r': strcpy(esc, "\\r"); break;
+            case '\t': strcpy(esc, "\\t"); break;
+            default: snprintf(esc, sizeof(esc), "\\u%04x", c); break;
+        }
+        if (put_encoder_append(esc, strlen(esc), enc) != 0)
+            return -1;
+        run = p + 1;
     }
-    putdoc = la_codec_copy((la_codec_value_t *) doc);
-    if (putdoc == NULL)
+    if (put_encoder_append(run, p - run, enc) != 0)
+        return -1;
+    return put_encoder_append("\"", 1, enc);
+}
+
+static int put_encode_member(const char *key, const la_codec_value_t *value, void *baton)
+{
+    struct put_encoder *enc = (struct put_encoder *) baton;
+    
+    if (enc->members++ > 0 && put_encoder_append(", ", 2, enc) != 0)
+        return -1;
+    if (put_encode_key(enc, key) != 0 || put_encoder_append(": ", 2, enc) != 0)
+        return -1;
+    return la_codec_dump_callback(value, put_encoder_append, enc, LA_CODEC_ENCODE_ANY);
+}
+
+static la_storage_object *new_put_object(const char *key, size_t capacity, int is_delete,
+                                         const la_storage_rev_t *revs, size_t revcount)
+{
+    la_storage_object *object = la_storage_alloc_object(key, strlen(key), capacity);
+    
+    if (object == NULL)
+        return NULL;
+    // rev_count is only 13 bits; keep the newest revisions that fit.
+    if (revcount > LA_OBJECT_MAX_REVISION_COUNT)
+        revcount = LA_OBJECT_MAX_REVISION_COUNT;
+    memset(object->header, 0, sizeof(struct la_storage_object_header));
+    object->header->rev_count = (uint16_t) revcount;
+    if (revcount > 0)
+        memcpy(object->header->revs_data, revs, revcount * sizeof(la_storage_rev_t));
+    object->header->deleted = is_delete;
+    return object;
+}
+
+/*
+ * Build a new object from the document in the thread's scratch buffer,
+ * compressed if that pays (see la_host_configure_compression), or else
+ * as is, marked uncompressed. With the context API, it's compressed
+ * straight into the object, allocated once with room for either.
+ */
+static la_storage_object *compress_put_object(la_host_t *host, struct compress_state *state,
+                                              const char *key, int is_delete,
+                                              const la_storage_rev_t *revs, size_t revcount)
+{
+    la_compressor_t *compressor = host->compressor;
+    size_t header_size = sizeof(struct la_storage_object_header) + revcount * sizeof(la_storage_rev_t);
+    const unsigned char *data = la_buffer_data(state->scratch);
+    size_t length = la_buffer_size(state->scratch);
+    size_t worthwhile = length - length * host->compress_min_savings / 100;
+    la_storage_object *object = NULL;
+    unsigned char *deflated;
+    size_t deflated_size;
+    
+    if (length >= host->compress_min_size && state->context != NULL)
+    {
+        size_t capacity = compressor->bound(length);
+        if (capacity < length)
+            capacity = length;
+        object = new_put_object(key, header_size + capacity, is_delete, revs, revcount);
+        if (object == NULL)
+            return NULL;
+        if (compressor->compress_into(state->context, data, length, la_storage_object_get_data(object),
+                                      capacity, &deflated_size) != 0)
+        {
+            la_storage_destroy_object(object);
+            return NULL;
+        }
+        if (deflated_size <= worthwhile)
+        {
+            object->data_length = (uint32_t) deflated_size;
+            object->header->sized = compressor->decompressed_length != NULL;
+            return object;
+        }
+    }
+    else if (length >= host->compress_min_size)
     {
+        deflated = compressor->compressor((unsigned char *) data, length, &deflated_size);
+        if (deflated == NULL)
+            return NULL;
+        if (deflated_size <= worthwhile)
+        {
+            object = new_put_object(key, header_size + deflated_size, is_delete, revs, revcount);
+            if (object != NULL)
+            {
+                memcpy(la_storage_object_get_data(object), deflated, deflated_size);
+                object->data_length = (uint32_t) deflated_size;
+            }
+            free(deflated);
+            return object;
+        }
+        free(deflated);
+    }
+    
+    // Not worth compressing; store it as is.
+    if (object == NULL)
+        object = new_put_object(key, header_size + length, is_delete, revs, revcount);
+    if (object != NULL)
+    {
+        memcpy(la_storage_object_get_data(object), data, length);
+        object->data_length = (uint32_t) length;
+        object->header->uncompressed = 1;
+    }
+    return object;
+}
+
+/*
+ * Build a storage object from a document in one pass, generating its
+ * revision into rev while encoding it.
+ */
+static la_db_put_result encode_put_object(la_db_t *db, const char *key, const la_codec_value_t *doc,
+                                          uint64_t old_start, la_storage_rev_t *oldrev, int is_delete,
+                                          const la_storage_rev_t *revs, size_t revcount,
+                                          la_storage_rev_t *rev, la_storage_object **_object)
+{
+    la_compressor_t *compressor = db->host->compressor;
+    struct compress_state *state = NULL;
+    struct put_encoder enc;
+    la_storage_object *object = NULL;
+    int ret;
+    
+    enc.object = NULL;
+    enc.scratch = NULL;
+    enc.members = 0;
+    if (compressor != NULL)
+    {
+        state = get_compress_state(compressor);
+        if (state == NULL)
+            return LA_DB_PUT_ERROR;
+        if (state->scratch == NULL && (state->scratch = la_buffer_new(1024)) == NULL)
+            return LA_DB_PUT_ERROR;
+        la_buffer_truncate(state->scratch, 0);
+        enc.scratch = state->scratch;
+    }
+    else
+    {
+        object = new_put_object(key, sizeof(struct la_storage_object_header) + revcount * sizeof(la_storage_rev_t) + 256,
+                                is_delete, revs, revcount);
+        if (object == NULL)
+            return LA_DB_PUT_ERROR;
+        enc.object = object;
+    }
+    
+    ret = put_encoder_append("{", 1, &enc) != 0
+        || la_revgen_members(doc, put_skip_keys, old_start, oldrev, is_delete, rev, put_encode_member, &enc) < 0
+        || put_encoder_append("}", 1, &enc) != 0;
+    if (compressor != NULL)
+    {
+        if (ret == 0)
+            object = compress_put_object(db->host, state, key, is_delete, revs, revcount);
+        // Don't hang on to the memory from an unusually large document.
+        if (la_buffer_capacity(state->scratch) > LA_API_SCRATCH_MAX)
+        {
+            la_buffer_destroy(state->scratch);
+            state->scratch = NULL;
+        }
+    }
+    if (ret != 0 || object == NULL)
+    {
+        if (object != NULL)
+            la_storage_destroy_object(object);
         return LA_DB_PUT_ERROR;
     }
-    la_codec_object_del(putdoc, LA_API_KEY_NAME);
-    la_codec_object_del(putdoc, LA_API_REV_NAME);
+    memcpy(&object->header->rev, rev, LA_OBJECT_REVISION_LEN);
+    
+    *_object = object;
+    return LA_DB_PUT_OK;
+}
+
+/*
+ * Build the storage object for putting a document, generating the next
+ * revision.
+ */
+static la_db_put_result make_put_object(la_db_t *db, const char *key, const la_rev_t *oldrev, const la_codec_value_t *doc,
+                                        int is_delete, la_storage_object **_object, la_rev_t *nextrev)
+{
+    char uuidkey[65];
+    
+    if (!la_codec_is_object(doc) || (!is_delete && la_codec_object_get(doc, LA_API_DELETED_NAME) != NULL))
+    {
+        return LA_DB_PUT_INVALID_ARG;
+    }
     
     if (key == NULL)
     {
@@ -240,59 +619,129 @@ static la_db_put_result do_la_db_put(la_db_t *db, const char *key, const la_rev_
             key = la_codec_string_value(id);
         }
     }
+    
+    return encode_put_object(db, key, doc, oldrev ? oldrev->seq : 0, oldrev ? (la_storage_rev_t *) &oldrev->rev : NULL,
+                             is_delete, NULL, 0, &nextrev->rev, _object);
+}
+
+static la_db_put_result put_result(la_storage_object_put_result result)
+{
+    if (result == LA_STORAGE_OBJECT_PUT_ERROR)
+        return LA_DB_PUT_ERROR;
+    if (result == LA_STORAGE_OBJECT_PUT_CONFLICT)
+        return LA_DB_PUT_CONFLICT;
+    return LA_DB_PUT_OK;
+}
 
-    la_revgen(putdoc, oldrev ? oldrev->seq : 0, oldrev ? &oldrev->rev : NULL, is_delete, &nextrev.rev);
+static la_db_put_result do_la_db_put(la_db_t *db, const char *key, const la_rev_t *oldrev, const la_codec_value_t *doc,
+                                     la_rev_t *newrev, int is_delete)
+{
+    la_storage_object *object;
+    la_storage_object_put_result result;
+    la_db_put_result ret;
+    la_rev_t nextrev;
     
-    buffer = la_buffer_new(256);
-    if (la_codec_dump_callback(putdoc, accumulate, buffer, 0) != 0)
+    ret = make_put_object(db, key, oldrev, doc, is_delete, &object, &nextrev);
+    if (ret != LA_DB_PUT_OK)
+        return ret;
+    result = la_storage_put(db->store, oldrev ? &oldrev->rev : NULL, object);
+    nextrev.seq = object->header->doc_seq;
+    if (newrev != NULL)
+        memcpy(newrev, &nextrev, sizeof(la_rev_t));
+    la_storage_destroy_object(object);
+    return put_result(result);
+}
+
+la_db_put_result la_db_put(la_db_t *db, const char *key, const la_rev_t *rev, const la_codec_value_t *doc, la_rev_t *newrev)
+{
+    return do_la_db_put(db, key, rev, doc, newrev, 0);
+}
+
+la_db_put_result la_db_put_bulk(la_db_t *db, la_db_bulk_doc_t *docs, size_t count)
+{
+    la_storage_object **objects;
+    const la_storage_rev_t **revs;
+    la_storage_object_put_result *results;
+    size_t *index;
+    la_codec_value_t *tombstone;
+    la_storage_object_put_result result;
+    size_t i, n;
+    
+    if (count == 0)
+        return LA_DB_PUT_OK;
+    objects = (la_storage_object **) malloc(count * sizeof(la_storage_object *));
+    revs = (const la_storage_rev_t **) malloc(count * sizeof(la_storage_rev_t *));
+    results = (la_storage_object_put_result *) malloc(count * sizeof(la_storage_object_put_result));
+    index = (size_t *) malloc(count * sizeof(size_t));
+    tombstone = la_codec_object();
+    if (objects == NULL || revs == NULL || results == NULL || index == NULL || tombstone == NULL)
     {
-        la_codec_decref(putdoc);
-        la_buffer_destroy(buffer);
+        free(objects);
+        free(revs);
+        free(results);
+        free(index);
+        if (tombstone != NULL)
+            la_codec_decref(tombstone);
         return LA_DB_PUT_ERROR;
     }
-    la_codec_decref(putdoc);
     
-    if (db->host->compressor != NULL)
+    for (i = 0, n = 0; i < count; i++)
     {
-        size_t deflated_size;
-        unsigned char *deflated = db->host->compressor->compressor(la_buffer_data(buffer), la_buffer_size(buffer), &deflated_size);
-        la_buffer_destroy(buffer);
-        if (deflated == NULL)
+        const char *key = docs[i].key;
+        const la_codec_value_t *doc = docs[i].doc;
+        int is_delete = 0;
+        
+        if (doc != NULL && la_codec_is_true(la_codec_object_get(doc, LA_API_DELETED_NAME)))
         {
-            return LA_DB_PUT_ERROR;
+            // Deletes store an empty document, just like la_db_delete.
+            if (key == NULL)
+            {
+                la_codec_value_t *id = la_codec_object_get(doc, LA_API_KEY_NAME);
+                if (id == NULL || !la_codec_is_string(id))
+                {
+                    docs[i].result = LA_DB_PUT_INVALID_ARG;
+                    continue;
+                }
+                key = la_codec_string_value(id);
+            }
+            doc = tombstone;
+            is_delete = 1;
         }
-    
-        object = la_storage_create_object(key, nextrev.rev, deflated, deflated_size, NULL, 0);
-        free(deflated);
-    }
-    else
-    {
-        object = la_storage_create_object(key, nextrev.rev, la_buffer_data(buffer), la_buffer_size(buffer), NULL, 0);
-        la_buffer_destroy(buffer);
+        if (doc == NULL)
+        {
+            docs[i].result = LA_DB_PUT_INVALID_ARG;
+            continue;
+        }
+        docs[i].result = make_put_object(db, key, docs[i].rev, doc, is_delete, &objects[n], &docs[i].newrev);
+        if (docs[i].result != LA_DB_PUT_OK)
+            continue;
+        revs[n] = docs[i].rev ? &docs[i].rev->rev : NULL;
+        index[n] = i;
+        n++;
     }
-    if (object == NULL)
+    la_codec_decref(tombstone);
+    
+    result = la_storage_put_bulk(db->store, revs, objects, n, results);
+    for (i = 0; i < n; i++)
     {
-        return LA_DB_PUT_ERROR;
+        la_db_bulk_doc_t *doc = &docs[index[i]];
+        if (result == LA_STORAGE_OBJECT_PUT_ERROR)
+            doc->result = LA_DB_PUT_ERROR;
+        else
+            doc->result = put_result(results[i]);
+        doc->newrev.seq = objects[i]->header->doc_seq;
+        la_storage_destroy_object(objects[i]);
     }
     
-    object->header->deleted = is_delete;
-    result = la_storage_put(db->store, oldrev ? &oldrev->rev : NULL, object);
-    nextrev.seq = object->header->doc_seq;
-    if (newrev != NULL)
-        memcpy(newrev, &nextrev, sizeof(la_rev_t));
-    la_storage_destroy_object(object);
+    free(objects);
+    free(revs);
+    free(results);
+    free(index);
     if (result == LA_STORAGE_OBJECT_PUT_ERROR)
         return LA_DB_PUT_ERROR;
-    if (result == LA_STORAGE_OBJECT_PUT_CONFLICT)
-        return LA_DB_PUT_CONFLICT;
     return LA_DB_PUT_OK;
 }
 
-la_db_put_result la_db_put(la_db_t *db, const char *key, const la_rev_t *rev, const la_codec_value_t *doc, la_rev_t *newrev)
-{
-    return do_la_db_put(db, key, rev, doc, newrev, 0);
-}
-
 la_db_delete_result la_db_delete(la_db_t *db, const char *key, const la_rev_t *rev)
 {
     la_codec_value_t *doc = la_codec_object();
@@ -312,12 +761,9 @@ la_db_delete_result la_db_delete(la_db_t *db, const char *key, const la_rev_t *r
 la_db_put_result la_db_replace(la_db_t *db, const char *key, const la_rev_t *rev, const la_codec_value_t *doc,
                                const la_storage_rev_t *oldrevs, size_t revcount)
 {
-    la_buffer_t *buffer;
-    la_codec_value_t *copy;
     la_storage_object *obj;
-    la_storage_rev_t *_oldrevs = NULL;
     la_rev_t locrev;
-    int i;
+    la_db_put_result result;
     
     if (key == NULL || rev == NULL || doc == NULL || !la_codec_is_object(doc))
     {
@@ -327,31 +773,17 @@ la_db_put_result la_db_replace(la_db_t *db, const char *key, const la_rev_t *rev
         return LA_DB_PUT_INVALID_ARG;
     }
     
-    buffer = la_buffer_new(1024);
-    if (buffer == NULL)
-    {
-        printf("memory error\n");
-        return LA_DB_PUT_ERROR;
-    }
-    copy = la_codec_copy(doc);
-    if (copy == NULL)
-    {
-        la_buffer_destroy(buffer);
-        return LA_DB_PUT_ERROR;
-    }
-    
-    la_codec_object_del(copy, LA_API_KEY_NAME);
-    la_codec_object_del(copy, LA_API_REV_NAME);
-    la_codec_object_del(copy, LA_API_DELETED_NAME);
-    
     int is_delete = 0;
     if (la_codec_is_true(la_codec_object_get(doc, LA_API_DELETED_NAME)))
         is_delete = 1;
     
     la_storage_rev_t *oldrev = NULL;
     if (oldrevs != NULL && revcount > 0)
-        oldrev = &oldrevs[0];
-    la_revgen(copy, rev->seq - 1, oldrev, is_delete, &locrev.rev);
+        oldrev = (la_storage_rev_t *) &oldrevs[0];
+    result = encode_put_object(db, key, doc, rev->seq - 1, oldrev, is_delete, oldrevs, oldrevs ? revcount : 0,
+                               &locrev.rev, &obj);
+    if (result != LA_DB_PUT_OK)
+        return result;
     locrev.seq = rev->seq;
     
 #if DEBUG
@@ -361,42 +793,10 @@ la_db_put_result la_db_replace(la_db_t *db, const char *key, const la_rev_t *rev
     printf("local rev: %s\n", la_rev_string(locrev));
 #endif
     
-    if (la_codec_dump_callback(copy, accumulate, buffer, 0) != 0)
-    {
-        la_codec_decref(copy);
-        la_buffer_destroy(buffer);
-        return LA_DB_PUT_ERROR;
-    }
-    la_codec_decref(copy);
-    
-    if (db->host->compressor != NULL)
-    {
-        size_t deflated_size;
-        unsigned char *deflated = db->host->compressor->compressor(la_buffer_data(buffer), la_buffer_size(buffer), &deflated_size);
-        if (deflated == NULL)
-        {
-            la_buffer_destroy(buffer);
-            return LA_DB_PUT_ERROR;
-        }
-        obj = la_storage_create_object(key, rev->rev, deflated, deflated_size, oldrevs, revcount);
-        free(deflated);
-    }
-    else
-    {
-        obj = la_storage_create_object(key, rev->rev, la_buffer_data(buffer), la_buffer_size(buffer), oldrevs, revcount);
-    }
-    obj->header->deleted = is_delete;
-    la_buffer_destroy(buffer);
-    if (_oldrevs != NULL)
-        free(_oldrevs);
-    if (obj == NULL)
-    {
-        printf("create object memory error\n");
-        return LA_DB_PUT_ERROR;
-    }
+    // Store the revision we were given, not the one generated locally.
+    memcpy(&obj->header->rev, &rev->rev, LA_OBJECT_REVISION_LEN);
     obj->header->doc_seq = rev->seq;
-    int ret;
-    if ((ret = la_storage_replace(db->store, obj)) != LA_STORAGE_OBJECT_PUT_SUCCESS)
+    if (la_storage_replace(db->store, obj) != LA_STORAGE_OBJECT_PUT_SUCCESS)
     {
         la_storage_destroy_object(obj);
         return LA_DB_PUT_ERROR;
@@ -416,16 +816,22 @@ static void _do_map_emit(la_view_state_t *state, la_codec_value_t *value)
 
 la_view_iterator_t *la_db_view(la_db_t *db, la_view_mapfn map, la_view_reducefn reduce, la_view_rereducefn rereduce, void *baton)
 {
+    la_storage_object_iterator *objects;
     la_view_iterator_t *it = (la_view_iterator_t *) malloc(sizeof(struct la_view_iterator));
     if (it == NULL)
         return NULL;
     it->db = db;
-    it->it = la_storage_iterator_open(db->store, 0);
-    if (it->it == NULL)
+    if ((objects = la_storage_iterator_open(db->store, 0)) == NULL)
     {
         free(it);
         return NULL;
     }
+    if ((it->it = la_storage_prefetch_open(db->store, objects, 0)) == NULL)
+    {
+        la_storage_iterator_close(db->store, objects);
+        free(it);
+        return NULL;
+    }
     it->map = map;
     it->reduce = reduce;
     it->baton = baton;
@@ -443,9 +849,10 @@ la_view_iterator_result la_view_iterator_next(la_view_iterator_t *it, la_codec_v
     
     if (value != NULL)
         *value = NULL;
-    while (la_codec_array_size(it->mapped) == 0 && parsed == NULL)
+    // Keep going until something is mapped; map may emit nothing for a doc.
+    while (la_codec_array_size(it->mapped) == 0)
     {
-        result = la_storage_iterator_next(it->db->store, it->it, &object);
+        result = la_storage_prefetch_next(it->it, &object);
     
         if (result == LA_STORAGE_OBJECT_ITERATOR_ERROR)
             return LA_VIEW_ITERATOR_ERROR;
@@ -463,22 +870,7 @@ la_view_iterator_result la_view_iterator_next(la_view_iterator_t *it, la_codec_v
             la_storage_destroy_object(object);
             continue;
         }
-        if (it->db->host->compressor != NULL)
-        {
-            size_t inflated_size;
-            unsigned char *inflated = it->db->host->compressor->decompressor(la_storage_object_get_data(object), object->data_length, &inflated_size);
-            if (inflated == NULL)
-            {
-                la_storage_destroy_object(object);
-                return LA_VIEW_ITERATOR_ERROR;
-            }
-            parsed = la_codec_loadb((const char *) inflated, inflated_size, 0, error);
-            free(inflated);
-        }
-        else
-        {
-            parsed = la_codec_loadb(la_storage_object_get_data(object), object->data_length, 0, error);
-        }
+        parsed = decode_doc(it->db, object, error);
         la_storage_destroy_object(object);
         if (parsed == NULL)
         {
@@ -496,8 +888,6 @@ la_view_iterator_result la_view_iterator_next(la_view_iterator_t *it, la_codec_v
         }
     }
     
-    if (la_codec_array_size(it->mapped) == 0)
-        return LA_VIEW_ITERATOR_ERROR;
     mapped = la_codec_array_get(it->mapped, 0);
     la_codec_incref(mapped);
     la_codec_array_remove(it->mapped, 0);
@@ -518,12 +908,81 @@ la_view_iterator_result la_view_iterator_next(la_view_iterator_t *it, la_codec_v
 
 void la_view_iterator_close(la_view_iterator_t *it)
 {
-    la_storage_iterator_close(it->db->store, it->it);
+    la_storage_prefetch_close(it->it);
     if (it->accum != NULL)
         la_codec_decref(it->accum);
     free(it);
 }
 
+la_all_docs_iterator_t *la_db_all_docs(la_db_t *db, const la_db_all_docs_options_t *options)
+{
+    la_db_all_docs_options_t defaults;
+    la_all_docs_iterator_t *it;
+    int flags = LA_STORAGE_ITERATOR_SKIP_DELETED;
+    
+    if (options == NULL)
+    {
+        memset(&defaults, 0, sizeof(la_db_all_docs_options_t));
+        options = &defaults;
+    }
+    if ((it = (la_all_docs_iterator_t *) malloc(sizeof(struct la_all_docs_iterator))) == NULL)
+        return NULL;
+    if (!options->include_docs)
+        flags |= LA_STORAGE_ITERATOR_HEADERS_ONLY;
+    it->db = db;
+    it->include_docs = options->include_docs;
+    it->current = NULL;
+    it->it = la_storage_iterator_open_keyrange(db->store, options->startkey, options->endkey,
+                                               options->descending, options->limit, flags);
+    if (it->it == NULL)
+    {
+        free(it);
+        return NULL;
+    }
+    return it;
+}
+
+la_view_iterator_result la_all_docs_iterator_next(la_all_docs_iterator_t *it, const char **key, la_rev_t *rev,
+                                                  la_codec_value_t **doc, la_codec_error_t *error)
+{
+    la_storage_object_iterator_result result;
+    
+    if (doc != NULL)
+        *doc = NULL;
+    if (it->current != NULL)
+    {
+        la_storage_destroy_object(it->current);
+        it->current = NULL;
+    }
+    result = la_storage_iterator_next(it->db->store, it->it, &it->current);
+    if (result == LA_STORAGE_OBJECT_ITERATOR_END)
+        return LA_VIEW_ITERATOR_END;
+    if (result != LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT)
+        return LA_VIEW_ITERATOR_ERROR;
+    if (doc != NULL && it->include_docs)
+    {
+        *doc = decode_doc(it->db, it->current, error);
+        if (*doc == NULL)
+            return LA_VIEW_ITERATOR_ERROR;
+    }
+    if (key != NULL)
+        *key = it->current->key;
+    if (rev != NULL)
+    {
+        rev->seq = it->current->header->doc_seq;
+        memcpy(&rev->rev, &it->current->header->rev, sizeof(la_storage_rev_t));
+    }
+    return LA_VIEW_ITERATOR_GOT_NEXT;
+}
+
+void la_all_docs_iterator_close(la_all_docs_iterator_t *it)
+{
+    if (it->current != NULL)
+        la_storage_destroy_object(it->current);
+    la_storage_iterator_close(it->db->store, it->it);
+    free(it);
+}
+
 void la_db_close(la_db_t *db)
 {
     if (db->store)
@@ -14,6 +14,7 @@
 #include <stdlib.h>
 
 #include <API/LoungeAct.h>
+#include <compress-lz4/compress-lz4.h>
 
 int cb1(const char *path, const struct stat *ptr, int flag, struct FTW *ftw);
 int cb1(const char *path, const struct stat *ptr, int flag, struct FTW *ftw)
@@ -99,17 +100,20 @@ int main(int argc, char **argv)
     
     atexit(cleanup);
     setvbuf(stdout, NULL, _IONBF, 0);
-    printf("opening host... ");
-    if ((host = la_host_open("/tmp/apitest")) == NULL)
+    // The storage driver to test may be given as the first argument.
+    const char *driver = (argc > 1) ? argv[1] : "Memory";
+    printf("opening host with driver %s... ", driver);
+    if ((host = la_host_open(driver, "/tmp/apitest", NULL)) == NULL)
     {
         FAIL0();
     }
     OK();
     
     printf("opening db... ");
-    if ((db = la_db_open(host, "apitest")) == NULL)
+    la_db_open_result_t opened = la_db_open(host, "apitest", LA_DB_OPEN_FLAG_CREATE, &db);
+    if (opened != LA_DB_OPEN_OK && opened != LA_DB_OPEN_CREATED)
     {
-        FAIL0();
+        FAIL(" (%d)", opened);
     }
     OK();
     
@@ -181,6 +185,23 @@ int main(int argc, char **argv)
     la_codec_decref(value);
     OK();
     
+    printf("getting the raw object... ");
+    {
+        la_db_raw_doc_t raw;
+        if ((get = la_db_get_raw(db, "newobject", NULL, 0, &raw)) != LA_DB_GET_OK)
+        {
+            FAIL(" (%d)", get);
+        }
+        if (raw.deleted || raw.compressed || memcmp(&raw.rev, &newrev, sizeof(la_rev_t)) != 0)
+        {
+            la_db_release_raw(db, &raw);
+            FAIL0();
+        }
+        printf(" the doc: %.*s ", (int) raw.length, raw.data);
+        la_db_release_raw(db, &raw);
+    }
+    OK();
+    
     printf("delete the object... ");
     la_db_delete_result del;
     if ((del = la_db_delete(db, "newobject", &newrev)) != LA_DB_DELETE_OK)
@@ -213,7 +234,90 @@ int main(int argc, char **argv)
     if ((put = la_db_put(db, "three", NULL, value, &newrev)) != LA_DB_PUT_OK) FAIL(" (%d)", put);
     la_codec_decref(value);
     OK();
-    
+
+    printf("bulk put... ");
+    {
+        la_db_bulk_doc_t bulk[3];
+        memset(bulk, 0, sizeof(bulk));
+        bulk[0].key = "bulk-one";
+        bulk[0].doc = la_codec_object();
+        bulk[1].key = "bulk-two";
+        bulk[1].doc = la_codec_object();
+        bulk[2].key = "one";
+        bulk[2].doc = la_codec_object();
+        if ((put = la_db_put_bulk(db, bulk, 3)) != LA_DB_PUT_OK) FAIL(" (%d)", put);
+        if (bulk[0].result != LA_DB_PUT_OK || bulk[1].result != LA_DB_PUT_OK)
+            FAIL(" (%d %d)", bulk[0].result, bulk[1].result);
+        if (bulk[2].result != LA_DB_PUT_CONFLICT) FAIL(" expected conflict (%d)", bulk[2].result);
+        for (int i = 0; i < 3; i++)
+            la_codec_decref((la_codec_value_t *) bulk[i].doc);
+    }
+    OK();
+
+    printf("replace with too many revisions... ");
+    {
+        size_t revcount = 1 << 14;
+        la_storage_rev_t *revs = calloc(revcount, sizeof(la_storage_rev_t));
+        la_rev_t rev;
+        la_db_raw_doc_t raw;
+        if (revs == NULL) FAIL0();
+        memset(&rev, 0, sizeof(la_rev_t));
+        rev.seq = revcount + 1;
+        value = la_codec_object();
+        put = la_db_replace(db, "many-revs", &rev, value, revs, revcount);
+        la_codec_decref(value);
+        free(revs);
+        if (put != LA_DB_PUT_OK) FAIL(" (%d)", put);
+        if ((get = la_db_get_raw(db, "many-revs", NULL, 0, &raw)) != LA_DB_GET_OK) FAIL(" (%d)", get);
+        revcount = raw.object.header.rev_count;
+        la_db_release_raw(db, &raw);
+        if (revcount != LA_OBJECT_MAX_REVISION_COUNT) FAIL(" (%zu revisions)", revcount);
+    }
+    OK();
+
+    printf("reading documents lz4 compressed without their length... ");
+    {
+        // Only the plain functions, as documents were compressed before the context API.
+        la_compressor_t bare = { la_lz4_compressor->compressor, la_lz4_compressor->decompressor };
+        const char *keys[2] = { "bare-lz4", "sized-lz4" };
+        la_rev_t revs[2];
+        char text[301];
+        la_db_raw_doc_t raw;
+        la_codec_value_t *field;
+        int wrong;
+        memset(text, 'a', 300);
+        text[300] = '\0';
+        la_host_configure_compression(host, 0, 0);
+        for (int i = 0; i < 2; i++)
+        {
+            la_host_configure_compressor(host, i == 0 ? &bare : la_lz4_compressor);
+            value = la_codec_object();
+            la_codec_object_set_new(value, "text", la_codec_string(text));
+            put = la_db_put(db, keys[i], NULL, value, &revs[i]);
+            la_codec_decref(value);
+            if (put != LA_DB_PUT_OK) FAIL(" (%d)", put);
+        }
+        // Both are read back with the full compressor.
+        for (int i = 0; i < 2; i++)
+        {
+            if ((get = la_db_get_raw(db, keys[i], NULL, LA_DB_GET_RAW_COMPRESSED, &raw)) != LA_DB_GET_OK) FAIL(" (%d)", get);
+            wrong = !raw.compressed || raw.object.header.sized != i;
+            la_db_release_raw(db, &raw);
+            if (wrong) FAIL(" %s not stored as expected", keys[i]);
+            if ((get = la_db_get(db, keys[i], NULL, &value, NULL, &error)) != LA_DB_GET_OK) FAIL(" (%d)", get);
+            field = la_codec_object_get(value, "text");
+            wrong = field == NULL || !la_codec_is_string(field) || strcmp(la_codec_string_value(field), text) != 0;
+            la_codec_decref(value);
+            if (wrong) FAIL(" %s read back wrong", keys[i]);
+        }
+        // The rest of the database isn't compressed; deleted documents aren't decoded.
+        for (int i = 0; i < 2; i++)
+            if ((del = la_db_delete(db, keys[i], &revs[i])) != LA_DB_DELETE_OK) FAIL(" (%d)", del);
+        la_host_configure_compressor(host, NULL);
+        la_host_configure_compression(host, LA_API_COMPRESS_MIN_SIZE, LA_API_COMPRESS_MIN_SAVINGS);
+    }
+    OK();
+
     printf("map/reduce objects... ");
     la_view_iterator_t *it = la_db_view(db, mymap, myreduce, NULL, NULL);
     if (it == NULL) FAIL("creating iterator");
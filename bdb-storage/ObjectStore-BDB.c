@@ -7,19 +7,23 @@
 //
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <syslog.h>
+#include <time.h>
 
 #include <db.h>
 #include "../Storage/ObjectStore.h"
 #include "../Utils/stringutils.h"
 #include "../Utils/hexdump.h"
 #include "../utils/utils.h"
+#include "../utils/trace.h"
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
 
 #if DEBUG
 #define debug(fmt,args...) fprintf(stderr, fmt, ##args)
@@ -27,39 +31,50 @@
 #define debug(fmt,args...)
 #endif
 
+#if LA_TRACE
 #define txn_abort(txn) do { \
-    syslog(LOG_NOTICE, "ABORT txn %p %x (%s:%d)", txn, txn->txnid, __FILE__, __LINE__); \
-    int abort_ret = txn->abort(txn); \
-    syslog(LOG_NOTICE, "  --> %d", abort_ret); \
+    uint32_t abort_id = (txn)->txnid; \
+    uint64_t abort_start = la_trace_now(); \
+    int abort_ret = (txn)->abort(txn); \
+    la_trace(LA_TRACE_TXN_ABORT, abort_id, abort_ret, abort_start); \
 } while (0)
 #define txn_commit(txn,flags) do { \
-    syslog(LOG_NOTICE, "COMMIT txn %p %d %x (%s:%d)", txn, flags, txn->txnid, __FILE__, __LINE__); \
-    int commit_ret = txn->commit(txn, flags); \
-    syslog(LOG_NOTICE, "  --> %d", commit_ret); \
+    uint32_t commit_id = (txn)->txnid; \
+    uint64_t commit_start = la_trace_now(); \
+    int commit_ret = (txn)->commit(txn, flags); \
+    la_trace(LA_TRACE_TXN_COMMIT, commit_id, commit_ret, commit_start); \
 } while (0)
 
 static inline int
 do_txn_begin(DB_ENV *env, DB_TXN *parent, DB_TXN **txn, u_int32_t flags, const char *file, int line)
 {
+    uint64_t start = la_trace_now();
     int ret = env->txn_begin(env, parent, txn, flags);
-    if (ret == 0)
-        syslog(LOG_NOTICE, "BEGIN txn %p %x (%s:%d)", *txn, (*txn)->txnid, file, line);
+    la_trace_record(LA_TRACE_TXN_BEGIN, ret == 0 ? (*txn)->txnid : 0, ret, start, file, line);
     return ret;
 }
 #define txn_begin(env,parent,txn,flags) do_txn_begin(env, parent, txn, flags, __FILE__, __LINE__)
-
-static char *
-keycpy(char *key, u_int32_t len)
-{
-    char *ret = (char *) malloc(len + 1);
-    strncpy(ret, key, len);
-    ret[len] = '\0';
-    return ret;
-}
+#else
+#define txn_abort(txn) (txn)->abort(txn)
+#define txn_commit(txn,flags) (txn)->commit(txn, flags)
+#define txn_begin(env,parent,txn,flags) (env)->txn_begin(env, parent, txn, flags)
+#endif
 
 struct la_storage_env
 {
     DB_ENV *env;
+    la_storage_env_config_t config;
+    
+    /**
+     * The maintenance thread, which takes checkpoints, removes old logs
+     * and does the group commit flushes. Only running if
+     * maintenance_running is set.
+     */
+    pthread_t maintenance;
+    pthread_mutex_t maintenance_lock;
+    pthread_cond_t maintenance_cond;
+    int maintenance_running;
+    int maintenance_stop;
 };
 
 struct la_storage_object_store
@@ -68,21 +83,124 @@ struct la_storage_object_store
     DB *db;
     DB *seq_db;
     DB_SEQUENCE *seq;
+    
+    /**
+     * The last sequence number committed. Read from the sequence once at
+     * open and then advanced by publish_seq, because DB_SEQUENCE->stat
+     * allocates.
+     */
+    uint64_t lastseq;
 };
 
 struct la_storage_object_iterator
 {
     la_storage_object_store *store;
     DBC *cursor;
+    
+    /**
+     * For range iterators: the first seq to look for, and the last to
+     * return. start is 0 once the cursor is positioned.
+     */
+    uint64_t start;
+    uint64_t until;
+    
+    /**
+     * The la_storage_iterator_flag_t flags the iterator was opened with.
+     */
+    int flags;
+    
+    /**
+     * For key range iterators, which walk the primary database: the
+     * bounds (copied), and how many more objects to return. positioned
+     * is set once the cursor is at the first key.
+     */
+    int by_id;
+    int positioned;
+    int descending;
+    char *startkey;
+    char *endkey;
+    uint64_t remaining;
 };
 
-static la_storage_env *bdb_la_storage_open_env(const char *name)
+/*
+ * Milliseconds until the next thing the maintenance thread has to do.
+ */
+static unsigned int maintenance_tick(const la_storage_env_config_t *config)
+{
+    unsigned int tick = config->bdb_checkpoint_interval * 1000;
+    if (config->bdb_group_commit_interval > 0 && (tick == 0 || config->bdb_group_commit_interval < tick))
+        tick = config->bdb_group_commit_interval;
+    return tick;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *maintenance_main(void *arg)
+{
+    la_storage_env *env = (la_storage_env *) arg;
+    const la_storage_env_config_t *config = &env->config;
+    unsigned int tick = maintenance_tick(config);
+    uint64_t now = now_ms();
+    uint64_t next_flush = now + config->bdb_group_commit_interval;
+    uint64_t next_checkpoint = now + (uint64_t) config->bdb_checkpoint_interval * 1000;
+    struct timespec deadline;
+    char **logs;
+    int ret;
+    
+    pthread_mutex_lock(&env->maintenance_lock);
+    while (!env->maintenance_stop)
+    {
+        uint64_t wake = now_ms() + tick;
+        deadline.tv_sec = wake / 1000;
+        deadline.tv_nsec = (wake % 1000) * 1000000;
+        pthread_cond_timedwait(&env->maintenance_cond, &env->maintenance_lock, &deadline);
+        if (env->maintenance_stop)
+            break;
+        pthread_mutex_unlock(&env->maintenance_lock);
+        
+        now = now_ms();
+        if (config->bdb_group_commit_interval > 0 && now >= next_flush)
+        {
+            // Flush everything committed with DB_TXN_NOSYNC since last time.
+            if ((ret = env->env->log_flush(env->env, NULL)) != 0)
+                syslog(LOG_NOTICE, "log flush failed: %d", ret);
+            next_flush = now + config->bdb_group_commit_interval;
+        }
+        if (config->bdb_checkpoint_interval > 0 && now >= next_checkpoint)
+        {
+            if ((ret = env->env->txn_checkpoint(env->env, config->bdb_checkpoint_kbytes, 0, 0)) != 0)
+                syslog(LOG_NOTICE, "checkpoint failed: %d", ret);
+            else if (config->bdb_archive_logs)
+            {
+                logs = NULL;
+                if ((ret = env->env->log_archive(env->env, &logs, DB_ARCH_REMOVE)) != 0)
+                    syslog(LOG_NOTICE, "log archive failed: %d", ret);
+                free(logs);
+            }
+            next_checkpoint = now + (uint64_t) config->bdb_checkpoint_interval * 1000;
+        }
+        
+        pthread_mutex_lock(&env->maintenance_lock);
+    }
+    pthread_mutex_unlock(&env->maintenance_lock);
+    return NULL;
+}
+
+static la_storage_env *bdb_la_storage_open_env(const char *name, const la_storage_env_config_t *config)
 {
     int ret;
     struct stat st;
     struct la_storage_env *env = (la_storage_env *) malloc(sizeof(struct la_storage_env));
     if (env == NULL)
         return NULL;
+    memcpy(&env->config, config, sizeof(la_storage_env_config_t));
+    env->maintenance_running = 0;
+    env->maintenance_stop = 0;
     if (db_env_create(&env->env, 0) != 0)
     {
         free(env);
@@ -116,16 +234,53 @@ static la_storage_env *bdb_la_storage_open_env(const char *name)
             return NULL;
         }
     }
+    if (config->bdb_cache_size > 0)
+        env->env->set_cachesize(env->env, (u_int32_t) (config->bdb_cache_size / (1024 * 1024 * 1024)),
+                                (u_int32_t) (config->bdb_cache_size % (1024 * 1024 * 1024)), 1);
+    if (config->bdb_log_buffer_size > 0)
+        env->env->set_lg_bsize(env->env, config->bdb_log_buffer_size);
+    if (config->bdb_max_locks > 0)
+        env->env->set_lk_max_locks(env->env, config->bdb_max_locks);
+    if (config->bdb_max_lockers > 0)
+        env->env->set_lk_max_lockers(env->env, config->bdb_max_lockers);
+    if (config->bdb_max_lock_objects > 0)
+        env->env->set_lk_max_objects(env->env, config->bdb_max_lock_objects);
+    // Bulk puts wait for locks; break any deadlock they get into.
+    env->env->set_lk_detect(env->env, DB_LOCK_DEFAULT);
     if (env->env->open(env->env, name, DB_CREATE | DB_INIT_LOG | DB_INIT_LOCK | DB_INIT_MPOOL | DB_THREAD | DB_INIT_TXN, 0) != 0)
     {
         free(env);
         return NULL;
     }
+    
+    if (maintenance_tick(config) > 0)
+    {
+        pthread_mutex_init(&env->maintenance_lock, NULL);
+        pthread_cond_init(&env->maintenance_cond, NULL);
+        if (pthread_create(&env->maintenance, NULL, maintenance_main, env) == 0)
+            env->maintenance_running = 1;
+        else
+            syslog(LOG_NOTICE, "could not start maintenance thread: %s", strerror(errno));
+    }
     return env;
 }
 
 static void bdb_la_storage_close_env(la_storage_env *env)
 {
+    if (env->maintenance_running)
+    {
+        pthread_mutex_lock(&env->maintenance_lock);
+        env->maintenance_stop = 1;
+        pthread_cond_signal(&env->maintenance_cond);
+        pthread_mutex_unlock(&env->maintenance_lock);
+        pthread_join(env->maintenance, NULL);
+    }
+    if (maintenance_tick(&env->config) > 0)
+    {
+        pthread_mutex_destroy(&env->maintenance_lock);
+        pthread_cond_destroy(&env->maintenance_cond);
+    }
+    env->env->log_flush(env->env, NULL);
     env->env->close(env->env, 0);
     free(env);
 }
@@ -162,12 +317,42 @@ static int compare_seq(DB *db, const DBT *key1, const DBT *key2)
     return 0;
 }
 
+/*
+ * Take the next sequence number for obj. It only becomes lastseq once
+ * the transaction commits; see publish_seq.
+ */
+static int next_seq(la_storage_object_store *store, DB_TXN *txn, la_storage_object *obj)
+{
+    db_seq_t seq;
+    
+    if (store->seq->get(store->seq, txn, 1, &seq, 0) != 0)
+        return -1;
+    obj->header->seq = (uint64_t) seq;
+    return 0;
+}
+
+/*
+ * Note seq, from a committed transaction, as the last sequence number.
+ */
+static void publish_seq(la_storage_object_store *store, uint64_t seq)
+{
+    uint64_t last;
+    
+    do
+    {
+        last = store->lastseq;
+        if (seq <= last)
+            break;
+    } while (!__sync_bool_compare_and_swap(&store->lastseq, last, seq));
+}
+
 static la_storage_open_result_t bdb_la_storage_open(la_storage_env *env, const char *path, int flags, la_storage_object_store **_store)
 {
     la_storage_object_store *store = (la_storage_object_store *) malloc(sizeof(struct la_storage_object_store));
     DB_TXN *txn;
     char *seqpath;
     DBT seq_key;
+    DB_SEQUENCE_STAT *seq_stat;
     char seq_name[4];
     int dbflags;
     int ret;
@@ -197,6 +382,12 @@ static la_storage_open_result_t bdb_la_storage_open(la_storage_env *env, const c
         dbflags = DB_CREATE;
     if (flags & LA_STORAGE_OPEN_FLAG_EXCL)
         dbflags |= DB_EXCL;
+    if (env->config.bdb_page_size > 0)
+    {
+        // Only takes effect when the databases are created.
+        store->db->set_pagesize(store->db, env->config.bdb_page_size);
+        store->seq_db->set_pagesize(store->seq_db, env->config.bdb_page_size);
+    }
     if ((ret = store->db->open(store->db, txn, path, NULL, DB_BTREE, dbflags | DB_MULTIVERSION | DB_THREAD, 0)) != 0)
     {
         txn_abort(txn);
@@ -222,7 +413,8 @@ static la_storage_open_result_t bdb_la_storage_open(la_storage_env *env, const c
         free(store);
         return LA_STORAGE_OPEN_ERROR;
     }
-    if (store->seq_db->open(store->seq_db, txn, seqpath, NULL, DB_BTREE, DB_CREATE | DB_THREAD, 0) != 0)
+    // Multiversion, so snapshot cursors on the index don't block writers.
+    if (store->seq_db->open(store->seq_db, txn, seqpath, NULL, DB_BTREE, DB_CREATE | DB_MULTIVERSION | DB_THREAD, 0) != 0)
     {
         free(seqpath);
         store->db->close(store->db, 0);
@@ -257,6 +449,18 @@ static la_storage_open_result_t bdb_la_storage_open(la_storage_env *env, const c
         free(store);
         return LA_STORAGE_OPEN_ERROR;        
     }
+    if (store->seq->stat(store->seq, &seq_stat, 0) != 0)
+    {
+        store->seq->close(store->seq, 0);
+        store->seq_db->close(store->seq_db, 0);
+        store->db->close(store->db, 0);
+        txn_abort(txn);
+        free(store);
+        return LA_STORAGE_OPEN_ERROR;
+    }
+    // st_current is the next value the sequence will hand out.
+    store->lastseq = (uint64_t) (seq_stat->st_current - 1);
+    free(seq_stat);
     txn_commit(txn, DB_TXN_NOSYNC);
     *_store = store;
     if ((flags & (LA_STORAGE_OPEN_FLAG_CREATE|LA_STORAGE_OPEN_FLAG_EXCL)) == (LA_STORAGE_OPEN_FLAG_CREATE|LA_STORAGE_OPEN_FLAG_EXCL))
@@ -328,6 +532,62 @@ static int bdb_la_storage_object_store_delete(la_storage_object_store *store)
     return 0;
 }
 
+/*
+ * How much room to give an object on the first try at reading a record
+ * into it, and how long a key to expect when we don't know it yet.
+ */
+#define READ_SIZE_GUESS 1024
+#define READ_KEY_GUESS 64
+
+#define object_set_data_length(obj, size) ((obj)->data_length = (uint32_t) ((size) \
+    - ((obj)->header->rev_count * sizeof(la_storage_rev_t)) - sizeof(struct la_storage_object_header)))
+
+/*
+ * Read the record for key straight into a new object's block, with
+ * db->get if cursor is NULL, or with cursor->get and flags otherwise. If
+ * our guess at the record size was too small, BDB tells us the real size,
+ * and we read it again into a block that fits.
+ */
+static int bdb_read_object(DB *db, DBC *cursor, const char *key, u_int32_t flags, la_storage_object **obj)
+{
+    DBT db_key;
+    DBT db_value;
+    size_t keylen = strlen(key);
+    size_t size = READ_SIZE_GUESS;
+    int result;
+    
+    for (;;)
+    {
+        *obj = la_storage_alloc_object(key, keylen, size);
+        if (*obj == NULL)
+            return ENOMEM;
+        memset(&db_key, 0, sizeof(DBT));
+        memset(&db_value, 0, sizeof(DBT));
+        db_key.data = (*obj)->key;
+        db_key.size = (u_int32_t) keylen;
+        db_key.ulen = (u_int32_t) keylen;
+        db_key.flags = DB_DBT_USERMEM;
+        db_value.data = (*obj)->header;
+        db_value.ulen = (*obj)->header_capacity;
+        db_value.flags = DB_DBT_USERMEM;
+        
+        if (cursor != NULL)
+            result = cursor->get(cursor, &db_key, &db_value, flags);
+        else
+            result = db->get(db, NULL, &db_key, &db_value, flags);
+        if (result == 0)
+        {
+            object_set_data_length(*obj, db_value.size);
+            return 0;
+        }
+        la_storage_destroy_object(*obj);
+        *obj = NULL;
+        if (result != DB_BUFFER_SMALL)
+            return result;
+        size = db_value.size;
+    }
+}
+
 /**
  * Get an object from the store, placing it in the given pointer.
  *
@@ -345,28 +605,25 @@ static la_storage_object_get_result bdb_la_storage_get(la_storage_object_store *
     
     memset(&header, 0, sizeof(la_storage_object_header));
     
-    db_key.data = (void *) key;
-    db_key.size = (u_int32_t) strlen(key);
-    db_key.ulen = db_key.size;
-    db_key.flags = DB_DBT_USERMEM;
-    
     if (obj != NULL)
     {
-        db_value.data = NULL;
-        db_value.ulen = 0;
-        db_value.size = 0;
-        db_value.flags = DB_DBT_MALLOC;
+        result = bdb_read_object(store->db, NULL, key, DB_READ_COMMITTED, obj);
     }
     else
     {
+        memset(&db_key, 0, sizeof(DBT));
+        memset(&db_value, 0, sizeof(DBT));
+        db_key.data = (void *) key;
+        db_key.size = (u_int32_t) strlen(key);
+        db_key.ulen = db_key.size;
+        db_key.flags = DB_DBT_USERMEM;
         db_value.data = &header;
         db_value.ulen = sizeof(la_storage_object_header);
         db_value.dlen = sizeof(la_storage_object_header);
         db_value.doff = 0;
         db_value.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;
+        result = store->db->get(store->db, NULL, &db_key, &db_value, DB_READ_COMMITTED);
     }
-
-    result = store->db->get(store->db, NULL, &db_key, &db_value, DB_READ_COMMITTED);
     if (result != 0)
     {
         if (result == DB_NOTFOUND)
@@ -374,23 +631,225 @@ static la_storage_object_get_result bdb_la_storage_get(la_storage_object_store *
         return LA_STORAGE_OBJECT_GET_ERROR;
     }
     
-    debug("got { size: %u, data: %s }\n", db_value.size, (char *) db_value.data);
-    
-    if (rev != NULL && memcmp(rev, &header.rev, sizeof(la_storage_rev_t)) != 0)
+    if (rev != NULL && memcmp(rev, obj != NULL ? &(*obj)->header->rev : &header.rev, sizeof(la_storage_rev_t)) != 0)
+    {
+        if (obj != NULL)
+        {
+            la_storage_destroy_object(*obj);
+            *obj = NULL;
+        }
         return LA_STORAGE_OBJECT_GET_NOT_FOUND;
+    }
     
+#if DEBUG
     if (obj != NULL)
     {
-        *obj = (la_storage_object *) malloc(sizeof(la_storage_object));
-        (*obj)->key = strdup(key);
-        (*obj)->header = db_value.data;
-        (*obj)->data_length = (uint32_t) (db_value.size - ((*obj)->header->rev_count * sizeof(la_storage_rev_t)) - sizeof(struct la_storage_object_header));
-#if DEBUG
         printf("got %u bytes\n", (*obj)->data_length);
         la_hexdump(la_storage_object_get_data((*obj)), (*obj)->data_length);
+    }
 #endif
+    
+    return LA_STORAGE_OBJECT_GET_OK;
+}
+
+/*
+ * Per-thread buffer that borrowed gets read records into. It is kept
+ * between gets, and only grows, so a borrowed get normally doesn't
+ * allocate anything.
+ */
+struct borrow_buffer
+{
+    void *data;
+    u_int32_t size;
+};
+
+static __thread struct borrow_buffer *borrow_buf = NULL;
+static pthread_key_t borrow_key;
+static pthread_once_t borrow_key_once = PTHREAD_ONCE_INIT;
+
+static void borrow_buffer_free(void *p)
+{
+    struct borrow_buffer *buf = (struct borrow_buffer *) p;
+    free(buf->data);
+    free(buf);
+    borrow_buf = NULL;
+}
+
+static void borrow_key_init(void)
+{
+    pthread_key_create(&borrow_key, borrow_buffer_free);
+}
+
+static struct borrow_buffer *get_borrow_buffer(void)
+{
+    if (borrow_buf == NULL)
+    {
+        pthread_once(&borrow_key_once, borrow_key_init);
+        borrow_buf = calloc(1, sizeof(struct borrow_buffer));
+        if (borrow_buf != NULL)
+            pthread_setspecific(borrow_key, borrow_buf);
     }
+    return borrow_buf;
+}
+
+/**
+ * Get an object into this thread's borrow buffer. The object stays valid
+ * until the next borrowed get on this thread, so there is nothing to do
+ * on release.
+ */
+static la_storage_object_get_result bdb_la_storage_get_borrowed(la_storage_object_store *store, const char *key,
+                                                                const la_storage_rev_t *rev, la_storage_borrowed_object *obj)
+{
+    struct borrow_buffer *buf = get_borrow_buffer();
+    la_storage_object_header *header;
+    DBT db_key;
+    DBT db_value;
+    int result;
     
+    if (buf == NULL)
+        return LA_STORAGE_OBJECT_GET_ERROR;
+    
+    memset(&db_key, 0, sizeof(DBT));
+    memset(&db_value, 0, sizeof(DBT));
+    db_key.data = (void *) key;
+    db_key.size = (u_int32_t) strlen(key);
+    db_key.ulen = db_key.size;
+    db_key.flags = DB_DBT_USERMEM;
+    
+    for (;;)
+    {
+        db_value.data = buf->data;
+        db_value.ulen = buf->size;
+        db_value.flags = DB_DBT_USERMEM;
+        result = store->db->get(store->db, NULL, &db_key, &db_value, DB_READ_COMMITTED);
+        if (result != DB_BUFFER_SMALL)
+            break;
+        void *p = realloc(buf->data, db_value.size);
+        if (p == NULL)
+            return LA_STORAGE_OBJECT_GET_ERROR;
+        buf->data = p;
+        buf->size = db_value.size;
+    }
+    if (result != 0)
+    {
+        if (result == DB_NOTFOUND)
+            return LA_STORAGE_OBJECT_GET_NOT_FOUND;
+        return LA_STORAGE_OBJECT_GET_ERROR;
+    }
+    
+    header = (la_storage_object_header *) buf->data;
+    if (rev != NULL && memcmp(rev, &header->rev, sizeof(la_storage_rev_t)) != 0)
+        return LA_STORAGE_OBJECT_GET_NOT_FOUND;
+    
+    memcpy(&obj->header, header, sizeof(la_storage_object_header));
+    obj->revs = (const la_storage_rev_t *) header->revs_data;
+    obj->data = header->revs_data + (header->rev_count * sizeof(la_storage_rev_t));
+    obj->data_length = (uint32_t) (db_value.size - (header->rev_count * sizeof(la_storage_rev_t)) - sizeof(struct la_storage_object_header));
+    obj->cookie = NULL;
+    return LA_STORAGE_OBJECT_GET_OK;
+}
+
+/*
+ * Compare a null-terminated key with a key from the database, the same
+ * way the default btree comparison does.
+ */
+static int keycmp(const char *key, const DBT *db_key)
+{
+    size_t len = strlen(key);
+    int ret = memcmp(key, db_key->data, min(len, db_key->size));
+    if (ret != 0)
+        return ret;
+    if (len < db_key->size)
+        return -1;
+    if (len > db_key->size)
+        return 1;
+    return 0;
+}
+
+/**
+ * Get many objects with one cursor walk over the primary database.
+ *
+ * The keys are sorted, so we seek to the first one with DB_SET_RANGE, then
+ * step with DB_NEXT while the following records are ones we want. Keys
+ * that are skipped over are not in the database; if the cursor falls
+ * behind the next wanted key, we seek ahead again.
+ */
+static la_storage_object_get_result bdb_la_storage_get_many(la_storage_object_store *store, const char * const *keys,
+                                                            size_t count, la_storage_object **objs)
+{
+    DBC *cursor;
+    DBT db_key;
+    DBT db_probe;
+    u_int32_t flag;
+    size_t i;
+    int result = 0;
+    int cmp = 0;
+
+    for (i = 0; i < count; i++)
+        objs[i] = NULL;
+    if (count == 0)
+        return LA_STORAGE_OBJECT_GET_OK;
+
+    if (store->db->cursor(store->db, NULL, &cursor, DB_TXN_SNAPSHOT) != 0)
+        return LA_STORAGE_OBJECT_GET_ERROR;
+
+    memset(&db_key, 0, sizeof(DBT));
+    memset(&db_probe, 0, sizeof(DBT));
+    db_key.flags = DB_DBT_REALLOC;
+    db_probe.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;
+
+    i = 0;
+    flag = DB_SET_RANGE;
+    while (i < count)
+    {
+        if (flag == DB_SET_RANGE)
+        {
+            size_t len = strlen(keys[i]);
+            void *p = realloc(db_key.data, len + 1);
+            if (p == NULL)
+            {
+                result = ENOMEM;
+                break;
+            }
+            memcpy(p, keys[i], len);
+            db_key.data = p;
+            db_key.size = (u_int32_t) len;
+        }
+
+        // Only look at the key; fetch the value once we know we want it.
+        result = cursor->get(cursor, &db_key, &db_probe, flag);
+        if (result != 0)
+            break;
+
+        while (i < count && (cmp = keycmp(keys[i], &db_key)) < 0)
+            i++;
+        if (i == count)
+            break;
+        if (cmp > 0)
+        {
+            flag = DB_SET_RANGE;
+            continue;
+        }
+
+        result = bdb_read_object(store->db, cursor, keys[i], DB_CURRENT, &objs[i]);
+        if (result != 0)
+            break;
+        i++;
+        flag = DB_NEXT;
+    }
+
+    free(db_key.data);
+    cursor->close(cursor);
+    if (result != 0 && result != DB_NOTFOUND)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (objs[i] != NULL)
+                la_storage_destroy_object(objs[i]);
+            objs[i] = NULL;
+        }
+        return LA_STORAGE_OBJECT_GET_ERROR;
+    }
     return LA_STORAGE_OBJECT_GET_OK;
 }
 
@@ -536,12 +995,12 @@ static la_storage_object_put_result bdb_la_storage_set_revs(la_storage_object_st
     return 0;
 }
 
-/**
- * Put an object into the store.
+/*
+ * Put an object as part of the given transaction. Nothing is written if
+ * this returns a conflict; on error the caller must abort the transaction.
  */
-static la_storage_object_put_result bdb_la_storage_put(la_storage_object_store *store, const la_storage_rev_t *rev, la_storage_object *obj)
+static la_storage_object_put_result bdb_do_put(la_storage_object_store *store, DB_TXN *txn, const la_storage_rev_t *rev, la_storage_object *obj)
 {
-    DB_TXN *txn;
     la_storage_object_header header;
     DBT db_key;
     DBT db_value_read, db_value_write;
@@ -567,13 +1026,9 @@ static la_storage_object_put_result bdb_la_storage_put(la_storage_object_store *
     db_value_read.doff = 0;
     db_value_read.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;
     
-    if (txn_begin(store->env->env, NULL, &txn, DB_TXN_NOSYNC | DB_TXN_NOWAIT) != 0)
-        return LA_STORAGE_OBJECT_PUT_ERROR;
-    
     result = store->db->get(store->db, txn, &db_key, &db_value_read, DB_RMW);
     if (result != 0 && result != DB_NOTFOUND)
     {
-        txn_abort(txn);
         if (result == DB_LOCK_NOTGRANTED)
             return LA_STORAGE_OBJECT_PUT_CONFLICT;
         return LA_STORAGE_OBJECT_PUT_ERROR;
@@ -584,13 +1039,13 @@ static la_storage_object_put_result bdb_la_storage_put(la_storage_object_store *
         debug("data size: %d, data: %s\n", db_value_read.size, db_value_read.data);
         if (rev == NULL || memcmp(rev, &header.rev, sizeof(la_storage_rev_t)) != 0)
         {
-            txn_abort(txn);
             return LA_STORAGE_OBJECT_PUT_CONFLICT;
         }
         obj->header->doc_seq = header.doc_seq + 1;
         if (header.rev_count < LA_OBJECT_MAX_REVISION_COUNT)
         {
-            obj->header = realloc(obj->header, la_storage_object_total_size(obj) + sizeof(la_storage_rev_t));
+            if (la_storage_object_reserve(obj, la_storage_object_total_size(obj) + sizeof(la_storage_rev_t)) != 0)
+                return LA_STORAGE_OBJECT_PUT_ERROR;
             // If we added a revision, move the object data up to make room.
             memmove(la_storage_object_get_data(obj) + sizeof(la_storage_rev_t), la_storage_object_get_data(obj), obj->data_length);
             obj->header->rev_count = header.rev_count + 1;
@@ -612,9 +1067,8 @@ static la_storage_object_put_result bdb_la_storage_put(la_storage_object_store *
         obj->header->rev_count = 0;
     }
     
-    db_seq_t seq;
-    store->seq->get(store->seq, txn, 1, &seq, 0);
-    obj->header->seq = seq;
+    if (next_seq(store, txn, obj) != 0)
+        return LA_STORAGE_OBJECT_PUT_ERROR;
 
     db_value_write.size = (u_int32_t) la_storage_object_total_size(obj);
     db_value_write.ulen = (u_int32_t) la_storage_object_total_size(obj);
@@ -626,11 +1080,64 @@ static la_storage_object_put_result bdb_la_storage_put(la_storage_object_store *
     
     result = store->db->put(store->db, txn, &db_key, &db_value_write, 0);
     if (result != 0)
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    return LA_STORAGE_OBJECT_PUT_SUCCESS;
+}
+
+/**
+ * Put an object into the store.
+ */
+static la_storage_object_put_result bdb_la_storage_put(la_storage_object_store *store, const la_storage_rev_t *rev, la_storage_object *obj)
+{
+    DB_TXN *txn;
+    la_storage_object_put_result result;
+    
+    if (txn_begin(store->env->env, NULL, &txn, DB_TXN_NOSYNC | DB_TXN_NOWAIT) != 0)
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    result = bdb_do_put(store, txn, rev, obj);
+    if (result != LA_STORAGE_OBJECT_PUT_SUCCESS)
     {
         txn_abort(txn);
+        return result;
+    }
+    txn_commit(txn, DB_TXN_NOSYNC);
+    publish_seq(store, obj->header->seq);
+    return LA_STORAGE_OBJECT_PUT_SUCCESS;
+}
+
+/**
+ * Put many objects into the store under a single transaction.
+ *
+ * Unlike a single put, the transaction waits for locks held by other
+ * writers instead of reporting a conflict, so a conflict result here
+ * always means a revision mismatch. If the wait deadlocks, the lock
+ * detector picks a transaction to fail with DB_LOCK_DEADLOCK; if that's
+ * this one, it is aborted and the whole batch returns an error.
+ */
+static la_storage_object_put_result bdb_la_storage_put_bulk(la_storage_object_store *store, const la_storage_rev_t * const *revs,
+                                                            la_storage_object **objs, size_t count,
+                                                            la_storage_object_put_result *results)
+{
+    DB_TXN *txn;
+    size_t i;
+    
+    if (txn_begin(store->env->env, NULL, &txn, DB_TXN_NOSYNC) != 0)
         return LA_STORAGE_OBJECT_PUT_ERROR;
+    for (i = 0; i < count; i++)
+    {
+        results[i] = bdb_do_put(store, txn, revs[i], objs[i]);
+        if (results[i] == LA_STORAGE_OBJECT_PUT_ERROR)
+        {
+            txn_abort(txn);
+            return LA_STORAGE_OBJECT_PUT_ERROR;
+        }
     }
     txn_commit(txn, DB_TXN_NOSYNC);
+    for (i = 0; i < count; i++)
+    {
+        if (results[i] == LA_STORAGE_OBJECT_PUT_SUCCESS)
+            publish_seq(store, objs[i]->header->seq);
+    }
     return LA_STORAGE_OBJECT_PUT_SUCCESS;
 }
 
@@ -656,29 +1163,21 @@ static la_storage_object_put_result bdb_la_storage_replace(la_storage_object_sto
     if (txn_begin(store->env->env, NULL, &txn, DB_TXN_NOSYNC | DB_TXN_NOWAIT) != 0)
         return LA_STORAGE_OBJECT_PUT_ERROR;
 
-    db_seq_t seq;
-    store->seq->get(store->seq, txn, 1, &seq, 0);
-    obj->header->seq = seq;
-    
-    if (store->db->put(store->db, txn, &db_key, &db_value, 0) != 0)
+    if (next_seq(store, txn, obj) != 0
+        || store->db->put(store->db, txn, &db_key, &db_value, 0) != 0)
     {
         txn_abort(txn);
         return LA_STORAGE_OBJECT_PUT_ERROR;
     }
     
     txn_commit(txn, DB_TXN_NOSYNC);
+    publish_seq(store, obj->header->seq);
     return LA_STORAGE_OBJECT_PUT_SUCCESS;
 }
 
 static uint64_t bdb_la_storage_lastseq(la_storage_object_store *store)
 {
-    DB_SEQUENCE_STAT *stat;
-    db_seq_t seq;
-    if (store->seq->stat(store->seq, &stat, 0) != 0)
-        return 0;
-    seq = stat->st_current;
-    free(stat);
-    return seq;
+    return __sync_add_and_fetch(&store->lastseq, 0);
 }
 
 static int bdb_la_storage_stat(la_storage_object_store *store, la_storage_stat_t *stat)
@@ -720,7 +1219,10 @@ static la_storage_object_iterator *bdb_la_storage_iterator_open(la_storage_objec
     la_storage_object_iterator *it = (la_storage_object_iterator *) malloc(sizeof(struct la_storage_object_iterator));
     if (it == NULL)
         return NULL;
+    memset(it, 0, sizeof(struct la_storage_object_iterator));
     it->store = store;
+    it->start = 0;
+    it->until = UINT64_MAX;
     if (store->db->cursor(store->seq_db, NULL, &it->cursor, DB_TXN_SNAPSHOT) != 0)
     {
         free(it);
@@ -738,68 +1240,326 @@ static la_storage_object_iterator *bdb_la_storage_iterator_open(la_storage_objec
     return it;
 }
 
-static la_storage_object_iterator_result bdb_la_storage_iterator_next(la_storage_object_iterator *it, la_storage_object **obj)
+/*
+ * Range iterators use snapshot cursors on the seq index, so scans of
+ * different ranges on different threads neither block each other nor
+ * the writers. The cursor is positioned by the first iterator_next.
+ * With LA_STORAGE_ITERATOR_HEADERS_ONLY, only the header at the start
+ * of each record is read.
+ */
+static la_storage_object_iterator *bdb_la_storage_iterator_open_range(la_storage_object_store *store, uint64_t from_seq, uint64_t to_seq, int flags)
+{
+    la_storage_object_iterator *it = (la_storage_object_iterator *) malloc(sizeof(struct la_storage_object_iterator));
+    if (it == NULL)
+        return NULL;
+    memset(it, 0, sizeof(struct la_storage_object_iterator));
+    it->store = store;
+    it->start = from_seq + 1;
+    it->until = to_seq;
+    it->flags = flags;
+    if (store->seq_db->cursor(store->seq_db, NULL, &it->cursor, DB_TXN_SNAPSHOT) != 0)
+    {
+        free(it);
+        return NULL;
+    }
+    return it;
+}
+
+/*
+ * Key range iterators use a snapshot cursor on the primary database,
+ * which is a btree ordered the same way as the keys. With
+ * LA_STORAGE_ITERATOR_HEADERS_ONLY, only the header at the start of
+ * each record is read.
+ */
+static la_storage_object_iterator *bdb_la_storage_iterator_open_keyrange(la_storage_object_store *store, const char *startkey,
+                                                                          const char *endkey, int descending, uint64_t limit, int flags)
+{
+    la_storage_object_iterator *it = (la_storage_object_iterator *) calloc(1, sizeof(struct la_storage_object_iterator));
+    if (it == NULL)
+        return NULL;
+    it->store = store;
+    it->by_id = 1;
+    it->descending = descending;
+    it->flags = flags;
+    it->remaining = (limit > 0) ? limit : UINT64_MAX;
+    if ((startkey != NULL && (it->startkey = strdup(startkey)) == NULL)
+        || (endkey != NULL && (it->endkey = strdup(endkey)) == NULL)
+        || store->db->cursor(store->db, NULL, &it->cursor, DB_TXN_SNAPSHOT) != 0)
+    {
+        free(it->startkey);
+        free(it->endkey);
+        free(it);
+        return NULL;
+    }
+    return it;
+}
+
+/*
+ * Move the cursor to the first key of the range, without reading any
+ * data. Descending ranges start at the last key not after startkey.
+ */
+static int keyrange_position(la_storage_object_iterator *it)
 {
-    DBT db_pkey;
     DBT db_key;
     DBT db_value;
-    int result;
+    int result, cmp;
     
-    memset(&db_pkey, 0, sizeof(DBT));
     memset(&db_key, 0, sizeof(DBT));
     memset(&db_value, 0, sizeof(DBT));
+    db_value.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;
+    db_key.flags = DB_DBT_MALLOC;
+    if (it->startkey == NULL)
+    {
+        result = it->cursor->get(it->cursor, &db_key, &db_value, it->descending ? DB_LAST : DB_FIRST);
+        if (result == 0)
+            free(db_key.data);
+        return result;
+    }
     
-    db_pkey.flags = DB_DBT_MALLOC;
+    db_key.data = it->startkey;
+    db_key.size = (u_int32_t) strlen(it->startkey);
+    result = it->cursor->get(it->cursor, &db_key, &db_value, DB_SET_RANGE);
+    if (!it->descending || (result != 0 && result != DB_NOTFOUND))
+    {
+        if (result == 0)
+            free(db_key.data);
+        return result;
+    }
+    
+    // We're at the first key not before startkey; step back unless it
+    // is startkey itself, or to the last key if there's none.
+    if (result == 0)
+    {
+        cmp = keycmp(it->startkey, &db_key);
+        free(db_key.data);
+        if (cmp == 0)
+            return 0;
+    }
+    memset(&db_key, 0, sizeof(DBT));
     db_key.flags = DB_DBT_MALLOC;
-    if (obj != NULL)
-        db_value.flags = DB_DBT_MALLOC;
+    result = it->cursor->get(it->cursor, &db_key, &db_value, (result == DB_NOTFOUND) ? DB_LAST : DB_PREV);
+    if (result == 0)
+        free(db_key.data);
+    return result;
+}
+
+static la_storage_object_iterator_result keyrange_next(la_storage_object_iterator *it, la_storage_object **obj)
+{
+    DBT db_key;
+    DBT db_value;
+    la_storage_object *o;
+    size_t keysize = READ_KEY_GUESS;
+    size_t size;
+    int headers_only = (obj == NULL || (it->flags & LA_STORAGE_ITERATOR_HEADERS_ONLY));
+    int result, cmp;
+    
+    for (;;)
+    {
+        if (it->remaining == 0)
+            return LA_STORAGE_OBJECT_ITERATOR_END;
+        if (!it->positioned)
+        {
+            result = keyrange_position(it);
+            if (result == DB_NOTFOUND)
+                return LA_STORAGE_OBJECT_ITERATOR_END;
+            if (result != 0)
+                return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+        }
+        
+        // As in bdb_la_storage_iterator_next, a read that doesn't fit
+        // leaves the cursor where it was.
+        size = headers_only ? sizeof(la_storage_object_header) : READ_SIZE_GUESS;
+        for (;;)
+        {
+            o = la_storage_alloc_object(NULL, keysize, size);
+            if (o == NULL)
+                return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+            memset(&db_key, 0, sizeof(DBT));
+            memset(&db_value, 0, sizeof(DBT));
+            db_key.data = o->key;
+            db_key.ulen = (u_int32_t) keysize;
+            db_key.flags = DB_DBT_USERMEM;
+            db_value.data = o->header;
+            db_value.ulen = o->header_capacity;
+            db_value.flags = DB_DBT_USERMEM;
+            if (headers_only)
+            {
+                db_value.dlen = sizeof(la_storage_object_header);
+                db_value.doff = 0;
+                db_value.flags |= DB_DBT_PARTIAL;
+            }
+            result = it->cursor->get(it->cursor, &db_key, &db_value,
+                                     !it->positioned ? DB_CURRENT : (it->descending ? DB_PREV : DB_NEXT));
+            if (result == 0)
+                break;
+            la_storage_destroy_object(o);
+            if (result == DB_NOTFOUND)
+                return LA_STORAGE_OBJECT_ITERATOR_END;
+            if (result != DB_BUFFER_SMALL)
+                return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+            keysize = max(keysize, db_key.size);
+            size = max(size, db_value.size);
+        }
+        it->positioned = 1;
+        o->key[db_key.size] = '\0';
+        
+        if (it->endkey != NULL)
+        {
+            cmp = keycmp(it->endkey, &db_key);
+            if (it->descending ? cmp > 0 : cmp < 0)
+            {
+                la_storage_destroy_object(o);
+                return LA_STORAGE_OBJECT_ITERATOR_END;
+            }
+        }
+        if (db_value.size < sizeof(la_storage_object_header))
+        {
+            la_storage_destroy_object(o);
+            return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+        }
+        if (o->header->deleted && (it->flags & LA_STORAGE_ITERATOR_SKIP_DELETED))
+        {
+            la_storage_destroy_object(o);
+            continue;
+        }
+        break;
+    }
+    
+    it->remaining--;
+    if (obj == NULL)
+    {
+        la_storage_destroy_object(o);
+        return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
+    }
+    if (headers_only)
+    {
+        o->header->rev_count = 0;
+        o->data_length = 0;
+    }
     else
-        db_value.flags = DB_DBT_USERMEM;
+        object_set_data_length(o, db_value.size);
+    *obj = o;
+    return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
+}
+
+static la_storage_object_iterator_result bdb_la_storage_iterator_next(la_storage_object_iterator *it, la_storage_object **obj)
+{
+    DBT db_pkey;
+    DBT db_key;
+    DBT db_value;
+    uint64_t seq;
+    la_storage_object *o = NULL;
+    int headers_only = (it->flags & LA_STORAGE_ITERATOR_HEADERS_ONLY);
+    size_t keysize = READ_KEY_GUESS;
+    size_t size = headers_only ? sizeof(la_storage_object_header) : READ_SIZE_GUESS;
+    int result;
     
-    result = it->cursor->pget(it->cursor, &db_key, &db_pkey, &db_value, DB_NEXT);
-    if (result != 0)
+    if (it->by_id)
+        return keyrange_next(it, obj);
+    
+    // Read the key and value right into the object's block; if either
+    // doesn't fit, the cursor stays put and we try again with more room.
+    for (;;)
     {
+        memset(&db_pkey, 0, sizeof(DBT));
+        memset(&db_key, 0, sizeof(DBT));
+        memset(&db_value, 0, sizeof(DBT));
+        
+        db_key.data = &seq;
+        db_key.ulen = sizeof(uint64_t);
+        db_key.flags = DB_DBT_USERMEM;
+        if (it->start > 0)
+        {
+            seq = it->start;
+            db_key.size = sizeof(uint64_t);
+        }
+        if (obj != NULL)
+        {
+            o = la_storage_alloc_object(NULL, keysize, size);
+            if (o == NULL)
+                return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+            db_pkey.data = o->key;
+            db_pkey.ulen = (u_int32_t) keysize;
+            db_pkey.flags = DB_DBT_USERMEM;
+            db_value.data = o->header;
+            db_value.ulen = o->header_capacity;
+            db_value.flags = DB_DBT_USERMEM;
+            if (headers_only)
+            {
+                db_value.dlen = sizeof(la_storage_object_header);
+                db_value.doff = 0;
+                db_value.flags |= DB_DBT_PARTIAL;
+            }
+        }
+        else
+        {
+            db_pkey.flags = DB_DBT_MALLOC;
+            db_value.flags = DB_DBT_USERMEM | DB_DBT_PARTIAL;
+        }
+        
+        result = it->cursor->pget(it->cursor, &db_key, &db_pkey, &db_value, (it->start > 0) ? DB_SET_RANGE : DB_NEXT);
+        if (result == 0)
+            break;
+        if (o != NULL)
+            la_storage_destroy_object(o);
+        o = NULL;
         if (result == DB_NOTFOUND)
             return LA_STORAGE_OBJECT_ITERATOR_END;
-        return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+        if (result != DB_BUFFER_SMALL || obj == NULL)
+            return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+        keysize = max(keysize, db_pkey.size);
+        size = max(size, db_value.size);
     }
 
 #if DEBUG
     printf("cursor key:\n");
     la_hexdump(db_key.data, db_key.size);
 #endif
-    free(db_key.data);
-    if (obj != NULL)
+    it->start = 0;
+    if (seq > it->until)
+    {
+        if (o != NULL)
+            la_storage_destroy_object(o);
+        else
+            free(db_pkey.data);
+        return LA_STORAGE_OBJECT_ITERATOR_END;
+    }
+    if (obj == NULL)
     {
-        *obj = (la_storage_object *) malloc(sizeof(la_storage_object));
-        if (*obj == NULL)
-            return LA_STORAGE_OBJECT_ITERATOR_ERROR;
-        (*obj)->key = keycpy(db_pkey.data, db_pkey.size);
         free(db_pkey.data);
-        if ((*obj)->key == NULL)
+        return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
+    }
+    
+    o->key[db_pkey.size] = '\0';
+#if DEBUG
+    printf("got %u bytes from cursor:\n", db_value.size);
+    la_hexdump(db_value.data, db_value.size);
+#endif
+    if (headers_only)
+    {
+        if (db_value.size < sizeof(la_storage_object_header))
         {
-            free(*obj);
+            la_storage_destroy_object(o);
             return LA_STORAGE_OBJECT_ITERATOR_ERROR;
         }
-        (*obj)->header = db_value.data;
-#if DEBUG
-        printf("got %u bytes from cursor:\n", db_value.size);
-        la_hexdump(db_value.data, db_value.size);
-#endif
-        (*obj)->data_length = (uint32_t) (db_value.size - sizeof(struct la_storage_object_header) 
-                                          - (sizeof(la_storage_rev_t) * (*obj)->header->rev_count));
+        o->header->rev_count = 0;
+        o->data_length = 0;
+    }
+    else
+        object_set_data_length(o, db_value.size);
 #if DEBUG
-        printf("got %u bytes\n", (*obj)->data_length);
-        la_hexdump(la_storage_object_get_data((*obj)), (*obj)->data_length);
+    printf("got %u bytes\n", o->data_length);
+    la_hexdump(la_storage_object_get_data(o), o->data_length);
 #endif
-    }
-    
+    *obj = o;
     return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
 }
 
 static void bdb_la_storage_iterator_close(la_storage_object_iterator *it)
 {
     it->cursor->close(it->cursor);
+    free(it->startkey);
+    free(it->endkey);
     free(it);
 }
 
@@ -825,14 +1585,19 @@ static la_object_store_driver_t bdb_driver = {
     .close_store = bdb_la_storage_close,
     .delete_store = NULL,
     .get = bdb_la_storage_get,
+    .get_many = bdb_la_storage_get_many,
+    .get_borrowed = bdb_la_storage_get_borrowed,
     .get_rev = bdb_la_storage_get_rev,
     .get_all_revs = bdb_la_storage_get_all_revs,
     .set_revs = bdb_la_storage_set_revs,
     .put = bdb_la_storage_put,
+    .put_bulk = bdb_la_storage_put_bulk,
     .replace = bdb_la_storage_replace,
     .lastseq = bdb_la_storage_lastseq,
     .stat = bdb_la_storage_stat,
     .iterator_open = bdb_la_storage_iterator_open,
+    .iterator_open_range = bdb_la_storage_iterator_open_range,
+    .iterator_open_keyrange = bdb_la_storage_iterator_open_keyrange,
     .iterator_next = bdb_la_storage_iterator_next,
     .iterator_close = bdb_la_storage_iterator_close
 };
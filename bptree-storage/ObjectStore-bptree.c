@@ -0,0 +1,1546 @@
+//
+//  ObjectStore-bptree.c
+//  LoungeAct
+//
+//  Created by agent on 10/18/26.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../bptree/labptree.h"
+#include "../utils/stringutils.h"
+#include "../utils/trace.h"
+#include "../utils/utils.h"
+#include "../utils/uthash.h"
+#include "../Storage/ObjectStore.h"
+
+#if DEBUG
+#define debug(fmt,args...) fprintf(stderr, "%s:%d -- " fmt, basename( __FILE__ ), __LINE__, ##args)
+#else
+#define debug(fmt,args...)
+#endif
+
+/*
+ * Each store is a single append-only file (see bptree/labptree.h). A
+ * document version is appended as a record holding its key and its
+ * la_storage_object_header, revisions and data; the by-id tree maps
+ * keys to id_entry values, and the by-seq tree maps sequence numbers to
+ * seq_entry values, both pointing at the current record.
+ */
+#define STORE_SUFFIX ".bpt"
+
+struct record_header
+{
+    uint16_t key_length;
+} LA_PACKED;
+
+struct id_entry
+{
+    uint64_t offset;
+    uint64_t seq;
+    uint8_t deleted;
+    la_storage_rev_t rev;
+    uint64_t doc_seq;
+} LA_PACKED;
+
+struct seq_entry
+{
+    uint64_t offset;
+} LA_PACKED;
+
+struct la_storage_env
+{
+    char *name;
+    la_storage_env_config_t config;
+};
+
+/*
+ * Compaction (see bptree_la_storage_compact) replaces the store's tree
+ * with a tree in a new file. Every operation takes a reference to the
+ * current tree (see use_tree) and uses that tree throughout, so it sees
+ * one file or the other. The store holds a reference to its current
+ * tree, and the tree a compaction replaces is closed once the last
+ * operation or iterator using it lets go. Its file has been renamed
+ * over by then, so closing it frees its space.
+ */
+struct tree_ref
+{
+    BPTree *tree;
+    int refs;
+};
+
+struct dirty_key
+{
+    char *key;
+    UT_hash_handle hh;
+};
+
+struct la_storage_object_store
+{
+    la_storage_env *env;
+    char *path;
+    
+    /*
+     * The current tree. current_lock is held to take a reference to it,
+     * and to replace it.
+     */
+    struct tree_ref * volatile current;
+    pthread_mutex_t current_lock;
+    
+    /*
+     * While compacting, writers note the keys they commit in dirty, so
+     * the compactor can copy them again. Guarded by the tree's write
+     * lock. dirty_lost is set if a key couldn't be noted, which fails
+     * the compaction.
+     */
+    int compacting;
+    int dirty_lost;
+    struct dirty_key *dirty;
+};
+
+struct la_storage_object_iterator
+{
+    struct tree_ref *ref;
+    BPTree *tree;
+    BTreeCursor *cursor;
+    uint64_t until;
+    int flags;
+    
+    /*
+     * Key range iterators walk the by-id tree instead, and stop after
+     * endkey (if not NULL) or once remaining objects have been returned.
+     */
+    int by_id;
+    char *endkey;
+    size_t endkey_length;
+    int descending;
+    uint64_t remaining;
+};
+
+/*
+ * The documents written by one commit, by key. Only the last version of
+ * a key written in a batch goes into the trees. Records are held in
+ * memory until the commit, which appends them all with one write and
+ * then fills in each entry's offset.
+ */
+struct pending
+{
+    char *key;
+    struct id_entry entry;
+    uint64_t old_seq;   /* The seq the key had in the trees before, or 0. */
+    FileTerm record;
+    UT_hash_handle hh;
+};
+
+struct batch
+{
+    BPTreeState state;
+    struct pending *docs;
+};
+
+static la_storage_env *bptree_la_storage_open_env(const char *name, const la_storage_env_config_t *config)
+{
+    struct stat st;
+    int ret;
+    la_storage_env *env = (la_storage_env *) malloc(sizeof(struct la_storage_env));
+    if (env == NULL)
+        return NULL;
+    env->name = strdup(name);
+    memcpy(&env->config, config, sizeof(la_storage_env_config_t));
+    ret = stat(name, &st);
+    if (ret != 0)
+    {
+        if (errno == ENOENT)
+        {
+            debug("creating directory %s\n", name);
+            if (mkdir(name, 0777) != 0)
+            {
+                free(env->name);
+                free(env);
+                return NULL;
+            }
+        }
+        else
+        {
+            debug("failed to read directory %s: %s\n", name, strerror(errno));
+            free(env->name);
+            free(env);
+            return NULL;
+        }
+    }
+    else if (!S_ISDIR(st.st_mode))
+    {
+        debug("%s: %s\n", name, strerror(ENOTDIR));
+        free(env->name);
+        free(env);
+        return NULL;
+    }
+    return env;
+}
+
+static int bptree_la_storage_close_env(la_storage_env *env)
+{
+    free(env->name);
+    free(env);
+    return 0;
+}
+
+static BPTree *open_tree(la_storage_env *env, const char *path, int create, int *created)
+{
+    BPTree *tree;
+
+    if ((tree = bptree_open(path, create, created)) == NULL)
+        return NULL;
+    bptree_set_sync(tree, env->config.bptree_sync, env->config.bptree_group_commit_window);
+    file_set_checksum(bptree_file(tree), (FileChecksum) env->config.bptree_checksum, env->config.bptree_verify_reads);
+    // If the file can't be mapped, reads just use pread.
+    if (env->config.bptree_mmap_size > 0)
+        file_map(bptree_file(tree), (size_t) env->config.bptree_mmap_size);
+    return tree;
+}
+
+static struct tree_ref *new_tree_ref(BPTree *tree)
+{
+    struct tree_ref *ref = (struct tree_ref *) malloc(sizeof(struct tree_ref));
+    if (ref == NULL)
+        return NULL;
+    ref->tree = tree;
+    ref->refs = 1;
+    return ref;
+}
+
+static la_storage_open_result_t bptree_la_storage_open(la_storage_env *env, const char *name, int flags, la_storage_object_store **_store)
+{
+    const char *parts[2];
+    BPTree *tree;
+    char *path;
+    struct stat st;
+    int created = 0;
+    la_storage_object_store *store;
+
+    parts[0] = env->name;
+    parts[1] = name;
+    if ((path = string_join("/", (char * const *) parts, 2)) == NULL)
+        return LA_STORAGE_OPEN_ERROR;
+    store = (la_storage_object_store *) calloc(1, sizeof(struct la_storage_object_store));
+    if (store == NULL || (store->path = string_append(path, STORE_SUFFIX)) == NULL)
+    {
+        free(path);
+        free(store);
+        return LA_STORAGE_OPEN_ERROR;
+    }
+    free(path);
+    store->env = env;
+
+    if (stat(store->path, &st) == 0)
+    {
+        if ((flags & LA_STORAGE_OPEN_FLAG_CREATE) && (flags & LA_STORAGE_OPEN_FLAG_EXCL))
+        {
+            free(store->path);
+            free(store);
+            return LA_STORAGE_OPEN_EXISTS;
+        }
+    }
+    else if (!(flags & LA_STORAGE_OPEN_FLAG_CREATE))
+    {
+        free(store->path);
+        free(store);
+        return LA_STORAGE_OPEN_NOT_FOUND;
+    }
+
+    if ((tree = open_tree(env, store->path, flags & LA_STORAGE_OPEN_FLAG_CREATE, &created)) == NULL)
+    {
+        free(store->path);
+        free(store);
+        return LA_STORAGE_OPEN_ERROR;
+    }
+    if ((store->current = new_tree_ref(tree)) == NULL)
+    {
+        bptree_close(tree);
+        free(store->path);
+        free(store);
+        return LA_STORAGE_OPEN_ERROR;
+    }
+    pthread_mutex_init(&store->current_lock, NULL);
+    *_store = store;
+    if (created)
+        return LA_STORAGE_OPEN_CREATED;
+    return LA_STORAGE_OPEN_OK;
+}
+
+/*
+ * Take a reference to the store's current tree. Give it back with
+ * done_tree.
+ */
+static struct tree_ref *use_tree(la_storage_object_store *store)
+{
+    struct tree_ref *ref;
+
+    pthread_mutex_lock(&store->current_lock);
+    ref = store->current;
+    __sync_add_and_fetch(&ref->refs, 1);
+    pthread_mutex_unlock(&store->current_lock);
+    return ref;
+}
+
+static void done_tree(struct tree_ref *ref)
+{
+    if (__sync_sub_and_fetch(&ref->refs, 1) == 0)
+    {
+        bptree_close(ref->tree);
+        free(ref);
+    }
+}
+
+static int bptree_la_storage_close(la_storage_object_store *store)
+{
+    done_tree(store->current);
+    pthread_mutex_destroy(&store->current_lock);
+    free(store->path);
+    free(store);
+    return 0;
+}
+
+static int bptree_la_storage_delete(la_storage_object_store *store)
+{
+    // The file goes away once the store is closed.
+    return unlink(store->path);
+}
+
+/*
+ * Take a reference to the store's current tree, and its write lock. If
+ * compaction replaced the tree while we waited, try again on the new
+ * one.
+ */
+static struct tree_ref *lock_tree(la_storage_object_store *store)
+{
+    struct tree_ref *ref;
+    for (;;)
+    {
+        ref = use_tree(store);
+        bptree_write_lock(ref->tree);
+        if (ref == store->current)
+            return ref;
+        bptree_write_unlock(ref->tree);
+        done_tree(ref);
+    }
+}
+
+/*
+ * Encode obj as a record, replacing whatever record doc held.
+ */
+static int encode_record(struct pending *doc, const la_storage_object *obj)
+{
+    struct record_header header;
+    size_t key_length = strlen(obj->key);
+    size_t size = la_storage_object_total_size(obj);
+    void *data;
+
+    if ((data = malloc(sizeof(struct record_header) + key_length + size)) == NULL)
+        return -1;
+    free(doc->record.data);
+    doc->record.data = data;
+    doc->record.length = sizeof(struct record_header) + key_length + size;
+    header.key_length = (uint16_t) key_length;
+    memcpy(data, &header, sizeof(struct record_header));
+    memcpy((char *) data + sizeof(struct record_header), obj->key, key_length);
+    memcpy((char *) data + sizeof(struct record_header) + key_length, obj->header, size);
+    return 0;
+}
+
+/*
+ * Find the object header in a record, after its key, and check that the
+ * record is long enough for the header's revisions. Sets *size to the
+ * length of the header, revisions and data. Returns NULL if the record
+ * is damaged.
+ */
+static const la_storage_object_header *record_object(const void *data, size_t length, struct record_header *header, size_t *size)
+{
+    const la_storage_object_header *h;
+
+    if (length < sizeof(struct record_header))
+        return NULL;
+    memcpy(header, data, sizeof(struct record_header));
+    if (length < sizeof(struct record_header) + header->key_length + sizeof(la_storage_object_header))
+        return NULL;
+    *size = length - sizeof(struct record_header) - header->key_length;
+    h = (const la_storage_object_header *) ((const char *) data + sizeof(struct record_header) + header->key_length);
+    if (sizeof(la_storage_object_header) + (h->rev_count * sizeof(la_storage_rev_t)) > *size)
+        return NULL;
+    return h;
+}
+
+/*
+ * Decode a record into a new object. With headers_only, only the key
+ * and header are copied out, and the object has no revisions or data.
+ */
+static int decode_record(const void *data, size_t length, int headers_only, la_storage_object **obj)
+{
+    struct record_header header;
+    const la_storage_object_header *h;
+    const char *p = (const char *) data + sizeof(struct record_header);
+    size_t size;
+
+    if ((h = record_object(data, length, &header, &size)) == NULL)
+        return -1;
+    if (headers_only)
+    {
+        if ((*obj = la_storage_alloc_object(p, header.key_length, sizeof(la_storage_object_header))) == NULL)
+            return -1;
+        memcpy((*obj)->header, h, sizeof(la_storage_object_header));
+        (*obj)->header->rev_count = 0;
+        return 0;
+    }
+    *obj = la_storage_alloc_object(p, header.key_length, size);
+    if (*obj == NULL)
+        return -1;
+    memcpy((*obj)->header, h, size);
+    (*obj)->data_length = (uint32_t) (size - sizeof(la_storage_object_header) - (h->rev_count * sizeof(la_storage_rev_t)));
+    return 0;
+}
+
+static int read_record(BPTree *tree, uint64_t offset, int headers_only, la_storage_object **obj)
+{
+    FileTerm term;
+    int mapped, ret;
+
+    if (file_read_mapped(bptree_file(tree), (off_t) offset, &term, &mapped) != FILE_SUCCESS)
+        return -1;
+    ret = decode_record(term.data, term.length, headers_only, obj);
+    if (!mapped)
+        free(term.data);
+    return ret;
+}
+
+/*
+ * Decode a by-id tree value. Returns 0, or -1 if it isn't an entry.
+ */
+static int decode_id_entry(const void *value, size_t length, struct id_entry *entry)
+{
+    if (length != sizeof(struct id_entry))
+        return -1;
+    memcpy(entry, value, sizeof(struct id_entry));
+    return 0;
+}
+
+static BTreeResult lookup_id(BPTree *tree, const BPTreeState *state, const char *key, struct id_entry *entry)
+{
+    void *value;
+    size_t length;
+    BTreeResult ret;
+
+    ret = btree_lookup(bptree_by_id(tree), &state->by_id, key, strlen(key), &value, &length);
+    if (ret != BTREE_SUCCESS)
+        return ret;
+    if (decode_id_entry(value, length, entry) < 0)
+    {
+        free(value);
+        return BTREE_CORRUPTION;
+    }
+    free(value);
+    return BTREE_SUCCESS;
+}
+
+static la_storage_object_get_result bptree_la_storage_get(la_storage_object_store *store, const char *key,
+                                                          const la_storage_rev_t *rev, la_storage_object **obj)
+{
+    struct tree_ref *ref = use_tree(store);
+    BPTreeState state;
+    struct id_entry entry;
+    la_storage_object_get_result result = LA_STORAGE_OBJECT_GET_OK;
+    BTreeResult ret;
+
+    bptree_snapshot(ref->tree, &state);
+    if ((ret = lookup_id(ref->tree, &state, key, &entry)) != BTREE_SUCCESS)
+        result = (ret == BTREE_NOT_FOUND) ? LA_STORAGE_OBJECT_GET_NOT_FOUND : LA_STORAGE_OBJECT_GET_ERROR;
+    else if (rev != NULL && memcmp(rev, &entry.rev, sizeof(la_storage_rev_t)) != 0)
+        result = LA_STORAGE_OBJECT_GET_NOT_FOUND;
+    else if (obj != NULL && read_record(ref->tree, entry.offset, 0, obj) != 0)
+        result = LA_STORAGE_OBJECT_GET_ERROR;
+    done_tree(ref);
+    return result;
+}
+
+/*
+ * Borrowed objects point into the file's mapping when the record is in
+ * it, and hold a reference to the tree, so neither goes away (even if
+ * compaction replaces the tree) until release. Otherwise the record is
+ * read into memory from malloc, which release frees.
+ */
+enum
+{
+    BORROW_MAPPED,
+    BORROW_READ
+};
+
+static la_storage_object_get_result bptree_la_storage_get_borrowed(la_storage_object_store *store, const char *key,
+                                                                   const la_storage_rev_t *rev, la_storage_borrowed_object *obj)
+{
+    struct tree_ref *ref = use_tree(store);
+    BPTreeState state;
+    struct id_entry entry;
+    struct record_header header;
+    const la_storage_object_header *h;
+    FileTerm term;
+    size_t size, revs_size;
+    int mapped;
+    BTreeResult ret;
+
+    bptree_snapshot(ref->tree, &state);
+    if ((ret = lookup_id(ref->tree, &state, key, &entry)) != BTREE_SUCCESS)
+    {
+        done_tree(ref);
+        return (ret == BTREE_NOT_FOUND) ? LA_STORAGE_OBJECT_GET_NOT_FOUND : LA_STORAGE_OBJECT_GET_ERROR;
+    }
+    if (rev != NULL && memcmp(rev, &entry.rev, sizeof(la_storage_rev_t)) != 0)
+    {
+        done_tree(ref);
+        return LA_STORAGE_OBJECT_GET_NOT_FOUND;
+    }
+    if (file_read_mapped(bptree_file(ref->tree), (off_t) entry.offset, &term, &mapped) != FILE_SUCCESS)
+    {
+        done_tree(ref);
+        return LA_STORAGE_OBJECT_GET_ERROR;
+    }
+    if ((h = record_object(term.data, term.length, &header, &size)) == NULL)
+    {
+        if (!mapped)
+            free(term.data);
+        done_tree(ref);
+        return LA_STORAGE_OBJECT_GET_ERROR;
+    }
+    memcpy(&obj->header, h, sizeof(la_storage_object_header));
+    revs_size = obj->header.rev_count * sizeof(la_storage_rev_t);
+    obj->revs = (const la_storage_rev_t *) h->revs_data;
+    obj->data = h->revs_data + revs_size;
+    obj->data_length = (uint32_t) (size - sizeof(la_storage_object_header) - revs_size);
+    if (mapped)
+    {
+        obj->cookie = ref;
+        obj->cookie_kind = BORROW_MAPPED;
+    }
+    else
+    {
+        done_tree(ref);
+        obj->cookie = term.data;
+        obj->cookie_kind = BORROW_READ;
+    }
+    return LA_STORAGE_OBJECT_GET_OK;
+}
+
+static void bptree_la_storage_release(la_storage_object_store *store, la_storage_borrowed_object *obj)
+{
+    (void) store;
+    if (obj->cookie_kind == BORROW_MAPPED)
+        done_tree((struct tree_ref *) obj->cookie);
+    else
+        free(obj->cookie);
+}
+
+static la_storage_object_get_result bptree_la_storage_get_rev(la_storage_object_store *store, const char *key, la_storage_rev_t *rev)
+{
+    struct tree_ref *ref = use_tree(store);
+    BPTreeState state;
+    struct id_entry entry;
+    BTreeResult ret;
+
+    bptree_snapshot(ref->tree, &state);
+    ret = lookup_id(ref->tree, &state, key, &entry);
+    done_tree(ref);
+    if (ret != BTREE_SUCCESS)
+    {
+        if (ret == BTREE_NOT_FOUND)
+            return LA_STORAGE_OBJECT_GET_NOT_FOUND;
+        return LA_STORAGE_OBJECT_GET_ERROR;
+    }
+    if (rev != NULL)
+        memcpy(rev, &entry.rev, sizeof(la_storage_rev_t));
+    return LA_STORAGE_OBJECT_GET_OK;
+}
+
+static int bptree_la_storage_get_all_revs(la_storage_object_store *store, const char *key, uint64_t *start, la_storage_rev_t **revs)
+{
+    la_storage_object *obj;
+    int count;
+
+    if (bptree_la_storage_get(store, key, NULL, &obj) != LA_STORAGE_OBJECT_GET_OK)
+        return -1;
+    if (start != NULL)
+        *start = obj->header->doc_seq;
+    if (revs != NULL)
+    {
+        *revs = malloc(sizeof(la_storage_rev_t) * obj->header->rev_count);
+        if (*revs != NULL)
+            memcpy(*revs, obj->header->revs_data, obj->header->rev_count * sizeof(la_storage_rev_t));
+    }
+    count = obj->header->rev_count;
+    la_storage_destroy_object(obj);
+    return count;
+}
+
+static void batch_free(struct batch *batch)
+{
+    struct pending *doc, *tmp;
+    HASH_ITER(hh, batch->docs, doc, tmp)
+    {
+        HASH_DEL(batch->docs, doc);
+        free(doc->record.data);
+        free(doc->key);
+        free(doc);
+    }
+}
+
+/*
+ * Find the current entry for key, looking at what this batch already
+ * wrote before looking in the trees.
+ */
+static BTreeResult batch_lookup(BPTree *tree, struct batch *batch, const char *key,
+                                struct pending **doc, struct id_entry *entry)
+{
+    struct pending *found = NULL;
+    HASH_FIND_STR(batch->docs, key, found);
+    *doc = found;
+    if (found != NULL)
+    {
+        memcpy(entry, &found->entry, sizeof(struct id_entry));
+        return BTREE_SUCCESS;
+    }
+    return lookup_id(tree, &batch->state, key, entry);
+}
+
+/*
+ * Read the current version of a key found with batch_lookup.
+ */
+static int batch_read(BPTree *tree, const struct pending *doc, const struct id_entry *entry,
+                      la_storage_object **obj)
+{
+    if (doc != NULL)
+        return decode_record(doc->record.data, doc->record.length, 0, obj);
+    return read_record(tree, entry->offset, 0, obj);
+}
+
+/*
+ * Note obj as the current version of its key.
+ */
+static la_storage_object_put_result batch_write(struct batch *batch, struct pending *doc,
+                                                const struct id_entry *old, la_storage_object *obj, int new_seq)
+{
+    // Records and tree entries only have 16 bits for the key length.
+    if (strlen(obj->key) > LA_BTREE_MAX_KEY_LENGTH)
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    if (new_seq)
+        obj->header->seq = ++batch->state.lastseq;
+    if (doc == NULL)
+    {
+        if ((doc = (struct pending *) calloc(1, sizeof(struct pending))) == NULL)
+            return LA_STORAGE_OBJECT_PUT_ERROR;
+        if ((doc->key = strdup(obj->key)) == NULL)
+        {
+            free(doc);
+            return LA_STORAGE_OBJECT_PUT_ERROR;
+        }
+        doc->old_seq = (old != NULL) ? old->seq : 0;
+        HASH_ADD_KEYPTR(hh, batch->docs, doc->key, strlen(doc->key), doc);
+    }
+    if (encode_record(doc, obj) != 0)
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    doc->entry.seq = obj->header->seq;
+    doc->entry.doc_seq = obj->header->doc_seq;
+    doc->entry.deleted = obj->header->deleted;
+    memcpy(&doc->entry.rev, &obj->header->rev, sizeof(la_storage_rev_t));
+    return LA_STORAGE_OBJECT_PUT_SUCCESS;
+}
+
+/*
+ * Put an object as part of batch. Nothing is written if this returns a
+ * conflict.
+ */
+static la_storage_object_put_result bptree_do_put(BPTree *tree, struct batch *batch,
+                                                  const la_storage_rev_t *rev, la_storage_object *obj)
+{
+    struct pending *doc;
+    struct id_entry entry;
+    la_storage_object *old;
+    unsigned int oldrev_count;
+    int rc;
+    BTreeResult ret;
+
+    ret = batch_lookup(tree, batch, obj->key, &doc, &entry);
+    if (ret != BTREE_SUCCESS && ret != BTREE_NOT_FOUND)
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    if (ret == BTREE_NOT_FOUND)
+    {
+        obj->header->doc_seq = 1;
+        obj->header->rev_count = 0;
+        return batch_write(batch, NULL, NULL, obj, 1);
+    }
+
+    if (rev == NULL || memcmp(rev, &entry.rev, sizeof(la_storage_rev_t)) != 0)
+        return LA_STORAGE_OBJECT_PUT_CONFLICT;
+    if (batch_read(tree, doc, &entry, &old) != 0)
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+
+    // The new history is the old current revision, then the old history.
+    obj->header->doc_seq = old->header->doc_seq + 1;
+    oldrev_count = old->header->rev_count;
+    if (oldrev_count < LA_OBJECT_MAX_REVISION_COUNT)
+        oldrev_count++;
+    rc = obj->header->rev_count;
+    obj->header->rev_count = oldrev_count;
+    if (la_storage_object_reserve(obj, la_storage_object_total_size(obj)) != 0)
+    {
+        la_storage_destroy_object(old);
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    }
+    memmove(la_storage_object_get_data(obj), obj->header->revs_data + (rc * sizeof(la_storage_rev_t)), obj->data_length);
+    memcpy(obj->header->revs_data + sizeof(la_storage_rev_t), old->header->revs_data,
+           (oldrev_count - 1) * sizeof(la_storage_rev_t));
+    memcpy(obj->header->revs_data, &old->header->rev, sizeof(la_storage_rev_t));
+    la_storage_destroy_object(old);
+    return batch_write(batch, doc, &entry, obj, 1);
+}
+
+static int compare_id_actions(const void *a, const void *b)
+{
+    const BTreeAction *a1 = (const BTreeAction *) a;
+    const BTreeAction *a2 = (const BTreeAction *) b;
+    return btree_compare_bytes(a1->key, a1->key_length, a2->key, a2->key_length);
+}
+
+static int compare_seq_actions(const void *a, const void *b)
+{
+    const BTreeAction *a1 = (const BTreeAction *) a;
+    const BTreeAction *a2 = (const BTreeAction *) b;
+    return btree_compare_u64(a1->key, a1->key_length, a2->key, a2->key_length);
+}
+
+/*
+ * Append the batch's records, update both trees with them, and commit.
+ * Call with the write lock held, then release it and wait for ticket
+ * with bptree_sync.
+ */
+static int batch_commit(BPTree *tree, struct batch *batch, uint64_t *ticket)
+{
+    struct pending *doc, *tmp;
+    BTreeAction *id_actions, *seq_actions;
+    struct seq_entry *seq_values;
+    FileTerm *terms;
+    off_t *offsets;
+    size_t count = HASH_COUNT(batch->docs);
+    size_t i = 0, j = 0;
+    BPTreeState state;
+    int ret = -1;
+
+    *ticket = 0;
+    if (count == 0)
+        return 0;
+    id_actions = (BTreeAction *) calloc(count, sizeof(BTreeAction));
+    seq_actions = (BTreeAction *) calloc(count * 2, sizeof(BTreeAction));
+    seq_values = (struct seq_entry *) calloc(count, sizeof(struct seq_entry));
+    terms = (FileTerm *) malloc(count * sizeof(FileTerm));
+    offsets = (off_t *) malloc(count * sizeof(off_t));
+    if (id_actions == NULL || seq_actions == NULL || seq_values == NULL
+        || terms == NULL || offsets == NULL)
+        goto done;
+
+    HASH_ITER(hh, batch->docs, doc, tmp)
+        terms[i++] = doc->record;
+    if (file_append_many(bptree_file(tree), terms, count, offsets) != FILE_SUCCESS)
+        goto done;
+    i = 0;
+    HASH_ITER(hh, batch->docs, doc, tmp)
+        doc->entry.offset = (uint64_t) offsets[i++];
+
+    i = 0;
+    HASH_ITER(hh, batch->docs, doc, tmp)
+    {
+        id_actions[i].type = BTREE_INSERT;
+        id_actions[i].key = doc->key;
+        id_actions[i].key_length = strlen(doc->key);
+        id_actions[i].value = &doc->entry;
+        id_actions[i].value_length = sizeof(struct id_entry);
+        if (doc->old_seq != 0 && doc->old_seq != doc->entry.seq)
+        {
+            seq_actions[j].type = BTREE_REMOVE;
+            seq_actions[j].key = &doc->old_seq;
+            seq_actions[j].key_length = sizeof(uint64_t);
+            j++;
+        }
+        seq_values[i].offset = doc->entry.offset;
+        seq_actions[j].type = BTREE_INSERT;
+        seq_actions[j].key = &doc->entry.seq;
+        seq_actions[j].key_length = sizeof(uint64_t);
+        seq_actions[j].value = &seq_values[i];
+        seq_actions[j].value_length = sizeof(struct seq_entry);
+        i++;
+        j++;
+    }
+    qsort(id_actions, i, sizeof(BTreeAction), compare_id_actions);
+    qsort(seq_actions, j, sizeof(BTreeAction), compare_seq_actions);
+
+    state.lastseq = batch->state.lastseq;
+    if (btree_modify(bptree_by_id(tree), &batch->state.by_id, id_actions, i, &state.by_id) != BTREE_SUCCESS)
+        goto done;
+    if (btree_modify(bptree_by_seq(tree), &batch->state.by_seq, seq_actions, j, &state.by_seq) != BTREE_SUCCESS)
+        goto done;
+    *ticket = bptree_commit(tree, &state);
+    ret = 0;
+
+done:
+    free(id_actions);
+    free(seq_actions);
+    free(seq_values);
+    free(terms);
+    free(offsets);
+    return ret;
+}
+
+/*
+ * Note the batch's keys for the compactor to copy again.
+ */
+static void note_dirty(la_storage_object_store *store, struct batch *batch)
+{
+    struct pending *doc, *tmp;
+    struct dirty_key *dirty;
+
+    HASH_ITER(hh, batch->docs, doc, tmp)
+    {
+        HASH_FIND_STR(store->dirty, doc->key, dirty);
+        if (dirty != NULL)
+            continue;
+        if ((dirty = (struct dirty_key *) malloc(sizeof(struct dirty_key))) == NULL
+            || (dirty->key = strdup(doc->key)) == NULL)
+        {
+            free(dirty);
+            store->dirty_lost = 1;
+            return;
+        }
+        HASH_ADD_KEYPTR(hh, store->dirty, dirty->key, strlen(dirty->key), dirty);
+    }
+}
+
+/*
+ * Commit a writer's batch if result says it's good to, release the
+ * write lock on tree, and wait for the commit to be durable.
+ */
+static la_storage_object_put_result batch_finish(la_storage_object_store *store, BPTree *tree, struct batch *batch,
+                                                 la_storage_object_put_result result)
+{
+    uint64_t ticket;
+
+    if (result == LA_STORAGE_OBJECT_PUT_SUCCESS && batch_commit(tree, batch, &ticket) != 0)
+        result = LA_STORAGE_OBJECT_PUT_ERROR;
+    if (result == LA_STORAGE_OBJECT_PUT_SUCCESS && store->compacting)
+        note_dirty(store, batch);
+    bptree_write_unlock(tree);
+    if (result == LA_STORAGE_OBJECT_PUT_SUCCESS && bptree_sync(tree, ticket) != 0)
+        result = LA_STORAGE_OBJECT_PUT_ERROR;
+    return result;
+}
+
+static la_storage_object_put_result bptree_la_storage_put(la_storage_object_store *store, const la_storage_rev_t *rev, la_storage_object *obj)
+{
+    struct batch batch;
+    struct tree_ref *ref;
+    BPTree *tree;
+    la_storage_object_put_result result;
+
+    memset(&batch, 0, sizeof(struct batch));
+    ref = lock_tree(store);
+    tree = ref->tree;
+    bptree_tip(tree, &batch.state);
+    result = bptree_do_put(tree, &batch, rev, obj);
+    result = batch_finish(store, tree, &batch, result);
+    batch_free(&batch);
+    done_tree(ref);
+    return result;
+}
+
+/**
+ * Put many objects with a single commit, so the tree nodes they share
+ * are only rewritten once.
+ */
+static la_storage_object_put_result bptree_la_storage_put_bulk(la_storage_object_store *store, const la_storage_rev_t * const *revs,
+                                                               la_storage_object **objs, size_t count,
+                                                               la_storage_object_put_result *results)
+{
+    struct batch batch;
+    struct tree_ref *ref;
+    BPTree *tree;
+    la_storage_object_put_result result = LA_STORAGE_OBJECT_PUT_SUCCESS;
+    size_t i;
+
+    memset(&batch, 0, sizeof(struct batch));
+    ref = lock_tree(store);
+    tree = ref->tree;
+    bptree_tip(tree, &batch.state);
+    for (i = 0; i < count; i++)
+    {
+        results[i] = bptree_do_put(tree, &batch, revs[i], objs[i]);
+        if (results[i] == LA_STORAGE_OBJECT_PUT_ERROR)
+        {
+            result = LA_STORAGE_OBJECT_PUT_ERROR;
+            break;
+        }
+    }
+    result = batch_finish(store, tree, &batch, result);
+    batch_free(&batch);
+    done_tree(ref);
+    return result;
+}
+
+static la_storage_object_put_result bptree_la_storage_replace(la_storage_object_store *store, la_storage_object *obj)
+{
+    struct batch batch;
+    struct tree_ref *ref;
+    BPTree *tree;
+    struct pending *doc;
+    struct id_entry entry;
+    la_storage_object_put_result result;
+    BTreeResult ret;
+
+    memset(&batch, 0, sizeof(struct batch));
+    ref = lock_tree(store);
+    tree = ref->tree;
+    bptree_tip(tree, &batch.state);
+    ret = batch_lookup(tree, &batch, obj->key, &doc, &entry);
+    if (ret != BTREE_SUCCESS && ret != BTREE_NOT_FOUND)
+        result = LA_STORAGE_OBJECT_PUT_ERROR;
+    else
+        result = batch_write(&batch, doc, ret == BTREE_SUCCESS ? &entry : NULL, obj, 1);
+    result = batch_finish(store, tree, &batch, result);
+    batch_free(&batch);
+    done_tree(ref);
+    return result;
+}
+
+static la_storage_object_put_result bptree_la_storage_set_revs(la_storage_object_store *store, const char *key, la_storage_rev_t *revs, size_t revcount)
+{
+    struct batch batch;
+    struct tree_ref *ref;
+    BPTree *tree;
+    struct pending *doc;
+    struct id_entry entry;
+    la_storage_object *obj = NULL;
+    la_storage_object_put_result result = LA_STORAGE_OBJECT_PUT_ERROR;
+    int rc;
+
+    revcount = la_min(revcount, LA_OBJECT_MAX_REVISION_COUNT);
+    memset(&batch, 0, sizeof(struct batch));
+    ref = lock_tree(store);
+    tree = ref->tree;
+    bptree_tip(tree, &batch.state);
+    if (batch_lookup(tree, &batch, key, &doc, &entry) == BTREE_SUCCESS
+        && batch_read(tree, doc, &entry, &obj) == 0)
+    {
+        rc = obj->header->rev_count;
+        obj->header->rev_count = (uint16_t) revcount;
+        if (la_storage_object_reserve(obj, la_storage_object_total_size(obj)) == 0)
+        {
+            memmove(la_storage_object_get_data(obj), obj->header->revs_data + (rc * sizeof(la_storage_rev_t)), obj->data_length);
+            memcpy(obj->header->revs_data, revs, revcount * sizeof(la_storage_rev_t));
+            // Same version, same seq; only the record moves.
+            result = batch_write(&batch, doc, &entry, obj, 0);
+        }
+    }
+    result = batch_finish(store, tree, &batch, result);
+    batch_free(&batch);
+    done_tree(ref);
+    if (obj != NULL)
+        la_storage_destroy_object(obj);
+    return result;
+}
+
+static uint64_t bptree_la_storage_lastseq(la_storage_object_store *store)
+{
+    struct tree_ref *ref = use_tree(store);
+    BPTreeState state;
+    bptree_snapshot(ref->tree, &state);
+    done_tree(ref);
+    return state.lastseq;
+}
+
+static int bptree_la_storage_stat(la_storage_object_store *store, la_storage_stat_t *stat)
+{
+    struct tree_ref *ref = use_tree(store);
+    BPTreeState state;
+    off_t size;
+
+    bptree_snapshot(ref->tree, &state);
+    size = file_size(bptree_file(ref->tree));
+    done_tree(ref);
+    if (size < 0)
+        return -1;
+    stat->numkeys = (int) state.by_id.count;
+    stat->size = (uint64_t) size;
+    return 0;
+}
+
+/*
+ * Iterators read the by-seq tree as of when they were opened, so they
+ * never see writes that happen while they run. The by-seq entries only
+ * point at records, so LA_STORAGE_ITERATOR_HEADERS_ONLY still reads
+ * each record (without copying it, if the file is mapped), but copies
+ * out only the header.
+ */
+static la_storage_object_iterator *bptree_la_storage_iterator_open_range(la_storage_object_store *store, uint64_t from_seq, uint64_t to_seq, int flags)
+{
+    BPTreeState state;
+    uint64_t start = from_seq + 1;
+    la_storage_object_iterator *it = (la_storage_object_iterator *) malloc(sizeof(struct la_storage_object_iterator));
+    BPTree *tree;
+    if (it == NULL)
+        return NULL;
+    memset(it, 0, sizeof(struct la_storage_object_iterator));
+    it->ref = use_tree(store);
+    it->tree = tree = it->ref->tree;
+    it->until = to_seq;
+    it->flags = flags;
+    bptree_snapshot(tree, &state);
+    it->cursor = btree_cursor_open(bptree_by_seq(tree), &state.by_seq,
+                                   from_seq > 0 ? &start : NULL, sizeof(uint64_t));
+    if (it->cursor == NULL)
+    {
+        done_tree(it->ref);
+        free(it);
+        return NULL;
+    }
+    return it;
+}
+
+static la_storage_object_iterator *bptree_la_storage_iterator_open(la_storage_object_store *store, uint64_t since)
+{
+    return bptree_la_storage_iterator_open_range(store, since, UINT64_MAX, 0);
+}
+
+/*
+ * Key range iterators also read the tree as of when they were opened.
+ * The by-id entries hold each document's header, so with
+ * LA_STORAGE_ITERATOR_HEADERS_ONLY the records aren't read at all
+ * (unless the entries predate doc_seq).
+ */
+static la_storage_object_iterator *bptree_la_storage_iterator_open_keyrange(la_storage_object_store *store, const char *startkey,
+                                                                             const char *endkey, int descending, uint64_t limit, int flags)
+{
+    BPTreeState state;
+    la_storage_object_iterator *it = (la_storage_object_iterator *) calloc(1, sizeof(struct la_storage_object_iterator));
+    BPTree *tree;
+    size_t start_length = (startkey != NULL) ? strlen(startkey) : 0;
+    if (it == NULL)
+        return NULL;
+    it->by_id = 1;
+    it->descending = descending;
+    it->flags = flags;
+    it->remaining = (limit > 0) ? limit : UINT64_MAX;
+    if (endkey != NULL)
+    {
+        if ((it->endkey = strdup(endkey)) == NULL)
+        {
+            free(it);
+            return NULL;
+        }
+        it->endkey_length = strlen(endkey);
+    }
+    it->ref = use_tree(store);
+    it->tree = tree = it->ref->tree;
+    bptree_snapshot(tree, &state);
+    if (descending)
+        it->cursor = btree_cursor_open_reverse(bptree_by_id(tree), &state.by_id, startkey, start_length);
+    else
+        it->cursor = btree_cursor_open(bptree_by_id(tree), &state.by_id, startkey, start_length);
+    if (it->cursor == NULL)
+    {
+        done_tree(it->ref);
+        free(it->endkey);
+        free(it);
+        return NULL;
+    }
+    return it;
+}
+
+static la_storage_object_iterator_result keyrange_next(la_storage_object_iterator *it, la_storage_object **obj)
+{
+    struct id_entry entry;
+    const void *key, *value;
+    size_t key_length, length;
+    BTreeResult ret;
+    int cmp;
+
+    do
+    {
+        if (it->remaining == 0)
+            return LA_STORAGE_OBJECT_ITERATOR_END;
+        ret = btree_cursor_next(it->cursor, &key, &key_length, &value, &length);
+        if (ret == BTREE_NOT_FOUND)
+            return LA_STORAGE_OBJECT_ITERATOR_END;
+        if (ret != BTREE_SUCCESS || decode_id_entry(value, length, &entry) < 0)
+            return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+        if (it->endkey != NULL)
+        {
+            cmp = btree_compare_bytes(key, key_length, it->endkey, it->endkey_length);
+            if (it->descending ? cmp < 0 : cmp > 0)
+                return LA_STORAGE_OBJECT_ITERATOR_END;
+        }
+    } while (entry.deleted && (it->flags & LA_STORAGE_ITERATOR_SKIP_DELETED));
+    it->remaining--;
+    if (obj == NULL)
+        return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
+    if (it->flags & LA_STORAGE_ITERATOR_HEADERS_ONLY)
+    {
+        *obj = la_storage_alloc_object((const char *) key, key_length, sizeof(la_storage_object_header));
+        if (*obj == NULL)
+            return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+        memset((*obj)->header, 0, sizeof(la_storage_object_header));
+        (*obj)->header->seq = entry.seq;
+        (*obj)->header->doc_seq = entry.doc_seq;
+        (*obj)->header->deleted = entry.deleted;
+        memcpy(&(*obj)->header->rev, &entry.rev, sizeof(la_storage_rev_t));
+        return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
+    }
+    if (read_record(it->tree, entry.offset, it->flags & LA_STORAGE_ITERATOR_HEADERS_ONLY, obj) != 0)
+        return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+    return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
+}
+
+static la_storage_object_iterator_result bptree_la_storage_iterator_next(la_storage_object_iterator *it, la_storage_object **obj)
+{
+    struct seq_entry entry;
+    const void *key, *value;
+    size_t key_length, length;
+    uint64_t seq;
+    BTreeResult ret;
+
+    if (it->by_id)
+        return keyrange_next(it, obj);
+    ret = btree_cursor_next(it->cursor, &key, &key_length, &value, &length);
+    if (ret == BTREE_NOT_FOUND)
+        return LA_STORAGE_OBJECT_ITERATOR_END;
+    if (ret != BTREE_SUCCESS || key_length != sizeof(uint64_t) || length != sizeof(struct seq_entry))
+        return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+    memcpy(&seq, key, sizeof(uint64_t));
+    if (seq > it->until)
+        return LA_STORAGE_OBJECT_ITERATOR_END;
+    if (obj == NULL)
+        return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
+    memcpy(&entry, value, sizeof(struct seq_entry));
+    if (read_record(it->tree, entry.offset, it->flags & LA_STORAGE_ITERATOR_HEADERS_ONLY, obj) != 0)
+        return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+    return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
+}
+
+static void bptree_la_storage_iterator_close(la_storage_object_iterator *it)
+{
+    btree_cursor_close(it->cursor);
+    done_tree(it->ref);
+    free(it->endkey);
+    free(it);
+}
+
+/*
+ * Compaction copies the live documents into <path>.compact: first every
+ * document in a snapshot, in seq order, then again each key written
+ * since, round after round, until few enough are left to copy with the
+ * write lock held. Then the new file is synced, renamed over the old
+ * one, and becomes the store's tree. If writers are still ahead after
+ * COMPACT_MAX_ROUNDS, later rounds copy one batch at a time with the
+ * write lock held, so writers only get in between batches and can't
+ * outrun the copy, and no one wait is longer than a batch.
+ */
+#define COMPACT_SUFFIX ".compact"
+#define COMPACT_BATCH_SIZE 1000
+#define COMPACT_MAX_ROUNDS 8
+
+struct compaction
+{
+    la_storage_object_store *store;
+    struct tree_ref *from_ref;
+    BPTree *from;
+    BPTree *to;
+    const la_storage_compact_options_t *options;
+    size_t batch_size;
+    int final;          /* Copying with the write lock held; don't throttle. */
+    uint64_t copied;
+    uint64_t total;
+    uint64_t bytes;
+    uint64_t start;
+};
+
+/*
+ * Leave the first count of keys in *keys, and return the rest.
+ */
+static struct dirty_key *split_keys(struct dirty_key **keys, size_t count)
+{
+    struct dirty_key *key, *tmp, *rest = NULL;
+    HASH_ITER(hh, *keys, key, tmp)
+    {
+        if (count > 0)
+        {
+            count--;
+            continue;
+        }
+        HASH_DEL(*keys, key);
+        HASH_ADD_KEYPTR(hh, rest, key->key, strlen(key->key), key);
+    }
+    return rest;
+}
+
+static void free_keys(struct dirty_key *keys)
+{
+    struct dirty_key *key, *tmp;
+    HASH_ITER(hh, keys, key, tmp)
+    {
+        HASH_DEL(keys, key);
+        free(key->key);
+        free(key);
+    }
+}
+
+/*
+ * Add the record at offset in the old file to batch. If the key may
+ * already be in the new file, look up its seq there, so the commit
+ * removes it from the by-seq tree.
+ */
+static int copy_record(struct compaction *c, struct batch *batch, uint64_t offset, int recopy)
+{
+    struct record_header header;
+    const la_storage_object_header *h;
+    struct pending *doc;
+    struct id_entry old;
+    FileTerm term;
+
+    term.data = NULL;
+    term.length = 0;
+    if (file_read(bptree_file(c->from), (off_t) offset, &term) != FILE_SUCCESS)
+        return -1;
+    if (term.length >= sizeof(struct record_header))
+        memcpy(&header, term.data, sizeof(struct record_header));
+    if (term.length < sizeof(struct record_header)
+        || term.length < sizeof(struct record_header) + header.key_length + sizeof(la_storage_object_header)
+        || (doc = (struct pending *) calloc(1, sizeof(struct pending))) == NULL)
+    {
+        free(term.data);
+        return -1;
+    }
+    if ((doc->key = (char *) malloc(header.key_length + 1)) == NULL)
+    {
+        free(doc);
+        free(term.data);
+        return -1;
+    }
+    memcpy(doc->key, (const char *) term.data + sizeof(struct record_header), header.key_length);
+    doc->key[header.key_length] = '\0';
+    h = (const la_storage_object_header *) ((const char *) term.data + sizeof(struct record_header) + header.key_length);
+    doc->record = term;
+    doc->entry.seq = h->seq;
+    doc->entry.doc_seq = h->doc_seq;
+    doc->entry.deleted = h->deleted;
+    memcpy(&doc->entry.rev, &h->rev, sizeof(la_storage_rev_t));
+    if (recopy && lookup_id(c->to, &batch->state, doc->key, &old) == BTREE_SUCCESS)
+        doc->old_seq = old.seq;
+    if (h->seq > batch->state.lastseq)
+        batch->state.lastseq = h->seq;
+    HASH_ADD_KEYPTR(hh, batch->docs, doc->key, strlen(doc->key), doc);
+    c->bytes += term.length;
+    return 0;
+}
+
+/*
+ * Commit a batch of copied documents to the new file, then pause if
+ * we're going faster than the throttle allows, and report progress.
+ */
+static int copy_commit(struct compaction *c, struct batch *batch)
+{
+    struct timespec ts;
+    uint64_t ticket, elapsed, wanted;
+    size_t count = HASH_COUNT(batch->docs);
+    int ret;
+
+    bptree_write_lock(c->to);
+    ret = batch_commit(c->to, batch, &ticket);
+    bptree_write_unlock(c->to);
+    batch_free(batch);
+    if (ret != 0 || bptree_sync(c->to, ticket) != 0)
+        return -1;
+    c->copied += count;
+
+    if (c->options->max_bytes_per_second > 0 && !c->final)
+    {
+        elapsed = la_trace_now() - c->start;
+        wanted = (uint64_t) ((double) c->bytes / c->options->max_bytes_per_second * 1000000000.0);
+        if (wanted > elapsed)
+        {
+            ts.tv_sec = (time_t) ((wanted - elapsed) / 1000000000ULL);
+            ts.tv_nsec = (long) ((wanted - elapsed) % 1000000000ULL);
+            nanosleep(&ts, NULL);
+        }
+    }
+    if (c->options->progress != NULL && c->options->progress(c->copied, c->total, c->options->baton) != 0)
+        return -1;
+    return 0;
+}
+
+static void copy_begin(struct compaction *c, struct batch *batch)
+{
+    memset(batch, 0, sizeof(struct batch));
+    bptree_write_lock(c->to);
+    bptree_tip(c->to, &batch->state);
+    bptree_write_unlock(c->to);
+}
+
+/*
+ * Copy every document in state, in seq order.
+ */
+static int copy_snapshot(struct compaction *c, const BPTreeState *state)
+{
+    struct batch batch;
+    struct seq_entry entry;
+    BTreeCursor *cursor;
+    const void *value;
+    size_t length;
+    BTreeResult ret = BTREE_SUCCESS;
+
+    if ((cursor = btree_cursor_open(bptree_by_seq(c->from), &state->by_seq, NULL, 0)) == NULL)
+        return -1;
+    while (ret == BTREE_SUCCESS)
+    {
+        copy_begin(c, &batch);
+        while (HASH_COUNT(batch.docs) < c->batch_size
+               && (ret = btree_cursor_next(cursor, NULL, NULL, &value, &length)) == BTREE_SUCCESS)
+        {
+            memcpy(&entry, value, la_min(length, sizeof(struct seq_entry)));
+            if (length != sizeof(struct seq_entry) || copy_record(c, &batch, entry.offset, 0) != 0)
+            {
+                ret = BTREE_CORRUPTION;
+                break;
+            }
+        }
+        if ((ret == BTREE_SUCCESS || ret == BTREE_NOT_FOUND) && copy_commit(c, &batch) != 0)
+            ret = BTREE_IO_ERROR;
+        batch_free(&batch);
+    }
+    btree_cursor_close(cursor);
+    return ret == BTREE_NOT_FOUND ? 0 : -1;
+}
+
+/*
+ * Copy the current version of each of keys, as of state.
+ */
+static int copy_keys(struct compaction *c, const BPTreeState *state, struct dirty_key *keys)
+{
+    struct batch batch;
+    struct dirty_key *key, *tmp;
+    struct id_entry entry;
+    int ret = 0;
+
+    c->total += HASH_COUNT(keys);
+    copy_begin(c, &batch);
+    HASH_ITER(hh, keys, key, tmp)
+    {
+        if (lookup_id(c->from, state, key->key, &entry) != BTREE_SUCCESS
+            || copy_record(c, &batch, entry.offset, 1) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        if (HASH_COUNT(batch.docs) >= c->batch_size)
+        {
+            if ((ret = copy_commit(c, &batch)) != 0)
+                break;
+            copy_begin(c, &batch);
+        }
+    }
+    if (ret == 0)
+        ret = copy_commit(c, &batch);
+    batch_free(&batch);
+    return ret;
+}
+
+static int sync_dir(const char *path)
+{
+    char *copy = strdup(path);
+    int fd, ret = -1;
+
+    if (copy == NULL)
+        return -1;
+    if ((fd = open(dirname(copy), O_RDONLY)) >= 0)
+    {
+        ret = fsync(fd);
+        close(fd);
+    }
+    free(copy);
+    return ret;
+}
+
+/*
+ * Make the new file durable, move it over the old one, and switch the
+ * store to it. Call with the old tree's write lock held, so no writer
+ * can slip in between the last copy and the switch.
+ */
+static int swap_tree(struct compaction *c, const BPTreeState *state, const char *path)
+{
+    la_storage_env_config_t *config = &c->store->env->config;
+    struct tree_ref *to_ref;
+    BPTreeState final;
+    uint64_t ticket;
+
+    if ((to_ref = new_tree_ref(c->to)) == NULL)
+        return -1;
+    bptree_write_lock(c->to);
+    bptree_tip(c->to, &final);
+    final.lastseq = state->lastseq;
+    ticket = bptree_commit(c->to, &final);
+    bptree_write_unlock(c->to);
+    bptree_set_sync(c->to, 1, 0);
+    if (bptree_sync(c->to, ticket) != 0 || rename(path, c->store->path) != 0)
+    {
+        free(to_ref);
+        return -1;
+    }
+    sync_dir(c->store->path);
+    bptree_set_sync(c->to, config->bptree_sync, config->bptree_group_commit_window);
+
+    c->store->compacting = 0;
+    pthread_mutex_lock(&c->store->current_lock);
+    c->store->current = to_ref;
+    pthread_mutex_unlock(&c->store->current_lock);
+    // Drop the store's reference to the old tree; we still hold one.
+    done_tree(c->from_ref);
+    return 0;
+}
+
+static int bptree_la_storage_compact(la_storage_object_store *store, const la_storage_compact_options_t *options)
+{
+    struct compaction c;
+    struct dirty_key *keys;
+    BPTreeState state;
+    char *path;
+    int ret, rounds = 0, done = 0;
+
+    if ((path = string_append(store->path, COMPACT_SUFFIX)) == NULL)
+        return -1;
+    // Left over from a compaction that didn't finish.
+    unlink(path);
+    memset(&c, 0, sizeof(struct compaction));
+    c.store = store;
+    c.options = options;
+    c.batch_size = options->batch_size > 0 ? options->batch_size : COMPACT_BATCH_SIZE;
+    c.start = la_trace_now();
+    if ((c.to = open_tree(store->env, path, 1, NULL)) == NULL)
+    {
+        free(path);
+        return -1;
+    }
+    // Only the last commit needs to be durable.
+    bptree_set_sync(c.to, 0, 0);
+
+    c.from_ref = lock_tree(store);
+    c.from = c.from_ref->tree;
+    if (store->compacting)
+    {
+        bptree_write_unlock(c.from);
+        done_tree(c.from_ref);
+        bptree_close(c.to);
+        free(path);
+        return -1;
+    }
+    store->compacting = 1;
+    store->dirty_lost = 0;
+    bptree_tip(c.from, &state);
+    bptree_write_unlock(c.from);
+
+    c.total = state.by_seq.count;
+    ret = copy_snapshot(&c, &state);
+    while (ret == 0 && !done)
+    {
+        bptree_write_lock(c.from);
+        keys = store->dirty;
+        store->dirty = NULL;
+        bptree_tip(c.from, &state);
+        if (store->dirty_lost)
+        {
+            ret = -1;
+            bptree_write_unlock(c.from);
+        }
+        else if (HASH_COUNT(keys) <= c.batch_size)
+        {
+            // Few enough left, so copy the rest while writers wait.
+            c.final = 1;
+            if ((ret = copy_keys(&c, &state, keys)) == 0)
+                ret = swap_tree(&c, &state, path);
+            bptree_write_unlock(c.from);
+            done = 1;
+        }
+        else if (++rounds >= COMPACT_MAX_ROUNDS)
+        {
+            // Writers are keeping up with us; copy a batch while they
+            // wait, and leave the rest for the next round.
+            c.final = 1;
+            store->dirty = split_keys(&keys, c.batch_size);
+            ret = copy_keys(&c, &state, keys);
+            bptree_write_unlock(c.from);
+        }
+        else
+        {
+            bptree_write_unlock(c.from);
+            ret = copy_keys(&c, &state, keys);
+        }
+        free_keys(keys);
+    }
+
+    if (ret != 0)
+    {
+        bptree_write_lock(c.from);
+        store->compacting = 0;
+        free_keys(store->dirty);
+        store->dirty = NULL;
+        bptree_write_unlock(c.from);
+        bptree_close(c.to);
+        unlink(path);
+    }
+    // Closes the old tree, if nothing else is using it.
+    done_tree(c.from_ref);
+    free(path);
+    return ret;
+}
+
+static la_object_store_driver_t bptree_driver = {
+    .name = "BPTree",
+    .open_env = bptree_la_storage_open_env,
+    .close_env = bptree_la_storage_close_env,
+    .open_store = bptree_la_storage_open,
+    .close_store = bptree_la_storage_close,
+    .delete_store = bptree_la_storage_delete,
+    .get = bptree_la_storage_get,
+    .get_many = NULL,
+    .get_borrowed = bptree_la_storage_get_borrowed,
+    .release = bptree_la_storage_release,
+    .get_rev = bptree_la_storage_get_rev,
+    .get_all_revs = bptree_la_storage_get_all_revs,
+    .set_revs = bptree_la_storage_set_revs,
+    .put = bptree_la_storage_put,
+    .put_bulk = bptree_la_storage_put_bulk,
+    .replace = bptree_la_storage_replace,
+    .lastseq = bptree_la_storage_lastseq,
+    .stat = bptree_la_storage_stat,
+    .compact = bptree_la_storage_compact,
+    .iterator_open = bptree_la_storage_iterator_open,
+    .iterator_open_range = bptree_la_storage_iterator_open_range,
+    .iterator_open_keyrange = bptree_la_storage_iterator_open_keyrange,
+    .iterator_next = bptree_la_storage_iterator_next,
+    .iterator_close = bptree_la_storage_iterator_close
+};
+
+__attribute__((constructor)) void bptree_driver_init()
+{
+    la_storage_install_driver("BPTree", &bptree_driver);
+}
@@ -10,19 +10,71 @@
 #define LoungeAct_bptree_priv_h
 
 #include <stdint.h>
+#include <pthread.h>
 
+#include "labptree.h"
+
+#define BPTREE_MAGIC "LABPTREE"
+#define BPTREE_VERSION 1
+
+/*
+ * A header block, written at a FILE_BLOCK_SIZE boundary after each
+ * commit. On open, the last one with the block marker, the right magic
+ * and the checksum wins; anything after it is an incomplete commit, and
+ * is ignored.
+ */
 typedef union
 {
-    struct header
+    struct
     {
-        
-    },
-    char pad[4096]
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        BPTreeState state;
+        unsigned char md5[MD5_DIGEST_LENGTH]; /** Of everything before it. */
+    } LA_PACKED header;
+    char pad[FILE_BLOCK_SIZE];
 } _BPTreeHeader;
 
-typedef struct BPTree
+struct BPTree
 {
-    int fd; /** File descriptor. */
-} BPTree;
+    FileHandle *file;
+    BTree by_id;
+    BTree by_seq;
+    
+    /**
+     * The current state, guarded by a sequence lock: version is odd
+     * while a commit is copying in a new state, and readers retry if it
+     * changed while they copied.
+     */
+    BPTreeState state;
+    volatile unsigned version;
+    
+    pthread_mutex_t write_lock;
+    
+    /**
+     * The newest state and its ticket, which may not be durable yet.
+     * Guarded by write_lock. tip_mark is the file_sync_mark taken after
+     * its nodes were appended.
+     */
+    BPTreeState tip;
+    uint64_t tip_ticket;
+    uint64_t tip_mark;
+    
+    /**
+     * Group commit: the ticket of the current (durable) state, whether a
+     * thread is committing, and whether a commit has failed. Once one
+     * has, the tip holds states that may never reach the disk, and every
+     * later commit fails too (see bptree_sync).
+     */
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_cond;
+    uint64_t committed;
+    int committing;
+    int poisoned;
+    
+    int sync;
+    unsigned int window;
+};
 
 #endif
@@ -0,0 +1,253 @@
+//
+//  bptree.c
+//  LoungeAct
+//
+//  Created by agent on 10/18/26.
+//
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bptree-priv.h"
+
+static void header_checksum(const _BPTreeHeader *block, unsigned char md5[MD5_DIGEST_LENGTH])
+{
+    MD5((const unsigned char *) block, offsetof(_BPTreeHeader, header.md5), md5);
+}
+
+static int write_header(BPTree *tree, const BPTreeState *state)
+{
+    _BPTreeHeader block;
+    
+    memset(&block, 0, sizeof(_BPTreeHeader));
+    memcpy(block.header.magic, BPTREE_MAGIC, sizeof(block.header.magic));
+    block.header.version = BPTREE_VERSION;
+    memcpy(&block.header.state, state, sizeof(BPTreeState));
+    header_checksum(&block, block.header.md5);
+    if (file_write_block(tree->file, &block, sizeof(_BPTreeHeader), NULL) != FILE_SUCCESS)
+        return -1;
+    return 0;
+}
+
+/*
+ * Find the last valid header, stepping back a block at a time from the
+ * end of the file.
+ */
+static int find_header(BPTree *tree, off_t size)
+{
+    _BPTreeHeader block;
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    off_t offset;
+    
+    if (size < (off_t) (FILE_BLOCK_MARKER_LENGTH + sizeof(_BPTreeHeader)))
+        return -1;
+    offset = ((size - FILE_BLOCK_MARKER_LENGTH - sizeof(_BPTreeHeader)) / FILE_BLOCK_SIZE) * FILE_BLOCK_SIZE;
+    for (;;)
+    {
+        if (file_read_block(tree->file, offset, &block, sizeof(_BPTreeHeader)) == FILE_SUCCESS
+            && memcmp(block.header.magic, BPTREE_MAGIC, sizeof(block.header.magic)) == 0
+            && block.header.version == BPTREE_VERSION)
+        {
+            header_checksum(&block, md5);
+            if (memcmp(md5, block.header.md5, MD5_DIGEST_LENGTH) == 0)
+            {
+                memcpy(&tree->state, &block.header.state, sizeof(BPTreeState));
+                return 0;
+            }
+        }
+        if (offset == 0)
+            return -1;
+        offset -= FILE_BLOCK_SIZE;
+    }
+}
+
+BPTree *bptree_open(const char *path, int create, int *created)
+{
+    BPTree *tree = (BPTree *) calloc(1, sizeof(struct BPTree));
+    off_t size;
+    
+    if (tree == NULL)
+        return NULL;
+    if ((tree->file = file_open(path, create)) == NULL)
+    {
+        free(tree);
+        return NULL;
+    }
+    tree->by_id.file = tree->file;
+    tree->by_id.compare = btree_compare_bytes;
+    tree->by_seq.file = tree->file;
+    tree->by_seq.compare = btree_compare_u64;
+    pthread_mutex_init(&tree->write_lock, NULL);
+    pthread_mutex_init(&tree->commit_lock, NULL);
+    pthread_cond_init(&tree->commit_cond, NULL);
+    tree->sync = 1;
+    if (created != NULL)
+        *created = 0;
+    
+    size = file_size(tree->file);
+    if (size == 0 && create)
+    {
+        // A new file starts with an empty header, so no tree node ever
+        // sits at offset 0, which stands for an empty tree.
+        if (write_header(tree, &tree->state) != 0 || file_sync(tree->file, 0) != 0)
+        {
+            bptree_close(tree);
+            return NULL;
+        }
+        if (created != NULL)
+            *created = 1;
+        return tree;
+    }
+    if (size < 0 || find_header(tree, size) != 0)
+    {
+        bptree_close(tree);
+        return NULL;
+    }
+    memcpy(&tree->tip, &tree->state, sizeof(BPTreeState));
+    return tree;
+}
+
+void bptree_close(BPTree *tree)
+{
+    file_close(tree->file);
+    pthread_mutex_destroy(&tree->write_lock);
+    pthread_mutex_destroy(&tree->commit_lock);
+    pthread_cond_destroy(&tree->commit_cond);
+    free(tree);
+}
+
+void bptree_set_sync(BPTree *tree, int sync, unsigned int window)
+{
+    tree->sync = sync;
+    tree->window = window;
+}
+
+void bptree_snapshot(BPTree *tree, BPTreeState *state)
+{
+    unsigned version;
+    
+    do
+    {
+        version = tree->version;
+        __sync_synchronize();
+        memcpy(state, &tree->state, sizeof(BPTreeState));
+        __sync_synchronize();
+    } while ((version & 1) != 0 || version != tree->version);
+}
+
+void bptree_write_lock(BPTree *tree)
+{
+    pthread_mutex_lock(&tree->write_lock);
+}
+
+void bptree_write_unlock(BPTree *tree)
+{
+    pthread_mutex_unlock(&tree->write_lock);
+}
+
+void bptree_tip(BPTree *tree, BPTreeState *state)
+{
+    memcpy(state, &tree->tip, sizeof(BPTreeState));
+}
+
+uint64_t bptree_commit(BPTree *tree, const BPTreeState *state)
+{
+    memcpy(&tree->tip, state, sizeof(BPTreeState));
+    tree->tip_mark = file_sync_mark(tree->file);
+    return ++tree->tip_ticket;
+}
+
+static void publish(BPTree *tree, const BPTreeState *state)
+{
+    tree->version++;
+    __sync_synchronize();
+    memcpy(&tree->state, state, sizeof(BPTreeState));
+    __sync_synchronize();
+    tree->version++;
+}
+
+/*
+ * Commit the newest state, and set ticket to the ticket it had. The
+ * records and nodes must be on disk before a header points at them, so
+ * this syncs twice: once for them, and once for the header.
+ *
+ * The window is spent in the first sync, before we look at the newest
+ * state, so that commits made meanwhile are in it. Their appends may
+ * have finished after that sync started, though, in which case it takes
+ * another one.
+ */
+static int group_commit(BPTree *tree, uint64_t *ticket)
+{
+    BPTreeState state;
+    uint64_t mark;
+    
+    if (tree->sync && file_sync(tree->file, tree->window) != 0)
+        return -1;
+    pthread_mutex_lock(&tree->write_lock);
+    memcpy(&state, &tree->tip, sizeof(BPTreeState));
+    *ticket = tree->tip_ticket;
+    mark = tree->tip_mark;
+    pthread_mutex_unlock(&tree->write_lock);
+    
+    if (tree->sync && !file_synced(tree->file, mark) && file_sync(tree->file, 0) != 0)
+        return -1;
+    if (write_header(tree, &state) != 0)
+        return -1;
+    if (tree->sync && file_sync(tree->file, 0) != 0)
+        return -1;
+    publish(tree, &state);
+    return 0;
+}
+
+int bptree_sync(BPTree *tree, uint64_t ticket)
+{
+    uint64_t done;
+    int ret = 0;
+    
+    pthread_mutex_lock(&tree->commit_lock);
+    while (tree->committed < ticket)
+    {
+        if (tree->poisoned)
+        {
+            ret = -1;
+            break;
+        }
+        if (tree->committing)
+        {
+            pthread_cond_wait(&tree->commit_cond, &tree->commit_lock);
+            continue;
+        }
+        tree->committing = 1;
+        pthread_mutex_unlock(&tree->commit_lock);
+        done = ticket;
+        ret = group_commit(tree, &done);
+        pthread_mutex_lock(&tree->commit_lock);
+        tree->committing = 0;
+        if (ret == 0)
+            tree->committed = done;
+        else
+            tree->poisoned = 1;
+        pthread_cond_broadcast(&tree->commit_cond);
+        if (ret != 0)
+            break;
+    }
+    pthread_mutex_unlock(&tree->commit_lock);
+    return ret;
+}
+
+FileHandle *bptree_file(BPTree *tree)
+{
+    return tree->file;
+}
+
+const BTree *bptree_by_id(BPTree *tree)
+{
+    return &tree->by_id;
+}
+
+const BTree *bptree_by_seq(BPTree *tree)
+{
+    return &tree->by_seq;
+}
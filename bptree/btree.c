@@ -6,7 +6,764 @@
 //  Copyright (c) 2012 Memeo, Inc. All rights reserved.
 //
 
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "btree.h"
 
+#define min(a,b) ((a) < (b) ? (a) : (b))
+
+/*
+ * A node is a node_header followed by count entries, each an
+ * entry_header and then the key and value bytes. Leaf values are
+ * whatever the caller stored; interior values are the BTreeRoot of the
+ * child, keyed by the last (greatest) key in the child.
+ */
+enum
+{
+    NODE_LEAF = 0,
+    NODE_INTERIOR = 1
+};
+
+struct node_header
+{
+    uint8_t kind;
+    uint8_t reserved;
+    uint16_t count;
+} LA_PACKED;
+
+struct entry_header
+{
+    uint16_t key_length;
+    uint32_t value_length;
+} LA_PACKED;
+
+struct entry
+{
+    const void *key;
+    size_t key_length;
+    const void *value;
+    size_t value_length;
+};
+
+struct node
+{
+    int kind;
+    size_t count;
+    struct entry *entries;
+    void *data;
+    int mapped;     /* data points into the file's mapping. */
+};
+
+struct entry_list
+{
+    struct entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+/*
+ * State for one btree_modify. New entries point at keys in the nodes
+ * we read and at child pointers we allocate, so all of those are kept
+ * until the whole modification is written.
+ */
+struct modify
+{
+    const BTree *tree;
+    void **keep;
+    size_t keep_count;
+    size_t keep_capacity;
+};
+
+/*
+ * Going forward, index is the next entry to visit; in reverse, it is one
+ * past it, so entries [0, index) are left.
+ */
+struct cursor_level
+{
+    struct node node;
+    size_t index;
+};
+
+struct BTreeCursor
+{
+    const BTree *tree;
+    struct cursor_level levels[LA_BTREE_MAX_DEPTH];
+    int depth;
+    int reverse;
+};
+
+int btree_compare_bytes(const void *key1, size_t length1, const void *key2, size_t length2)
+{
+    int ret = memcmp(key1, key2, min(length1, length2));
+    if (ret != 0)
+        return ret;
+    if (length1 < length2)
+        return -1;
+    if (length1 > length2)
+        return 1;
+    return 0;
+}
+
+int btree_compare_u64(const void *key1, size_t length1, const void *key2, size_t length2)
+{
+    uint64_t v1, v2;
+    if (length1 != sizeof(uint64_t) || length2 != sizeof(uint64_t))
+        return btree_compare_bytes(key1, length1, key2, length2);
+    memcpy(&v1, key1, sizeof(uint64_t));
+    memcpy(&v2, key2, sizeof(uint64_t));
+    if (v1 < v2)
+        return -1;
+    if (v1 > v2)
+        return 1;
+    return 0;
+}
+
+static BTreeResult file_result(FileError error)
+{
+    switch (error)
+    {
+        case FILE_SUCCESS:
+            return BTREE_SUCCESS;
+        case FILE_CORRUPTION:
+            return BTREE_CORRUPTION;
+        case FILE_MEMORY_ERROR:
+            return BTREE_MEMORY_ERROR;
+        default:
+            return BTREE_IO_ERROR;
+    }
+}
+
+static void node_free(struct node *node)
+{
+    free(node->entries);
+    if (!node->mapped)
+        free(node->data);
+    node->entries = NULL;
+    node->data = NULL;
+}
+
+static BTreeResult read_node(const BTree *tree, uint64_t offset, struct node *node)
+{
+    FileTerm term;
+    FileError error;
+    struct node_header header;
+    struct entry_header eheader;
+    const unsigned char *p, *end;
+    size_t i;
+    
+    if ((error = file_read_mapped(tree->file, (off_t) offset, &term, &node->mapped)) != FILE_SUCCESS)
+        return file_result(error);
+    node->data = term.data;
+    node->entries = NULL;
+    if (term.length < sizeof(struct node_header))
+    {
+        node_free(node);
+        return BTREE_CORRUPTION;
+    }
+    memcpy(&header, term.data, sizeof(struct node_header));
+    node->kind = header.kind;
+    node->count = header.count;
+    node->entries = (struct entry *) malloc(sizeof(struct entry) * (header.count > 0 ? header.count : 1));
+    if (node->entries == NULL)
+    {
+        node_free(node);
+        return BTREE_MEMORY_ERROR;
+    }
+    p = (const unsigned char *) term.data + sizeof(struct node_header);
+    end = (const unsigned char *) term.data + term.length;
+    for (i = 0; i < node->count; i++)
+    {
+        if (end - p < (ptrdiff_t) sizeof(struct entry_header))
+            break;
+        memcpy(&eheader, p, sizeof(struct entry_header));
+        p += sizeof(struct entry_header);
+        if ((size_t) (end - p) < (size_t) eheader.key_length + eheader.value_length)
+            break;
+        if (node->kind == NODE_INTERIOR && eheader.value_length != sizeof(BTreeRoot))
+            break;
+        node->entries[i].key = p;
+        node->entries[i].key_length = eheader.key_length;
+        p += eheader.key_length;
+        node->entries[i].value = p;
+        node->entries[i].value_length = eheader.value_length;
+        p += eheader.value_length;
+    }
+    if (i < node->count || (node->kind != NODE_LEAF && node->kind != NODE_INTERIOR))
+    {
+        node_free(node);
+        return BTREE_CORRUPTION;
+    }
+    return BTREE_SUCCESS;
+}
+
+/*
+ * The index of the first entry whose key is not less than key, or the
+ * node's count if there is none.
+ */
+static size_t lower_bound(const BTree *tree, const struct node *node, const void *key, size_t key_length)
+{
+    size_t lo = 0, hi = node->count, mid;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (tree->compare(node->entries[mid].key, node->entries[mid].key_length, key, key_length) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void child_root(const struct entry *entry, BTreeRoot *root)
+{
+    memcpy(root, entry->value, sizeof(BTreeRoot));
+}
+
+BTreeResult btree_lookup(const BTree *tree, const BTreeRoot *root, const void *key, size_t key_length,
+                         void **value, size_t *value_length)
+{
+    struct node node;
+    BTreeRoot child;
+    uint64_t offset = root->offset;
+    BTreeResult ret;
+    size_t i;
+    int depth;
+    
+    for (depth = 0; offset != 0 && depth < LA_BTREE_MAX_DEPTH; depth++)
+    {
+        if ((ret = read_node(tree, offset, &node)) != BTREE_SUCCESS)
+            return ret;
+        i = lower_bound(tree, &node, key, key_length);
+        if (i == node.count)
+            break;
+        if (node.kind == NODE_INTERIOR)
+        {
+            child_root(&node.entries[i], &child);
+            node_free(&node);
+            offset = child.offset;
+            continue;
+        }
+        if (tree->compare(node.entries[i].key, node.entries[i].key_length, key, key_length) != 0)
+            break;
+        if (value != NULL)
+        {
+            *value = malloc(node.entries[i].value_length > 0 ? node.entries[i].value_length : 1);
+            if (*value == NULL)
+            {
+                node_free(&node);
+                return BTREE_MEMORY_ERROR;
+            }
+            memcpy(*value, node.entries[i].value, node.entries[i].value_length);
+        }
+        if (value_length != NULL)
+            *value_length = node.entries[i].value_length;
+        node_free(&node);
+        return BTREE_SUCCESS;
+    }
+    if (offset != 0 && depth < LA_BTREE_MAX_DEPTH)
+        node_free(&node);
+    if (depth == LA_BTREE_MAX_DEPTH)
+        return BTREE_CORRUPTION;
+    return BTREE_NOT_FOUND;
+}
+
+static int keep(struct modify *m, void *p)
+{
+    if (m->keep_count == m->keep_capacity)
+    {
+        size_t capacity = m->keep_capacity > 0 ? m->keep_capacity * 2 : 16;
+        void **k = (void **) realloc(m->keep, capacity * sizeof(void *));
+        if (k == NULL)
+        {
+            free(p);
+            return -1;
+        }
+        m->keep = k;
+        m->keep_capacity = capacity;
+    }
+    m->keep[m->keep_count++] = p;
+    return 0;
+}
+
+static int list_push(struct entry_list *list, const struct entry *entry)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : 32;
+        struct entry *e = (struct entry *) realloc(list->entries, capacity * sizeof(struct entry));
+        if (e == NULL)
+            return -1;
+        list->entries = e;
+        list->capacity = capacity;
+    }
+    list->entries[list->count++] = *entry;
+    return 0;
+}
+
+/*
+ * A node encoded for writing: its bytes, and the pointer to it that
+ * goes up to its parent once we know where it landed.
+ */
+struct new_node
+{
+    unsigned char *buf;
+    size_t size;
+    size_t first;
+    size_t count;
+    uint64_t total;
+};
+
+/*
+ * Encode count entries as one node.
+ */
+static BTreeResult encode_node(int kind, const struct entry *entries, size_t count, struct new_node *node)
+{
+    struct node_header header;
+    struct entry_header eheader;
+    unsigned char *p;
+    BTreeRoot child;
+    size_t i;
+    
+    node->size = sizeof(struct node_header);
+    node->total = 0;
+    for (i = 0; i < count; i++)
+        node->size += sizeof(struct entry_header) + entries[i].key_length + entries[i].value_length;
+    if ((node->buf = (unsigned char *) malloc(node->size)) == NULL)
+        return BTREE_MEMORY_ERROR;
+    header.kind = (uint8_t) kind;
+    header.reserved = 0;
+    header.count = (uint16_t) count;
+    memcpy(node->buf, &header, sizeof(struct node_header));
+    p = node->buf + sizeof(struct node_header);
+    for (i = 0; i < count; i++)
+    {
+        eheader.key_length = (uint16_t) entries[i].key_length;
+        eheader.value_length = (uint32_t) entries[i].value_length;
+        memcpy(p, &eheader, sizeof(struct entry_header));
+        p += sizeof(struct entry_header);
+        memcpy(p, entries[i].key, entries[i].key_length);
+        p += entries[i].key_length;
+        memcpy(p, entries[i].value, entries[i].value_length);
+        p += entries[i].value_length;
+        if (kind == NODE_INTERIOR)
+        {
+            child_root(&entries[i], &child);
+            node->total += child.count;
+        }
+    }
+    if (kind == NODE_LEAF)
+        node->total = count;
+    return BTREE_SUCCESS;
+}
+
+/*
+ * Write the entries in in as a run of nodes of about LA_BTREE_CHUNK_SIZE
+ * bytes each, adding a pointer to each node to out. Every node but the
+ * last gets at least two entries, so each level up has fewer nodes.
+ *
+ * The whole run goes out in one file_append_many.
+ */
+static BTreeResult write_chunked(struct modify *m, int kind, const struct entry_list *in, struct entry_list *out)
+{
+    struct new_node *nodes;
+    FileTerm *terms = NULL;
+    off_t *offsets = NULL;
+    struct entry pointer;
+    BTreeRoot *root;
+    BTreeResult ret = BTREE_SUCCESS;
+    FileError error;
+    size_t start = 0, size = 0, count = 0, i;
+    
+    if (in->count == 0)
+        return BTREE_SUCCESS;
+    // At most one node per two entries, plus the last.
+    if ((nodes = (struct new_node *) calloc(in->count / 2 + 1, sizeof(struct new_node))) == NULL)
+        return BTREE_MEMORY_ERROR;
+    for (i = 0; i < in->count; i++)
+    {
+        size += sizeof(struct entry_header) + in->entries[i].key_length + in->entries[i].value_length;
+        if ((size >= LA_BTREE_CHUNK_SIZE && i + 1 - start >= 2) || i + 1 == in->count)
+        {
+            nodes[count].first = start;
+            nodes[count++].count = i + 1 - start;
+            start = i + 1;
+            size = 0;
+        }
+    }
+    
+    terms = (FileTerm *) malloc(count * sizeof(FileTerm));
+    offsets = (off_t *) malloc(count * sizeof(off_t));
+    if (terms == NULL || offsets == NULL)
+        ret = BTREE_MEMORY_ERROR;
+    for (i = 0; i < count && ret == BTREE_SUCCESS; i++)
+    {
+        ret = encode_node(kind, in->entries + nodes[i].first, nodes[i].count, &nodes[i]);
+        if (ret != BTREE_SUCCESS)
+            break;
+        terms[i].data = nodes[i].buf;
+        terms[i].length = nodes[i].size;
+    }
+    if (ret == BTREE_SUCCESS && (error = file_append_many(m->tree->file, terms, count, offsets)) != FILE_SUCCESS)
+        ret = file_result(error);
+    
+    for (i = 0; i < count && ret == BTREE_SUCCESS; i++)
+    {
+        if ((root = (BTreeRoot *) malloc(sizeof(BTreeRoot))) == NULL || keep(m, root) != 0)
+        {
+            ret = BTREE_MEMORY_ERROR;
+            break;
+        }
+        root->offset = (uint64_t) offsets[i];
+        root->count = nodes[i].total;
+        pointer.key = in->entries[nodes[i].first + nodes[i].count - 1].key;
+        pointer.key_length = in->entries[nodes[i].first + nodes[i].count - 1].key_length;
+        pointer.value = root;
+        pointer.value_length = sizeof(BTreeRoot);
+        if (list_push(out, &pointer) != 0)
+            ret = BTREE_MEMORY_ERROR;
+    }
+    
+    for (i = 0; i < count; i++)
+        free(nodes[i].buf);
+    free(nodes);
+    free(terms);
+    free(offsets);
+    return ret;
+}
+
+static BTreeResult merge_leaf(struct modify *m, const struct node *node, const BTreeAction *actions, size_t count, struct entry_list *list)
+{
+    struct entry e;
+    size_t i = 0, j = 0;
+    int cmp;
+    
+    while (i < node->count || j < count)
+    {
+        if (i == node->count)
+            cmp = 1;
+        else if (j == count)
+            cmp = -1;
+        else
+            cmp = m->tree->compare(node->entries[i].key, node->entries[i].key_length, actions[j].key, actions[j].key_length);
+        if (cmp < 0)
+        {
+            if (list_push(list, &node->entries[i]) != 0)
+                return BTREE_MEMORY_ERROR;
+            i++;
+            continue;
+        }
+        if (actions[j].type == BTREE_INSERT)
+        {
+            e.key = actions[j].key;
+            e.key_length = actions[j].key_length;
+            e.value = actions[j].value;
+            e.value_length = actions[j].value_length;
+            if (list_push(list, &e) != 0)
+                return BTREE_MEMORY_ERROR;
+        }
+        if (cmp == 0)
+            i++;
+        j++;
+    }
+    return BTREE_SUCCESS;
+}
+
+/*
+ * Apply actions to the subtree at offset (0 for an empty leaf), and add
+ * pointers to the nodes that replace it to out. Nothing is added if the
+ * subtree ends up empty.
+ */
+static BTreeResult modify_node(struct modify *m, uint64_t offset, const BTreeAction *actions, size_t count,
+                               struct entry_list *out, int depth)
+{
+    struct node node;
+    struct entry_list list;
+    BTreeRoot child;
+    BTreeResult ret = BTREE_SUCCESS;
+    size_t i, j, end;
+    
+    if (depth >= LA_BTREE_MAX_DEPTH)
+        return BTREE_CORRUPTION;
+    memset(&list, 0, sizeof(struct entry_list));
+    memset(&node, 0, sizeof(struct node));
+    node.kind = NODE_LEAF;
+    if (offset != 0)
+    {
+        if ((ret = read_node(m->tree, offset, &node)) != BTREE_SUCCESS)
+            return ret;
+        if (!node.mapped && keep(m, node.data) != 0)
+        {
+            free(node.entries);
+            return BTREE_MEMORY_ERROR;
+        }
+    }
+    
+    if (node.kind == NODE_LEAF)
+    {
+        ret = merge_leaf(m, &node, actions, count, &list);
+    }
+    else
+    {
+        j = 0;
+        for (i = 0; i < node.count && ret == BTREE_SUCCESS; i++)
+        {
+            end = j;
+            if (i == node.count - 1)
+                end = count;
+            else
+            {
+                while (end < count && m->tree->compare(actions[end].key, actions[end].key_length,
+                                                       node.entries[i].key, node.entries[i].key_length) <= 0)
+                    end++;
+            }
+            if (end == j)
+            {
+                if (list_push(&list, &node.entries[i]) != 0)
+                    ret = BTREE_MEMORY_ERROR;
+                continue;
+            }
+            child_root(&node.entries[i], &child);
+            ret = modify_node(m, child.offset, actions + j, end - j, &list, depth + 1);
+            j = end;
+        }
+    }
+    
+    if (ret == BTREE_SUCCESS)
+        ret = write_chunked(m, node.kind, &list, out);
+    free(list.entries);
+    free(node.entries);
+    return ret;
+}
+
+BTreeResult btree_modify(const BTree *tree, const BTreeRoot *root, const BTreeAction *actions, size_t count, BTreeRoot *new_root)
+{
+    struct modify m;
+    struct entry_list level, next, swap;
+    struct node node;
+    BTreeResult ret;
+    size_t i;
+    
+    if (count == 0)
+    {
+        memcpy(new_root, root, sizeof(BTreeRoot));
+        return BTREE_SUCCESS;
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (actions[i].key_length > LA_BTREE_MAX_KEY_LENGTH)
+            return BTREE_INVALID_KEY;
+    }
+    memset(&m, 0, sizeof(struct modify));
+    memset(&level, 0, sizeof(struct entry_list));
+    memset(&next, 0, sizeof(struct entry_list));
+    m.tree = tree;
+    
+    ret = modify_node(&m, root->offset, actions, count, &level, 0);
+    while (ret == BTREE_SUCCESS && level.count > 1)
+    {
+        next.count = 0;
+        ret = write_chunked(&m, NODE_INTERIOR, &level, &next);
+        swap = level;
+        level = next;
+        next = swap;
+    }
+    if (ret == BTREE_SUCCESS)
+    {
+        if (level.count == 0)
+            memset(new_root, 0, sizeof(BTreeRoot));
+        else
+            child_root(&level.entries[0], new_root);
+        
+        // Removals can leave a chain of single-child roots; skip them.
+        while (new_root->offset != 0)
+        {
+            if ((ret = read_node(tree, new_root->offset, &node)) != BTREE_SUCCESS)
+                break;
+            if (node.kind != NODE_INTERIOR || node.count != 1)
+            {
+                node_free(&node);
+                break;
+            }
+            child_root(&node.entries[0], new_root);
+            node_free(&node);
+        }
+    }
+    
+    free(level.entries);
+    free(next.entries);
+    for (i = 0; i < m.keep_count; i++)
+        free(m.keep[i]);
+    free(m.keep);
+    return ret;
+}
+
+static BTreeResult cursor_push(BTreeCursor *cursor, uint64_t offset, const void *start, size_t start_length)
+{
+    struct cursor_level *level;
+    struct node *node;
+    size_t i;
+    BTreeResult ret;
+    
+    if (cursor->depth == LA_BTREE_MAX_DEPTH)
+        return BTREE_CORRUPTION;
+    level = &cursor->levels[cursor->depth];
+    node = &level->node;
+    if ((ret = read_node(cursor->tree, offset, node)) != BTREE_SUCCESS)
+        return ret;
+    if (!cursor->reverse)
+        level->index = (start != NULL) ? lower_bound(cursor->tree, node, start, start_length) : 0;
+    else if (start == NULL)
+        level->index = node->count;
+    else
+    {
+        i = lower_bound(cursor->tree, node, start, start_length);
+        if (node->kind == NODE_INTERIOR)
+        {
+            // The child holding start, if any key in it is that small;
+            // if not, the reverse walk moves on to the child before it.
+            level->index = min(i + 1, node->count);
+        }
+        else if (i < node->count && cursor->tree->compare(node->entries[i].key, node->entries[i].key_length,
+                                                          start, start_length) == 0)
+            level->index = i + 1;
+        else
+            level->index = i;
+    }
+    cursor->depth++;
+    return BTREE_SUCCESS;
+}
+
+static BTreeCursor *cursor_open(const BTree *tree, const BTreeRoot *root, const void *start, size_t start_length, int reverse)
+{
+    BTreeCursor *cursor = (BTreeCursor *) malloc(sizeof(struct BTreeCursor));
+    struct cursor_level *top;
+    BTreeRoot child;
+    uint64_t offset = root->offset;
+    
+    if (cursor == NULL)
+        return NULL;
+    cursor->tree = tree;
+    cursor->depth = 0;
+    cursor->reverse = reverse;
+    while (offset != 0)
+    {
+        if (cursor_push(cursor, offset, start, start_length) != BTREE_SUCCESS)
+        {
+            btree_cursor_close(cursor);
+            return NULL;
+        }
+        top = &cursor->levels[cursor->depth - 1];
+        if (top->node.kind != NODE_INTERIOR || top->index == (reverse ? 0 : top->node.count))
+            break;
+        child_root(&top->node.entries[reverse ? top->index - 1 : top->index], &child);
+        offset = child.offset;
+    }
+    return cursor;
+}
+
+BTreeCursor *btree_cursor_open(const BTree *tree, const BTreeRoot *root, const void *start, size_t start_length)
+{
+    return cursor_open(tree, root, start, start_length, 0);
+}
+
+BTreeCursor *btree_cursor_open_reverse(const BTree *tree, const BTreeRoot *root, const void *start, size_t start_length)
+{
+    return cursor_open(tree, root, start, start_length, 1);
+}
+
+/*
+ * Step a reverse cursor; the mirror image of btree_cursor_next.
+ */
+static BTreeResult cursor_prev(BTreeCursor *cursor, struct entry **entry)
+{
+    struct cursor_level *top;
+    BTreeRoot child;
+    BTreeResult ret;
+    
+    while (cursor->depth > 0)
+    {
+        top = &cursor->levels[cursor->depth - 1];
+        if (top->index == 0)
+        {
+            node_free(&top->node);
+            cursor->depth--;
+            if (cursor->depth > 0)
+                cursor->levels[cursor->depth - 1].index--;
+            continue;
+        }
+        if (top->node.kind == NODE_INTERIOR)
+        {
+            child_root(&top->node.entries[top->index - 1], &child);
+            if ((ret = cursor_push(cursor, child.offset, NULL, 0)) != BTREE_SUCCESS)
+                return ret;
+            continue;
+        }
+        *entry = &top->node.entries[--top->index];
+        return BTREE_SUCCESS;
+    }
+    return BTREE_NOT_FOUND;
+}
+
+BTreeResult btree_cursor_next(BTreeCursor *cursor, const void **key, size_t *key_length,
+                              const void **value, size_t *value_length)
+{
+    struct cursor_level *top;
+    struct entry *e;
+    BTreeRoot child;
+    BTreeResult ret;
+    
+    if (cursor->reverse)
+    {
+        if ((ret = cursor_prev(cursor, &e)) != BTREE_SUCCESS)
+            return ret;
+        if (key != NULL)
+            *key = e->key;
+        if (key_length != NULL)
+            *key_length = e->key_length;
+        if (value != NULL)
+            *value = e->value;
+        if (value_length != NULL)
+            *value_length = e->value_length;
+        return BTREE_SUCCESS;
+    }
+    while (cursor->depth > 0)
+    {
+        top = &cursor->levels[cursor->depth - 1];
+        if (top->index >= top->node.count)
+        {
+            node_free(&top->node);
+            cursor->depth--;
+            if (cursor->depth > 0)
+                cursor->levels[cursor->depth - 1].index++;
+            continue;
+        }
+        if (top->node.kind == NODE_INTERIOR)
+        {
+            child_root(&top->node.entries[top->index], &child);
+            if ((ret = cursor_push(cursor, child.offset, NULL, 0)) != BTREE_SUCCESS)
+                return ret;
+            continue;
+        }
+        e = &top->node.entries[top->index++];
+        if (key != NULL)
+            *key = e->key;
+        if (key_length != NULL)
+            *key_length = e->key_length;
+        if (value != NULL)
+            *value = e->value;
+        if (value_length != NULL)
+            *value_length = e->value_length;
+        return BTREE_SUCCESS;
+    }
+    return BTREE_NOT_FOUND;
+}
+
+void btree_cursor_close(BTreeCursor *cursor)
+{
+    while (cursor->depth > 0)
+        node_free(&cursor->levels[--cursor->depth].node);
+    free(cursor);
+}
@@ -9,6 +9,138 @@
 #ifndef LoungeAct_btree_h
 #define LoungeAct_btree_h
 
+#include <stdint.h>
+#include <sys/types.h>
 
+#include "file.h"
+#include "config.h"
+
+/**
+ * Nodes are written out once they hold at least this many bytes of
+ * entries.
+ */
+#ifndef LA_BTREE_CHUNK_SIZE
+#define LA_BTREE_CHUNK_SIZE 4096
+#endif
+
+/**
+ * The deepest tree a cursor can walk.
+ */
+#define LA_BTREE_MAX_DEPTH 32
+
+/**
+ * The longest key a node can hold; entry headers store the length in
+ * 16 bits.
+ */
+#define LA_BTREE_MAX_KEY_LENGTH UINT16_MAX
+
+/**
+ * Compare two keys; returns less than, equal to or greater than zero,
+ * like memcmp.
+ */
+typedef int (*BTreeCompare)(const void *key1, size_t length1, const void *key2, size_t length2);
+
+/**
+ * A pointer to a tree (or subtree) in the file.
+ */
+typedef struct
+{
+    uint64_t offset;  /** Offset of the root node, or 0 if the tree is empty. */
+    uint64_t count;   /** The number of entries in the tree. */
+} LA_PACKED BTreeRoot;
+
+/**
+ * A copy-on-write B+tree stored in an append-only file.
+ *
+ * Nodes are never changed once written. A modification writes new
+ * copies of the nodes it touches, up to a new root, so any root that
+ * was ever written remains a consistent snapshot of the tree.
+ */
+typedef struct
+{
+    FileHandle *file;
+    BTreeCompare compare;
+} BTree;
+
+typedef enum
+{
+    BTREE_INSERT = 0,
+    BTREE_REMOVE
+} BTreeActionType;
+
+typedef struct
+{
+    BTreeActionType type;
+    const void *key;
+    size_t key_length;
+    const void *value;
+    size_t value_length;
+} BTreeAction;
+
+typedef enum
+{
+    BTREE_SUCCESS = 0,
+    BTREE_NOT_FOUND,
+    BTREE_IO_ERROR,
+    BTREE_CORRUPTION,
+    BTREE_MEMORY_ERROR,
+    BTREE_INVALID_KEY
+} BTreeResult;
+
+typedef struct BTreeCursor BTreeCursor;
+
+/**
+ * Compare keys as byte strings, shorter keys first on a tie.
+ */
+int btree_compare_bytes(const void *key1, size_t length1, const void *key2, size_t length2);
+
+/**
+ * Compare keys that are uint64_t values in host byte order.
+ */
+int btree_compare_u64(const void *key1, size_t length1, const void *key2, size_t length2);
+
+/**
+ * Apply actions to the tree at root, writing the changed nodes, and
+ * set new_root to the resulting tree. The old tree is left intact.
+ *
+ * @param actions The actions, sorted by key with no key repeated.
+ *  Inserting an existing key replaces its value; removing a missing
+ *  key does nothing. Keys longer than LA_BTREE_MAX_KEY_LENGTH fail
+ *  with BTREE_INVALID_KEY, and nothing is written.
+ */
+BTreeResult btree_modify(const BTree *tree, const BTreeRoot *root, const BTreeAction *actions, size_t count, BTreeRoot *new_root);
+
+/**
+ * Look up key in the tree at root.
+ *
+ * @param value Set to a copy of the value, which must be freed with free.
+ *  May be NULL to only test if the key exists.
+ */
+BTreeResult btree_lookup(const BTree *tree, const BTreeRoot *root, const void *key, size_t key_length,
+                         void **value, size_t *value_length);
+
+/**
+ * Open a cursor over the tree at root, positioned before the first key
+ * not less than start (or the first key, if start is NULL).
+ */
+BTreeCursor *btree_cursor_open(const BTree *tree, const BTreeRoot *root, const void *start, size_t start_length);
+
+/**
+ * Open a cursor that walks the tree backwards, positioned after the last
+ * key not greater than start (or the last key, if start is NULL).
+ */
+BTreeCursor *btree_cursor_open_reverse(const BTree *tree, const BTreeRoot *root, const void *start, size_t start_length);
+
+/**
+ * Move to the next entry, in key order (or reverse key order, for
+ * cursors from btree_cursor_open_reverse). The key and value are valid
+ * until the next call on this cursor.
+ *
+ * @return BTREE_SUCCESS, BTREE_NOT_FOUND at the end of the tree, or an
+ *  error.
+ */
+BTreeResult btree_cursor_next(BTreeCursor *cursor, const void **key, size_t *key_length,
+                              const void **value, size_t *value_length);
+void btree_cursor_close(BTreeCursor *cursor);
 
 #endif
@@ -8,95 +8,464 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <strings.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <stdint.h>
 
 #include "file.h"
 #include "config.h"
+#include "../utils/crc32c.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#if defined (__APPLE__)
+# define fdatasync fsync
+#endif
+
+/*
+ * has_crc32c takes the top bit of what was a 31-bit length, so records
+ * written before it existed read the same.
+ */
 struct RecordHeader
 {
     int has_md5 : 1;
-    uint32_t length : 31;
+    uint32_t length : 30;
+    int has_crc32c : 1;
 } LA_PACKED;
 
+struct FileMap
+{
+    void *base;
+    size_t length;
+    struct FileMap *prev;
+};
+
+static const char zeros[FILE_BLOCK_SIZE];
+
+/*
+ * No proper prefix of the marker is also a suffix of it, so shifting an
+ * append by a byte moves a match off the boundary.
+ */
+static const unsigned char block_marker[FILE_BLOCK_MARKER_LENGTH] = {
+    0xb1, 'L', 'A', 'B', 'L', 'O', 'C', 'K'
+};
+
+/*
+ * Write all of v at offset, picking up after short writes. Long vectors
+ * are written IOV_MAX entries at a time.
+ */
+static int
+write_all(int fd, struct iovec *v, int count, off_t offset)
+{
+    ssize_t ret;
+    while (count > 0)
+    {
+        ret = pwritev(fd, v, count < IOV_MAX ? count : IOV_MAX, offset);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        offset += ret;
+        while (count > 0 && (size_t) ret >= v->iov_len)
+        {
+            ret -= v->iov_len;
+            v++;
+            count--;
+        }
+        if (count > 0)
+        {
+            v->iov_base = (char *) v->iov_base + ret;
+            v->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read all of v at offset. Running into the end of the file is an
+ * error.
+ */
+static FileError
+read_all(int fd, struct iovec *v, int count, off_t offset)
+{
+    ssize_t ret;
+    while (count > 0)
+    {
+        ret = preadv(fd, v, count, offset);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return FILE_READ_ERROR;
+        }
+        if (ret == 0)
+            return FILE_READ_ERROR;
+        offset += ret;
+        while (count > 0 && (size_t) ret >= v->iov_len)
+        {
+            ret -= v->iov_len;
+            v++;
+            count--;
+        }
+        if (count > 0)
+        {
+            v->iov_base = (char *) v->iov_base + ret;
+            v->iov_len -= ret;
+        }
+    }
+    return FILE_SUCCESS;
+}
+
+/*
+ * Reserve length bytes at the end of the file, after padding out to a
+ * block boundary if align is set, and return where the padding starts.
+ * The caller then owns that range, and writes it without a lock.
+ */
+static off_t
+reserve(FileHandle *f, size_t length, int align, size_t *pad)
+{
+    off_t start;
+    do
+    {
+        start = f->end;
+        *pad = align ? (FILE_BLOCK_SIZE - (start % FILE_BLOCK_SIZE)) % FILE_BLOCK_SIZE : 0;
+    } while (!__sync_bool_compare_and_swap(&f->end, start, start + (off_t) (*pad + length)));
+    return start;
+}
+
+/*
+ * Return nonzero if the bytes at skip into v match the block marker, or
+ * start it and run out.
+ */
+static int
+marker_at(const struct iovec *v, int count, size_t skip)
+{
+    size_t i = 0, n;
+
+    for (; count > 0 && i < FILE_BLOCK_MARKER_LENGTH; v++, count--, skip = 0)
+    {
+        if (skip >= v->iov_len)
+        {
+            skip -= v->iov_len;
+            continue;
+        }
+        n = v->iov_len - skip;
+        if (n > FILE_BLOCK_MARKER_LENGTH - i)
+            n = FILE_BLOCK_MARKER_LENGTH - i;
+        if (memcmp((const unsigned char *) v->iov_base + skip, block_marker + i, n) != 0)
+            return 0;
+        i += n;
+    }
+    return 1;
+}
+
+/*
+ * Return nonzero if writing v at start would put the block marker at a
+ * block boundary.
+ */
+static int
+has_marker(off_t start, const struct iovec *v, int count)
+{
+    off_t pos = start, end;
+    off_t boundary = ((start + FILE_BLOCK_SIZE - 1) / FILE_BLOCK_SIZE) * FILE_BLOCK_SIZE;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        end = pos + (off_t) v[i].iov_len;
+        for (; boundary < end; boundary += FILE_BLOCK_SIZE)
+        {
+            if (marker_at(v + i, count - i, (size_t) (boundary - pos)))
+                return 1;
+        }
+        pos = end;
+    }
+    return 0;
+}
+
+/*
+ * Like reserve, for records: pad just enough that writing v at the end
+ * of the padding puts no block marker at a block boundary.
+ */
+static off_t
+reserve_escaped(FileHandle *f, const struct iovec *v, int count, size_t length, size_t *pad)
+{
+    off_t start;
+    do
+    {
+        start = f->end;
+        for (*pad = 0; has_marker(start + (off_t) *pad, v, count); (*pad)++)
+            ;
+    } while (!__sync_bool_compare_and_swap(&f->end, start, start + (off_t) (*pad + length)));
+    return start;
+}
+
+/*
+ * Replace the mapping with one covering at least length bytes, doubling
+ * it at a time. Call with map_lock held.
+ */
+static int
+remap(FileHandle *f, size_t length)
+{
+    struct FileMap *m;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    if (f->map != NULL && f->map->length >= length)
+        return 0;
+    if (f->map != NULL && f->map->length * 2 > length)
+        length = f->map->length * 2;
+    length = ((length + page - 1) / page) * page;
+    if ((m = (struct FileMap *) malloc(sizeof(struct FileMap))) == NULL)
+        return -1;
+    // Pages past the end of the file fill in as appends reach them.
+    m->base = mmap(NULL, length, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (m->base == MAP_FAILED)
+    {
+        free(m);
+        return -1;
+    }
+    m->length = length;
+    m->prev = f->map;
+    __sync_synchronize();
+    f->map = m;
+    return 0;
+}
+
+/*
+ * Return the length bytes at offset in the mapping, making it larger
+ * if the file has grown past it, or NULL if they can't be mapped.
+ */
+static const unsigned char *
+mapped_range(FileHandle *f, off_t offset, size_t length)
+{
+    struct FileMap *m = f->map;
+
+    if (m == NULL || offset < 0 || (uint64_t) offset + length > (uint64_t) f->end)
+        return NULL;
+    if ((uint64_t) offset + length > m->length)
+    {
+        if (f->map_stuck)
+            return NULL;
+        pthread_mutex_lock(&f->map_lock);
+        if (remap(f, (size_t) offset + length) != 0)
+            f->map_stuck = 1;
+        m = f->map;
+        pthread_mutex_unlock(&f->map_lock);
+        if ((uint64_t) offset + length > m->length)
+            return NULL;
+    }
+    return (const unsigned char *) m->base + offset;
+}
+
 FileHandle *
-file_open(const char *filename)
+file_open(const char *filename, int create)
 {
     FileHandle *ret = malloc(sizeof(FileHandle));
     if (ret)
     {
-        ret->file = fopen(filename, "rb+");
-        if (ret->file == NULL)
+        memset(ret, 0, sizeof(FileHandle));
+        ret->fd = open(filename, O_RDWR | (create ? O_CREAT : 0), 0666);
+        if (ret->fd < 0 || (ret->end = lseek(ret->fd, 0, SEEK_END)) < 0)
         {
+            if (ret->fd >= 0)
+                close(ret->fd);
             free(ret);
             return NULL;
         }
+        pthread_mutex_init(&ret->sync_lock, NULL);
+        pthread_cond_init(&ret->sync_cond, NULL);
+        pthread_mutex_init(&ret->map_lock, NULL);
+        ret->checksum = FILE_CHECKSUM_CRC32C;
+        ret->verify = 1;
     }
     return ret;
 }
 
-FileError
-file_append(FileHandle *f, const FileTerm *term)
+void
+file_set_checksum(FileHandle *f, FileChecksum checksum, int verify)
 {
-    struct RecordHeader header;
-    struct iovec v[2];
-    if (fseek(f->file, 0, SEEK_END) != 0)
-        return FILE_SEEK_ERROR;
-    header.has_md5 = 0;
-    header.length = (uint32_t) term->length;
-    v[0].iov_base = &header;
-    v[0].iov_len = sizeof(struct RecordHeader);
-    v[1].iov_base = term->data;
-    v[1].iov_len = term->length;
-    if (writev(fileno(f->file), (const struct iovec *) &v, 2) != 0)
+    f->checksum = checksum;
+    f->verify = verify;
+}
+
+int
+file_map(FileHandle *f, size_t length)
+{
+    int ret;
+    if ((off_t) length < f->end)
+        length = (size_t) f->end;
+    pthread_mutex_lock(&f->map_lock);
+    ret = remap(f, length > 0 ? length : 1);
+    pthread_mutex_unlock(&f->map_lock);
+    return ret;
+}
+
+static size_t
+checksum_length(const struct RecordHeader *header)
+{
+    if (header->has_md5)
+        return MD5_DIGEST_LENGTH;
+    if (header->has_crc32c)
+        return sizeof(uint32_t);
+    return 0;
+}
+
+/*
+ * Append count records with one write. The checksums are computed with
+ * checksum, unless md5s gives them.
+ */
+static FileError
+append(FileHandle *f, const FileTerm *terms, size_t count, FileChecksum checksum, const unsigned char *md5s, off_t *offsets)
+{
+    struct RecordHeader one_header, *headers = &one_header;
+    struct iovec one_v[4], *v = one_v;
+    unsigned char one_sum[MD5_DIGEST_LENGTH], *sums = one_sum, *sum;
+    uint32_t crc;
+    size_t i, n = 1, total = 0, pad;
+    off_t start;
+    FileError ret = FILE_SUCCESS;
+
+    if (count == 0)
+        return FILE_SUCCESS;
+    for (i = 0; i < count; i++)
     {
-        return FILE_WRITE_ERROR;
+        if (terms[i].length > FILE_TERM_MAX)
+            return FILE_TOO_LARGE;
     }
-    return FILE_SUCCESS;
+    if (count > 1)
+    {
+        headers = (struct RecordHeader *) malloc(count * sizeof(struct RecordHeader));
+        v = (struct iovec *) malloc((count * 3 + 1) * sizeof(struct iovec));
+        sums = (unsigned char *) malloc(count * MD5_DIGEST_LENGTH);
+        if (headers == NULL || v == NULL || sums == NULL)
+        {
+            free(headers);
+            free(v);
+            free(sums);
+            return FILE_MEMORY_ERROR;
+        }
+    }
+    for (i = 0; i < count; i++)
+    {
+        headers[i].has_md5 = (checksum == FILE_CHECKSUM_MD5);
+        headers[i].has_crc32c = (checksum == FILE_CHECKSUM_CRC32C);
+        headers[i].length = (uint32_t) terms[i].length;
+        v[n].iov_base = &headers[i];
+        v[n++].iov_len = sizeof(struct RecordHeader);
+        sum = sums + (i * MD5_DIGEST_LENGTH);
+        if (checksum == FILE_CHECKSUM_MD5)
+        {
+            if (md5s != NULL)
+                memcpy(sum, md5s + (i * MD5_DIGEST_LENGTH), MD5_DIGEST_LENGTH);
+            else
+                MD5(terms[i].data, terms[i].length, sum);
+        }
+        else if (checksum == FILE_CHECKSUM_CRC32C)
+        {
+            crc = la_crc32c(0, terms[i].data, terms[i].length);
+            memcpy(sum, &crc, sizeof(uint32_t));
+        }
+        if (checksum_length(&headers[i]) > 0)
+        {
+            v[n].iov_base = sum;
+            v[n++].iov_len = checksum_length(&headers[i]);
+        }
+        v[n].iov_base = terms[i].data;
+        v[n++].iov_len = terms[i].length;
+        if (offsets != NULL)
+            offsets[i] = (off_t) total;
+        total += sizeof(struct RecordHeader) + checksum_length(&headers[i]) + terms[i].length;
+    }
+
+    // v[0] is for the padding, if any, that reserve_escaped asks for.
+    start = reserve_escaped(f, v + 1, (int) n - 1, total, &pad);
+    v[0].iov_base = (void *) zeros;
+    v[0].iov_len = pad;
+    if (write_all(f->fd, v, (int) n, start) != 0)
+        ret = FILE_WRITE_ERROR;
+    else if (offsets != NULL)
+    {
+        for (i = 0; i < count; i++)
+            offsets[i] += start + (off_t) pad;
+    }
+    if (count > 1)
+    {
+        free(headers);
+        free(v);
+        free(sums);
+    }
+    return ret;
 }
 
 FileError
-file_append_md5(FileHandle *f, const FileTerm *term, const unsigned char md5[MD5_DIGEST_LENGTH])
+file_append(FileHandle *f, const FileTerm *term, off_t *offset)
 {
-    struct RecordHeader header;
-    struct iovec v[3];
-    if (fseek(f->file, 0, SEEK_END) != 0)
-        return FILE_SEEK_ERROR;
-    header.has_md5 = 1;
-    header.length = (uint32_t) term->length;
-    v[0].iov_base = &header;
-    v[0].iov_len = sizeof(struct RecordHeader);
-    v[1].iov_base = (void *) md5;
-    v[1].iov_len = MD5_DIGEST_LENGTH;
-    v[2].iov_base = term->data;
-    v[2].iov_len = term->length;
-    if (writev(fileno(f->file), (const struct iovec *) &v, 3) != 0)
-        return FILE_WRITE_ERROR;
-    return FILE_SUCCESS;
+    return append(f, term, 1, FILE_CHECKSUM_NONE, NULL, offset);
+}
+
+FileError
+file_append_md5(FileHandle *f, const FileTerm *term, const unsigned char md5[MD5_DIGEST_LENGTH], off_t *offset)
+{
+    return append(f, term, 1, FILE_CHECKSUM_MD5, md5, offset);
+}
+
+FileError
+file_append_many(FileHandle *f, const FileTerm *terms, size_t count, off_t *offsets)
+{
+    return append(f, terms, count, f->checksum, NULL, offsets);
+}
+
+/*
+ * Check a record's checksum, if it has one and we check them.
+ */
+static int
+verify(FileHandle *f, const struct RecordHeader *header, const unsigned char *sum, const void *data)
+{
+    unsigned char md5[MD5_DIGEST_LENGTH];
+    uint32_t crc;
+
+    if (!f->verify)
+        return 1;
+    if (header->has_md5)
+    {
+        MD5(data, header->length, md5);
+        return memcmp(sum, md5, MD5_DIGEST_LENGTH) == 0;
+    }
+    if (header->has_crc32c)
+    {
+        crc = la_crc32c(0, data, header->length);
+        return memcmp(sum, &crc, sizeof(uint32_t)) == 0;
+    }
+    return 1;
 }
 
 FileError
 file_read(FileHandle *f, const off_t offset, FileTerm *term)
 {
     struct RecordHeader header;
-    int owned = 0;
-    unsigned char file_md5[MD5_DIGEST_LENGTH], comp_md5[MD5_DIGEST_LENGTH];
-    if (fseeko(f->file, offset, SEEK_SET) != 0)
-        return FILE_SEEK_ERROR;
-    if (fread(&header, sizeof(struct RecordHeader), 1, f->file) != 1)
-        return FILE_READ_ERROR;
-    if (header.has_md5)
-    {
-        if (fread(file_md5, MD5_DIGEST_LENGTH, 1, f->file) != 1)
-            return FILE_READ_ERROR;
-    }
+    struct iovec v[2];
+    int owned = 0, n = 0;
+    FileError ret;
+    unsigned char sum[MD5_DIGEST_LENGTH];
+
+    v[0].iov_base = &header;
+    v[0].iov_len = sizeof(struct RecordHeader);
+    if ((ret = read_all(f->fd, v, 1, offset)) != FILE_SUCCESS)
+        return ret;
     if (term->data == NULL)
     {
-        term->data = malloc(header.length);
+        term->data = malloc(header.length > 0 ? header.length : 1);
         term->length = header.length;
         if (term->data == NULL)
             return FILE_MEMORY_ERROR;
@@ -107,21 +476,34 @@ file_read(FileHandle *f, const off_t offset, FileTerm *term)
         if (header.length < term->length)
             term->length = header.length;
     }
-    if (fread(term->data, term->length, 1, f->file) != 1)
+    // The checksum and the value follow the header; read both at once.
+    if (checksum_length(&header) > 0)
+    {
+        v[n].iov_base = sum;
+        v[n++].iov_len = checksum_length(&header);
+    }
+    if (term->length > 0)
+    {
+        v[n].iov_base = term->data;
+        v[n++].iov_len = term->length;
+    }
+    if (n > 0 && (ret = read_all(f->fd, v, n, offset + sizeof(struct RecordHeader))) != FILE_SUCCESS)
     {
         if (owned)
+        {
             free(term->data);
-        return -1;
+            term->data = NULL;
+        }
+        return ret;
     }
-    if (header.has_md5)
+    if (term->length == header.length && !verify(f, &header, sum, term->data))
     {
-        MD5(term->data, header.length, comp_md5);
-        if (memcmp(file_md5, comp_md5, MD5_DIGEST_LENGTH) != 0)
+        if (owned)
         {
-            if (owned)
-                free(term->data);
-            return FILE_CORRUPTION;
+            free(term->data);
+            term->data = NULL;
         }
+        return FILE_CORRUPTION;
     }
     if (term->length < header.length)
     {
@@ -131,63 +513,182 @@ file_read(FileHandle *f, const off_t offset, FileTerm *term)
     return FILE_SUCCESS;
 }
 
+FileError
+file_read_mapped(FileHandle *f, const off_t offset, FileTerm *term, int *mapped)
+{
+    struct RecordHeader header;
+    const unsigned char *p;
+    size_t head;
+
+    *mapped = 0;
+    term->data = NULL;
+    term->length = 0;
+    if ((p = mapped_range(f, offset, sizeof(struct RecordHeader))) == NULL)
+        return file_read(f, offset, term);
+    memcpy(&header, p, sizeof(struct RecordHeader));
+    head = sizeof(struct RecordHeader) + checksum_length(&header);
+    if ((p = mapped_range(f, offset, head + header.length)) == NULL)
+        return file_read(f, offset, term);
+    if (!verify(f, &header, p + sizeof(struct RecordHeader), p + head))
+        return FILE_CORRUPTION;
+    term->data = (void *) (p + head);
+    term->length = header.length;
+    *mapped = 1;
+    return FILE_SUCCESS;
+}
+
 void
 file_read_cb(FileHandle *f, const off_t offset, ReadCallback cb)
 {
-    struct RecordHeader header;
     FileTerm term;
-    unsigned char file_md5[MD5_DIGEST_LENGTH], comp_md5[MD5_DIGEST_LENGTH];
-    if (fseeko(f->file, offset, SEEK_SET) != 0)
+    FileError ret;
+    term.data = NULL;
+    term.length = 0;
+    ret = file_read(f, offset, &term);
+    if (ret != FILE_SUCCESS)
     {
-        cb(NULL, FILE_SEEK_ERROR);
+        cb(NULL, ret);
         return;
     }
-    if (fread(&header, sizeof(struct RecordHeader), 1, f->file) != 1)
-    {
-        cb(NULL, FILE_READ_ERROR);
-        return;
-    }
-    if (header.has_md5)
+    cb(&term, FILE_SUCCESS);
+}
+
+FileError
+file_write_block(FileHandle *f, const void *block, size_t length, off_t *offset)
+{
+    struct iovec v[3];
+    off_t start;
+    size_t pad;
+
+    start = reserve(f, FILE_BLOCK_MARKER_LENGTH + length, 1, &pad);
+    v[0].iov_base = (void *) zeros;
+    v[0].iov_len = pad;
+    v[1].iov_base = (void *) block_marker;
+    v[1].iov_len = FILE_BLOCK_MARKER_LENGTH;
+    v[2].iov_base = (void *) block;
+    v[2].iov_len = length;
+    if (write_all(f->fd, v, 3, start) != 0)
+        return FILE_WRITE_ERROR;
+    if (offset != NULL)
+        *offset = start + pad;
+    return FILE_SUCCESS;
+}
+
+FileError
+file_read_block(FileHandle *f, off_t offset, void *block, size_t length)
+{
+    unsigned char marker[FILE_BLOCK_MARKER_LENGTH];
+    struct iovec v[2];
+    FileError ret;
+
+    if (offset % FILE_BLOCK_SIZE != 0)
+        return FILE_CORRUPTION;
+    v[0].iov_base = marker;
+    v[0].iov_len = FILE_BLOCK_MARKER_LENGTH;
+    v[1].iov_base = block;
+    v[1].iov_len = length;
+    if ((ret = read_all(f->fd, v, 2, offset)) != FILE_SUCCESS)
+        return ret;
+    if (memcmp(marker, block_marker, FILE_BLOCK_MARKER_LENGTH) != 0)
+        return FILE_CORRUPTION;
+    return FILE_SUCCESS;
+}
+
+off_t
+file_size(FileHandle *f)
+{
+    return f->end;
+}
+
+/*
+ * Syncs are numbered as they start. A caller needs a sync that starts
+ * after it arrived, so it waits until the one numbered sync_started + 1
+ * (as of its arrival) is done. Only one sync runs at a time; callers
+ * that arrive during one all wait for the next, and the first of them
+ * to wake up runs it for everyone.
+ */
+int
+file_sync(FileHandle *f, unsigned int window)
+{
+    uint64_t target, gen;
+    int ret = 0;
+
+    pthread_mutex_lock(&f->sync_lock);
+    target = f->sync_started + 1;
+    while (f->sync_done < target)
     {
-        if (fread(&file_md5, MD5_DIGEST_LENGTH, 1, f->file) != 1)
+        if (f->sync_failed >= target)
         {
-            cb(NULL, FILE_READ_ERROR);
-            return;
+            ret = -1;
+            break;
         }
-    }
-    term.data = malloc(header.length);
-    term.length = header.length;
-    if (term.data == NULL)
-    {
-        cb(NULL, FILE_MEMORY_ERROR);
-        return;
-    }
-    if (fread(term.data, term.length, 1, f->file) != 1)
-    {
-        cb(NULL, FILE_READ_ERROR);
-        free(term.data);
-        return;
-    }
-    if (header.has_md5)
-    {
-        MD5(term.data, term.length, comp_md5);
-        if (memcmp(file_md5, comp_md5, MD5_DIGEST_LENGTH) != 0)
+        if (f->syncing)
         {
-            
+            pthread_cond_wait(&f->sync_cond, &f->sync_lock);
+            continue;
+        }
+        f->syncing = 1;
+        if (window > 0)
+        {
+            // Callers arriving now still get target == gen below.
+            pthread_mutex_unlock(&f->sync_lock);
+            usleep(window);
+            pthread_mutex_lock(&f->sync_lock);
+        }
+        gen = ++f->sync_started;
+        pthread_mutex_unlock(&f->sync_lock);
+        ret = fdatasync(f->fd);
+        pthread_mutex_lock(&f->sync_lock);
+        f->syncing = 0;
+        if (ret == 0)
+            f->sync_done = gen;
+        else
+            f->sync_failed = gen;
+        pthread_cond_broadcast(&f->sync_cond);
+        if (ret != 0)
+        {
+            ret = -1;
+            break;
         }
     }
+    pthread_mutex_unlock(&f->sync_lock);
+    return ret;
+}
+
+uint64_t
+file_sync_mark(FileHandle *f)
+{
+    uint64_t mark;
+    pthread_mutex_lock(&f->sync_lock);
+    mark = f->sync_started + 1;
+    pthread_mutex_unlock(&f->sync_lock);
+    return mark;
 }
 
 int
-file_flush(FileHandle *f)
+file_synced(FileHandle *f, uint64_t mark)
 {
-    return fflush(f->file);
+    int ret;
+    pthread_mutex_lock(&f->sync_lock);
+    ret = f->sync_done >= mark;
+    pthread_mutex_unlock(&f->sync_lock);
+    return ret;
 }
 
 int
 file_close(FileHandle *f)
 {
-    fclose(f->file);
+    struct FileMap *m, *prev;
+    for (m = f->map; m != NULL; m = prev)
+    {
+        prev = m->prev;
+        munmap(m->base, m->length);
+        free(m);
+    }
+    pthread_mutex_destroy(&f->map_lock);
+    close(f->fd);
+    pthread_mutex_destroy(&f->sync_lock);
+    pthread_cond_destroy(&f->sync_cond);
     free(f);
     return 0;
-}
\ No newline at end of file
+}
@@ -9,6 +9,11 @@
 #ifndef LoungeAct_file_h
 #define LoungeAct_file_h
 
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
 #if defined (__APPLE__) /* Jerks. */
 # include <CommonCrypto/CommonDigest.h>
 # define MD5 CC_MD5
@@ -17,9 +22,72 @@
 # include <openssl/md5.h>
 #endif
 
+/**
+ * Header blocks are written at multiples of this many bytes, so that
+ * the last one can be found by stepping back from the end of the file.
+ */
+#define FILE_BLOCK_SIZE 4096
+
+/**
+ * Every block starts with a marker this long, ahead of the caller's
+ * bytes. Appends are placed so that record bytes never start with the
+ * marker at a block boundary, so a document can't pose as a block.
+ */
+#define FILE_BLOCK_MARKER_LENGTH 8
+
+/**
+ * Records and blocks are read and written with positional I/O, so reads
+ * take no lock and run in parallel with each other and with appends.
+ * Appends reserve their range by advancing end atomically, then write
+ * it with a single pwritev.
+ */
+/**
+ * How records are checksummed. The algorithm is recorded in each
+ * record's header, so records written with any of them can be read
+ * whatever the handle is set to.
+ */
+typedef enum
+{
+    FILE_CHECKSUM_NONE = 0,
+    FILE_CHECKSUM_MD5,
+    FILE_CHECKSUM_CRC32C
+} FileChecksum;
+
+struct FileMap;
+
 typedef struct
 {
-    FILE *file;
+    int fd;
+    volatile off_t end;
+
+    /**
+     * The read mapping, if file_map was called. When the file outgrows
+     * it, a larger one replaces it; the old ones stay mapped until the
+     * file is closed, since callers may still hold pointers into them.
+     * If a larger mapping can't be made, map_stuck is set and reads past
+     * the mapping use pread.
+     */
+    struct FileMap * volatile map;
+    pthread_mutex_t map_lock;
+    int map_stuck;
+
+    /**
+     * The checksum file_append_many writes, and whether reads check
+     * checksums. See file_set_checksum.
+     */
+    FileChecksum checksum;
+    int verify;
+
+    /**
+     * Group commit state (see file_sync): how many syncs have started
+     * and finished, whether one is running, and the last that failed.
+     */
+    pthread_mutex_t sync_lock;
+    pthread_cond_t sync_cond;
+    uint64_t sync_started;
+    uint64_t sync_done;
+    uint64_t sync_failed;
+    int syncing;
 } FileHandle;
 
 typedef struct
@@ -28,6 +96,12 @@ typedef struct
     size_t length;
 } FileTerm;
 
+/**
+ * The largest record a file can hold; record headers store the length in
+ * 30 bits.
+ */
+#define FILE_TERM_MAX ((1U << 30) - 1)
+
 typedef enum
 {
     FILE_SUCCESS = 0,
@@ -36,15 +110,44 @@ typedef enum
     FILE_READ_ERROR,
     FILE_WRITE_ERROR,
     FILE_CORRUPTION,
-    FILE_MEMORY_ERROR
+    FILE_MEMORY_ERROR,
+    FILE_TOO_LARGE
 } FileError;
 
+typedef void (*ReadCallback)(FileTerm *term, FileError error);
+
+/**
+ * Open a file, creating it (empty) if create is nonzero and it does
+ * not exist.
+ */
+FileHandle *file_open(const char *path, int create);
+
+/**
+ * Set the checksum file_append_many writes; new handles use CRC-32C.
+ *
+ * @param verify Nonzero (the default) to check the checksum of every
+ *  record read. Turning this off trusts the file, and saves the cost of
+ *  checksumming on each read.
+ */
+void file_set_checksum(FileHandle *handle, FileChecksum checksum, int verify);
+
+/**
+ * Append a record to the end of the file. Records longer than
+ * FILE_TERM_MAX fail with FILE_TOO_LARGE.
+ *
+ * @param offset If not NULL, set to the offset of the new record, for
+ *  passing to file_read.
+ */
+FileError file_append(FileHandle *handle, const FileTerm *term, off_t *offset);
+FileError file_append_md5(FileHandle *handle, const FileTerm *term, const unsigned char md5[MD5_DIGEST_LENGTH], off_t *offset);
+
 /**
- * Open a file.
+ * Append count records with one write, checksummed as set with
+ * file_set_checksum.
+ *
+ * @param offsets If not NULL, set to the offset of each record.
  */
-FileHandle *file_open(const char *path);
-FileError file_append(FileHandle *handle, const FileTerm *term);
-FileError file_append_md5(FileHandle *handle, const FileTerm *term, const unsigned char md5[MD5_DIGEST_LENGTH]);
+FileError file_append_many(FileHandle *handle, const FileTerm *terms, size_t count, off_t *offsets);
 
 /**
  * Read a value from a file.
@@ -58,7 +161,68 @@ FileError file_append_md5(FileHandle *handle, const FileTerm *term, const unsign
  */
 FileError file_read(FileHandle *handle, off_t offset, FileTerm *term);
 
-int file_flush(FileHandle *handle);
+/**
+ * Read a value without copying it, if the file is mapped.
+ *
+ * If the value is within the mapping, term->data is set to point at it
+ * there, and *mapped to 1; the data must not be changed or freed, and
+ * stays valid until the file is closed. Otherwise this reads the value
+ * into memory from malloc, like file_read, and sets *mapped to 0.
+ */
+FileError file_read_mapped(FileHandle *handle, off_t offset, FileTerm *term, int *mapped);
+void file_read_cb(FileHandle *handle, off_t offset, ReadCallback cb);
+
+/**
+ * Pad the file out to the next FILE_BLOCK_SIZE boundary, and write the
+ * block marker and a raw block of length bytes there. Unlike records,
+ * blocks have no record header; the caller checks their contents itself.
+ *
+ * @param offset If not NULL, set to the offset of the block.
+ */
+FileError file_write_block(FileHandle *handle, const void *block, size_t length, off_t *offset);
+
+/**
+ * Read a raw block of length bytes at offset. Returns FILE_CORRUPTION if
+ * no block was written there.
+ */
+FileError file_read_block(FileHandle *handle, off_t offset, void *block, size_t length);
+
+/**
+ * Map the file for reading with file_read_mapped.
+ *
+ * @param length How much of the file to map at first; the mapping is
+ *  made larger as the file grows past it.
+ * @return 0 on success, -1 if the file could not be mapped, in which
+ *  case reads go on using pread.
+ */
+int file_map(FileHandle *handle, size_t length);
+
+/**
+ * Return the current size of the file, including appends that are
+ * still being written.
+ */
+off_t file_size(FileHandle *handle);
+
+/**
+ * Return once everything appended before the call is on stable storage.
+ *
+ * Callers that arrive while a sync is running wait for it to finish and
+ * then share the next one, so concurrent callers cost one sync per
+ * round rather than one each.
+ *
+ * @param window Microseconds to wait before syncing, if this call ends
+ *  up doing the sync, so that more callers can join it.
+ * @return 0 on success, -1 on error.
+ */
+int file_sync(FileHandle *handle, unsigned int window);
+
+/**
+ * Return a mark covering every append that has finished so far; once
+ * file_synced returns nonzero for it, they are all on stable storage.
+ */
+uint64_t file_sync_mark(FileHandle *handle);
+int file_synced(FileHandle *handle, uint64_t mark);
+
 int file_close(FileHandle *handle);
 
 #endif
@@ -9,8 +9,93 @@
 #ifndef LoungeAct_labptree_h
 #define LoungeAct_labptree_h
 
+#include <stdint.h>
+
+#include "btree.h"
+
 typedef struct BPTree BPTree;
 
+/**
+ * The state of the database as of one commit: the roots of the by-id
+ * and by-seq trees, and the last sequence number. Everything a state
+ * refers to is immutable, so a state copied out with bptree_snapshot
+ * can be read for as long as the file is open, whatever writers do.
+ */
+typedef struct
+{
+    uint64_t lastseq;
+    BTreeRoot by_id;
+    BTreeRoot by_seq;
+} BPTreeState;
+
+/**
+ * Open a database file, recovering the last complete commit.
+ *
+ * @param path The file path.
+ * @param create Nonzero to create the file if it does not exist.
+ * @param created If not NULL, set to 1 if the file was created.
+ * @return The database handle, or NULL if the file could not be opened,
+ *  or has no valid header.
+ */
+BPTree *bptree_open(const char *path, int create, int *created);
+void bptree_close(BPTree *tree);
+
+/**
+ * Set how commits reach stable storage.
+ *
+ * @param sync Nonzero to sync each commit before bptree_sync returns;
+ *  with 0, commits are written but not synced, and a crash may lose the
+ *  most recent ones.
+ * @param window Microseconds the thread that syncs a group of commits
+ *  waits first, so that more commits can join the group.
+ */
+void bptree_set_sync(BPTree *tree, int sync, unsigned int window);
+
+/**
+ * Copy out the most recently committed (durable) state. Never blocks.
+ */
+void bptree_snapshot(BPTree *tree, BPTreeState *state);
+
+/**
+ * Writers hold the write lock from reading the state they build on
+ * until they commit the new one.
+ */
+void bptree_write_lock(BPTree *tree);
+void bptree_write_unlock(BPTree *tree);
+
+/**
+ * Copy out the newest state, including commits that are not yet
+ * durable. Writers build on this rather than bptree_snapshot. Call with
+ * the write lock held.
+ */
+void bptree_tip(BPTree *tree, BPTreeState *state);
+
+/**
+ * Make state the newest state. The nodes and records it refers to must
+ * already be appended. Call with the write lock held, then release it
+ * and pass the returned ticket to bptree_sync.
+ */
+uint64_t bptree_commit(BPTree *tree, const BPTreeState *state);
+
+/**
+ * Wait until the commit with ticket is durable and visible to
+ * bptree_snapshot.
+ *
+ * Commits are synced in groups: one thread writes a header for the
+ * newest state and syncs it, and every commit that went into that state
+ * is done at once.
+ *
+ * If a group fails to sync, the newest state includes commits that may
+ * or may not have reached the disk, so the tree stops committing: that
+ * commit and every later one fail, and bptree_snapshot keeps returning
+ * the last durable state. Reopen the file to recover from it.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int bptree_sync(BPTree *tree, uint64_t ticket);
 
+FileHandle *bptree_file(BPTree *tree);
+const BTree *bptree_by_id(BPTree *tree);
+const BTree *bptree_by_seq(BPTree *tree);
 
 #endif
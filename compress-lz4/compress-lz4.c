@@ -7,36 +7,178 @@
 //
 
 #include <stdlib.h>
+#include <limits.h>
 
 #include "lz4.h"
 #include "../compress/compress.h"
 
+/*
+ * Data from compress_into starts with the uncompressed length, as a
+ * varint (7 bits per byte, low bits first, high bit set on all but the
+ * last byte), so decompressing is one allocation of the right size and
+ * one pass. The plain compressor and decompressor keep lz4's bare
+ * format, which is what documents written before the context API hold;
+ * the storage header's sized flag says which a document uses.
+ */
+#define LZ4_LENGTH_MAX 5
+
+static size_t put_length(unsigned char *out, size_t length)
+{
+    size_t n = 0;
+    while (length >= 0x80)
+    {
+        out[n++] = (unsigned char) (length | 0x80);
+        length >>= 7;
+    }
+    out[n++] = (unsigned char) length;
+    return n;
+}
+
+static size_t get_length(const unsigned char *in, size_t inlen, size_t *length)
+{
+    size_t n = 0;
+    int shift = 0;
+    
+    *length = 0;
+    while (n < inlen && n < LZ4_LENGTH_MAX)
+    {
+        *length |= (size_t) (in[n] & 0x7f) << shift;
+        if ((in[n++] & 0x80) == 0)
+            return n;
+        shift += 7;
+    }
+    return 0;
+}
+
+/*
+ * Inputs shorter than this are compressed with the 64K variant, which is
+ * faster (the library's own limit is a few bytes higher).
+ */
+#define LZ4_SMALL_INPUT 65536
+
+/*
+ * A context keeps lz4's hash tables, which it allocates on first use if
+ * it keeps them on the heap at all.
+ */
+struct lz4_context
+{
+    void *tables;
+};
+
+static void *lz4_context_new(void)
+{
+    return calloc(1, sizeof(struct lz4_context));
+}
+
+static void lz4_context_free(void *context)
+{
+    struct lz4_context *ctx = (struct lz4_context *) context;
+    free(ctx->tables);
+    free(ctx);
+}
+
+static size_t lz4_bound(size_t len)
+{
+    return LZ4_LENGTH_MAX + LZ4_compressBound((int) len);
+}
+
+static int lz4_compress_into(void *context, const unsigned char *in, size_t inlen,
+                             unsigned char *out, size_t outsize, size_t *outlen)
+{
+    struct lz4_context *ctx = (struct lz4_context *) context;
+    size_t n;
+    int ret;
+    
+    // lz4 doesn't check the output size, so there must be room for the worst case.
+    if (inlen > INT_MAX - LZ4_LENGTH_MAX || outsize < lz4_bound(inlen))
+        return -1;
+    n = put_length(out, inlen);
+    if (inlen < LZ4_SMALL_INPUT)
+        ret = LZ4_compress64kCtx(&ctx->tables, (const char *) in, (char *) out + n, (int) inlen);
+    else
+        ret = LZ4_compressCtx(&ctx->tables, (const char *) in, (char *) out + n, (int) inlen);
+    if (ret < 0)
+        return -1;
+    *outlen = n + ret;
+    return 0;
+}
+
+static int lz4_decompressed_length(const unsigned char *in, size_t inlen, size_t *outlen)
+{
+    if (get_length(in, inlen, outlen) == 0 || *outlen > INT_MAX)
+        return -1;
+    return 0;
+}
+
+static int lz4_decompress_into(void *context, const unsigned char *in, size_t inlen,
+                               unsigned char *out, size_t outsize, size_t *outlen)
+{
+    size_t length;
+    size_t n = get_length(in, inlen, &length);
+    
+    // lz4 decompression keeps no state.
+    (void) context;
+    if (n == 0 || length > INT_MAX || length > outsize)
+        return -1;
+    if (LZ4_uncompress_unknownOutputSize((const char *) in + n, (char *) out, (int) (inlen - n), (int) length) != (int) length)
+        return -1;
+    *outlen = length;
+    return 0;
+}
+
 static unsigned char *lz4_compress(unsigned char *in, size_t inlen, size_t *outlen)
 {
-    int maxlen = LZ4_compressBound(inlen);
-    unsigned char *buffer = malloc(maxlen);
+    unsigned char *buffer;
+    
+    if (inlen > INT_MAX)
+        return NULL;
+    buffer = malloc(LZ4_compressBound((int) inlen));
     if (buffer == NULL)
         return NULL;
-    *outlen = LZ4_compress((const char *) in, (char *) buffer, inlen);
+    *outlen = LZ4_compress((const char *) in, (char *) buffer, (int) inlen);
     return buffer;
 }
 
+/*
+ * Bare lz4 data doesn't say how long it decompresses to, so guess, and
+ * grow the buffer until the output fits.
+ */
 static unsigned char *lz4_decompress(unsigned char *in, size_t inlen, size_t *outlen)
 {
-    int alloclen = inlen + (inlen / 2);
-    unsigned char *buffer = malloc(alloclen);
-    int osize = LZ4_uncompress_unknownOutputSize((const char *) in, (char *) buffer, inlen, alloclen);
+    int alloclen;
+    unsigned char *buffer;
+    unsigned char *grown;
+    int osize;
+    
+    if (inlen > INT_MAX / 2)
+        return NULL;
+    alloclen = (int) (inlen + (inlen / 2));
+    if ((buffer = malloc(alloclen)) == NULL)
+        return NULL;
+    osize = LZ4_uncompress_unknownOutputSize((const char *) in, (char *) buffer, (int) inlen, alloclen);
     while (osize < 0 || osize == alloclen)
     {
-        alloclen += 1024;
-        buffer = realloc(buffer, alloclen);
-        if (buffer == NULL)
+        if (alloclen > INT_MAX - 1024 || (grown = realloc(buffer, alloclen + 1024)) == NULL)
+        {
+            free(buffer);
             return NULL;
-        osize = LZ4_uncompress_unknownOutputSize((const char *) in, (char *) buffer, inlen, alloclen);
+        }
+        alloclen += 1024;
+        buffer = grown;
+        osize = LZ4_uncompress_unknownOutputSize((const char *) in, (char *) buffer, (int) inlen, alloclen);
     }
     *outlen = osize;
     return buffer;
 }
 
-la_compressor_t __lz4_compressor = { lz4_compress, lz4_decompress };
+la_compressor_t __lz4_compressor = {
+    .compressor = lz4_compress,
+    .decompressor = lz4_decompress,
+    .context_new = lz4_context_new,
+    .context_free = lz4_context_free,
+    .bound = lz4_bound,
+    .compress_into = lz4_compress_into,
+    .decompressed_length = lz4_decompressed_length,
+    .decompress_into = lz4_decompress_into
+};
 la_compressor_t *la_lz4_compressor = &__lz4_compressor;
\ No newline at end of file
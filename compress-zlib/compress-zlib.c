@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <zlib.h>
 
 #include "../compress/compress.h"
@@ -97,5 +98,71 @@ static unsigned char *_zlib_decompress(unsigned char *input, size_t len, size_t
     return ret;
 }
 
-la_compressor_t __zlib_compressor = { _zlib_compress, _zlib_decompress };
+/*
+ * A context keeps a deflate stream, set up on first use and reset, rather
+ * than set up again, for each call after that. zlib data doesn't record
+ * its decompressed length, so there is no decompress_into; inflating
+ * goes through _zlib_decompress.
+ */
+struct zlib_context
+{
+    z_stream deflate;
+    int deflate_ready;
+};
+
+static void *_zlib_context_new(void)
+{
+    return calloc(1, sizeof(struct zlib_context));
+}
+
+static void _zlib_context_free(void *context)
+{
+    struct zlib_context *ctx = (struct zlib_context *) context;
+    if (ctx->deflate_ready)
+        deflateEnd(&ctx->deflate);
+    free(ctx);
+}
+
+static size_t _zlib_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+static int _zlib_compress_into(void *context, const unsigned char *input, size_t len,
+                               unsigned char *output, size_t outsize, size_t *outlen)
+{
+    struct zlib_context *ctx = (struct zlib_context *) context;
+    z_stream *zs = &ctx->deflate;
+    
+    if (ctx->deflate_ready)
+    {
+        if (deflateReset(zs) != Z_OK)
+            return -1;
+    }
+    else
+    {
+        if (deflateInit(zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+            return -1;
+        ctx->deflate_ready = 1;
+    }
+    zs->next_in = (Bytef *) input;
+    zs->avail_in = len;
+    zs->next_out = output;
+    zs->avail_out = outsize;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+        return -1;
+    *outlen = zs->total_out;
+    return 0;
+}
+
+la_compressor_t __zlib_compressor = {
+    .compressor = _zlib_compress,
+    .decompressor = _zlib_decompress,
+    .context_new = _zlib_context_new,
+    .context_free = _zlib_context_free,
+    .bound = _zlib_bound,
+    .compress_into = _zlib_compress_into,
+    .decompressed_length = NULL,
+    .decompress_into = NULL
+};
 la_compressor_t *la_zlib_compressor = &__zlib_compressor;
@@ -9,13 +9,73 @@
 #ifndef LoungeAct_compress_h
 #define LoungeAct_compress_h
 
+#include <sys/types.h>
+
 typedef unsigned char *(*la_compress_fn)(unsigned char *input, size_t len, size_t *outlen);
 typedef unsigned char *(*la_decompress_fn)(unsigned char *input, size_t len, size_t *outlen);
 
+/*
+ * The context API. A context holds whatever state the compressor can
+ * reuse from one call to the next, and is used by one thread at a time;
+ * callers usually keep one per thread. Output goes to buffers the caller
+ * provides.
+ */
+typedef void *(*la_compress_context_new_fn)(void);
+typedef void (*la_compress_context_free_fn)(void *context);
+
+/**
+ * Return the most bytes compressing len bytes can produce.
+ */
+typedef size_t (*la_compress_bound_fn)(size_t len);
+
+/**
+ * Compress len bytes of input into output, which has room for outsize
+ * bytes. outsize should be at least the compressor's bound for len.
+ *
+ * @return 0 on success, with *outlen set to the compressed length; -1
+ *  on error.
+ */
+typedef int (*la_compress_into_fn)(void *context, const unsigned char *input, size_t len,
+                                   unsigned char *output, size_t outsize, size_t *outlen);
+
+/**
+ * Get the length compressed input will decompress to, if the compressed
+ * format records it.
+ *
+ * @return 0 on success, -1 if the length isn't known.
+ */
+typedef int (*la_decompressed_length_fn)(const unsigned char *input, size_t len, size_t *outlen);
+
+/**
+ * Decompress len bytes of input into output, which has room for outsize
+ * bytes.
+ *
+ * @return 0 on success, with *outlen set to the decompressed length; -1
+ *  on error, or if the output doesn't fit.
+ */
+typedef int (*la_decompress_into_fn)(void *context, const unsigned char *input, size_t len,
+                                     unsigned char *output, size_t outsize, size_t *outlen);
+
 typedef struct
 {
     la_compress_fn compressor;
     la_decompress_fn decompressor;
+    
+    /**
+     * The context API, or NULL if the compressor only has the functions
+     * above. If context_new is set, so are context_free, bound and
+     * compress_into. decompressed_length and decompress_into are either
+     * both set or both NULL, since the output can only be sized when the
+     * decompressed length is known. If they are set, they read what
+     * compress_into writes, which may be a different format from what
+     * compressor writes; decompressor reads only the latter.
+     */
+    la_compress_context_new_fn context_new;
+    la_compress_context_free_fn context_free;
+    la_compress_bound_fn bound;
+    la_compress_into_fn compress_into;
+    la_decompressed_length_fn decompressed_length;
+    la_decompress_into_fn decompress_into;
 } la_compressor_t;
 
 #endif
@@ -0,0 +1,1302 @@
+//
+//  ObjectStore-memory.c
+//  LoungeAct
+//
+//  Created by agent on 10/18/26.
+//
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../utils/crc32c.h"
+#include "../utils/stringutils.h"
+#include "../utils/utils.h"
+#include "../utils/uthash.h"
+#include "../Storage/ObjectStore.h"
+
+#if DEBUG
+#define debug(fmt,args...) fprintf(stderr, "%s:%d -- " fmt, basename( __FILE__ ), __LINE__, ##args)
+#else
+#define debug(fmt,args...)
+#endif
+
+/*
+ * Stores live in memory, and belong to the environment: closing a store
+ * keeps its documents, so it can be opened again, until the environment
+ * is closed or the store is deleted.
+ *
+ * Each document version is an immutable object with a reference count.
+ * The store holds a reference to each key's current version; readers
+ * that borrow a version or iterate over it take their own, so writers
+ * never wait for them or change what they see.
+ *
+ * If memory_snapshot_interval is set, the environment is a directory,
+ * each store is loaded from <name>.mem there when first opened, and a
+ * thread writes changed stores back to it every so often (and when they
+ * are closed). Writes made since the last snapshot are lost in a crash.
+ */
+#define SNAPSHOT_SUFFIX ".mem"
+#define SNAPSHOT_TEMP_SUFFIX ".mem.tmp"
+#define SNAPSHOT_MAGIC "LAMEMSN1"
+
+struct version
+{
+    volatile int refs;
+    la_storage_object *obj;
+};
+
+/*
+ * Besides the by-id hash, docs are linked into a skip list in key order
+ * (see key_seek), for key range iterators. next has levels entries, and
+ * prev links the bottom level backwards.
+ */
+#define KEY_LEVELS 24
+
+struct doc
+{
+    char *key;
+    struct version *current;
+    size_t slot;        /* Index of current in the store's by_seq array. */
+    UT_hash_handle hh;
+    struct doc *prev;
+    int levels;
+    struct doc *next[];
+};
+
+/*
+ * One entry in the by-seq index, which is kept sorted by seq. When a
+ * document gets a new seq, its old slot is left as a hole (doc is NULL)
+ * until there are enough holes to be worth squeezing out.
+ */
+struct seq_slot
+{
+    uint64_t seq;
+    struct doc *doc;
+};
+
+struct la_storage_env
+{
+    char *name;
+    la_storage_env_config_t config;
+
+    /*
+     * The stores by name; guarded by lock, as are the open counts.
+     */
+    pthread_mutex_t lock;
+    struct la_storage_object_store *stores;
+
+    /*
+     * The snapshot thread; only running if snapshot_running is set.
+     */
+    pthread_t snapshot;
+    pthread_cond_t snapshot_cond;
+    int snapshot_running;
+    int snapshot_stop;
+};
+
+struct la_storage_object_store
+{
+    la_storage_env *env;
+    char *name;
+    int opens;
+    int deleted;
+    UT_hash_handle hh;
+
+    pthread_rwlock_t lock;
+    struct doc *by_id;
+    struct doc *by_key[KEY_LEVELS];
+    struct doc *last_key;
+    uint32_t key_random;
+    struct seq_slot *by_seq;
+    size_t seq_count;
+    size_t seq_capacity;
+    size_t holes;
+    uint64_t lastseq;
+    uint64_t size;
+
+    /*
+     * The lastseq written to the last snapshot, so unchanged stores
+     * aren't written again.
+     */
+    uint64_t snapshot_seq;
+};
+
+/*
+ * Iterators hold a reference to every version they will return, taken
+ * when they are opened.
+ */
+struct la_storage_object_iterator
+{
+    struct version **versions;
+    size_t count;
+    size_t next;
+    int flags;
+};
+
+static struct version *version_new(const la_storage_object *obj)
+{
+    size_t size = la_storage_object_total_size(obj);
+    struct version *v = (struct version *) malloc(sizeof(struct version));
+    if (v == NULL)
+        return NULL;
+    if ((v->obj = la_storage_alloc_object(obj->key, strlen(obj->key), size)) == NULL)
+    {
+        free(v);
+        return NULL;
+    }
+    memcpy(v->obj->header, obj->header, size);
+    v->obj->data_length = obj->data_length;
+    v->refs = 1;
+    return v;
+}
+
+static void version_ref(struct version *v)
+{
+    __sync_add_and_fetch(&v->refs, 1);
+}
+
+static void version_unref(struct version *v)
+{
+    if (__sync_sub_and_fetch(&v->refs, 1) == 0)
+    {
+        la_storage_destroy_object(v->obj);
+        free(v);
+    }
+}
+
+static uint64_t version_size(const struct version *v)
+{
+    return strlen(v->obj->key) + la_storage_object_total_size(v->obj);
+}
+
+static la_storage_object *version_copy(const struct version *v)
+{
+    size_t size = la_storage_object_total_size(v->obj);
+    la_storage_object *obj = la_storage_alloc_object(v->obj->key, strlen(v->obj->key), size);
+    if (obj == NULL)
+        return NULL;
+    memcpy(obj->header, v->obj->header, size);
+    obj->data_length = v->obj->data_length;
+    return obj;
+}
+
+/*
+ * Copy just the key and header of v, with no revisions or data.
+ */
+static la_storage_object *version_copy_header(const struct version *v)
+{
+    la_storage_object *obj = la_storage_alloc_object(v->obj->key, strlen(v->obj->key), sizeof(la_storage_object_header));
+    if (obj == NULL)
+        return NULL;
+    memcpy(obj->header, v->obj->header, sizeof(la_storage_object_header));
+    obj->header->rev_count = 0;
+    return obj;
+}
+
+/*
+ * Find the first slot with a seq after since.
+ */
+static size_t seq_search(const la_storage_object_store *store, uint64_t since)
+{
+    size_t lo = 0, hi = store->seq_count, mid;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (store->by_seq[mid].seq <= since)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Find the first doc whose key is not before key, or NULL if there is
+ * none. If links is not NULL, it is set to the link to that doc at each
+ * level; if before is not NULL, it is set to the doc just before it.
+ */
+static struct doc *key_seek(la_storage_object_store *store, const char *key, struct doc ***links, struct doc **before)
+{
+    struct doc **next = store->by_key;
+    struct doc *prev = NULL;
+    int i;
+
+    for (i = KEY_LEVELS - 1; i >= 0; i--)
+    {
+        while (next[i] != NULL && strcmp(next[i]->key, key) < 0)
+        {
+            prev = next[i];
+            next = prev->next;
+        }
+        if (links != NULL)
+            links[i] = &next[i];
+    }
+    if (before != NULL)
+        *before = prev;
+    return next[0];
+}
+
+/*
+ * Pick a level count for a new doc: each level past the first with
+ * probability 1/4.
+ */
+static int key_levels(la_storage_object_store *store)
+{
+    uint32_t x = store->key_random != 0 ? store->key_random : 2463534242u;
+    int levels = 1;
+
+    // xorshift32; good enough for balancing.
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    store->key_random = x;
+    while (levels < KEY_LEVELS && (x & 3) == 0)
+    {
+        levels++;
+        x >>= 2;
+    }
+    return levels;
+}
+
+static void key_insert(la_storage_object_store *store, struct doc *doc)
+{
+    struct doc **links[KEY_LEVELS];
+    struct doc *next = key_seek(store, doc->key, links, &doc->prev);
+    int i;
+
+    for (i = 0; i < doc->levels; i++)
+    {
+        doc->next[i] = *links[i];
+        *links[i] = doc;
+    }
+    if (next != NULL)
+        next->prev = doc;
+    else
+        store->last_key = doc;
+}
+
+static void key_remove(la_storage_object_store *store, struct doc *doc)
+{
+    struct doc **links[KEY_LEVELS];
+    int i;
+
+    key_seek(store, doc->key, links, NULL);
+    for (i = 0; i < doc->levels; i++)
+        *links[i] = doc->next[i];
+    if (doc->next[0] != NULL)
+        doc->next[0]->prev = doc->prev;
+    else
+        store->last_key = doc->prev;
+}
+
+static int seq_reserve(la_storage_object_store *store, size_t count)
+{
+    size_t capacity = store->seq_capacity > 0 ? store->seq_capacity : 64;
+    struct seq_slot *slots;
+
+    while (capacity < store->seq_count + count)
+        capacity *= 2;
+    if (capacity == store->seq_capacity)
+        return 0;
+    if ((slots = (struct seq_slot *) realloc(store->by_seq, capacity * sizeof(struct seq_slot))) == NULL)
+        return -1;
+    store->by_seq = slots;
+    store->seq_capacity = capacity;
+    return 0;
+}
+
+/*
+ * Squeeze the holes out of by_seq once they make up half of it.
+ */
+static void seq_compact(la_storage_object_store *store)
+{
+    size_t i, j = 0;
+
+    if (store->holes < 64 || store->holes < store->seq_count / 2)
+        return;
+    for (i = 0; i < store->seq_count; i++)
+    {
+        if (store->by_seq[i].doc == NULL)
+            continue;
+        store->by_seq[j] = store->by_seq[i];
+        store->by_seq[j].doc->slot = j;
+        j++;
+    }
+    store->seq_count = j;
+    store->holes = 0;
+}
+
+/*
+ * Take a reference to every current version with a seq after since and
+ * no later than until, in seq order. Call with the store locked.
+ */
+static int collect_versions(la_storage_object_store *store, uint64_t since, uint64_t until,
+                            struct version ***versions, size_t *count)
+{
+    size_t i, n = 0, start = seq_search(store, since);
+    size_t end = (until == UINT64_MAX) ? store->seq_count : seq_search(store, until);
+    struct version **v;
+
+    if (end < start)
+        end = start;
+    if ((v = (struct version **) malloc((end - start + 1) * sizeof(struct version *))) == NULL)
+        return -1;
+    for (i = start; i < end; i++)
+    {
+        if (store->by_seq[i].doc == NULL)
+            continue;
+        v[n] = store->by_seq[i].doc->current;
+        version_ref(v[n]);
+        n++;
+    }
+    *versions = v;
+    *count = n;
+    return 0;
+}
+
+static void release_versions(struct version **versions, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++)
+        version_unref(versions[i]);
+    free(versions);
+}
+
+/*
+ * Everything a write changed, so that a batch that fails part way can
+ * be put back the way it was.
+ */
+struct undo
+{
+    struct doc *doc;
+    struct version *old;    /* NULL if the write created doc. */
+    size_t old_slot;
+};
+
+struct batch
+{
+    struct undo *undo;
+    size_t count;
+    size_t seq_count;
+    size_t holes;
+    uint64_t lastseq;
+    uint64_t size;
+};
+
+static int batch_begin(la_storage_object_store *store, struct batch *batch, size_t count)
+{
+    if (seq_reserve(store, count) != 0)
+        return -1;
+    if ((batch->undo = (struct undo *) malloc(count * sizeof(struct undo))) == NULL)
+        return -1;
+    batch->count = 0;
+    batch->seq_count = store->seq_count;
+    batch->holes = store->holes;
+    batch->lastseq = store->lastseq;
+    batch->size = store->size;
+    return 0;
+}
+
+static void batch_commit(la_storage_object_store *store, struct batch *batch)
+{
+    size_t i;
+    for (i = 0; i < batch->count; i++)
+    {
+        if (batch->undo[i].old != NULL)
+            version_unref(batch->undo[i].old);
+    }
+    free(batch->undo);
+    seq_compact(store);
+}
+
+static void batch_abort(la_storage_object_store *store, struct batch *batch)
+{
+    struct undo *u;
+
+    while (batch->count > 0)
+    {
+        u = &batch->undo[--batch->count];
+        version_unref(u->doc->current);
+        if (u->old == NULL)
+        {
+            HASH_DEL(store->by_id, u->doc);
+            key_remove(store, u->doc);
+            free(u->doc->key);
+            free(u->doc);
+            continue;
+        }
+        u->doc->current = u->old;
+        u->doc->slot = u->old_slot;
+        store->by_seq[u->old_slot].doc = u->doc;
+    }
+    free(batch->undo);
+    store->seq_count = batch->seq_count;
+    store->holes = batch->holes;
+    store->lastseq = batch->lastseq;
+    store->size = batch->size;
+}
+
+/*
+ * Make obj the current version of its key, with the next seq. The
+ * batch must have room for this write (see batch_begin).
+ */
+static la_storage_object_put_result batch_write(la_storage_object_store *store, struct batch *batch,
+                                                struct doc *doc, la_storage_object *obj)
+{
+    struct version *v;
+    struct undo *u = &batch->undo[batch->count];
+    int levels;
+
+    obj->header->seq = store->lastseq + 1;
+    if ((v = version_new(obj)) == NULL)
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    if (doc == NULL)
+    {
+        levels = key_levels(store);
+        if ((doc = (struct doc *) calloc(1, sizeof(struct doc) + levels * sizeof(struct doc *))) == NULL
+            || (doc->key = strdup(obj->key)) == NULL)
+        {
+            free(doc);
+            version_unref(v);
+            return LA_STORAGE_OBJECT_PUT_ERROR;
+        }
+        doc->levels = levels;
+        HASH_ADD_KEYPTR(hh, store->by_id, doc->key, strlen(doc->key), doc);
+        key_insert(store, doc);
+        u->old = NULL;
+    }
+    else
+    {
+        u->old = doc->current;
+        u->old_slot = doc->slot;
+        store->by_seq[doc->slot].doc = NULL;
+        store->holes++;
+        store->size -= version_size(doc->current);
+    }
+    u->doc = doc;
+    batch->count++;
+
+    doc->current = v;
+    doc->slot = store->seq_count;
+    store->by_seq[store->seq_count].seq = obj->header->seq;
+    store->by_seq[store->seq_count].doc = doc;
+    store->seq_count++;
+    store->lastseq = obj->header->seq;
+    store->size += version_size(v);
+    return LA_STORAGE_OBJECT_PUT_SUCCESS;
+}
+
+/*
+ * Put obj as part of batch, checking for conflicts as in the other
+ * drivers.
+ */
+static la_storage_object_put_result memory_do_put(la_storage_object_store *store, struct batch *batch,
+                                                  const la_storage_rev_t *rev, la_storage_object *obj)
+{
+    struct doc *doc;
+    const la_storage_object *old;
+    unsigned int oldrev_count;
+    int rc;
+
+    HASH_FIND_STR(store->by_id, obj->key, doc);
+    if (doc == NULL)
+    {
+        obj->header->doc_seq = 1;
+        obj->header->rev_count = 0;
+        return batch_write(store, batch, NULL, obj);
+    }
+
+    old = doc->current->obj;
+    if (rev == NULL || memcmp(rev, &old->header->rev, sizeof(la_storage_rev_t)) != 0)
+        return LA_STORAGE_OBJECT_PUT_CONFLICT;
+
+    // The new history is the old current revision, then the old history.
+    obj->header->doc_seq = old->header->doc_seq + 1;
+    oldrev_count = old->header->rev_count;
+    if (oldrev_count < LA_OBJECT_MAX_REVISION_COUNT)
+        oldrev_count++;
+    rc = obj->header->rev_count;
+    obj->header->rev_count = oldrev_count;
+    if (la_storage_object_reserve(obj, la_storage_object_total_size(obj)) != 0)
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    memmove(la_storage_object_get_data(obj), obj->header->revs_data + (rc * sizeof(la_storage_rev_t)), obj->data_length);
+    memcpy(obj->header->revs_data + sizeof(la_storage_rev_t), old->header->revs_data,
+           (oldrev_count - 1) * sizeof(la_storage_rev_t));
+    memcpy(obj->header->revs_data, &old->header->rev, sizeof(la_storage_rev_t));
+    return batch_write(store, batch, doc, obj);
+}
+
+static void store_free(la_storage_object_store *store)
+{
+    struct doc *doc, *tmp;
+
+    HASH_ITER(hh, store->by_id, doc, tmp)
+    {
+        HASH_DEL(store->by_id, doc);
+        version_unref(doc->current);
+        free(doc->key);
+        free(doc);
+    }
+    pthread_rwlock_destroy(&store->lock);
+    free(store->by_seq);
+    free(store->name);
+    free(store);
+}
+
+static char *snapshot_path(la_storage_env *env, const char *name, const char *suffix)
+{
+    const char *parts[2];
+    char *path, *full;
+
+    parts[0] = env->name;
+    parts[1] = name;
+    if ((path = string_join("/", (char * const *) parts, 2)) == NULL)
+        return NULL;
+    full = string_append(path, suffix);
+    free(path);
+    return full;
+}
+
+/*
+ * A snapshot file is SNAPSHOT_MAGIC and the store's lastseq, then each
+ * document as a 16-bit key length, 32-bit object size, key and object
+ * header, revisions and data, in seq order, then the CRC-32C of all
+ * that.
+ */
+static int snapshot_write(FILE *f, const void *data, size_t length, uint32_t *crc)
+{
+    *crc = la_crc32c(*crc, data, length);
+    return fwrite(data, 1, length, f) == length ? 0 : -1;
+}
+
+/*
+ * Write a snapshot of store, if it changed since the last one. The
+ * store is only locked while the versions to write are collected.
+ */
+static int snapshot_store(la_storage_object_store *store)
+{
+    struct version **versions;
+    size_t count, i;
+    uint64_t lastseq;
+    uint32_t crc = 0, size;
+    uint16_t key_length;
+    char *path, *temp;
+    FILE *f;
+    int ret = -1;
+
+    pthread_rwlock_rdlock(&store->lock);
+    lastseq = store->lastseq;
+    if (store->deleted || lastseq == store->snapshot_seq)
+    {
+        pthread_rwlock_unlock(&store->lock);
+        return 0;
+    }
+    if (collect_versions(store, 0, UINT64_MAX, &versions, &count) != 0)
+    {
+        pthread_rwlock_unlock(&store->lock);
+        return -1;
+    }
+    pthread_rwlock_unlock(&store->lock);
+
+    path = snapshot_path(store->env, store->name, SNAPSHOT_SUFFIX);
+    temp = snapshot_path(store->env, store->name, SNAPSHOT_TEMP_SUFFIX);
+    if (path == NULL || temp == NULL || (f = fopen(temp, "w")) == NULL)
+        goto done;
+    if (snapshot_write(f, SNAPSHOT_MAGIC, 8, &crc) != 0
+        || snapshot_write(f, &lastseq, sizeof(uint64_t), &crc) != 0)
+        goto fail;
+    for (i = 0; i < count; i++)
+    {
+        key_length = (uint16_t) strlen(versions[i]->obj->key);
+        size = (uint32_t) la_storage_object_total_size(versions[i]->obj);
+        if (snapshot_write(f, &key_length, sizeof(uint16_t), &crc) != 0
+            || snapshot_write(f, &size, sizeof(uint32_t), &crc) != 0
+            || snapshot_write(f, versions[i]->obj->key, key_length, &crc) != 0
+            || snapshot_write(f, versions[i]->obj->header, size, &crc) != 0)
+            goto fail;
+    }
+    if (fwrite(&crc, sizeof(uint32_t), 1, f) != 1 || fflush(f) != 0 || fsync(fileno(f)) != 0)
+        goto fail;
+    if (fclose(f) != 0 || rename(temp, path) != 0)
+    {
+        unlink(temp);
+        goto done;
+    }
+
+    pthread_rwlock_wrlock(&store->lock);
+    if (lastseq > store->snapshot_seq)
+        store->snapshot_seq = lastseq;
+    pthread_rwlock_unlock(&store->lock);
+    ret = 0;
+    goto done;
+
+fail:
+    fclose(f);
+    unlink(temp);
+done:
+    if (ret != 0)
+        syslog(LOG_NOTICE, "could not write snapshot of %s: %s", store->name, strerror(errno));
+    release_versions(versions, count);
+    free(path);
+    free(temp);
+    return ret;
+}
+
+/*
+ * Load a store from its snapshot file.
+ *
+ * @return 0 on success, 1 if there is no snapshot, -1 on error.
+ */
+static int snapshot_load(la_storage_object_store *store, const char *path)
+{
+    struct stat st;
+    unsigned char *data, *p, *end;
+    uint64_t lastseq;
+    uint32_t crc, size;
+    uint16_t key_length;
+    la_storage_object *obj;
+    struct batch batch;
+    int fd, ret = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return errno == ENOENT ? 1 : -1;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) (8 + sizeof(uint64_t) + sizeof(uint32_t))
+        || (data = (unsigned char *) malloc(st.st_size)) == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    if (read(fd, data, st.st_size) != st.st_size)
+        goto done;
+    end = data + st.st_size - sizeof(uint32_t);
+    memcpy(&crc, end, sizeof(uint32_t));
+    if (memcmp(data, SNAPSHOT_MAGIC, 8) != 0 || la_crc32c(0, data, end - data) != crc)
+    {
+        syslog(LOG_NOTICE, "%s is not a valid snapshot", path);
+        goto done;
+    }
+    memcpy(&lastseq, data + 8, sizeof(uint64_t));
+
+    for (p = data + 8 + sizeof(uint64_t); p < end; p += key_length + size)
+    {
+        if (end - p < (ptrdiff_t) (sizeof(uint16_t) + sizeof(uint32_t)))
+            goto done;
+        memcpy(&key_length, p, sizeof(uint16_t));
+        memcpy(&size, p + sizeof(uint16_t), sizeof(uint32_t));
+        p += sizeof(uint16_t) + sizeof(uint32_t);
+        if (end - p < (ptrdiff_t) key_length + size || size < sizeof(la_storage_object_header))
+            goto done;
+        if ((obj = la_storage_alloc_object((const char *) p, key_length, size)) == NULL)
+            goto done;
+        memcpy(obj->header, p + key_length, size);
+        obj->data_length = (uint32_t) (size - sizeof(la_storage_object_header) - (obj->header->rev_count * sizeof(la_storage_rev_t)));
+
+        // Snapshots are written in seq order, so keeping each seq keeps
+        // the index sorted.
+        store->lastseq = obj->header->seq - 1;
+        if (batch_begin(store, &batch, 1) != 0)
+        {
+            la_storage_destroy_object(obj);
+            goto done;
+        }
+        if (batch_write(store, &batch, NULL, obj) != LA_STORAGE_OBJECT_PUT_SUCCESS)
+        {
+            batch_abort(store, &batch);
+            la_storage_destroy_object(obj);
+            goto done;
+        }
+        batch_commit(store, &batch);
+        la_storage_destroy_object(obj);
+    }
+    store->lastseq = lastseq;
+    store->snapshot_seq = lastseq;
+    ret = 0;
+
+done:
+    free(data);
+    close(fd);
+    return ret;
+}
+
+static void *snapshot_main(void *arg)
+{
+    la_storage_env *env = (la_storage_env *) arg;
+    la_storage_object_store *store, *tmp;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&env->lock);
+    while (!env->snapshot_stop)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += env->config.memory_snapshot_interval;
+        pthread_cond_timedwait(&env->snapshot_cond, &env->lock, &deadline);
+        if (env->snapshot_stop)
+            break;
+        // Stores aren't freed while the env is open, so holding the
+        // env lock while writing keeps only opens and closes waiting.
+        HASH_ITER(hh, env->stores, store, tmp)
+            snapshot_store(store);
+    }
+    pthread_mutex_unlock(&env->lock);
+    return NULL;
+}
+
+static la_storage_env *memory_la_storage_open_env(const char *name, const la_storage_env_config_t *config)
+{
+    struct stat st;
+    la_storage_env *env = (la_storage_env *) calloc(1, sizeof(struct la_storage_env));
+    if (env == NULL)
+        return NULL;
+    if ((env->name = strdup(name != NULL ? name : "")) == NULL)
+    {
+        free(env);
+        return NULL;
+    }
+    memcpy(&env->config, config, sizeof(la_storage_env_config_t));
+
+    if (config->memory_snapshot_interval > 0)
+    {
+        if (stat(name, &st) != 0)
+        {
+            if (errno != ENOENT || mkdir(name, 0777) != 0)
+            {
+                debug("failed to create directory %s: %s\n", name, strerror(errno));
+                free(env->name);
+                free(env);
+                return NULL;
+            }
+        }
+        else if (!S_ISDIR(st.st_mode))
+        {
+            debug("%s: %s\n", name, strerror(ENOTDIR));
+            free(env->name);
+            free(env);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&env->lock, NULL);
+    if (config->memory_snapshot_interval > 0)
+    {
+        pthread_cond_init(&env->snapshot_cond, NULL);
+        if (pthread_create(&env->snapshot, NULL, snapshot_main, env) == 0)
+            env->snapshot_running = 1;
+        else
+            syslog(LOG_NOTICE, "could not start snapshot thread: %s", strerror(errno));
+    }
+    return env;
+}
+
+static int memory_la_storage_close_env(la_storage_env *env)
+{
+    la_storage_object_store *store, *tmp;
+
+    if (env->snapshot_running)
+    {
+        pthread_mutex_lock(&env->lock);
+        env->snapshot_stop = 1;
+        pthread_cond_signal(&env->snapshot_cond);
+        pthread_mutex_unlock(&env->lock);
+        pthread_join(env->snapshot, NULL);
+    }
+    HASH_ITER(hh, env->stores, store, tmp)
+    {
+        HASH_DEL(env->stores, store);
+        if (env->config.memory_snapshot_interval > 0)
+            snapshot_store(store);
+        store_free(store);
+    }
+    if (env->config.memory_snapshot_interval > 0)
+        pthread_cond_destroy(&env->snapshot_cond);
+    pthread_mutex_destroy(&env->lock);
+    free(env->name);
+    free(env);
+    return 0;
+}
+
+static la_storage_open_result_t memory_la_storage_open(la_storage_env *env, const char *name, int flags, la_storage_object_store **_store)
+{
+    la_storage_object_store *store;
+    char *path;
+    int ret = 1;
+
+    pthread_mutex_lock(&env->lock);
+    HASH_FIND_STR(env->stores, name, store);
+    if (store != NULL)
+    {
+        if ((flags & LA_STORAGE_OPEN_FLAG_CREATE) && (flags & LA_STORAGE_OPEN_FLAG_EXCL))
+        {
+            pthread_mutex_unlock(&env->lock);
+            return LA_STORAGE_OPEN_EXISTS;
+        }
+        store->opens++;
+        pthread_mutex_unlock(&env->lock);
+        *_store = store;
+        return LA_STORAGE_OPEN_OK;
+    }
+
+    if ((store = (la_storage_object_store *) calloc(1, sizeof(struct la_storage_object_store))) == NULL
+        || (store->name = strdup(name)) == NULL)
+    {
+        pthread_mutex_unlock(&env->lock);
+        free(store);
+        return LA_STORAGE_OPEN_ERROR;
+    }
+    store->env = env;
+    pthread_rwlock_init(&store->lock, NULL);
+    if (env->config.memory_snapshot_interval > 0)
+    {
+        if ((path = snapshot_path(env, name, SNAPSHOT_SUFFIX)) != NULL)
+            ret = snapshot_load(store, path);
+        free(path);
+        if (path == NULL || ret < 0)
+        {
+            pthread_mutex_unlock(&env->lock);
+            store_free(store);
+            return LA_STORAGE_OPEN_ERROR;
+        }
+        if (ret == 0 && (flags & LA_STORAGE_OPEN_FLAG_CREATE) && (flags & LA_STORAGE_OPEN_FLAG_EXCL))
+        {
+            pthread_mutex_unlock(&env->lock);
+            store_free(store);
+            return LA_STORAGE_OPEN_EXISTS;
+        }
+    }
+    if (ret != 0 && !(flags & LA_STORAGE_OPEN_FLAG_CREATE))
+    {
+        pthread_mutex_unlock(&env->lock);
+        store_free(store);
+        return LA_STORAGE_OPEN_NOT_FOUND;
+    }
+    store->opens = 1;
+    HASH_ADD_KEYPTR(hh, env->stores, store->name, strlen(store->name), store);
+    pthread_mutex_unlock(&env->lock);
+    *_store = store;
+    return ret == 0 ? LA_STORAGE_OPEN_OK : LA_STORAGE_OPEN_CREATED;
+}
+
+static int memory_la_storage_close(la_storage_object_store *store)
+{
+    la_storage_env *env = store->env;
+    int last, deleted;
+
+    pthread_mutex_lock(&env->lock);
+    last = (--store->opens == 0);
+    deleted = store->deleted;
+    if (last && env->config.memory_snapshot_interval > 0)
+        snapshot_store(store);
+    pthread_mutex_unlock(&env->lock);
+    // Deleted stores are no longer in the env, so the last close frees them.
+    if (last && deleted)
+        store_free(store);
+    return 0;
+}
+
+static int memory_la_storage_delete(la_storage_object_store *store)
+{
+    la_storage_env *env = store->env;
+    char *path;
+
+    pthread_mutex_lock(&env->lock);
+    if (!store->deleted)
+    {
+        HASH_DEL(env->stores, store);
+        store->deleted = 1;
+    }
+    pthread_mutex_unlock(&env->lock);
+    if (env->config.memory_snapshot_interval > 0 && (path = snapshot_path(env, store->name, SNAPSHOT_SUFFIX)) != NULL)
+    {
+        unlink(path);
+        free(path);
+    }
+    return 0;
+}
+
+static la_storage_object_get_result memory_la_storage_get(la_storage_object_store *store, const char *key,
+                                                          const la_storage_rev_t *rev, la_storage_object **obj)
+{
+    struct doc *doc;
+    la_storage_object_get_result result = LA_STORAGE_OBJECT_GET_OK;
+
+    pthread_rwlock_rdlock(&store->lock);
+    HASH_FIND_STR(store->by_id, key, doc);
+    if (doc == NULL || (rev != NULL && memcmp(rev, &doc->current->obj->header->rev, sizeof(la_storage_rev_t)) != 0))
+        result = LA_STORAGE_OBJECT_GET_NOT_FOUND;
+    else if (obj != NULL && (*obj = version_copy(doc->current)) == NULL)
+        result = LA_STORAGE_OBJECT_GET_ERROR;
+    pthread_rwlock_unlock(&store->lock);
+    return result;
+}
+
+static la_storage_object_get_result memory_la_storage_get_many(la_storage_object_store *store, const char * const *keys,
+                                                               size_t count, la_storage_object **objs)
+{
+    struct doc *doc;
+    size_t i;
+
+    pthread_rwlock_rdlock(&store->lock);
+    for (i = 0; i < count; i++)
+    {
+        HASH_FIND_STR(store->by_id, keys[i], doc);
+        objs[i] = NULL;
+        if (doc != NULL && (objs[i] = version_copy(doc->current)) == NULL)
+        {
+            pthread_rwlock_unlock(&store->lock);
+            while (i-- > 0)
+            {
+                if (objs[i] != NULL)
+                    la_storage_destroy_object(objs[i]);
+                objs[i] = NULL;
+            }
+            return LA_STORAGE_OBJECT_GET_ERROR;
+        }
+    }
+    pthread_rwlock_unlock(&store->lock);
+    return LA_STORAGE_OBJECT_GET_OK;
+}
+
+/**
+ * Get an object pointing straight at its current version, which is
+ * kept alive, as the object's cookie, until release.
+ */
+static la_storage_object_get_result memory_la_storage_get_borrowed(la_storage_object_store *store, const char *key,
+                                                                   const la_storage_rev_t *rev, la_storage_borrowed_object *obj)
+{
+    struct doc *doc;
+    struct version *v;
+
+    pthread_rwlock_rdlock(&store->lock);
+    HASH_FIND_STR(store->by_id, key, doc);
+    if (doc == NULL || (rev != NULL && memcmp(rev, &doc->current->obj->header->rev, sizeof(la_storage_rev_t)) != 0))
+    {
+        pthread_rwlock_unlock(&store->lock);
+        return LA_STORAGE_OBJECT_GET_NOT_FOUND;
+    }
+    v = doc->current;
+    version_ref(v);
+    pthread_rwlock_unlock(&store->lock);
+
+    memcpy(&obj->header, v->obj->header, sizeof(la_storage_object_header));
+    obj->revs = (const la_storage_rev_t *) v->obj->header->revs_data;
+    obj->data = la_storage_object_get_data(v->obj);
+    obj->data_length = v->obj->data_length;
+    obj->cookie = v;
+    return LA_STORAGE_OBJECT_GET_OK;
+}
+
+static void memory_la_storage_release(la_storage_object_store *store, la_storage_borrowed_object *obj)
+{
+    (void) store;
+    version_unref((struct version *) obj->cookie);
+}
+
+static la_storage_object_get_result memory_la_storage_get_rev(la_storage_object_store *store, const char *key, la_storage_rev_t *rev)
+{
+    struct doc *doc;
+
+    pthread_rwlock_rdlock(&store->lock);
+    HASH_FIND_STR(store->by_id, key, doc);
+    if (doc != NULL && rev != NULL)
+        memcpy(rev, &doc->current->obj->header->rev, sizeof(la_storage_rev_t));
+    pthread_rwlock_unlock(&store->lock);
+    return doc != NULL ? LA_STORAGE_OBJECT_GET_OK : LA_STORAGE_OBJECT_GET_NOT_FOUND;
+}
+
+static int memory_la_storage_get_all_revs(la_storage_object_store *store, const char *key, uint64_t *start, la_storage_rev_t **revs)
+{
+    la_storage_object *obj;
+    int count;
+
+    if (memory_la_storage_get(store, key, NULL, &obj) != LA_STORAGE_OBJECT_GET_OK)
+        return -1;
+    if (start != NULL)
+        *start = obj->header->doc_seq;
+    if (revs != NULL)
+    {
+        *revs = malloc(sizeof(la_storage_rev_t) * obj->header->rev_count);
+        if (*revs != NULL)
+            memcpy(*revs, obj->header->revs_data, obj->header->rev_count * sizeof(la_storage_rev_t));
+    }
+    count = obj->header->rev_count;
+    la_storage_destroy_object(obj);
+    return count;
+}
+
+static la_storage_object_put_result memory_la_storage_set_revs(la_storage_object_store *store, const char *key, la_storage_rev_t *revs, size_t revcount)
+{
+    struct doc *doc;
+    struct version *v;
+    la_storage_object *obj = NULL;
+    la_storage_object_put_result result = LA_STORAGE_OBJECT_PUT_ERROR;
+    int rc;
+
+    revcount = la_min(revcount, LA_OBJECT_MAX_REVISION_COUNT);
+    pthread_rwlock_wrlock(&store->lock);
+    HASH_FIND_STR(store->by_id, key, doc);
+    if (doc != NULL && (obj = version_copy(doc->current)) != NULL)
+    {
+        rc = obj->header->rev_count;
+        obj->header->rev_count = (uint16_t) revcount;
+        if (la_storage_object_reserve(obj, la_storage_object_total_size(obj)) == 0)
+        {
+            memmove(la_storage_object_get_data(obj), obj->header->revs_data + (rc * sizeof(la_storage_rev_t)), obj->data_length);
+            memcpy(obj->header->revs_data, revs, revcount * sizeof(la_storage_rev_t));
+            // Same version, same seq; swap in the new copy where the old one was.
+            if ((v = version_new(obj)) != NULL)
+            {
+                store->size += version_size(v);
+                store->size -= version_size(doc->current);
+                version_unref(doc->current);
+                doc->current = v;
+                result = LA_STORAGE_OBJECT_PUT_SUCCESS;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&store->lock);
+    if (obj != NULL)
+        la_storage_destroy_object(obj);
+    return result;
+}
+
+static la_storage_object_put_result memory_la_storage_put(la_storage_object_store *store, const la_storage_rev_t *rev, la_storage_object *obj)
+{
+    struct batch batch;
+    la_storage_object_put_result result;
+
+    pthread_rwlock_wrlock(&store->lock);
+    if (batch_begin(store, &batch, 1) != 0)
+    {
+        pthread_rwlock_unlock(&store->lock);
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    }
+    result = memory_do_put(store, &batch, rev, obj);
+    if (result == LA_STORAGE_OBJECT_PUT_ERROR)
+        batch_abort(store, &batch);
+    else
+        batch_commit(store, &batch);
+    pthread_rwlock_unlock(&store->lock);
+    return result;
+}
+
+/**
+ * Put many objects at once. If any put fails (for lack of memory), the
+ * ones before it are undone.
+ */
+static la_storage_object_put_result memory_la_storage_put_bulk(la_storage_object_store *store, const la_storage_rev_t * const *revs,
+                                                               la_storage_object **objs, size_t count,
+                                                               la_storage_object_put_result *results)
+{
+    struct batch batch;
+    size_t i;
+
+    pthread_rwlock_wrlock(&store->lock);
+    if (batch_begin(store, &batch, count) != 0)
+    {
+        pthread_rwlock_unlock(&store->lock);
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    }
+    for (i = 0; i < count; i++)
+    {
+        results[i] = memory_do_put(store, &batch, revs[i], objs[i]);
+        if (results[i] == LA_STORAGE_OBJECT_PUT_ERROR)
+        {
+            batch_abort(store, &batch);
+            pthread_rwlock_unlock(&store->lock);
+            return LA_STORAGE_OBJECT_PUT_ERROR;
+        }
+    }
+    batch_commit(store, &batch);
+    pthread_rwlock_unlock(&store->lock);
+    return LA_STORAGE_OBJECT_PUT_SUCCESS;
+}
+
+static la_storage_object_put_result memory_la_storage_replace(la_storage_object_store *store, la_storage_object *obj)
+{
+    struct batch batch;
+    struct doc *doc;
+    la_storage_object_put_result result;
+
+    pthread_rwlock_wrlock(&store->lock);
+    if (batch_begin(store, &batch, 1) != 0)
+    {
+        pthread_rwlock_unlock(&store->lock);
+        return LA_STORAGE_OBJECT_PUT_ERROR;
+    }
+    HASH_FIND_STR(store->by_id, obj->key, doc);
+    result = batch_write(store, &batch, doc, obj);
+    if (result == LA_STORAGE_OBJECT_PUT_SUCCESS)
+        batch_commit(store, &batch);
+    else
+        batch_abort(store, &batch);
+    pthread_rwlock_unlock(&store->lock);
+    return result;
+}
+
+static uint64_t memory_la_storage_lastseq(la_storage_object_store *store)
+{
+    uint64_t lastseq;
+
+    pthread_rwlock_rdlock(&store->lock);
+    lastseq = store->lastseq;
+    pthread_rwlock_unlock(&store->lock);
+    return lastseq;
+}
+
+static int memory_la_storage_stat(la_storage_object_store *store, la_storage_stat_t *stat)
+{
+    pthread_rwlock_rdlock(&store->lock);
+    stat->numkeys = (int) HASH_COUNT(store->by_id);
+    stat->size = store->size;
+    pthread_rwlock_unlock(&store->lock);
+    return 0;
+}
+
+/*
+ * Iterators see the store as it was when they were opened; opening one
+ * takes a reference to each version it will return.
+ */
+static la_storage_object_iterator *memory_la_storage_iterator_open_range(la_storage_object_store *store, uint64_t from_seq, uint64_t to_seq, int flags)
+{
+    la_storage_object_iterator *it = (la_storage_object_iterator *) malloc(sizeof(struct la_storage_object_iterator));
+    if (it == NULL)
+        return NULL;
+    it->next = 0;
+    it->flags = flags;
+    pthread_rwlock_rdlock(&store->lock);
+    if (collect_versions(store, from_seq, to_seq, &it->versions, &it->count) != 0)
+    {
+        pthread_rwlock_unlock(&store->lock);
+        free(it);
+        return NULL;
+    }
+    pthread_rwlock_unlock(&store->lock);
+    return it;
+}
+
+static la_storage_object_iterator *memory_la_storage_iterator_open(la_storage_object_store *store, uint64_t since)
+{
+    return memory_la_storage_iterator_open_range(store, since, UINT64_MAX, 0);
+}
+
+/*
+ * A key range iterator walks the skip list from its first key, so
+ * opening one costs the seek plus the documents it returns. strcmp
+ * orders keys the same way the other drivers do.
+ */
+static la_storage_object_iterator *memory_la_storage_iterator_open_keyrange(la_storage_object_store *store, const char *startkey,
+                                                                             const char *endkey, int descending, uint64_t limit, int flags)
+{
+    la_storage_object_iterator *it = (la_storage_object_iterator *) malloc(sizeof(struct la_storage_object_iterator));
+    const char *lo = descending ? endkey : startkey;
+    const char *hi = descending ? startkey : endkey;
+    struct doc *doc, *before;
+    struct version **v;
+    size_t capacity = 64;
+    
+    if (it == NULL)
+        return NULL;
+    it->next = 0;
+    it->count = 0;
+    it->flags = flags;
+    if ((it->versions = (struct version **) malloc(capacity * sizeof(struct version *))) == NULL)
+    {
+        free(it);
+        return NULL;
+    }
+    pthread_rwlock_rdlock(&store->lock);
+    if (!descending)
+        doc = (lo != NULL) ? key_seek(store, lo, NULL, NULL) : store->by_key[0];
+    else if (hi == NULL)
+        doc = store->last_key;
+    else if ((doc = key_seek(store, hi, NULL, &before)) == NULL || strcmp(doc->key, hi) != 0)
+        doc = before;
+    while (doc != NULL && (limit == 0 || it->count < limit))
+    {
+        if (descending ? (lo != NULL && strcmp(doc->key, lo) < 0) : (hi != NULL && strcmp(doc->key, hi) > 0))
+            break;
+        if (!(flags & LA_STORAGE_ITERATOR_SKIP_DELETED) || !doc->current->obj->header->deleted)
+        {
+            if (it->count == capacity)
+            {
+                if ((v = (struct version **) realloc(it->versions, capacity * 2 * sizeof(struct version *))) == NULL)
+                {
+                    pthread_rwlock_unlock(&store->lock);
+                    release_versions(it->versions, it->count);
+                    free(it);
+                    return NULL;
+                }
+                it->versions = v;
+                capacity *= 2;
+            }
+            it->versions[it->count] = doc->current;
+            version_ref(doc->current);
+            it->count++;
+        }
+        doc = descending ? doc->prev : doc->next[0];
+    }
+    pthread_rwlock_unlock(&store->lock);
+    return it;
+}
+
+static la_storage_object_iterator_result memory_la_storage_iterator_next(la_storage_object_iterator *it, la_storage_object **obj)
+{
+    if (it->next >= it->count)
+        return LA_STORAGE_OBJECT_ITERATOR_END;
+    if (obj != NULL && (it->flags & LA_STORAGE_ITERATOR_HEADERS_ONLY))
+    {
+        if ((*obj = version_copy_header(it->versions[it->next])) == NULL)
+            return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+    }
+    else if (obj != NULL && (*obj = version_copy(it->versions[it->next])) == NULL)
+        return LA_STORAGE_OBJECT_ITERATOR_ERROR;
+    it->next++;
+    return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
+}
+
+static void memory_la_storage_iterator_close(la_storage_object_iterator *it)
+{
+    release_versions(it->versions, it->count);
+    free(it);
+}
+
+static la_object_store_driver_t memory_driver = {
+    .name = "Memory",
+    .open_env = memory_la_storage_open_env,
+    .close_env = memory_la_storage_close_env,
+    .open_store = memory_la_storage_open,
+    .close_store = memory_la_storage_close,
+    .delete_store = memory_la_storage_delete,
+    .get = memory_la_storage_get,
+    .get_many = memory_la_storage_get_many,
+    .get_borrowed = memory_la_storage_get_borrowed,
+    .release = memory_la_storage_release,
+    .get_rev = memory_la_storage_get_rev,
+    .get_all_revs = memory_la_storage_get_all_revs,
+    .set_revs = memory_la_storage_set_revs,
+    .put = memory_la_storage_put,
+    .put_bulk = memory_la_storage_put_bulk,
+    .replace = memory_la_storage_replace,
+    .lastseq = memory_la_storage_lastseq,
+    .stat = memory_la_storage_stat,
+    .compact = NULL,
+    .iterator_open = memory_la_storage_iterator_open,
+    .iterator_open_range = memory_la_storage_iterator_open_range,
+    .iterator_open_keyrange = memory_la_storage_iterator_open_keyrange,
+    .iterator_next = memory_la_storage_iterator_next,
+    .iterator_close = memory_la_storage_iterator_close
+};
+
+__attribute__((constructor)) void memory_driver_init()
+{
+    la_storage_install_driver("Memory", &memory_driver);
+}
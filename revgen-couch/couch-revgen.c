@@ -94,6 +94,72 @@ static const unsigned char _LARGE_BIG[] = { 111 }; // Then int length, sign, the
 static la_buffer_t *DEBUG_BUFFER;
 #endif
 
+static void hash_value(const la_codec_value_t *value, MD5_CTX *md5);
+
+static int is_skipped(const char *key, const char * const *skip)
+{
+    if (skip == NULL)
+        return 0;
+    for (; *skip != NULL; skip++)
+        if (strcmp(key, *skip) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * Hash the members of an object, leaving out the keys in skip, and pass
+ * each member hashed to each (if not NULL). Stops and returns each's
+ * value if it's nonzero.
+ */
+static int hash_members(const la_codec_value_t *value, const char * const *skip, MD5_CTX *md5,
+                        la_revgen_member_fn each, void *baton)
+{
+    const char * const *s;
+    void *iter;
+    int len = (int) la_codec_object_size(value);
+    int ret;
+    
+    if (skip != NULL)
+    {
+        for (s = skip; *s != NULL; s++)
+            if (la_codec_object_get(value, *s) != NULL)
+                len--;
+    }
+    MD5_Update(md5, _SMALL_TUPLE_ONE, sizeof(_SMALL_TUPLE_ONE));
+    if (len > 0)
+    {
+        unsigned char c[] = { (unsigned char) (len >> 24),
+                              (unsigned char) (len >> 16),
+                              (unsigned char) (len >>  8),
+                              (unsigned char)  len };
+        MD5_Update(md5, _LIST, sizeof(_LIST));
+        MD5_Update(md5, c, 4);
+        for (iter = la_codec_object_iter((la_codec_value_t *) value); iter != NULL;
+             iter = la_codec_object_iter_next((la_codec_value_t *) value, iter))
+        {
+            const char *key = la_codec_object_iter_key(iter);
+            unsigned int keylen;
+            
+            if (is_skipped(key, skip))
+                continue;
+            keylen = (unsigned int) strlen(key);
+            unsigned char kc[] = { (unsigned char) (keylen >> 24),
+                                   (unsigned char) (keylen >> 16),
+                                   (unsigned char) (keylen >>  8),
+                                   (unsigned char)  keylen };
+            MD5_Update(md5, _SMALL_TUPLE_TWO, sizeof(_SMALL_TUPLE_TWO));
+            MD5_Update(md5, _BINARY, sizeof(_BINARY));
+            MD5_Update(md5, kc, 4);
+            MD5_Update(md5, key, keylen);
+            hash_value(la_codec_object_iter_value(iter), md5);
+            if (each != NULL && (ret = each(key, la_codec_object_iter_value(iter), baton)) != 0)
+                return ret;
+        }
+    }
+    MD5_Update(md5, _NIL, sizeof(_NIL));
+    return 0;
+}
+
 static void hash_value(const la_codec_value_t *value, MD5_CTX *md5)
 {
     switch (la_codec_typeof(value))
@@ -245,37 +311,8 @@ static void hash_value(const la_codec_value_t *value, MD5_CTX *md5)
         }
             
         case LA_CODEC_OBJECT:
-        {
-            MD5_Update(md5, _SMALL_TUPLE_ONE, sizeof(_SMALL_TUPLE_ONE));
-            int len = (int) la_codec_object_size(value);
-            unsigned char c[] = { (unsigned char) (len >> 24),
-                                  (unsigned char) (len >> 16),
-                                  (unsigned char) (len >>  8),
-                                  (unsigned char)  len };
-            void *iter = la_codec_object_iter((la_codec_value_t *) value);
-            if (len > 0)
-            {
-                MD5_Update(md5, _LIST, sizeof(_LIST));
-                MD5_Update(md5, c, 4);
-                while (iter != NULL)
-                {
-                    const char *key = la_codec_object_iter_key(iter);
-                    unsigned int keylen = (unsigned int) strlen(key);
-                    unsigned char kc[] = { (unsigned char) (keylen >> 24),
-                                           (unsigned char) (keylen >> 16),
-                                           (unsigned char) (keylen >>  8),
-                                           (unsigned char)  keylen };
-                    MD5_Update(md5, _SMALL_TUPLE_TWO, sizeof(_SMALL_TUPLE_TWO));
-                    MD5_Update(md5, _BINARY, sizeof(_BINARY));
-                    MD5_Update(md5, kc, 4);
-                    MD5_Update(md5, key, keylen);
-                    hash_value(la_codec_object_iter_value(iter), md5);
-                    iter = la_codec_object_iter_next((la_codec_value_t *) value, iter);
-                }
-            }
-            MD5_Update(md5, _NIL, sizeof(_NIL));
+            hash_members(value, NULL, md5, NULL, NULL);
             break;
-        }
     }
 }
 
@@ -288,10 +325,18 @@ static char hx(unsigned char c)
 
 int la_revgen(const la_codec_value_t *value, uint64_t old_start, la_storage_rev_t *oldrev,
               int is_delete, la_storage_rev_t *rev)
+{
+    return la_revgen_members(value, NULL, old_start, oldrev, is_delete, rev, NULL, NULL);
+}
+
+int la_revgen_members(const la_codec_value_t *value, const char * const *skip, uint64_t old_start,
+                      la_storage_rev_t *oldrev, int is_delete, la_storage_rev_t *rev,
+                      la_revgen_member_fn each, void *baton)
 {
     MD5_CTX md5;
     unsigned char digest[MD5_DIGEST_LENGTH];
     la_codec_value_t *start_value;
+    int ret;
     
 #if DEBUG
     DEBUG_BUFFER = la_buffer_new(256);
@@ -328,7 +373,20 @@ int la_revgen(const la_codec_value_t *value, uint64_t old_start, la_storage_rev_
         MD5_Update(&md5, oldrev->rev, LA_OBJECT_REVISION_LEN);
     }
     
-    hash_value(value, &md5);
+    if (la_codec_is_object(value))
+        ret = hash_members(value, skip, &md5, each, baton);
+    else
+    {
+        hash_value(value, &md5);
+        ret = 0;
+    }
+    if (ret != 0)
+    {
+#if DEBUG
+        la_buffer_destroy(DEBUG_BUFFER);
+#endif
+        return ret < 0 ? ret : -1;
+    }
     MD5_Update(&md5, _NIL, sizeof(_NIL));  // Attachments, TBD
     MD5_Update(&md5, _NIL, sizeof(_NIL));  // End outer list.
     
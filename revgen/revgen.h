@@ -45,6 +45,30 @@ int la_revgen(const la_codec_value_t *value, uint64_t old_start,
               la_storage_rev_t *oldrev, int is_delete,
               la_storage_rev_t *rev);
 
+/**
+ * Called by la_revgen_members for each member of the document, after it
+ * has been hashed.
+ *
+ * @return 0 to go on, nonzero to stop.
+ */
+typedef int (*la_revgen_member_fn)(const char *key, const la_codec_value_t *value, void *baton);
+
+/**
+ * Generate a revision number like la_revgen, leaving the keys in skip
+ * out of the document, and passing each member that is hashed to each,
+ * in the order it is hashed. This lets a caller encode the document in
+ * the same pass, without copying it to remove the reserved keys.
+ *
+ * @param skip A NULL-terminated list of top-level keys to leave out, or
+ *  NULL.
+ * @param each The member callback, or NULL.
+ * @return The length of the revision number, or a negative value if each
+ *  returned nonzero.
+ */
+int la_revgen_members(const la_codec_value_t *value, const char * const *skip, uint64_t old_start,
+                      la_storage_rev_t *oldrev, int is_delete, la_storage_rev_t *rev,
+                      la_revgen_member_fn each, void *baton);
+
 int la_rev_scan(const char *str, la_rev_t *rev);
 
 int la_rev_print(const la_rev_t rev, char *buffer, size_t size);
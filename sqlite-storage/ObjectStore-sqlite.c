@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include <sqlite3.h>
 
@@ -27,9 +28,6 @@
 #endif
 
 static const char *initsql = "BEGIN TRANSACTION; "
-"CREATE TABLE IF NOT EXISTS meta ( id TEXT UNIQUE PRIMARY KEY NOT NULL,"
-" seq INTEGER DEFAULT (1) ); "
-"INSERT OR IGNORE INTO meta VALUES ( 'meta', 1 ); "
 "CREATE TABLE IF NOT EXISTS docs ( "
 "  id TEXT UNIQUE PRIMARY KEY NOT NULL,"
 "  deleted INTEGER NOT NULL default (0),"
@@ -38,18 +36,21 @@ static const char *initsql = "BEGIN TRANSACTION; "
 "  seq INTEGER NOT NULL,"
 "  doc_seq INTEGER NOT NULL,"
 "  doc BLOB NOT NULL );"
-"CREATE TRIGGER IF NOT EXISTS onupdate AFTER UPDATE ON docs BEGIN"
-"  UPDATE meta SET seq = seq + 1 WHERE id = 'meta'; "
-"END;"
-"CREATE TRIGGER IF NOT EXISTS oninsert AFTER INSERT ON docs BEGIN"
-"  UPDATE meta SET seq = seq + 1 WHERE id = 'meta'; "
-"END;"
-"CREATE TRIGGER IF NOT EXISTS ondelete AFTER DELETE ON docs BEGIN"
-"  UPDATE meta SET seq = seq + 1 WHERE id = 'meta'; "
-"END; "
+"DROP TRIGGER IF EXISTS onupdate; "
+"DROP TRIGGER IF EXISTS oninsert; "
+"DROP TRIGGER IF EXISTS ondelete; "
 "CREATE INDEX IF NOT EXISTS seqindex ON docs ( seq ASC ); "
 "COMMIT;";
 
+/*
+ * The deleted column holds the header's flags: whether the document is
+ * deleted, whether its data is stored uncompressed, and whether its
+ * compressed data records its length.
+ */
+#define FLAG_DELETED      1
+#define FLAG_UNCOMPRESSED 2
+#define FLAG_SIZED        4
+
 #define COLUMN_ID       1
 #define COLUMN_DELETED  2
 #define COLUMN_REV      3
@@ -66,36 +67,138 @@ static const char *initsql = "BEGIN TRANSACTION; "
 #define RCOLUMN_DOCSEQ  5
 #define RCOLUMN_DOC     6
 
-static const char *begintxn = "BEGIN EXCLUSIVE TRANSACTION";
-static const char *endtxn = "COMMIT TRANSACTION";
-static const char *rollback = "ROLLBACK";
-static const char *getbyid = "SELECT * FROM docs WHERE id = ?;";
-static const char *getbyidrev = "SELECT * FROM docs WHERE id = ? AND rev = ?;";
-static const char *getrev = "SELECT rev FROM docs WHERE id = ?;";
-static const char *getmeta = "SELECT rev, oldrevs, seq, doc_seq FROM docs WHERE id = ?";
-static const char *getall = "SELECT * FROM docs;";
-static const char *getsince = "SELECT * FROM docs WHERE seq >= ?";
-static const char *putdoc = "INSERT OR REPLACE INTO docs VALUES (?, ?, ?, ?, ?, ?, ?);";
-static const char *getseq = "SELECT seq FROM meta";
+/*
+ * Statements that are prepared once per store and kept in its statement
+ * cache; see get_stmt and put_stmt.
+ */
+enum
+{
+    STMT_BEGIN = 0,
+    STMT_COMMIT,
+    STMT_ROLLBACK,
+    STMT_GETBYID,
+    STMT_GETBYIDREV,
+    STMT_GETREV,
+    STMT_GETMETA,
+    STMT_GETALL,
+    STMT_GETSINCE,
+    STMT_GETRANGE,
+    STMT_GETRANGEHEADERS,
+    STMT_PUTDOC,
+    STMT_MAXSEQ,
+    STMT_NUMKEYS,
+    STMT_PAGECOUNT,
+    STMT_PAGESIZE,
+    STMT_COUNT
+};
+
+static const char *stmt_sql[STMT_COUNT] = {
+    [STMT_BEGIN] = "BEGIN EXCLUSIVE TRANSACTION",
+    [STMT_COMMIT] = "COMMIT TRANSACTION",
+    [STMT_ROLLBACK] = "ROLLBACK",
+    [STMT_GETBYID] = "SELECT * FROM docs WHERE id = ?;",
+    [STMT_GETBYIDREV] = "SELECT * FROM docs WHERE id = ? AND rev = ?;",
+    [STMT_GETREV] = "SELECT rev FROM docs WHERE id = ?;",
+    [STMT_GETMETA] = "SELECT rev, oldrevs, seq, doc_seq FROM docs WHERE id = ?",
+    [STMT_GETALL] = "SELECT * FROM docs;",
+    [STMT_GETSINCE] = "SELECT * FROM docs WHERE seq >= ?",
+    [STMT_GETRANGE] = "SELECT * FROM docs WHERE seq > ? AND seq <= ? ORDER BY seq;",
+    [STMT_GETRANGEHEADERS] = "SELECT id, deleted, rev, X'' AS oldrevs, seq, doc_seq, X'' AS doc FROM docs "
+                             "WHERE seq > ? AND seq <= ? ORDER BY seq;",
+    [STMT_PUTDOC] = "INSERT OR REPLACE INTO docs VALUES (?, ?, ?, ?, ?, ?, ?);",
+    [STMT_MAXSEQ] = "SELECT MAX(seq) FROM docs;",
+    [STMT_NUMKEYS] = "SELECT COUNT(*) FROM docs;",
+    [STMT_PAGECOUNT] = "PRAGMA page_count;",
+    [STMT_PAGESIZE] = "PRAGMA page_size;"
+};
+
+static const char *getmany = "SELECT * FROM docs WHERE id IN (";
+
+/*
+ * Key range queries are built to fit their bounds, so aren't cached.
+ * Headers-only queries (here and STMT_GETRANGEHEADERS) put empty blobs
+ * in place of oldrevs and doc, which keeps the usual column order
+ * without reading the document.
+ */
+static const char *getkeys = "SELECT * FROM docs";
+static const char *getkeyheaders = "SELECT id, deleted, rev, X'' AS oldrevs, seq, doc_seq, X'' AS doc FROM docs";
 
 struct la_storage_env
 {
     char *name;
+    la_storage_env_config_t config;
+};
+
+/*
+ * A database connection and its statement cache.
+ */
+struct sqlite_conn
+{
+    sqlite3 *db;
+    
+    /**
+     * Prepared statements, indexed by STMT_*. A slot is NULL while its
+     * statement is in use (or not prepared yet).
+     */
+    sqlite3_stmt *stmts[STMT_COUNT];
+    
+    /**
+     * Nonzero while a thread owns this (read-only) connection.
+     */
+    int claimed;
 };
 
 struct la_storage_object_store
 {
     la_storage_env *env;
-    sqlite3 *db;
+    char *path;
+    
+    /**
+     * The read-write connection. It is opened with SQLITE_OPEN_FULLMUTEX
+     * and shared by every thread.
+     */
+    struct sqlite_conn writer;
+    
+    /**
+     * Read-only connections, handed out one per thread by read_conn.
+     * Each is opened the first time a thread claims it.
+     */
+    struct sqlite_conn *readers;
+    int reader_count;
+    pthread_key_t reader_key;
+    
+    /**
+     * The last sequence number written, seeded from MAX(seq) at open.
+     * Sequence numbers are only stored in each document's row, so we
+     * assume no other process writes to the same database.
+     */
+    uint64_t seq;
+    
+    /**
+     * The last sequence number handed out in the current write
+     * transaction; becomes seq once it commits.
+     */
+    uint64_t txn_seq;
+    
+    /**
+     * The number of documents, counted once at open and then kept up
+     * by the write paths the same way as seq, so stat never has to
+     * scan the table.
+     */
+    int64_t numkeys;
+    int64_t txn_numkeys;
 };
 
 struct la_storage_object_iterator
 {
     la_storage_object_store *store;
+    struct sqlite_conn *conn;
+    struct sqlite_conn own;     /* The iterator's own connection, if it has one. */
     sqlite3_stmt *stmt;
+    int which;      /* The STMT_* stmt came from, or -1 if it isn't cached. */
 };
 
-static la_storage_env *sqlite_la_storage_open_env(const char *name)
+static la_storage_env *sqlite_la_storage_open_env(const char *name, const la_storage_env_config_t *config)
 {
     struct stat st;
     int ret;
@@ -103,6 +206,7 @@ static la_storage_env *sqlite_la_storage_open_env(const char *name)
     if (env == NULL)
         return NULL;
     env->name = strdup(name);
+    memcpy(&env->config, config, sizeof(la_storage_env_config_t));
     ret = stat(name, &st);
     if (ret != 0)
     {
@@ -134,59 +238,339 @@ static la_storage_env *sqlite_la_storage_open_env(const char *name)
     return env;
 }
 
-static void sqlite_la_storage_close_env(la_storage_env *env)
+static int sqlite_la_storage_close_env(la_storage_env *env)
 {
     free(env->name);
     free(env);
+    return 0;
+}
+
+/*
+ * Open a connection to the store's database and apply the environment's
+ * pragmas. The journal mode and synchronous setting only matter for the
+ * writer.
+ */
+static int open_conn(la_storage_object_store *store, struct sqlite_conn *conn, int flags)
+{
+    const la_storage_env_config_t *config = &store->env->config;
+    char pragmas[256];
+    
+    memset(conn->stmts, 0, sizeof(conn->stmts));
+    if (sqlite3_open_v2(store->path, &conn->db, flags, NULL) != SQLITE_OK)
+    {
+        sqlite3_close(conn->db);
+        conn->db = NULL;
+        return -1;
+    }
+    sqlite3_busy_timeout(conn->db, 5000);
+    snprintf(pragmas, sizeof(pragmas), "PRAGMA mmap_size = %lld;", (long long) config->sqlite_mmap_size);
+    sqlite3_exec(conn->db, pragmas, NULL, NULL, NULL);
+    if (config->sqlite_cache_size != 0)
+    {
+        snprintf(pragmas, sizeof(pragmas), "PRAGMA cache_size = %d;", config->sqlite_cache_size);
+        sqlite3_exec(conn->db, pragmas, NULL, NULL, NULL);
+    }
+    if ((flags & SQLITE_OPEN_READONLY) == 0)
+    {
+        if (config->sqlite_wal)
+            sqlite3_exec(conn->db, "PRAGMA journal_mode = WAL;", NULL, NULL, NULL);
+        snprintf(pragmas, sizeof(pragmas), "PRAGMA synchronous = %d;", config->sqlite_synchronous);
+        sqlite3_exec(conn->db, pragmas, NULL, NULL, NULL);
+    }
+    return 0;
+}
+
+static void close_conn(struct sqlite_conn *conn)
+{
+    int i;
+    
+    if (conn->db == NULL)
+        return;
+    for (i = 0; i < STMT_COUNT; i++)
+    {
+        if (conn->stmts[i] != NULL)
+            sqlite3_finalize(conn->stmts[i]);
+    }
+    sqlite3_close(conn->db);
+    conn->db = NULL;
+}
+
+/*
+ * Called when a thread exits, to give its read connection back.
+ */
+static void release_reader(void *p)
+{
+    struct sqlite_conn *conn = (struct sqlite_conn *) p;
+    __sync_lock_release(&conn->claimed);
+}
+
+/*
+ * Return the connection this thread should read with: its own read-only
+ * connection if there is one to claim, and the writer otherwise.
+ */
+static struct sqlite_conn *read_conn(la_storage_object_store *store)
+{
+    struct sqlite_conn *conn;
+    int i;
+    
+    if (store->reader_count == 0)
+        return &store->writer;
+    conn = (struct sqlite_conn *) pthread_getspecific(store->reader_key);
+    if (conn != NULL)
+        return conn;
+    for (i = 0; i < store->reader_count; i++)
+    {
+        conn = &store->readers[i];
+        if (!__sync_bool_compare_and_swap(&conn->claimed, 0, 1))
+            continue;
+        if (conn->db == NULL && open_conn(store, conn, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX) != 0)
+        {
+            __sync_lock_release(&conn->claimed);
+            return &store->writer;
+        }
+        pthread_setspecific(store->reader_key, conn);
+        return conn;
+    }
+    // All taken; remember that, so we don't scan again on every read.
+    pthread_setspecific(store->reader_key, &store->writer);
+    return &store->writer;
+}
+
+/*
+ * Find the connection a statement belongs to.
+ */
+static struct sqlite_conn *stmt_conn(la_storage_object_store *store, sqlite3_stmt *stmt)
+{
+    sqlite3 *db = sqlite3_db_handle(stmt);
+    int i;
+    
+    for (i = 0; i < store->reader_count; i++)
+    {
+        if (store->readers[i].db == db)
+            return &store->readers[i];
+    }
+    return &store->writer;
+}
+
+/*
+ * Take a statement out of a connection's cache, preparing a new one if it
+ * isn't cached or another caller has it. Give it back with put_stmt.
+ */
+static sqlite3_stmt *get_stmt(struct sqlite_conn *conn, int which)
+{
+    sqlite3_stmt *stmt = __sync_lock_test_and_set(&conn->stmts[which], NULL);
+    if (stmt == NULL && sqlite3_prepare_v2(conn->db, stmt_sql[which], -1, &stmt, NULL) != SQLITE_OK)
+        return NULL;
+    return stmt;
+}
+
+/*
+ * Reset a statement from get_stmt and put it back in the cache, or
+ * finalize it if the cache slot was filled in the meantime.
+ */
+static void put_stmt(struct sqlite_conn *conn, int which, sqlite3_stmt *stmt)
+{
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (!__sync_bool_compare_and_swap(&conn->stmts[which], NULL, stmt))
+        sqlite3_finalize(stmt);
+}
+
+/*
+ * Run a cached statement that returns no rows, like BEGIN or COMMIT.
+ */
+static int exec_stmt(struct sqlite_conn *conn, int which)
+{
+    sqlite3_stmt *stmt = get_stmt(conn, which);
+    int ret;
+    
+    if (stmt == NULL)
+        return SQLITE_ERROR;
+    ret = sqlite3_step(stmt);
+    put_stmt(conn, which, stmt);
+    return (ret == SQLITE_DONE) ? SQLITE_OK : ret;
+}
+
+/*
+ * Run a statement that returns a single integer.
+ */
+static int query_int64(struct sqlite_conn *conn, int which, int64_t *value)
+{
+    sqlite3_stmt *stmt = get_stmt(conn, which);
+    
+    if (stmt == NULL)
+        return -1;
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+    {
+        put_stmt(conn, which, stmt);
+        return -1;
+    }
+    *value = sqlite3_column_int64(stmt, 0);
+    put_stmt(conn, which, stmt);
+    return 0;
+}
+
+/*
+ * Start the sequence counter from the highest seq stored, and the key
+ * count from the number of rows.
+ */
+static int seed_seq(la_storage_object_store *store)
+{
+    int64_t seq;
+    
+    if (query_int64(&store->writer, STMT_MAXSEQ, &seq) != 0
+        || query_int64(&store->writer, STMT_NUMKEYS, &store->numkeys) != 0)
+        return -1;
+    store->seq = (uint64_t) seq;
+    store->txn_seq = store->seq;
+    store->txn_numkeys = store->numkeys;
+    return 0;
+}
+
+static int begin_write(la_storage_object_store *store)
+{
+    if (exec_stmt(&store->writer, STMT_BEGIN) != SQLITE_OK)
+        return -1;
+    store->txn_seq = store->seq;
+    store->txn_numkeys = store->numkeys;
+    return 0;
+}
+
+static int commit_write(la_storage_object_store *store)
+{
+    if (exec_stmt(&store->writer, STMT_COMMIT) != SQLITE_OK)
+    {
+        exec_stmt(&store->writer, STMT_ROLLBACK);
+        return -1;
+    }
+    __sync_lock_test_and_set(&store->seq, store->txn_seq);
+    __sync_lock_test_and_set(&store->numkeys, store->txn_numkeys);
+    return 0;
+}
+
+static void rollback_write(la_storage_object_store *store)
+{
+    exec_stmt(&store->writer, STMT_ROLLBACK);
 }
 
-static la_storage_object_store *sqlite_la_storage_open(la_storage_env *env, const char *name)
+static int sqlite_la_storage_close(la_storage_object_store *store);
+
+static la_storage_open_result_t sqlite_la_storage_open(la_storage_env *env, const char *name, int flags, la_storage_object_store **_store)
 {
     const char *parts[2];
-    char *path;
-    la_storage_object_store *store = (la_storage_object_store *) malloc(sizeof(struct la_storage_object_store));
+    struct stat st;
+    int created = 0;
+    la_storage_object_store *store = (la_storage_object_store *) calloc(1, sizeof(struct la_storage_object_store));
     if (store == NULL)
-        return NULL;
+        return LA_STORAGE_OPEN_ERROR;
     store->env = env;
     parts[0] = env->name;
     parts[1] = name;
-    path = string_join("/", (char * const *) parts, 2);
-    if (path == NULL)
+    store->path = string_join("/", (char * const *) parts, 2);
+    if (store->path == NULL)
     {
         free(store);
-        return NULL;
+        return LA_STORAGE_OPEN_ERROR;
+    }
+    
+    if (stat(store->path, &st) == 0)
+    {
+        if ((flags & LA_STORAGE_OPEN_FLAG_CREATE) && (flags & LA_STORAGE_OPEN_FLAG_EXCL))
+        {
+            free(store->path);
+            free(store);
+            return LA_STORAGE_OPEN_EXISTS;
+        }
     }
-    if (sqlite3_open_v2(path, &store->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL) != 0)
+    else if (!(flags & LA_STORAGE_OPEN_FLAG_CREATE))
     {
+        free(store->path);
         free(store);
-        free(path);
-        return NULL;
+        return LA_STORAGE_OPEN_NOT_FOUND;
     }
-    sqlite3_exec(store->db, initsql, NULL, NULL, NULL);
+    else
+        created = 1;
     
-    return store;
+    if (open_conn(store, &store->writer, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX) != 0)
+    {
+        free(store->path);
+        free(store);
+        return LA_STORAGE_OPEN_ERROR;
+    }
+    sqlite3_exec(store->writer.db, initsql, NULL, NULL, NULL);
+    if (seed_seq(store) != 0)
+    {
+        sqlite_la_storage_close(store);
+        return LA_STORAGE_OPEN_ERROR;
+    }
+    
+    // Separate readers only help when they don't block on the writer.
+    if (env->config.sqlite_wal && env->config.sqlite_read_connections > 0
+        && pthread_key_create(&store->reader_key, release_reader) == 0)
+    {
+        store->readers = (struct sqlite_conn *) calloc(env->config.sqlite_read_connections, sizeof(struct sqlite_conn));
+        if (store->readers == NULL)
+            pthread_key_delete(store->reader_key);
+        else
+            store->reader_count = env->config.sqlite_read_connections;
+    }
+    
+    *_store = store;
+    if (created)
+        return LA_STORAGE_OPEN_CREATED;
+    return LA_STORAGE_OPEN_OK;
+}
+
+/*
+ * Build an object from the current row of a "SELECT * FROM docs" statement.
+ */
+static la_storage_object *object_from_row(sqlite3_stmt *stmt)
+{
+    la_storage_object *obj;
+    const void *rev = sqlite3_column_blob(stmt, RCOLUMN_REV);
+    const void *oldrevs = sqlite3_column_blob(stmt, RCOLUMN_OLDREVS);
+    size_t oldrev_count = la_min(sqlite3_column_bytes(stmt, RCOLUMN_OLDREVS) / sizeof(la_storage_rev_t),
+                                 LA_OBJECT_MAX_REVISION_COUNT);
+    const char *key = (const char *) sqlite3_column_text(stmt, RCOLUMN_ID);
+    uint32_t data_length = sqlite3_column_bytes(stmt, RCOLUMN_DOC);
+    
+    obj = la_storage_alloc_object(key, sqlite3_column_bytes(stmt, RCOLUMN_ID),
+                                  sizeof(la_storage_object_header) + (oldrev_count * sizeof(la_storage_rev_t)) + data_length);
+    if (obj == NULL)
+        return NULL;
+    obj->data_length = data_length;
+    obj->header->deleted = (sqlite3_column_int(stmt, RCOLUMN_DELETED) & FLAG_DELETED) != 0;
+    obj->header->uncompressed = (sqlite3_column_int(stmt, RCOLUMN_DELETED) & FLAG_UNCOMPRESSED) != 0;
+    obj->header->sized = (sqlite3_column_int(stmt, RCOLUMN_DELETED) & FLAG_SIZED) != 0;
+    obj->header->seq = sqlite3_column_int64(stmt, RCOLUMN_SEQ);
+    obj->header->doc_seq = sqlite3_column_int64(stmt, RCOLUMN_DOCSEQ);
+    obj->header->rev_count = oldrev_count;
+    memcpy(&obj->header->rev, rev, sizeof(la_storage_rev_t));
+    // SQLite returns NULL for empty blobs, so only copy what is there.
+    if (oldrev_count > 0)
+        memcpy(obj->header->revs_data, oldrevs, oldrev_count * sizeof(la_storage_rev_t));
+    if (data_length > 0)
+        memcpy(la_storage_object_get_data(obj), sqlite3_column_blob(stmt, RCOLUMN_DOC), data_length);
+    return obj;
 }
 
 static la_storage_object_get_result sqlite_la_storage_get(la_storage_object_store *store, const char *key, const la_storage_rev_t *rev, la_storage_object **obj)
 {
     sqlite3_stmt *stmt;
+    struct sqlite_conn *conn = read_conn(store);
+    int which = (rev == NULL) ? STMT_GETBYID : STMT_GETBYIDREV;
     int ret;
-    if (rev == NULL)
-    {
-        if (sqlite3_prepare(store->db, getbyid, (int) strlen(getbyid), &stmt, NULL) != SQLITE_OK)
-            return LA_STORAGE_OBJECT_GET_ERROR;
-    }
-    else
-        if (sqlite3_prepare(store->db, getbyidrev, (int) strlen(getbyidrev), &stmt, NULL) != SQLITE_OK)
-            return LA_STORAGE_OBJECT_GET_ERROR;
-    if (sqlite3_bind_text(stmt, 1, key, (int) strlen(key), SQLITE_TRANSIENT) != SQLITE_OK)
+    
+    if ((stmt = get_stmt(conn, which)) == NULL)
+        return LA_STORAGE_OBJECT_GET_ERROR;
+    if (sqlite3_bind_text(stmt, 1, key, (int) strlen(key), SQLITE_STATIC) != SQLITE_OK)
     {
-        sqlite3_finalize(stmt);
+        put_stmt(conn, which, stmt);
         return LA_STORAGE_OBJECT_GET_ERROR;
     }
-    if (rev != NULL && sqlite3_bind_blob(stmt, 2, rev, sizeof(la_storage_rev_t), SQLITE_TRANSIENT) != SQLITE_OK)
+    if (rev != NULL && sqlite3_bind_blob(stmt, 2, rev, sizeof(la_storage_rev_t), SQLITE_STATIC) != SQLITE_OK)
     {
-        sqlite3_finalize(stmt);
+        put_stmt(conn, which, stmt);
         return LA_STORAGE_OBJECT_GET_ERROR;
     }
     ret = sqlite3_step(stmt);
@@ -194,43 +578,170 @@ static la_storage_object_get_result sqlite_la_storage_get(la_storage_object_stor
     {
         if (obj != NULL)
         {
-            la_storage_rev_t *rev = (la_storage_rev_t *) sqlite3_column_blob(stmt, RCOLUMN_REV);
-            la_storage_rev_t *oldrev = (la_storage_rev_t *) sqlite3_column_blob(stmt, RCOLUMN_OLDREVS);
-            size_t oldrev_count = sqlite3_column_bytes(stmt, RCOLUMN_OLDREVS);
-            *obj = malloc(sizeof(la_storage_object));
-            (*obj)->key = strdup((const char *) sqlite3_column_text(stmt, RCOLUMN_ID));
-            (*obj)->data_length = sqlite3_column_bytes(stmt, RCOLUMN_DOC);
-            (*obj)->header = malloc(sizeof(la_storage_object_header) + (oldrev_count * sizeof(la_storage_rev_t)) + (*obj)->data_length);
-            (*obj)->header->deleted = sqlite3_column_int(stmt, RCOLUMN_DELETED);
-            (*obj)->header->seq = sqlite3_column_int64(stmt, RCOLUMN_SEQ);
-            (*obj)->header->doc_seq = sqlite3_column_int64(stmt, RCOLUMN_DOCSEQ);
-            (*obj)->header->rev_count = oldrev_count;
-            memcpy(&(*obj)->header->rev, rev, sizeof(la_storage_rev_t));
-            memcpy((*obj)->header->revs_data, oldrev, oldrev_count * sizeof(la_storage_rev_t));
-            memcpy(la_storage_object_get_data(*obj), sqlite3_column_blob(stmt, RCOLUMN_DOC), (*obj)->data_length);
+            *obj = object_from_row(stmt);
+            if (*obj == NULL)
+            {
+                put_stmt(conn, which, stmt);
+                return LA_STORAGE_OBJECT_GET_ERROR;
+            }
         }
-        sqlite3_finalize(stmt);
+        put_stmt(conn, which, stmt);
         return LA_STORAGE_OBJECT_GET_OK;
     }
     else if (ret == SQLITE_DONE)
     {
-        sqlite3_finalize(stmt);
+        put_stmt(conn, which, stmt);
         return LA_STORAGE_OBJECT_GET_NOT_FOUND;
     }
-    sqlite3_finalize(stmt);
+    put_stmt(conn, which, stmt);
     return LA_STORAGE_OBJECT_GET_ERROR;
 }
 
-static la_storage_object_get_result sqlite_la_storage_get_rev(la_storage_object_store *store, const char *key, la_storage_rev_t *rev)
+/**
+ * Get an object pointing straight at the column values of its row. The
+ * statement is kept open, as the object's cookie, until release; its
+ * STMT_* index is the cookie_kind.
+ */
+static la_storage_object_get_result sqlite_la_storage_get_borrowed(la_storage_object_store *store, const char *key,
+                                                                   const la_storage_rev_t *rev, la_storage_borrowed_object *obj)
 {
     sqlite3_stmt *stmt;
+    struct sqlite_conn *conn = read_conn(store);
+    int which = (rev == NULL) ? STMT_GETBYID : STMT_GETBYIDREV;
     int ret;
     
-    if (sqlite3_prepare(store->db, getrev, (int) strlen(getrev), &stmt, NULL) != SQLITE_OK)
+    if ((stmt = get_stmt(conn, which)) == NULL)
+        return LA_STORAGE_OBJECT_GET_ERROR;
+    if (sqlite3_bind_text(stmt, 1, key, (int) strlen(key), SQLITE_STATIC) != SQLITE_OK
+        || (rev != NULL && sqlite3_bind_blob(stmt, 2, rev, sizeof(la_storage_rev_t), SQLITE_STATIC) != SQLITE_OK))
+    {
+        put_stmt(conn, which, stmt);
+        return LA_STORAGE_OBJECT_GET_ERROR;
+    }
+    ret = sqlite3_step(stmt);
+    if (ret != SQLITE_ROW)
+    {
+        put_stmt(conn, which, stmt);
+        if (ret == SQLITE_DONE)
+            return LA_STORAGE_OBJECT_GET_NOT_FOUND;
         return LA_STORAGE_OBJECT_GET_ERROR;
-    if (sqlite3_bind_text(stmt, 1, key, (int) strlen(key), SQLITE_TRANSIENT) != SQLITE_OK)
+    }
+    
+    memset(&obj->header, 0, sizeof(la_storage_object_header));
+    obj->header.deleted = (sqlite3_column_int(stmt, RCOLUMN_DELETED) & FLAG_DELETED) != 0;
+    obj->header.uncompressed = (sqlite3_column_int(stmt, RCOLUMN_DELETED) & FLAG_UNCOMPRESSED) != 0;
+    obj->header.sized = (sqlite3_column_int(stmt, RCOLUMN_DELETED) & FLAG_SIZED) != 0;
+    obj->header.seq = sqlite3_column_int64(stmt, RCOLUMN_SEQ);
+    obj->header.doc_seq = sqlite3_column_int64(stmt, RCOLUMN_DOCSEQ);
+    memcpy(&obj->header.rev, sqlite3_column_blob(stmt, RCOLUMN_REV), sizeof(la_storage_rev_t));
+    obj->revs = (const la_storage_rev_t *) sqlite3_column_blob(stmt, RCOLUMN_OLDREVS);
+    obj->header.rev_count = la_min(sqlite3_column_bytes(stmt, RCOLUMN_OLDREVS) / sizeof(la_storage_rev_t),
+                                   LA_OBJECT_MAX_REVISION_COUNT);
+    obj->data = (const unsigned char *) sqlite3_column_blob(stmt, RCOLUMN_DOC);
+    obj->data_length = sqlite3_column_bytes(stmt, RCOLUMN_DOC);
+    obj->cookie = stmt;
+    obj->cookie_kind = which;
+    return LA_STORAGE_OBJECT_GET_OK;
+}
+
+static void sqlite_la_storage_release(la_storage_object_store *store, la_storage_borrowed_object *obj)
+{
+    sqlite3_stmt *stmt = (sqlite3_stmt *) obj->cookie;
+    
+    put_stmt(stmt_conn(store, stmt), obj->cookie_kind, stmt);
+}
+
+/*
+ * Fetch the keys in batches of this many, to stay under SQLite's limit
+ * on bound parameters in one statement.
+ */
+#define GET_MANY_BATCH 500
+
+/**
+ * Get many objects with one "SELECT ... WHERE id IN (...)" per batch of
+ * keys. The rows come back ordered by id, so we match them to the sorted
+ * keys with a single merge pass.
+ */
+static la_storage_object_get_result sqlite_la_storage_get_many(la_storage_object_store *store, const char * const *keys,
+                                                               size_t count, la_storage_object **objs)
+{
+    sqlite3_stmt *stmt;
+    struct sqlite_conn *conn = read_conn(store);
+    la_buffer_t *sql;
+    size_t start, batch, i, j;
+    int ret;
+    
+    for (i = 0; i < count; i++)
+        objs[i] = NULL;
+    
+    for (start = 0; start < count; start += batch)
     {
+        batch = la_min(count - start, GET_MANY_BATCH);
+        sql = la_buffer_new(64 + (batch * 3));
+        if (sql == NULL)
+            goto error;
+        la_buffer_appendf(sql, "%s", getmany);
+        for (i = 0; i < batch; i++)
+            la_buffer_appendf(sql, i == 0 ? "?" : ", ?");
+        la_buffer_appendf(sql, ") ORDER BY id;");
+        ret = sqlite3_prepare_v2(conn->db, la_buffer_data(sql), (int) la_buffer_size(sql), &stmt, NULL);
+        la_buffer_destroy(sql);
+        if (ret != SQLITE_OK)
+            goto error;
+        for (i = 0; i < batch; i++)
+        {
+            if (sqlite3_bind_text(stmt, (int) i + 1, keys[start + i], -1, SQLITE_STATIC) != SQLITE_OK)
+            {
+                sqlite3_finalize(stmt);
+                goto error;
+            }
+        }
+        
+        j = start;
+        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            const char *id = (const char *) sqlite3_column_text(stmt, RCOLUMN_ID);
+            while (j < start + batch && strcmp(keys[j], id) < 0)
+                j++;
+            if (j == start + batch)
+                break;
+            if (strcmp(keys[j], id) != 0)
+                continue;
+            objs[j] = object_from_row(stmt);
+            if (objs[j] == NULL)
+            {
+                sqlite3_finalize(stmt);
+                goto error;
+            }
+            j++;
+        }
         sqlite3_finalize(stmt);
+        if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+            goto error;
+    }
+    return LA_STORAGE_OBJECT_GET_OK;
+    
+error:
+    for (i = 0; i < count; i++)
+    {
+        if (objs[i] != NULL)
+            la_storage_destroy_object(objs[i]);
+        objs[i] = NULL;
+    }
+    return LA_STORAGE_OBJECT_GET_ERROR;
+}
+
+static la_storage_object_get_result sqlite_la_storage_get_rev(la_storage_object_store *store, const char *key, la_storage_rev_t *rev)
+{
+    sqlite3_stmt *stmt;
+    struct sqlite_conn *conn = read_conn(store);
+    int ret;
+    
+    if ((stmt = get_stmt(conn, STMT_GETREV)) == NULL)
+        return LA_STORAGE_OBJECT_GET_ERROR;
+    if (sqlite3_bind_text(stmt, 1, key, (int) strlen(key), SQLITE_STATIC) != SQLITE_OK)
+    {
+        put_stmt(conn, STMT_GETREV, stmt);
         return LA_STORAGE_OBJECT_GET_ERROR;
     }
     ret = sqlite3_step(stmt);
@@ -240,28 +751,29 @@ static la_storage_object_get_result sqlite_la_storage_get_rev(la_storage_object_
         {
             memcpy(rev, sqlite3_column_blob(stmt, 0), sizeof(la_storage_rev_t));
         }
-        sqlite3_finalize(stmt);
+        put_stmt(conn, STMT_GETREV, stmt);
         return LA_STORAGE_OBJECT_GET_OK;
     }
     else if (ret == SQLITE_DONE)
     {
-        sqlite3_finalize(stmt);
+        put_stmt(conn, STMT_GETREV, stmt);
         return LA_STORAGE_OBJECT_GET_NOT_FOUND;
     }
-    sqlite3_finalize(stmt);
+    put_stmt(conn, STMT_GETREV, stmt);
     return LA_STORAGE_OBJECT_GET_ERROR;
 }
 
 static int sqlite_la_storage_get_all_revs(la_storage_object_store *store, const char *key, uint64_t *start, la_storage_rev_t **revs)
 {
     sqlite3_stmt *stmt;
+    struct sqlite_conn *conn = read_conn(store);
     int ret;
     
-    if (sqlite3_prepare(store->db, getmeta, (int) strlen(getmeta), &stmt, NULL) != SQLITE_OK)
+    if ((stmt = get_stmt(conn, STMT_GETMETA)) == NULL)
         return LA_STORAGE_OBJECT_GET_ERROR;
-    if (sqlite3_bind_text(stmt, 1, key, (int) strlen(key), SQLITE_TRANSIENT) != SQLITE_OK)
+    if (sqlite3_bind_text(stmt, 1, key, (int) strlen(key), SQLITE_STATIC) != SQLITE_OK)
     {
-        sqlite3_finalize(stmt);
+        put_stmt(conn, STMT_GETMETA, stmt);
         return LA_STORAGE_OBJECT_GET_ERROR;
     }
     ret = sqlite3_step(stmt);
@@ -275,7 +787,7 @@ static int sqlite_la_storage_get_all_revs(la_storage_object_store *store, const
             *revs = (la_storage_rev_t *) malloc(oldrevs_len + sizeof(la_storage_rev_t));
             if (*revs == NULL)
             {
-                sqlite3_finalize(stmt);
+                put_stmt(conn, STMT_GETMETA, stmt);
                 return LA_STORAGE_OBJECT_GET_ERROR;
             }
             memcpy(*revs, rev, sizeof(la_storage_rev_t));
@@ -285,40 +797,51 @@ static int sqlite_la_storage_get_all_revs(la_storage_object_store *store, const
         {
             *start = sqlite3_column_int64(stmt, 3);
         }
-        sqlite3_finalize(stmt);
+        put_stmt(conn, STMT_GETMETA, stmt);
         return LA_STORAGE_OBJECT_GET_OK;
     }
+    put_stmt(conn, STMT_GETMETA, stmt);
     return LA_STORAGE_OBJECT_GET_NOT_FOUND;
 }
 
-static la_storage_object_put_result sqlite_la_storage_put(la_storage_object_store *store, const la_storage_rev_t *rev, la_storage_object *obj)
+/*
+ * Bind the columns of an object to a "putdoc" statement.
+ */
+static int bind_object(sqlite3_stmt *stmt, la_storage_object *obj)
+{
+    if (sqlite3_bind_text(stmt, COLUMN_ID, obj->key, (int) strlen(obj->key), SQLITE_TRANSIENT) != SQLITE_OK)
+        return -1;
+    if (sqlite3_bind_int(stmt, COLUMN_DELETED, (obj->header->deleted ? FLAG_DELETED : 0)
+                         | (obj->header->uncompressed ? FLAG_UNCOMPRESSED : 0)
+                         | (obj->header->sized ? FLAG_SIZED : 0)) != SQLITE_OK)
+        return -1;
+    if (sqlite3_bind_blob(stmt, COLUMN_REV, &obj->header->rev, sizeof(la_storage_rev_t), SQLITE_TRANSIENT) != SQLITE_OK)
+        return -1;
+    if (sqlite3_bind_blob(stmt, COLUMN_OLDREVS, obj->header->revs_data, sizeof(la_storage_rev_t) * (int) obj->header->rev_count, SQLITE_TRANSIENT) != SQLITE_OK)
+        return -1;
+    if (sqlite3_bind_int64(stmt, COLUMN_SEQ, obj->header->seq) != SQLITE_OK)
+        return -1;
+    if (sqlite3_bind_int64(stmt, COLUMN_DOCSEQ, obj->header->doc_seq) != SQLITE_OK)
+        return -1;
+    if (sqlite3_bind_blob(stmt, COLUMN_DOC, la_storage_object_get_data(obj), obj->data_length, SQLITE_TRANSIENT) != SQLITE_OK)
+        return -1;
+    return 0;
+}
+
+/*
+ * Put an object inside a transaction from begin_write. Nothing is written
+ * if this returns a conflict; on error the caller must roll back.
+ */
+static la_storage_object_put_result sqlite_do_put(la_storage_object_store *store, const la_storage_rev_t *rev, la_storage_object *obj)
 {
     sqlite3_stmt *stmt;
     int ret;
-    uint64_t seq, doc_seq;
-    
-    sqlite3_exec(store->db, begintxn, NULL, NULL, NULL);
     
-    if (sqlite3_prepare(store->db, getseq, (int) strlen(getseq), &stmt, NULL) != SQLITE_OK)
+    if ((stmt = get_stmt(&store->writer, STMT_GETMETA)) == NULL)
         return LA_STORAGE_OBJECT_PUT_ERROR;
-    if (sqlite3_step(stmt) != SQLITE_ROW)
-    {
-        sqlite3_finalize(stmt);
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        return LA_STORAGE_OBJECT_PUT_ERROR;
-    }
-    seq = sqlite3_column_int64(stmt, 0);
-    sqlite3_finalize(stmt);
-        
-    if (sqlite3_prepare(store->db, getmeta, (int) strlen(getmeta), &stmt, NULL) != SQLITE_OK)
-    {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        return LA_STORAGE_OBJECT_PUT_ERROR;
-    }
     if (sqlite3_bind_text(stmt, 1, obj->key, (int) strlen(obj->key), NULL) != SQLITE_OK)
     {
-        sqlite3_finalize(stmt);
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
+        put_stmt(&store->writer, STMT_GETMETA, stmt);
         return LA_STORAGE_OBJECT_PUT_ERROR;
     }
     ret = sqlite3_step(stmt);
@@ -327,215 +850,318 @@ static la_storage_object_put_result sqlite_la_storage_put(la_storage_object_stor
         la_storage_rev_t *r = (la_storage_rev_t *) sqlite3_column_blob(stmt, 0);
         if (rev == NULL || memcmp(rev, r, sizeof(la_storage_rev_t)) != 0)
         {
-            sqlite3_finalize(stmt);
-            sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
+            put_stmt(&store->writer, STMT_GETMETA, stmt);
             return LA_STORAGE_OBJECT_PUT_CONFLICT;
         }
-        doc_seq = sqlite3_column_int64(stmt, 3);
+        obj->header->doc_seq = sqlite3_column_int64(stmt, 3) + 1;
         unsigned int oldrev_bytes = (unsigned int) sqlite3_column_bytes(stmt, 1);
         unsigned int oldrev_count = oldrev_bytes / (unsigned int) sizeof(la_storage_rev_t);
         if (oldrev_count < LA_OBJECT_MAX_REVISION_COUNT)
             oldrev_count++;
         int rc = obj->header->rev_count;
         obj->header->rev_count = oldrev_count;
-        void *newheader = realloc(obj->header, la_storage_object_total_size(obj));
-        if (newheader == NULL)
+        if (la_storage_object_reserve(obj, la_storage_object_total_size(obj)) != 0)
         {
-            sqlite3_finalize(stmt);
-            sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
+            put_stmt(&store->writer, STMT_GETMETA, stmt);
             return LA_STORAGE_OBJECT_PUT_ERROR;
         }
-        obj->header = newheader;
         memmove(la_storage_object_get_data(obj), obj->header->revs_data + (rc * sizeof(la_storage_rev_t)), obj->data_length);
-        memcpy(obj->header->revs_data + sizeof(la_storage_rev_t),
-               sqlite3_column_blob(stmt, 1), la_min(oldrev_bytes, LA_OBJECT_MAX_REVISION_COUNT * sizeof(la_storage_rev_t)));
+        if (oldrev_bytes > 0)
+            memcpy(obj->header->revs_data + sizeof(la_storage_rev_t),
+                   sqlite3_column_blob(stmt, 1), la_min(oldrev_bytes, (oldrev_count - 1) * sizeof(la_storage_rev_t)));
         memcpy(obj->header->revs_data, r, sizeof(la_storage_rev_t));
     }
     else if (ret != SQLITE_DONE)
     {
-        sqlite3_finalize(stmt);
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
+        put_stmt(&store->writer, STMT_GETMETA, stmt);
         return LA_STORAGE_OBJECT_PUT_ERROR;
     }
     else
     {
+        obj->header->doc_seq = 1;
         obj->header->rev_count = 0;
     }
-    sqlite3_finalize(stmt);
+    put_stmt(&store->writer, STMT_GETMETA, stmt);
     
-    obj->header->seq = seq;
-    if (sqlite3_prepare(store->db, putdoc, (int) strlen(putdoc), &stmt, NULL) != SQLITE_OK)
-    {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
+    // Only take a sequence number once we know we're writing.
+    obj->header->seq = ++store->txn_seq;
+    if ((stmt = get_stmt(&store->writer, STMT_PUTDOC)) == NULL)
         return LA_STORAGE_OBJECT_PUT_ERROR;
-    }
-    if (sqlite3_bind_text(stmt, COLUMN_ID, obj->key, (int) strlen(obj->key), SQLITE_TRANSIENT) != SQLITE_OK)
+    if (bind_object(stmt, obj) != 0)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+        put_stmt(&store->writer, STMT_PUTDOC, stmt);
         return LA_STORAGE_OBJECT_PUT_ERROR;
     }
-    if (sqlite3_bind_int(stmt, COLUMN_DELETED, obj->header->deleted) != SQLITE_OK)
-    {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+    ret = sqlite3_step(stmt);
+    put_stmt(&store->writer, STMT_PUTDOC, stmt);
+    if (ret != SQLITE_DONE)
         return LA_STORAGE_OBJECT_PUT_ERROR;
-    }
-    if (sqlite3_bind_blob(stmt, COLUMN_REV, &obj->header->rev, sizeof(la_storage_rev_t), SQLITE_TRANSIENT) != SQLITE_OK)
-    {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+    if (obj->header->doc_seq == 1)
+        store->txn_numkeys++;
+    return LA_STORAGE_OBJECT_PUT_SUCCESS;
+}
+
+static la_storage_object_put_result sqlite_la_storage_put(la_storage_object_store *store, const la_storage_rev_t *rev, la_storage_object *obj)
+{
+    la_storage_object_put_result result;
+    
+    if (begin_write(store) != 0)
         return LA_STORAGE_OBJECT_PUT_ERROR;
-    }
-    if (sqlite3_bind_blob(stmt, COLUMN_OLDREVS, obj->header->revs_data, sizeof(la_storage_rev_t) * (int) obj->header->rev_count, SQLITE_TRANSIENT) != SQLITE_OK)
+    result = sqlite_do_put(store, rev, obj);
+    if (result != LA_STORAGE_OBJECT_PUT_SUCCESS)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
-        return LA_STORAGE_OBJECT_PUT_ERROR;
+        rollback_write(store);
+        return result;
     }
-    if (sqlite3_bind_int64(stmt, COLUMN_SEQ, obj->header->seq) != SQLITE_OK)
-    {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+    if (commit_write(store) != 0)
         return LA_STORAGE_OBJECT_PUT_ERROR;
-    }
-    if (sqlite3_bind_int64(stmt, COLUMN_DOCSEQ, obj->header->doc_seq) != SQLITE_OK)
-    {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+    return LA_STORAGE_OBJECT_PUT_SUCCESS;
+}
+
+static la_storage_object_put_result sqlite_la_storage_put_bulk(la_storage_object_store *store, const la_storage_rev_t * const *revs,
+                                                               la_storage_object **objs, size_t count,
+                                                               la_storage_object_put_result *results)
+{
+    size_t i;
+    
+    if (begin_write(store) != 0)
         return LA_STORAGE_OBJECT_PUT_ERROR;
-    }
-    if (sqlite3_bind_blob(stmt, COLUMN_DOC, la_storage_object_get_data(obj), obj->data_length, SQLITE_TRANSIENT) != SQLITE_OK)
+    for (i = 0; i < count; i++)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
-        return LA_STORAGE_OBJECT_PUT_ERROR;
+        results[i] = sqlite_do_put(store, revs[i], objs[i]);
+        if (results[i] == LA_STORAGE_OBJECT_PUT_ERROR)
+        {
+            rollback_write(store);
+            return LA_STORAGE_OBJECT_PUT_ERROR;
+        }
     }
-    ret = sqlite3_step(stmt);
-    if (ret != SQLITE_DONE)
-    {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+    if (commit_write(store) != 0)
         return LA_STORAGE_OBJECT_PUT_ERROR;
-    }
-    sqlite3_finalize(stmt);
-    
-    sqlite3_exec(store->db, endtxn, NULL, NULL, NULL);
     return LA_STORAGE_OBJECT_PUT_SUCCESS;
 }
 
-static la_storage_object_put_result sqlite_la_storage_replace(la_storage_object_store *store, la_storage_object *obj)
+/*
+ * Return 1 if key has a row, 0 if not, or -1 on error. Called with a
+ * write transaction open.
+ */
+static int key_exists(la_storage_object_store *store, const char *key)
 {
-    sqlite3_stmt *stmt;
+    sqlite3_stmt *stmt = get_stmt(&store->writer, STMT_GETREV);
     int ret;
     
-    if (sqlite3_exec(store->db, begintxn, NULL, NULL, NULL) != SQLITE_OK)
+    if (stmt == NULL)
+        return -1;
+    if (sqlite3_bind_text(stmt, 1, key, (int) strlen(key), NULL) != SQLITE_OK)
     {
-        printf("failed to begin transaction\n");
-        return LA_STORAGE_OBJECT_PUT_ERROR;
+        put_stmt(&store->writer, STMT_GETREV, stmt);
+        return -1;
     }
-    if (sqlite3_prepare(store->db, putdoc, (int) strlen(putdoc), &stmt, NULL) != SQLITE_OK)
+    ret = sqlite3_step(stmt);
+    put_stmt(&store->writer, STMT_GETREV, stmt);
+    if (ret == SQLITE_ROW)
+        return 1;
+    return ret == SQLITE_DONE ? 0 : -1;
+}
+
+static la_storage_object_put_result sqlite_la_storage_replace(la_storage_object_store *store, la_storage_object *obj)
+{
+    sqlite3_stmt *stmt;
+    int ret, exists;
+    
+    if (begin_write(store) != 0)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
+        printf("failed to begin transaction\n");
         return LA_STORAGE_OBJECT_PUT_ERROR;
     }
-    if (sqlite3_bind_text(stmt, COLUMN_ID, obj->key, (int) strlen(obj->key), SQLITE_TRANSIENT) != SQLITE_OK)
+    if ((exists = key_exists(store, obj->key)) < 0
+        || (stmt = get_stmt(&store->writer, STMT_PUTDOC)) == NULL)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+        rollback_write(store);
         return LA_STORAGE_OBJECT_PUT_ERROR;
     }
-    if (sqlite3_bind_int(stmt, COLUMN_DELETED, obj->header->deleted) != SQLITE_OK)
+    // A replaced document is still a change, so it gets a new seq.
+    obj->header->seq = ++store->txn_seq;
+    if (bind_object(stmt, obj) != 0)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+        put_stmt(&store->writer, STMT_PUTDOC, stmt);
+        rollback_write(store);
         return LA_STORAGE_OBJECT_PUT_ERROR;
     }
-    if (sqlite3_bind_blob(stmt, COLUMN_REV, &obj->header->rev, sizeof(la_storage_rev_t), SQLITE_TRANSIENT) != SQLITE_OK)
+    ret = sqlite3_step(stmt);
+    put_stmt(&store->writer, STMT_PUTDOC, stmt);
+    if (ret != SQLITE_DONE)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+        rollback_write(store);
         return LA_STORAGE_OBJECT_PUT_ERROR;
     }
-    if (sqlite3_bind_blob(stmt, COLUMN_OLDREVS, obj->header->revs_data, sizeof(la_storage_rev_t) * (int) obj->header->rev_count, SQLITE_TRANSIENT) != SQLITE_OK)
-    {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+    if (!exists)
+        store->txn_numkeys++;
+    if (commit_write(store) != 0)
         return LA_STORAGE_OBJECT_PUT_ERROR;
-    }
-    if (sqlite3_bind_int64(stmt, COLUMN_SEQ, obj->header->seq) != SQLITE_OK)
+    return LA_STORAGE_OBJECT_PUT_SUCCESS;
+}
+
+static uint64_t sqlite_la_storage_lastseq(la_storage_object_store *store)
+{
+    return __sync_add_and_fetch(&store->seq, 0);
+}
+
+static int sqlite_la_storage_stat(la_storage_object_store *store, la_storage_stat_t *stat)
+{
+    struct sqlite_conn *conn = read_conn(store);
+    int64_t pages, pagesize;
+    
+    if (query_int64(conn, STMT_PAGECOUNT, &pages) != 0
+        || query_int64(conn, STMT_PAGESIZE, &pagesize) != 0)
+        return -1;
+    stat->numkeys = (int) __sync_add_and_fetch(&store->numkeys, 0);
+    stat->size = (uint64_t) pages * (uint64_t) pagesize;
+    return 0;
+}
+
+/*
+ * Iterators may be stepped on a different thread from the one that
+ * opened them (by a prefetching iterator, say), so they can't use that
+ * thread's read connection, which is opened without a mutex. With read
+ * connections, each iterator opens one of its own; otherwise it reads
+ * with the writer, which is serialized.
+ */
+static int iterator_conn(la_storage_object_store *store, la_storage_object_iterator *it)
+{
+    memset(&it->own, 0, sizeof(struct sqlite_conn));
+    if (store->reader_count == 0)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
-        return LA_STORAGE_OBJECT_PUT_ERROR;
+        it->conn = &store->writer;
+        return 0;
     }
-    if (sqlite3_bind_int64(stmt, COLUMN_DOCSEQ, obj->header->doc_seq) != SQLITE_OK)
+    if (open_conn(store, &it->own, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX) != 0)
+        return -1;
+    it->conn = &it->own;
+    return 0;
+}
+
+static la_storage_object_iterator *sqlite_la_storage_iterator_open(la_storage_object_store *store, uint64_t since)
+{
+    la_storage_object_iterator *it = (la_storage_object_iterator *) malloc(sizeof(struct la_storage_object_iterator));
+    if (it == NULL)
+        return NULL;
+    it->which = (since > 0) ? STMT_GETSINCE : STMT_GETALL;
+    if (iterator_conn(store, it) != 0)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
-        return LA_STORAGE_OBJECT_PUT_ERROR;
+        free(it);
+        return NULL;
     }
-    if (sqlite3_bind_blob(stmt, COLUMN_DOC, la_storage_object_get_data(obj), obj->data_length, SQLITE_TRANSIENT) != SQLITE_OK)
+    if ((it->stmt = get_stmt(it->conn, it->which)) == NULL)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
-        return LA_STORAGE_OBJECT_PUT_ERROR;
+        close_conn(&it->own);
+        free(it);
+        return NULL;
     }
-    ret = sqlite3_step(stmt);
-    if (ret != SQLITE_DONE)
+    if (since > 0 && sqlite3_bind_int64(it->stmt, 1, since) != SQLITE_OK)
     {
-        sqlite3_exec(store->db, rollback, NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
-        return LA_STORAGE_OBJECT_PUT_ERROR;
+        put_stmt(it->conn, it->which, it->stmt);
+        close_conn(&it->own);
+        free(it);
+        return NULL;
     }
-    sqlite3_exec(store->db, endtxn, NULL, NULL, NULL);
-    return LA_STORAGE_OBJECT_PUT_SUCCESS;
+    it->store = store;
+    return it;
 }
 
-static uint64_t sqlite_la_storage_lastseq(la_storage_object_store *store)
+/*
+ * Each range iterator has its own read connection (see iterator_conn),
+ * so threads scanning different ranges don't share one.
+ */
+static la_storage_object_iterator *sqlite_la_storage_iterator_open_range(la_storage_object_store *store, uint64_t from_seq, uint64_t to_seq, int flags)
 {
-    sqlite3_stmt *stmt;
-    uint64_t seq;
-    if (sqlite3_prepare(store->db, getseq, (int) strlen(getseq), &stmt, NULL) != SQLITE_OK)
-        return 0;
-    if (sqlite3_step(stmt) != SQLITE_ROW)
+    la_storage_object_iterator *it = (la_storage_object_iterator *) malloc(sizeof(struct la_storage_object_iterator));
+    if (it == NULL)
+        return NULL;
+    it->which = (flags & LA_STORAGE_ITERATOR_HEADERS_ONLY) ? STMT_GETRANGEHEADERS : STMT_GETRANGE;
+    if (iterator_conn(store, it) != 0)
     {
-        sqlite3_finalize(stmt);
-        return 0;
+        free(it);
+        return NULL;
+    }
+    if ((it->stmt = get_stmt(it->conn, it->which)) == NULL)
+    {
+        close_conn(&it->own);
+        free(it);
+        return NULL;
     }
-    seq = sqlite3_column_int64(stmt, 0);
-    sqlite3_finalize(stmt);
-    return seq;
+    // SQLite integers are signed; clamp so "no limit" stays the largest.
+    if (sqlite3_bind_int64(it->stmt, 1, (sqlite3_int64) la_min(from_seq, INT64_MAX)) != SQLITE_OK
+        || sqlite3_bind_int64(it->stmt, 2, (sqlite3_int64) la_min(to_seq, INT64_MAX)) != SQLITE_OK)
+    {
+        put_stmt(it->conn, it->which, it->stmt);
+        close_conn(&it->own);
+        free(it);
+        return NULL;
+    }
+    it->store = store;
+    return it;
 }
 
-static la_storage_object_iterator *sqlite_la_storage_iterator_open(la_storage_object_store *store, uint64_t since)
+static la_storage_object_iterator *sqlite_la_storage_iterator_open_keyrange(la_storage_object_store *store, const char *startkey,
+                                                                              const char *endkey, int descending, uint64_t limit, int flags)
 {
     la_storage_object_iterator *it = (la_storage_object_iterator *) malloc(sizeof(struct la_storage_object_iterator));
+    const char *lo = descending ? endkey : startkey;
+    const char *hi = descending ? startkey : endkey;
+    const char *clause = " WHERE";
+    la_buffer_t *sql;
+    int ret, param = 1;
+    
     if (it == NULL)
         return NULL;
-    if (since > 0)
+    if ((sql = la_buffer_new(256)) == NULL)
     {
-        if (sqlite3_prepare(store->db, getsince, (int) strlen(getsince), &it->stmt, NULL) != SQLITE_OK)
-        {
-            free(it);
-            return NULL;
-        }
-        if (sqlite3_bind_int64(it->stmt, 1, since) != SQLITE_OK)
-        {
-            sqlite3_finalize(it->stmt);
-            free(it);
-            return NULL;
-        }
+        free(it);
+        return NULL;
     }
-    else
+    la_buffer_appendf(sql, "%s", (flags & LA_STORAGE_ITERATOR_HEADERS_ONLY) ? getkeyheaders : getkeys);
+    if (lo != NULL)
     {
-        if (sqlite3_prepare(store->db, getall, (int) strlen(getall), &it->stmt, NULL) != SQLITE_OK)
-        {
-            free(it);
-            return NULL;
-        }
+        la_buffer_appendf(sql, "%s id >= ?", clause);
+        clause = " AND";
     }
+    if (hi != NULL)
+    {
+        la_buffer_appendf(sql, "%s id <= ?", clause);
+        clause = " AND";
+    }
+    if (flags & LA_STORAGE_ITERATOR_SKIP_DELETED)
+        la_buffer_appendf(sql, "%s (deleted & %d) = 0", clause, FLAG_DELETED);
+    la_buffer_appendf(sql, " ORDER BY id %s", descending ? "DESC" : "ASC");
+    if (limit > 0)
+        la_buffer_appendf(sql, " LIMIT ?");
+    la_buffer_appendf(sql, ";");
+    
     it->store = store;
+    it->which = -1;
+    if (iterator_conn(store, it) != 0)
+    {
+        la_buffer_destroy(sql);
+        free(it);
+        return NULL;
+    }
+    ret = sqlite3_prepare_v2(it->conn->db, la_buffer_data(sql), (int) la_buffer_size(sql), &it->stmt, NULL);
+    la_buffer_destroy(sql);
+    if (ret != SQLITE_OK)
+    {
+        close_conn(&it->own);
+        free(it);
+        return NULL;
+    }
+    if ((lo != NULL && sqlite3_bind_text(it->stmt, param++, lo, -1, SQLITE_TRANSIENT) != SQLITE_OK)
+        || (hi != NULL && sqlite3_bind_text(it->stmt, param++, hi, -1, SQLITE_TRANSIENT) != SQLITE_OK)
+        || (limit > 0 && sqlite3_bind_int64(it->stmt, param++, (sqlite3_int64) la_min(limit, INT64_MAX)) != SQLITE_OK))
+    {
+        sqlite3_finalize(it->stmt);
+        close_conn(&it->own);
+        free(it);
+        return NULL;
+    }
     return it;
 }
 
@@ -550,20 +1176,9 @@ static la_storage_object_iterator_result sqlite_la_storage_iterator_next(la_stor
     {
         if (obj != NULL)
         {
-            la_storage_rev_t *rev = (la_storage_rev_t *) sqlite3_column_blob(iterator->stmt, RCOLUMN_REV);
-            la_storage_rev_t *oldrev = (la_storage_rev_t *) sqlite3_column_blob(iterator->stmt, RCOLUMN_OLDREVS);
-            size_t oldrev_count = sqlite3_column_bytes(iterator->stmt, RCOLUMN_OLDREVS);
-            *obj = malloc(sizeof(la_storage_object));
-            (*obj)->key = strdup((const char *) sqlite3_column_text(iterator->stmt, RCOLUMN_ID));
-            (*obj)->data_length = sqlite3_column_bytes(iterator->stmt, RCOLUMN_DOC);
-            (*obj)->header = malloc(sizeof(la_storage_object_header) + (oldrev_count * sizeof(la_storage_rev_t)) + (*obj)->data_length);
-            (*obj)->header->deleted = sqlite3_column_int(iterator->stmt, RCOLUMN_DELETED);
-            (*obj)->header->seq = sqlite3_column_int64(iterator->stmt, RCOLUMN_SEQ);
-            (*obj)->header->doc_seq = sqlite3_column_int64(iterator->stmt, RCOLUMN_DOCSEQ);
-            (*obj)->header->rev_count = oldrev_count;
-            memcpy(&(*obj)->header->rev, rev, sizeof(la_storage_rev_t));
-            memcpy((*obj)->header->revs_data, oldrev, oldrev_count * sizeof(la_storage_rev_t));
-            memcpy(la_storage_object_get_data(*obj), sqlite3_column_blob(iterator->stmt, RCOLUMN_DOC), (*obj)->data_length);
+            *obj = object_from_row(iterator->stmt);
+            if (*obj == NULL)
+                return LA_STORAGE_OBJECT_ITERATOR_ERROR;
         }
         return LA_STORAGE_OBJECT_ITERATOR_GOT_NEXT;
     }
@@ -572,14 +1187,29 @@ static la_storage_object_iterator_result sqlite_la_storage_iterator_next(la_stor
 
 static void sqlite_la_storage_iterator_close(la_storage_object_iterator *iterator)
 {
-    sqlite3_finalize(iterator->stmt);
+    if (iterator->which < 0)
+        sqlite3_finalize(iterator->stmt);
+    else
+        put_stmt(iterator->conn, iterator->which, iterator->stmt);
+    close_conn(&iterator->own);
     free(iterator);
 }
 
-static void sqlite_la_storage_close(la_storage_object_store *store)
+static int sqlite_la_storage_close(la_storage_object_store *store)
 {
-    sqlite3_close(store->db);
+    int i;
+    
+    if (store->reader_count > 0)
+    {
+        pthread_key_delete(store->reader_key);
+        for (i = 0; i < store->reader_count; i++)
+            close_conn(&store->readers[i]);
+        free(store->readers);
+    }
+    close_conn(&store->writer);
+    free(store->path);
     free(store);
+    return 0;
 }
 
 static const la_object_store_driver_t sqlite_driver = {
@@ -590,14 +1220,20 @@ static const la_object_store_driver_t sqlite_driver = {
     .close_store = sqlite_la_storage_close,
     .delete_store = NULL, /* TODO */
     .get = sqlite_la_storage_get,
+    .get_many = sqlite_la_storage_get_many,
+    .get_borrowed = sqlite_la_storage_get_borrowed,
+    .release = sqlite_la_storage_release,
     .get_rev = sqlite_la_storage_get_rev,
     .get_all_revs = sqlite_la_storage_get_all_revs,
     .set_revs = NULL, /* TODO */
     .put = sqlite_la_storage_put,
+    .put_bulk = sqlite_la_storage_put_bulk,
     .replace = sqlite_la_storage_replace,
     .lastseq = sqlite_la_storage_lastseq,
-    .stat = NULL, /* TODO */
+    .stat = sqlite_la_storage_stat,
     .iterator_open = sqlite_la_storage_iterator_open,
+    .iterator_open_range = sqlite_la_storage_iterator_open_range,
+    .iterator_open_keyrange = sqlite_la_storage_iterator_open_keyrange,
     .iterator_next = sqlite_la_storage_iterator_next,
     .iterator_close = sqlite_la_storage_iterator_close
 };
@@ -0,0 +1,82 @@
+//
+//  crc32c.c
+//  LoungeAct
+//
+//  Created by agent on 10/18/26.
+//
+
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+# define HAVE_SSE42_CRC 1
+# include <nmmintrin.h>
+#endif
+
+/* The Castagnoli polynomial, bit-reversed. */
+#define POLY 0x82F63B78
+
+static uint32_t table[256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void table_init(void)
+{
+    uint32_t crc;
+    int i, j;
+    for (i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len)
+{
+    pthread_once(&table_once, table_init);
+    while (len-- > 0)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+#if defined (__x86_64__)
+    uint64_t crc64 = crc, word;
+    while (len >= sizeof(uint64_t))
+    {
+        memcpy(&word, p, sizeof(uint64_t));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+    crc = (uint32_t) crc64;
+#endif
+    while (len >= sizeof(uint32_t))
+    {
+        uint32_t word32;
+        memcpy(&word32, p, sizeof(uint32_t));
+        crc = _mm_crc32_u32(crc, word32);
+        p += sizeof(uint32_t);
+        len -= sizeof(uint32_t);
+    }
+    while (len-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+uint32_t la_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    crc = ~crc;
+#if HAVE_SSE42_CRC
+    if (__builtin_cpu_supports("sse4.2"))
+        return ~crc32c_sse42(crc, (const unsigned char *) buf, len);
+#endif
+    return ~crc32c_table(crc, (const unsigned char *) buf, len);
+}
@@ -0,0 +1,23 @@
+//
+//  crc32c.h
+//  LoungeAct
+//
+//  Created by agent on 10/18/26.
+//
+
+#ifndef LoungeAct_crc32c_h
+#define LoungeAct_crc32c_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compute the CRC-32C (Castagnoli) of buf, continuing from crc; pass 0
+ * to start a new checksum.
+ *
+ * Uses the SSE4.2 crc32 instruction if the CPU has it, and a table
+ * otherwise.
+ */
+uint32_t la_crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
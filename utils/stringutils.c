@@ -43,7 +43,9 @@ string_join(const char *sep, char * const *parts, size_t length)
 char *
 string_append(const char *prefix, const char *suffix)
 {
-    char *buf = (char *) malloc(strlen(prefix) + strlen(suffix));
+    char *buf = (char *) malloc(strlen(prefix) + strlen(suffix) + 1);
+    if (buf == NULL)
+        return NULL;
     buf[0] = '\0';
     strcat(buf, prefix);
     strcat(buf, suffix);
@@ -0,0 +1,192 @@
+//
+//  trace.c
+//  LoungeAct
+//
+//  Created by agent on 10/18/26.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+/*
+ * Each thread records into its own ring, so recording never contends.
+ * Only the owning thread moves head, and it publishes each event before
+ * moving it. Readers copy an event and then check that head hasn't come
+ * around to that slot again while they were copying; if it has, the
+ * event was overwritten and is skipped.
+ *
+ * Rings are kept on a list that only grows. When a thread exits, its
+ * ring is released, and the next new thread picks it up.
+ */
+struct trace_ring
+{
+    la_trace_event_t events[LA_TRACE_RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+    int owned;
+    uint16_t index;
+    struct trace_ring *next;
+};
+
+static struct trace_ring *rings = NULL;
+static uint16_t ring_count = 0;
+static __thread struct trace_ring *thread_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/* Only taken by readers, to keep drains from racing each other. */
+static pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ring_release(void *p)
+{
+    struct trace_ring *ring = (struct trace_ring *) p;
+    thread_ring = NULL;
+    __sync_lock_release(&ring->owned);
+}
+
+static void ring_key_init(void)
+{
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static struct trace_ring *get_ring(void)
+{
+    struct trace_ring *ring;
+
+    if (thread_ring != NULL)
+        return thread_ring;
+    pthread_once(&ring_key_once, ring_key_init);
+    for (ring = rings; ring != NULL; ring = ring->next)
+    {
+        if (__sync_bool_compare_and_swap(&ring->owned, 0, 1))
+            break;
+    }
+    if (ring == NULL)
+    {
+        ring = (struct trace_ring *) calloc(1, sizeof(struct trace_ring));
+        if (ring == NULL)
+            return NULL;
+        ring->owned = 1;
+        ring->index = __sync_fetch_and_add(&ring_count, 1);
+        do
+        {
+            ring->next = rings;
+        } while (!__sync_bool_compare_and_swap(&rings, ring->next, ring));
+    }
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+uint64_t la_trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void la_trace_record(la_trace_op op, uint32_t id, int result, uint64_t start, const char *file, int line)
+{
+    struct trace_ring *ring = get_ring();
+    la_trace_event_t *event;
+    uint64_t end = la_trace_now();
+
+    if (ring == NULL)
+        return;
+    event = &ring->events[ring->head & (LA_TRACE_RING_SIZE - 1)];
+    event->start = start;
+    event->duration = end - start;
+    event->file = file;
+    event->line = (uint32_t) line;
+    event->id = id;
+    event->result = result;
+    event->op = (uint16_t) op;
+    event->thread = ring->index;
+    __sync_synchronize();
+    ring->head++;
+}
+
+/*
+ * Copy event i out of ring. Returns 0 if it was overwritten before we
+ * could read it.
+ */
+static int read_event(struct trace_ring *ring, uint64_t i, la_trace_event_t *event)
+{
+    memcpy(event, &ring->events[i & (LA_TRACE_RING_SIZE - 1)], sizeof(la_trace_event_t));
+    __sync_synchronize();
+    return ring->head < i + LA_TRACE_RING_SIZE;
+}
+
+/*
+ * The oldest event in ring that hasn't been drained or overwritten.
+ */
+static uint64_t first_event(struct trace_ring *ring, uint64_t head)
+{
+    if (head - ring->tail > LA_TRACE_RING_SIZE)
+        return head - LA_TRACE_RING_SIZE;
+    return ring->tail;
+}
+
+size_t la_trace_drain(la_trace_event_t *events, size_t max)
+{
+    struct trace_ring *ring;
+    uint64_t head, i;
+    size_t n = 0;
+
+    pthread_mutex_lock(&read_lock);
+    for (ring = rings; ring != NULL && n < max; ring = ring->next)
+    {
+        head = ring->head;
+        __sync_synchronize();
+        for (i = first_event(ring, head); i < head && n < max; i++)
+        {
+            if (read_event(ring, i, &events[n]))
+                n++;
+        }
+        ring->tail = i;
+    }
+    pthread_mutex_unlock(&read_lock);
+    return n;
+}
+
+void la_trace_dump(FILE *out)
+{
+    struct trace_ring *ring;
+    la_trace_event_t event;
+    uint64_t head, i;
+
+    pthread_mutex_lock(&read_lock);
+    for (ring = rings; ring != NULL; ring = ring->next)
+    {
+        head = ring->head;
+        __sync_synchronize();
+        for (i = first_event(ring, head); i < head; i++)
+        {
+            if (!read_event(ring, i, &event))
+                continue;
+            fprintf(out, "[%u] %llu.%09llu %s txn %x -> %d (%llu ns) %s:%u\n", event.thread,
+                    (unsigned long long) (event.start / 1000000000ULL), (unsigned long long) (event.start % 1000000000ULL),
+                    la_trace_op_name((la_trace_op) event.op), event.id, event.result,
+                    (unsigned long long) event.duration, event.file, event.line);
+        }
+    }
+    pthread_mutex_unlock(&read_lock);
+}
+
+const char *la_trace_op_name(la_trace_op op)
+{
+    switch (op)
+    {
+        case LA_TRACE_TXN_BEGIN:
+            return "BEGIN";
+        case LA_TRACE_TXN_COMMIT:
+            return "COMMIT";
+        case LA_TRACE_TXN_ABORT:
+            return "ABORT";
+    }
+    return "?";
+}
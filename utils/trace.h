@@ -0,0 +1,83 @@
+//
+//  trace.h
+//  LoungeAct
+//
+//  Created by agent on 10/18/26.
+//
+
+#ifndef LoungeAct_trace_h
+#define LoungeAct_trace_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Set to 0 to compile tracing out entirely.
+ */
+#ifndef LA_TRACE
+#define LA_TRACE 1
+#endif
+
+/**
+ * The number of events each thread's ring holds (a power of two). Older
+ * events are overwritten once it fills up.
+ */
+#ifndef LA_TRACE_RING_SIZE
+#define LA_TRACE_RING_SIZE 1024
+#endif
+
+typedef enum
+{
+    LA_TRACE_TXN_BEGIN = 0,
+    LA_TRACE_TXN_COMMIT,
+    LA_TRACE_TXN_ABORT
+} la_trace_op;
+
+typedef struct la_trace_event
+{
+    uint64_t start;       /**< Monotonic start time, in nanoseconds. */
+    uint64_t duration;    /**< How long the operation took, in nanoseconds. */
+    const char *file;     /**< Source file that did the operation. */
+    uint32_t line;        /**< Line in that file. */
+    uint32_t id;          /**< Transaction id. */
+    int32_t result;       /**< What the operation returned. */
+    uint16_t op;          /**< A la_trace_op. */
+    uint16_t thread;      /**< Which ring (thread) recorded the event. */
+} la_trace_event_t;
+
+/**
+ * Return the current monotonic time in nanoseconds.
+ */
+uint64_t la_trace_now(void);
+
+/**
+ * Record an event in the calling thread's ring. This takes no locks and
+ * makes no system calls, except for allocating the ring the first time
+ * a thread traces something.
+ */
+void la_trace_record(la_trace_op op, uint32_t id, int result, uint64_t start, const char *file, int line);
+
+/**
+ * Move up to max events out of all threads' rings into events, oldest
+ * first within each thread. Events are removed from the rings; ones
+ * that were overwritten before they could be drained are lost.
+ *
+ * @return The number of events stored.
+ */
+size_t la_trace_drain(la_trace_event_t *events, size_t max);
+
+/**
+ * Print the events currently in all threads' rings, without removing
+ * them.
+ */
+void la_trace_dump(FILE *out);
+
+const char *la_trace_op_name(la_trace_op op);
+
+#if LA_TRACE
+#define la_trace(op, id, result, start) la_trace_record(op, id, result, start, __FILE__, __LINE__)
+#else
+#define la_trace(op, id, result, start) do { } while (0)
+#endif
+
+#endif